@@ -25,9 +25,13 @@
 #include <math.h>
 
 #include "src/common/mem.h"
+#include "src/common/log.h"
+#include "src/common/number.h"
 #include "src/common/strnicmp.h"
 #include "src/common/uint32float.h"
 #include "src/rules/rules.h"
+#include "src/rules/vars.h"
+#include "src/rules/function.h"
 #include "src/rules/stack.h"
 
 #if defined(ESP8266) || defined(ESP32)
@@ -63,6 +67,9 @@ static uint16_t mmu_get_uint16(void *ptr) { return (*(uint16_t *)ptr); }
 static struct rules_t **rules = NULL;
 static uint8_t nrrules = 0;
 static char out[OUTPUT_SIZE];
+#if defined(DEBUG) || defined(COVERALLS)
+static unsigned int host_allocs = 0;
+#endif
 
 #if !defined(ESP8266) && !defined(ESP32)
 struct serial_t Serial;
@@ -99,6 +106,8 @@ typedef struct array_t {
     void *n;
     const char *s;
   } val;
+  uint16_t handle;
+  uint16_t pin;
   uint8_t type;
 } array_t;
 
@@ -216,12 +225,19 @@ struct unittest_t {
   { "if 3 == 3 then $a = 'foo bar'; end", { { "[1]$a = foo bar", 127 } }, { { "[1]$a = foo bar", 127 } }, 0 },
   { "if 3 == 3 then $a = 'foo\tbar'; end", { { "[1]$a = foo\tbar", 127 } }, { { "[1]$a = foo\tbar", 127 } }, 0 },
   { "if 3 == 3 then $a = 'foo\nbar'; end", { { "[1]$a = foo\nbar", 127 } }, { { "[1]$a = foo\nbar", 127 } }, 0 },
-  { "if 3 == 3 then $a = concat(1, 2, 3); end", { { "[1]$a = 123", 147 } }, { { "[1]$a = 123", 147 } }, 0 },
-  { "if 3 == 3 then $a = concat(1.2, NULL, 3); end", { { "[1]$a = 1.2NULL3", 143 } }, { { "[1]$a = 1.2NULL3", 143 } }, 0 },
-  { "if 3 == 3 then $a = 'foo bar'; $b = concat($a, ' ', 'foo'); end", { { "[1]$a = foo bar[1]$b = foo bar foo", 228 } }, { { "[1]$a = foo bar[1]$b = foo bar foo", 228 } }, 0 },
-  { "if 3 == 3 then $a = 'foo bar'; $b = concat($a, ' ', 'foo'); $b = concat($a, ' ', $a); $c = concat($a, ' ', 'test'); end", { { "[1]$a = foo bar[1]$b = foo bar foo bar[1]$c = foo bar test", 336 } }, { { "[1]$a = foo bar[1]$b = foo bar foo bar[1]$c = foo bar test", 336 } }, 0 },
-  { "if 3 == 3 then $a = 1; $b = concat('{zone1:{heat:{target:{high:', $a + 1, ',low:', $a + 1, '}}}}'); end", { { "[1]$a = 1[1]$b = {zone1:{heat:{target:{high:2,low:2}}}}", 281 } }, { { "[1]$a = 1[1]$b = {zone1:{heat:{target:{high:2,low:2}}}}", 281 } }, 0 },
-  { "if 3 == 3 then $a = 27; $b = 1; $c = concat('{zone1:{heat:{target:{high:', $a + $b, ',low:', $a + $b, '}}}}'); end", { { "[1]$a = 27[1]$b = 1[1]$c = {zone1:{heat:{target:{high:28,low:28}}}}", 324 } }, { { "[1]$a = 27[1]$b = 1[1]$c = {zone1:{heat:{target:{high:28,low:28}}}}", 324 } }, 0 },
+  { "if 3 == 3 then $a = concat(1, 2, 3); end", { { "[1]$a = 123", 151 } }, { { "[1]$a = 123", 151 } }, 0 },
+  { "if 3 == 3 then $a = concat(1.2, NULL, 3); end", { { "[1]$a = 1.2NULL3", 152 } }, { { "[1]$a = 1.2NULL3", 152 } }, 0 },
+  { "if 3 == 3 then $a = 'foo bar'; $b = concat($a, ' ', 'foo'); end", { { "[1]$a = foo bar[1]$b = foo bar foo", 240 } }, { { "[1]$a = foo bar[1]$b = foo bar foo", 240 } }, 0 },
+  { "if 3 == 3 then $a = 'foo bar'; $b = concat($a, ' ', 'foo'); $b = concat($a, ' ', $a); $c = concat($a, ' ', 'test'); end", { { "[1]$a = foo bar[1]$b = foo bar foo bar[1]$c = foo bar test", 365 } }, { { "[1]$a = foo bar[1]$b = foo bar foo bar[1]$c = foo bar test", 365 } }, 0 },
+  { "if 3 == 3 then $a = 1; $b = concat('{zone1:{heat:{target:{high:', $a + 1, ',low:', $a + 1, '}}}}'); end", { { "[1]$a = 1[1]$b = {zone1:{heat:{target:{high:2,low:2}}}}", 320 } }, { { "[1]$a = 1[1]$b = {zone1:{heat:{target:{high:2,low:2}}}}", 320 } }, 0 },
+  { "if 3 == 3 then $a = 27; $b = 1; $c = concat('{zone1:{heat:{target:{high:', $a + $b, ',low:', $a + $b, '}}}}'); end", { { "[1]$a = 27[1]$b = 1[1]$c = {zone1:{heat:{target:{high:28,low:28}}}}", 365 } }, { { "[1]$a = 27[1]$b = 1[1]$c = {zone1:{heat:{target:{high:28,low:28}}}}", 365 } }, 0 },
+  { "if 3 == 3 then $a = 'foo bar baz'; $b = substr($a, 4, 3); $c = substr($a, -3); $d = substr($b, 1); end", { { "[1]$a = foo bar baz[1]$b = bar[1]$c = baz[1]$d = ar", 363 } }, { { "[1]$a = foo bar baz[1]$b = bar[1]$c = baz[1]$d = ar", 363 } }, 0 },
+  { "if 3 == 3 then $a = 'foo bar'; $b = substr($a, 0, 100); $c = substr($a, 10); $d = substr($a, 0, 3); $e = concat($d, 'x'); end", { { "[1]$a = foo bar[1]$b = foo bar[1]$c = [1]$d = foo[1]$e = foox", 403 } }, { { "[1]$a = foo bar[1]$b = foo bar[1]$c = [1]$d = foo[1]$e = foox", 403 } }, 0 },
+  { "if 3 == 3 then $a = 'foo bar'; $b = startswith($a, 'foo'); $c = endswith($a, 'foo'); $d = endswith($a, 'bar'); end", { { "[1]$a = foo bar[1]$b = 1[1]$c = 0[1]$d = 1", 304 } }, { { "[1]$a = foo bar[1]$b = 1[1]$c = 0[1]$d = 1", 304 } }, 0 },
+  { "if 3 == 3 then $a = 'foo bar'; $b = find($a, 'bar'); $c = find($a, 'o', 2); $d = find($a, 'baz'); $e = strlen($a); $f = find($a, 'o', 65536); end", { { "[1]$a = foo bar[1]$b = 4[1]$c = 2[1]$d = -1[1]$e = 7[1]$f = -1", 416 } }, { { "[1]$a = foo bar[1]$b = 4[1]$c = 2[1]$d = -1[1]$e = 7[1]$f = -1", 416 } }, 0 },
+  { "if concat('a', 1) == concat('b', 2) then $x = 1; else $x = 2; end", { { "[1]$x = 2", 217 } }, { { "[1]$x = 2", 217 } }, 0 },
+  { "if 3 == 3 then $x = substr(concat('hello', 1), 1, 3) == substr(concat('hello', 2), 1, 3); end", { { "[1]$x = 1", 283 } }, { { "[1]$x = 1", 283 } }, 0 },
+  { "if substr('foo bar', 4) == coalesce('bar') then $a = 1; end", { { "[1]$a = 1", 191 } }, { { "[1]$a = 1", 191 } }, 0 },
   { "if 1 == 1 then $a = 'foo	bar'; end", { { "[1]$a = foo	bar", 127 } }, { { "[1]$a = foo	bar", 127 } }, 0}, // TAB
   { "if 1 == 1 then $a = \"foo	bar\"; end", { { "[1]$a = foo	bar", 127 } }, { { "[1]$a = foo	bar", 127 } }, 0 }, // TAB
   { "if 1 == 1 then $a = \"foo\\tbar\"; end", { { "[1]$a = foo	bar", 127 } }, { { "[1]$a = foo	bar", 127 } }, 0 }, // TAB
@@ -396,53 +412,56 @@ bar", 127 } }, 0 }, // Newline
   { "if 1 == 1 then $a = $a + 1; end", { "[1]$a = 2", 111 }, { "[1]$a = 2", 111 }, 0 },
   { "if 1 == 1 then $a = 1; print($a); end", { "[1]$a = 1", 119 }, { "[1]$a = 1", 119 }, 0 },
   { "if 1 == 1 then $a = 1; $b = 1.2; print($a, '-', $b, '-', $c); end", { "[1]$a = 1[1]$b = 1.2", 231 }, { "[1]$a = 1[1]$b = 1.2", 231 }, 0 },
-  { "if 1 == 1 then $a = 1; max($a); end", { "[1]$a = 1", 119 }, { "[1]$a = 1", 119 }, 0 },
-  { "if 1 == 1 then $a = max(foo#bar); end", { "[1]$a = 3", 139 }, { "[1]$a = 3", 139 }, 0 },
-  { "if 1 == 1 then $a = max(foo#bar, 4); end", { "[1]$a = 4", 151 }, { "[1]$a = 4", 151 }, 0 },
-  { "if 1 == 1 then $a = max(foo#bar, 4); end", { "[1]$a = 4", 151 }, { "[1]$a = 4", 151 }, 0 },
+  { "if 1 == 1 then $a = 1; max($a); end", { "[1]$a = 1", 115 }, { "[1]$a = 1", 115 }, 0 },
+  { "if 1 == 1 then $a = max(foo#bar); end", { "[1]$a = 3", 135 }, { "[1]$a = 3", 135 }, 0 },
+  { "if 1 == 1 then $a = max(foo#bar, 4); end", { "[1]$a = 4", 143 }, { "[1]$a = 4", 143 }, 0 },
+  { "if 1 == 1 then $a = max(foo#bar, 4); end", { "[1]$a = 4", 143 }, { "[1]$a = 4", 143 }, 0 },
   { "if 1 == 1 then $a = max(foo#bar, 4, 5.5); end", { "[1]$a = 5.5", 159 }, { "[1]$a = 5.5", 159 }, 0 },
   { "if 1 == 1 then $a = min(foo#bar, 4, 1.5); end", { "[1]$a = 1.5", 159 }, { "[1]$a = 1.5", 159 }, 0 },
-  { "if 1 == 1 then $a = max(NULL, 3 * 2); end", { "[1]$a = 6", 131 }, { "[1]$a = 6", 131 }, 0 },
-  { "if 1 == 1 then $a = max(NULL, $b * 2); end", { "[1]$a = 4", 150 }, { "[1]$a = 4", 158 }, 0 },
-  { "if 1 == 1 then $a = 5 * max(NULL, $b * 2); end", { "[1]$a = 20", 158 }, { "[1]$a = 20", 150 }, 0 },
-  { "if 1 == 1 then $a = 5 + max(NULL, $b * 2) * 2; end", { "[1]$a = 13", 162 }, { "[1]$a = 13", 162 }, 0 },
-  { "if 1 == 1 then $a = 5 * max(1 * 2, $b * 2); end", { "[1]$a = 20", 162 }, { "[1]$a = 20", 162 }, 0 },
+  { "if 1 == 1 then $a = max(NULL, 3 * 2); end", { "[1]$a = 6", 123 }, { "[1]$a = 6", 123 }, 0 },
+  { "if 1 == 1 then $a = max(NULL, $b * 2); end", { "[1]$a = 4", 142 }, { "[1]$a = 4", 158 }, 0 },
+  { "if 1 == 1 then $a = 5 * max(NULL, $b * 2); end", { "[1]$a = 20", 150 }, { "[1]$a = 20", 150 }, 0 },
+  { "if 1 == 1 then $a = 5 + max(NULL, $b * 2) * 2; end", { "[1]$a = 13", 154 }, { "[1]$a = 13", 154 }, 0 },
+  { "if 1 == 1 then $a = 5 * max(1 * 2, $b * 2); end", { "[1]$a = 20", 154 }, { "[1]$a = 20", 154 }, 0 },
   { "if 3 == 3 then $a = max(1, 2 + 1, 2); end", { { "[1]$a = 3", 135 } }, { { "[1]$a = 3", 135 } }, 0 },
-  { "if 1 == 1 then $a = max(5) * max(NULL, $b * 2); end", { "[1]$a = 20", 170 }, { "[1]$a = 20", 170 }, 0 },
+  { "if 1 == 1 then $a = max(5) * max(NULL, $b * 2); end", { "[1]$a = 20", 158 }, { "[1]$a = 20", 158 }, 0 },
   { "if 1 == 1 then $a = (5) * ($b * 2) + (1) * (1 + 2 * 3 / 2 ^ 2 ^ 2 * 1 ^ 2); end", { "[1]$a = 21.375", 190 }, { "[1]$a = 21.375", 190 }, 0 },
-  { "if 1 == 1 then $a = max(1) * max(0, 2 ^ 2 ^ 2 * 1); end", { "[1]$a = 16", 155 }, { "[1]$a = 16", 155 }, 0 },
-  { "if 1 == 1 then $a = max(5) * max(NULL, $b * 2) + max(1) * max(0, 1 + 2 * 3 / 2 ^ 2 ^ 2 * 1 ^ 2); end", { "[1]$a = 21.375", 246 }, { "[1]$a = 21.375", 256 }, 0 },
-  { "if 1 == 1 then $a = coalesce(NULL, 1) + 1; end", { "[1]$a = 2", 123 }, { "[1]$a = 2", 123 }, 0 },
-  { "if 1 == 1 then $a = coalesce(NULL, 1.2) + 1; end", { "[1]$a = 2.2", 127 }, { "[1]$a = 2.2", 127 }, 0 },
+  { "if 1 == 1 then $a = max(1) * max(0, 2 ^ 2 ^ 2 * 1); end", { "[1]$a = 16", 143 }, { "[1]$a = 16", 143 }, 0 },
+  { "if 1 == 1 then $a = max(5) * max(NULL, $b * 2) + max(1) * max(0, 1 + 2 * 3 / 2 ^ 2 ^ 2 * 1 ^ 2); end", { "[1]$a = 21.375", 222 }, { "[1]$a = 21.375", 256 }, 0 },
+  { "if 1 == 1 then $a = coalesce(NULL, 1) + 1; end", { "[1]$a = 2", 115 }, { "[1]$a = 2", 115 }, 0 },
+  { "if 1 == 1 then $a = coalesce(NULL, 1.2) + 1; end", { "[1]$a = 2.2", 119 }, { "[1]$a = 2.2", 119 }, 0 },
   { "if 1 == 1 then $a = coalesce(NULL, 'a'); end", { "[1]$a = a", 137 }, { "[1]$a = a", 137 }, 0 },
-  { "if 1 == 1 then $a = coalesce(1, 0) + 1; end", { "[1]$a = 2", 127 }, { "[1]$a = 2", 127 }, 0 },
-  { "if 1 == 1 then $a = coalesce($a, 0) + 1; end", { "[1]$a = 2", 131 }, { "[1]$a = 2", 131 }, 0 },
-  { "if 1 == 1 then $a = coalesce($a, 1.1) + 1; end", { "[1]$a = 2", 131 }, { "[1]$a = 2", 131 }, 0 },
-  { "if 3 == 3 then $a = max(1); end", { "[1]$a = 1", 119 }, { "[1]$a = 1", 119 }, 0 },
-  { "if 3 == 3 then $a = max(NULL, 1); end", { "[1]$a = 1", 123 }, { "[1]$a = 1", 123 }, 0 },
-  { "if 3 == 3 then $a = max(1, NULL); end", { "[1]$a = 1", 123 }, { "[1]$a = 1", 123 }, 0 },
-  { "if 3 == 3 then $b = 2; $a = max($b, 1); end", { "[1]$b = 2[1]$a = 2", 154 }, { "[1]$b = 2[1]$a = 2", 154 }, 0 },
-  { "if 3 == 3 then $a = max(1, 2); end", { "[1]$a = 2", 127 }, { "[1]$a = 2", 127 }, 0 },
+  { "if 1 == 1 then $a = coalesce(1, 0) + 1; end", { "[1]$a = 2", 119 }, { "[1]$a = 2", 119 }, 0 },
+  { "if 1 == 1 then $a = coalesce($a, 0) + 1; end", { "[1]$a = 2", 123 }, { "[1]$a = 2", 123 }, 0 },
+  { "if 1 == 1 then $a = coalesce($a, 1.1) + 1; end", { "[1]$a = 2", 123 }, { "[1]$a = 2", 123 }, 0 },
+  { "if coalesce('a') == coalesce('a') then $a = 1; end", { "[1]$a = 1", 161 }, { "[1]$a = 1", 161 }, 0 },
+  { "if coalesce('a') != coalesce('b') then $a = 1; end", { "[1]$a = 1", 159 }, { "[1]$a = 1", 159 }, 0 },
+  { "if 1 == 1 then $a = 'a'; $b = 'a'; $c = 'b'; if $a == $b then $d = 1; end if $a != $c then $e = 2; end if $a == $c then $f = 3; end end", { "[1]$a = a[1]$b = a[1]$c = b[1]$d = 1[1]$e = 2[1]$f = 3", 330 }, { "[1]$a = a[1]$b = a[1]$c = b[1]$d = 1[1]$e = 2", 330 }, 0 },
+  { "if 3 == 3 then $a = max(1); end", { "[1]$a = 1", 115 }, { "[1]$a = 1", 115 }, 0 },
+  { "if 3 == 3 then $a = max(NULL, 1); end", { "[1]$a = 1", 115 }, { "[1]$a = 1", 115 }, 0 },
+  { "if 3 == 3 then $a = max(1, NULL); end", { "[1]$a = 1", 115 }, { "[1]$a = 1", 115 }, 0 },
+  { "if 3 == 3 then $b = 2; $a = max($b, 1); end", { "[1]$b = 2[1]$a = 2", 146 }, { "[1]$b = 2[1]$a = 2", 146 }, 0 },
+  { "if 3 == 3 then $a = max(1, 2); end", { "[1]$a = 2", 119 }, { "[1]$a = 2", 119 }, 0 },
   { "if 3 == 3 then $a = max(1, 2, 3, 4); end", { "[1]$a = 4", 139 }, { "[1]$a = 4", 139 }, 0 },
   { "if 3 == 3 then $a = max(1, 4, 5, 3, 2); end", { "[1]$a = 5", 147 }, { "[1]$a = 5", 147 }, 0 },
-  { "if 3 == 3 then $a = max(max(1, 4), 2); end", { "[1]$a = 4", 147 }, { "[1]$a = 4", 147 }, 0 },
-  { "if 3 == 3 then max(max(1, 4), 2); end", { "", 128 }, { "", 128 }, 0 },
-  { "if 3 == 3 then max(2); min(2); end", { "", 112 }, { "", 112 }, 0 },
-  { "if 3 == 3 then max(2); min(2); max(3); end", { "", 128 }, { "", 128 }, 0 },
-  { "if 3 == 3 then max($a, 4, 2); $b = max(1, 3); end", { "[1]$b = 3", 178 }, { "[1]$b = 3", 178 }, 0 },
-  { "if 3 == 3 then $a = max(1, 2) * 3; end", { "[1]$a = 6", 131 }, { "[1]$a = 6", 131 }, 0 },
-  { "if 3 == 3 then $a = max(1, 2) * max(3, 4); end", { "[1]$a = 8", 151 }, { "[1]$a = 8", 151 }, 0 },
-  { "if 3 == 3 then $a = max(max(1, 2), (1 * max(1, 3) ^ 2)); end", { "[1]$a = 9", 163 }, { "[1]$a = 9", 163 }, 0 },
-  { "if 3 == 3 then $b = 1; $a = max($b + 1); end", { "[1]$b = 1[1]$a = 2", 146 }, { "[1]$b = 1[1]$a = 2", 146 }, 0 },
-  { "if 3 == 3 then $b = 1; $a = max($b + 1) * 3; end", { "[1]$b = 1[1]$a = 6", 150 }, { "[1]$b = 1[1]$a = 6", 150 }, 0 },
-  { "if 1 == 1 then $a = max(ceil(3), 3 * 4); end", { "[1]$a = 12", 143 }, { "[1]$a = 12", 143 }, 0 },
+  { "if 3 == 3 then $a = max(max(1, 4), 2); end", { "[1]$a = 4", 131 }, { "[1]$a = 4", 131 }, 0 },
+  { "if 3 == 3 then max(max(1, 4), 2); end", { "", 112 }, { "", 112 }, 0 },
+  { "if 3 == 3 then max(2); min(2); end", { "", 104 }, { "", 104 }, 0 },
+  { "if 3 == 3 then max(2); min(2); max(3); end", { "", 116 }, { "", 116 }, 0 },
+  { "if 3 == 3 then max($a, 4, 2); $b = max(1, 3); end", { "[1]$b = 3", 170 }, { "[1]$b = 3", 170 }, 0 },
+  { "if 3 == 3 then $a = max(1, 2) * 3; end", { "[1]$a = 6", 123 }, { "[1]$a = 6", 123 }, 0 },
+  { "if 3 == 3 then $a = max(1, 2) * max(3, 4); end", { "[1]$a = 8", 135 }, { "[1]$a = 8", 135 }, 0 },
+  { "if 3 == 3 then $a = max(max(1, 2), (1 * max(1, 3) ^ 2)); end", { "[1]$a = 9", 139 }, { "[1]$a = 9", 139 }, 0 },
+  { "if 3 == 3 then $b = 1; $a = max($b + 1); end", { "[1]$b = 1[1]$a = 2", 142 }, { "[1]$b = 1[1]$a = 2", 142 }, 0 },
+  { "if 3 == 3 then $b = 1; $a = max($b + 1) * 3; end", { "[1]$b = 1[1]$a = 6", 146 }, { "[1]$b = 1[1]$a = 6", 146 }, 0 },
+  { "if 1 == 1 then $a = max(ceil(3), 3 * 4); end", { "[1]$a = 12", 131 }, { "[1]$a = 12", 131 }, 0 },
   { "if NULL then $a = 1; end", { "[1]$a = 1", 103 }, { "", 103 }, 0 },
   { "if 0 then $a = 1; end", { "[1]$a = 1", 103 }, { "", 103 }, 0 },
   { "if 1 then $a = 1; end", { "[1]$a = 1", 99 }, { "[1]$a = 1", 99 }, 0 },
   { "if -1 then $a = 1; end", { "[1]$a = 1", 103 }, { "", 103 }, 0 },
   { "if 1.6 then $a = 1; end", { "[1]$a = 1", 103 }, { "[1]$a = 1", 103 }, 0 },
-  { "if max(0) then $a = 1; end", { "[1]$a = 1", 115 }, { "", 115 }, 0 },
-  { "if max(1) then $a = 1; end", { "[1]$a = 1", 111 }, { "[1]$a = 1", 111 }, 0 },
+  { "if max(0) then $a = 1; end", { "[1]$a = 1", 111 }, { "", 111 }, 0 },
+  { "if max(1) then $a = 1; end", { "[1]$a = 1", 107 }, { "[1]$a = 1", 107 }, 0 },
   { "if $a then $a = 1; end", { "[1]$a = 1", 107 }, { "[1]$a = 1", 107 }, 0 },
   { "if $d then $a = 1; end", { "[1]$a = 1", 126 }, { "", 126 }, 0 },
   { "if $a then if 1 then $a = 1; end end", { "[1]$a = 1", 115 }, { "[1]$a = 1", 115 }, 0 },
@@ -452,48 +471,48 @@ bar", 127 } }, 0 }, // Newline
   { "if 0 >= 1 + 1 then $a = 0; else $a = 1; end", { { "[1]$a = 1", 119 } }, { { "[1]$a = 1", 119 } }, 0 },
   { "if 0 < 0 || 0 >= 1 then $a = 0; else $a = 1; end", { { "[1]$a = 1", 127 } }, { { "[1]$a = 1", 127 } }, 0 },
   { "if (1 <= 5) then $a = 1; end", { "[1]$a = 1", 107 }, { "[1]$a = 1", 107 }, 0 },
-  { "if max(1) == 1 && max(1) then $a = 1; end", { "[1]$a = 1", 127 }, { "[1]$a = 1", 127 }, 0 },
-  { "if max(1) && max(1) then $a = 1; end", { "[1]$a = 1", 123 }, { "[1]$a = 1", 123 }, 0 },
-  { "if max(1, 3) == 3 then $a = 1; end", { "[1]$a = 1", 119 }, { "[1]$a = 1", 119 }, 0 },
-  { "if max(1, 3) == max(1, 3) then $a = 1; end", { "[1]$a = 1", 135 }, { "[1]$a = 1", 135 }, 0 },
-  { "if max(1, 12000) == max(1, 3) then $a = 1; end", { "[1]$a = 1", 139 }, { "", 139 }, 0 },
-  { "if max(1, 12222.5555) == max(1, 3) then $a = 1; end", { "[1]$a = 1", 139 }, { "", 139 }, 0 },
-  { "if 3 == 3 then max(1, 2); end", { "", 104 }, { "", 104 }, 0 },
-  { "if 3 == 3 then if 1 == 1 then $a = 1; end max(1, 2); end", { "[1]$a = 1", 135 }, { "[1]$a = 1", 135 }, 0 },
-  { "if 3 == 3 then max(1, 2); $b = 3; end", { "[1]$b = 3", 127 }, { "[1]$b = 3", 127 }, 0 },
-  { "if 3 == 3 then $a = 1; $b = $a; max(1, 2); end", { "[1]$a = 1[1]$b = 1", 154 }, { "[1]$a = 1[1]$b = 1", 154 }, 0 },
-  { "if 3 == 3 then $a = max(1 + 1, 2 + 2); end", { "[1]$a = 4", 135 }, { "[1]$a = 4", 135 }, 0 },
-  { "if 1 == 1 then $a = coalesce($b, 0); end  ", { { "[1]$a = 2", 146 } }, { { "[1]$a = 2", 146 } }, 0 },
-  { "if 1 == 1 then $a = round(3.5); end  ", { { "[1]$a = 4", 119 } }, { { "[1]$a = 4", 119 } }, 0 },
-  { "if 1 == 1 then $a = round(-2.8); end  ", { { "[1]$a = -3", 119 } }, { { "[1]$a = -3", 119 } }, 0 },
-  { "if 1 == 1 then $a = round(3.519231983, 2); end  ", { { "[1]$a = 3.52", 127 } }, { { "[1]$a = 3.52", 127 } }, 0 },
-  { "if 1 == 1 then $a = round(5); end  ", { { "[1]$a = 5", 119 } }, { { "[1]$a = 5", 119 } }, 0 },
-  { "if 1 == 1 then $a = round(-5); end  ", { { "[1]$a = -5", 119 } }, { { "[1]$a = -5", 119 } }, 0 },
-  { "if 1 == 1 then $a = round(-3.5); end  ", { { "[1]$a = -4", 119 } }, { { "[1]$a = -4", 119 } }, 0 },
-  { "if 1 == 1 then $a = round(-3.519231983, 4); end  ", { { "[1]$a = -3.5192", 127 } }, { { "[1]$a = -3.5192", 127 } }, 0 },
-  { "if 1 == 1 then $a = round(-3.519256, 4); end  ", { { "[1]$a = -3.5192", 127 } }, { { "[1]$a = -3.5192", 127 } }, 0 },
-  { "if 1 == 1 then $a = round(NULL, 4); end  ", { { "[1]$a = NULL", 123 } }, { { "[1]$a = NULL", 123 } }, 0 },
-  { "if 1 == 1 then $a = round(NULL); end  ", { { "[1]$a = NULL", 115 } }, { { "[1]$a = NULL", 115 } }, 0 },
-  { "if 1 == 1 then $a = ceil(3.5); end  ", { { "[1]$a = 4", 119 } }, { { "[1]$a = 4", 119 } }, 0 },
-  { "if 1 == 1 then $a = ceil(5); end  ", { { "[1]$a = 5", 119 } }, { { "[1]$a = 5", 119 } }, 0 },
-  { "if 1 == 1 then $a = ceil(-5); end  ", { { "[1]$a = -5", 119 } }, { { "[1]$a = -5", 119 } }, 0 },
-  { "if 1 == 1 then $a = ceil(-3.5); end  ", { { "[1]$a = -3", 119 } }, { { "[1]$a = -3", 119 } }, 0 },
-  { "if 1 == 1 then $a = ceil(NULL); end  ", { { "[1]$a = NULL", 115 } }, { { "[1]$a = NULL", 115 } }, 0 },
-  { "if 1 == 1 then $a = floor(3.5); end  ", { { "[1]$a = 3", 119 } }, { { "[1]$a = 3", 119 } }, 0 },
-  { "if 1 == 1 then $a = floor(5); end  ", { { "[1]$a = 5", 119 } }, { { "[1]$a = 5", 119 } }, 0 },
-  { "if 1 == 1 then $a = floor(-5); end  ", { { "[1]$a = -5", 119 } }, { { "[1]$a = -5", 119 } }, 0 },
-  { "if 1 == 1 then $a = floor(-3.5); end  ", { { "[1]$a = -4", 119 } }, { { "[1]$a = -4", 119 } }, 0 },
-  { "if 1 == 1 then $a = floor(NULL); end  ", { { "[1]$a = NULL", 115 } }, { { "[1]$a = NULL", 115 } }, 0 },
-  { "if 3 == 3 then $a = max((1 + 3), 2); end", { "[1]$a = 4", 131 }, { "[1]$a = 4", 131 }, 0 },
-  { "if 3 == 3 then $a = max((1 + (3 * 3)), 2); end", { "[1]$a = 10", 135 }, { "[1]$a = 10", 135 }, 0 },
-  { "if 3 == 3 then $a = max(1 + 3 * 3, 3 * 4); end", { "[1]$a = 12", 139 }, { "[1]$a = 12", 139 }, 0 },
-  { "if 3 == 3 then $a = max(((2 + 3) * 3), (3 * 4)); end", { "[1]$a = 15", 139 }, { "[1]$a = 15", 139 }, 0 },
-  { "if 3 == 3 then $a = (max(1, 2) + 2) * 3; end", { "[1]$a = 12", 135 }, { "[1]$a = 12", 135 }, 0 },
-  { "if 1 == 1 then $a = max(0, 1) + max(1, 2) * max(2, 3) / max(3, 4) ^ max(1, 2) ^ max(0, 1) * max(2, 3) ^ max(3, 4); end", { "[1]$a = 31.375", 275 }, { "[1]$a = 31.375", 275 }, 0 },
-  { "if 3 == 3 then $a = 2; $b = max((($a + 3) * 3), (3 * 4)); end", { "[1]$a = 2[1]$b = 15", 166 }, { "[1]$a = 2[1]$b = 15", 166 }, 0 },
-  { "if 3 == 3 then $a = 2; $b = max((max($a + 3) * 3), (3 * 4)); end", { "[1]$a = 2[1]$b = 15", 174 }, { "[1]$a = 2[1]$b = 15", 174 }, 0 },
-  { "if 1 == 1 then $a = max(1 * 2, (min(5, 6) + 1) * 6); end", { { "[1]$a = 36", 159 } }, { { "[1]$a = 36", 159 } }, 0 },
-  { "if 1 == 2 || 3 >= 4 then $a = max(1, 2); end", { "[1]$a = 2", 139 }, { "", 162 }, 0 },
+  { "if max(1) == 1 && max(1) then $a = 1; end", { "[1]$a = 1", 119 }, { "[1]$a = 1", 119 }, 0 },
+  { "if max(1) && max(1) then $a = 1; end", { "[1]$a = 1", 115 }, { "[1]$a = 1", 115 }, 0 },
+  { "if max(1, 3) == 3 then $a = 1; end", { "[1]$a = 1", 111 }, { "[1]$a = 1", 111 }, 0 },
+  { "if max(1, 3) == max(1, 3) then $a = 1; end", { "[1]$a = 1", 119 }, { "[1]$a = 1", 119 }, 0 },
+  { "if max(1, 12000) == max(1, 3) then $a = 1; end", { "[1]$a = 1", 123 }, { "", 123 }, 0 },
+  { "if max(1, 12222.5555) == max(1, 3) then $a = 1; end", { "[1]$a = 1", 123 }, { "", 123 }, 0 },
+  { "if 3 == 3 then max(1, 2); end", { "", 96 }, { "", 96 }, 0 },
+  { "if 3 == 3 then if 1 == 1 then $a = 1; end max(1, 2); end", { "[1]$a = 1", 127 }, { "[1]$a = 1", 127 }, 0 },
+  { "if 3 == 3 then max(1, 2); $b = 3; end", { "[1]$b = 3", 119 }, { "[1]$b = 3", 119 }, 0 },
+  { "if 3 == 3 then $a = 1; $b = $a; max(1, 2); end", { "[1]$a = 1[1]$b = 1", 146 }, { "[1]$a = 1[1]$b = 1", 146 }, 0 },
+  { "if 3 == 3 then $a = max(1 + 1, 2 + 2); end", { "[1]$a = 4", 127 }, { "[1]$a = 4", 127 }, 0 },
+  { "if 1 == 1 then $a = coalesce($b, 0); end  ", { { "[1]$a = 2", 138 } }, { { "[1]$a = 2", 138 } }, 0 },
+  { "if 1 == 1 then $a = round(3.5); end  ", { { "[1]$a = 4", 115 } }, { { "[1]$a = 4", 115 } }, 0 },
+  { "if 1 == 1 then $a = round(-2.8); end  ", { { "[1]$a = -3", 115 } }, { { "[1]$a = -3", 115 } }, 0 },
+  { "if 1 == 1 then $a = round(3.519231983, 2); end  ", { { "[1]$a = 3.52", 119 } }, { { "[1]$a = 3.52", 119 } }, 0 },
+  { "if 1 == 1 then $a = round(5); end  ", { { "[1]$a = 5", 115 } }, { { "[1]$a = 5", 115 } }, 0 },
+  { "if 1 == 1 then $a = round(-5); end  ", { { "[1]$a = -5", 115 } }, { { "[1]$a = -5", 115 } }, 0 },
+  { "if 1 == 1 then $a = round(-3.5); end  ", { { "[1]$a = -4", 115 } }, { { "[1]$a = -4", 115 } }, 0 },
+  { "if 1 == 1 then $a = round(-3.519231983, 4); end  ", { { "[1]$a = -3.5192", 119 } }, { { "[1]$a = -3.5192", 119 } }, 0 },
+  { "if 1 == 1 then $a = round(-3.519256, 4); end  ", { { "[1]$a = -3.5192", 119 } }, { { "[1]$a = -3.5192", 119 } }, 0 },
+  { "if 1 == 1 then $a = round(NULL, 4); end  ", { { "[1]$a = NULL", 115 } }, { { "[1]$a = NULL", 115 } }, 0 },
+  { "if 1 == 1 then $a = round(NULL); end  ", { { "[1]$a = NULL", 111 } }, { { "[1]$a = NULL", 111 } }, 0 },
+  { "if 1 == 1 then $a = ceil(3.5); end  ", { { "[1]$a = 4", 115 } }, { { "[1]$a = 4", 115 } }, 0 },
+  { "if 1 == 1 then $a = ceil(5); end  ", { { "[1]$a = 5", 115 } }, { { "[1]$a = 5", 115 } }, 0 },
+  { "if 1 == 1 then $a = ceil(-5); end  ", { { "[1]$a = -5", 115 } }, { { "[1]$a = -5", 115 } }, 0 },
+  { "if 1 == 1 then $a = ceil(-3.5); end  ", { { "[1]$a = -3", 115 } }, { { "[1]$a = -3", 115 } }, 0 },
+  { "if 1 == 1 then $a = ceil(NULL); end  ", { { "[1]$a = NULL", 111 } }, { { "[1]$a = NULL", 111 } }, 0 },
+  { "if 1 == 1 then $a = floor(3.5); end  ", { { "[1]$a = 3", 115 } }, { { "[1]$a = 3", 115 } }, 0 },
+  { "if 1 == 1 then $a = floor(5); end  ", { { "[1]$a = 5", 115 } }, { { "[1]$a = 5", 115 } }, 0 },
+  { "if 1 == 1 then $a = floor(-5); end  ", { { "[1]$a = -5", 115 } }, { { "[1]$a = -5", 115 } }, 0 },
+  { "if 1 == 1 then $a = floor(-3.5); end  ", { { "[1]$a = -4", 115 } }, { { "[1]$a = -4", 115 } }, 0 },
+  { "if 1 == 1 then $a = floor(NULL); end  ", { { "[1]$a = NULL", 111 } }, { { "[1]$a = NULL", 111 } }, 0 },
+  { "if 3 == 3 then $a = max((1 + 3), 2); end", { "[1]$a = 4", 123 }, { "[1]$a = 4", 123 }, 0 },
+  { "if 3 == 3 then $a = max((1 + (3 * 3)), 2); end", { "[1]$a = 10", 127 }, { "[1]$a = 10", 127 }, 0 },
+  { "if 3 == 3 then $a = max(1 + 3 * 3, 3 * 4); end", { "[1]$a = 12", 131 }, { "[1]$a = 12", 131 }, 0 },
+  { "if 3 == 3 then $a = max(((2 + 3) * 3), (3 * 4)); end", { "[1]$a = 15", 131 }, { "[1]$a = 15", 131 }, 0 },
+  { "if 3 == 3 then $a = (max(1, 2) + 2) * 3; end", { "[1]$a = 12", 127 }, { "[1]$a = 12", 127 }, 0 },
+  { "if 1 == 1 then $a = max(0, 1) + max(1, 2) * max(2, 3) / max(3, 4) ^ max(1, 2) ^ max(0, 1) * max(2, 3) ^ max(3, 4); end", { "[1]$a = 31.375", 211 }, { "[1]$a = 31.375", 211 }, 0 },
+  { "if 3 == 3 then $a = 2; $b = max((($a + 3) * 3), (3 * 4)); end", { "[1]$a = 2[1]$b = 15", 158 }, { "[1]$a = 2[1]$b = 15", 158 }, 0 },
+  { "if 3 == 3 then $a = 2; $b = max((max($a + 3) * 3), (3 * 4)); end", { "[1]$a = 2[1]$b = 15", 162 }, { "[1]$a = 2[1]$b = 15", 162 }, 0 },
+  { "if 1 == 1 then $a = max(1 * 2, (min(5, 6) + 1) * 6); end", { { "[1]$a = 36", 143 } }, { { "[1]$a = 36", 143 } }, 0 },
+  { "if 1 == 2 || 3 >= 4 then $a = max(1, 2); end", { "[1]$a = 2", 131 }, { "", 162 }, 0 },
   { "if 1 == 2 || 3 >= 4 then $a = min(3, 1, 2); end", { "[1]$a = 1", 143 }, { "", 143 }, 0 },
   { "if 1 == 1 then $a = 1; $a = NULL; end", { "[1]$a = NULL", 111 }, { "[1]$a = NULL", 111 }, 0 },
   { "if 1 == 2 then $a = 3; else $a = 4; end", { "[1]$a = 4", 123 }, { "[1]$a = 4", 123 }, 0 },
@@ -535,39 +554,39 @@ bar", 127 } }, 0 }, // Newline
   { "if 3 == 3 then foo(1, 2); $b = 3; end  ", { "[1]$b = 3", 147 }, { "[1]$b = 3", 147 }, 0 },
   { "on foo($a, $b) then $a = $b; end if 3 == 3 then foo(1, 5); $b = 3; end  ", { { "[1]$a = NULL[1]$b = NULL", 142 }, { "[1]$a = 5[1]$b = 5[2]$b = 3", 206 } }, { { "[1]$a = NULL[1]$b = NULL", 202 }, { "[1]$a = 5[1]$b = 5[2]$b = 3", 202 } }, 0 },
   { "on foo($a, $b) then $a = $b; end if 3 == 3 then foo(1, 'foo'); $b = 3; end  ", { { "[1]$a = NULL[1]$b = NULL", 142 }, { "[1]$a = foo[1]$b = foo[2]$b = 3", 202 } }, { { "[1]$a = NULL[1]$b = NULL", 202 }, { "[1]$a = foo[1]$b = foo[2]$b = 3", 202 } }, 0 },
-  { "on foo($a, $b) then $a = $b; end if 3 == 3 then foo(1, 5, 6); $b = max(1, 3); end  ", { { "[1]$a = NULL[1]$b = NULL", 142 }, { "[1]$a = 5[1]$b = 5[2]$b = 3", 230 } }, { { "[1]$a = NULL[1]$b = NULL", 142 }, { "[1]$a = 5[1]$b = 5[2]$b = 3", 142 } }, 0 },
+  { "on foo($a, $b) then $a = $b; end if 3 == 3 then foo(1, 5, 6); $b = max(1, 3); end  ", { { "[1]$a = NULL[1]$b = NULL", 142 }, { "[1]$a = 5[1]$b = 5[2]$b = 3", 222 } }, { { "[1]$a = NULL[1]$b = NULL", 142 }, { "[1]$a = 5[1]$b = 5[2]$b = 3", 142 } }, 0 },
   { "on foo($a, $b) then $a = $b; end if 3 == 3 then foo(1); $b = 3; end  ", { { "[1]$a = NULL[1]$b = NULL", 142 }, { "[1]$a = NULL[1]$b = NULL[2]$b = 3", 198 } }, { { "[1]$a = NULL[1]$b = NULL", 202 }, { "[1]$a = NULL[1]$b = NULL[2]$b = 3", 202 } }, 0 },
   { "on foo($a, $c) then $a = $c; end if 3 == 3 then foo(NULL, 1); $b = 3; end  ", { { "[1]$a = NULL[1]$c = NULL", 142 }, { "[1]$a = 1[1]$c = 1[2]$b = 3", 225 } }, { { "[1]$a = NULL[1]$c = NULL", 202 }, { "[1]$a = 1[1]$c = 1[2]$b = 3", 202 } }, 0 },
   { "if 3 == 3 then foo(1, 2); $b = 3; end  ", { "[1]$b = 3", 147 }, { "[1]$b = 3", 147 }, 0 },
   { "if 3 == 3 then $a = 1; foo($a, 2); end", { { "[1]$a = 1", 155 }, { "[1]$a = 1", 155 } }, { { "[1]$a = 1", 155 }, { "[1]$x = 1[1]$y = 2[1]$z = 3", 202 } }, 0 },
   { "on foo($b, $c) then $a = $b + $c; end if 3 == 3 then $a = 1; $b = 2; foo($a, $b); end  ", { { "[1]$b = NULL[1]$c = NULL[1]$a = NULL", 173 }, { "[1]$b = 1[1]$c = 2[1]$a = 3[2]$a = 1[2]$b = 2", 241 } }, { { "[1]$b = NULL[1]$c = NULL[1]$a = NULL", 202 }, { "[1]$b = 1[1]$c = 2[1]$a = 3[2]$a = 1[2]$b = 2", 202 } }, 0 },
   { "on foo($a, $b) then $a = $b; end if 3 == 3 then foo(1, 5); $b = 3; end  ", { { "[1]$a = NULL[1]$b = NULL", 142 }, { "[1]$a = 5[1]$b = 5[2]$b = 3", 206 } }, { { "[1]$a = NULL[1]$b = NULL", 202 }, { "[1]$a = 5[1]$b = 5[2]$b = 3", 202 } }, 0 },
-  { "on foo then max(1, 2); end", { "", 112 }, { "", 112 }, 0 },
-  { "on foo then max(1, 2); end if 3 == 3 then max(1); foo(1); end", { { "", 112 }, { "", 172 } }, { { "", 16 }, { "", 131 } }, 0 },
-  { "on foo then max(1, 2); end if 3 == 3 then if 1 == 1 then $a = 1; end foo(1); end", { { "", 112 }, { "[2]$a = 1", 187 } }, { { "", 16 }, { "[2]$a = 1", 147 } }, 0 },
+  { "on foo then max(1, 2); end", { "", 104 }, { "", 104 }, 0 },
+  { "on foo then max(1, 2); end if 3 == 3 then max(1); foo(1); end", { { "", 104 }, { "", 168 } }, { { "", 16 }, { "", 131 } }, 0 },
+  { "on foo then max(1, 2); end if 3 == 3 then if 1 == 1 then $a = 1; end foo(1); end", { { "", 104 }, { "[2]$a = 1", 187 } }, { { "", 16 }, { "[2]$a = 1", 147 } }, 0 },
   { "on foo then $a = 6; $b = 3; end", { "[1]$a = 6[1]$b = 3", 138 }, { "[1]$a = 6[1]$b = 3", 138 }, 0 },
   { "on foo then $a = 1 + 2; end", { { "[1]$a = 3", 123 } }, { { "[1]$a = 3", 107 } }, 0 },
-  { "on foo then if $a == 1 then max(2, 900); end end", { "", 147 }, { "", 166 }, 0 },
+  { "on foo then if $a == 1 then max(2, 900); end end", { "", 139 }, { "", 166 }, 0 },
   { "on foo then if 1 < 2 then $b = 1; end if (1 + 0) <= 2 then $a = 1; end end", { "[1]$b = 1[1]$a = 1", 166 }, { "[1]$b = 1[1]$a = 1", 166 }, 0 },
   { "if 1 == 1 then if 5 == 6 then $a = 1; end $a = 2; end", { "[1]$a = 2", 127 }, { "[1]$a = 2", 127 }, 0 },
   { "on foo then if $a <= 0.2 + $b then if $c - $a >= 1 then $a = -2; end end end", { "[1]$a = -2", 205 }, { "[1]$a = -2", 205 }, 0 },
   { "on foo then if 5 == 6 then $a = 1; end $a = 2; end", { "[1]$a = 2", 139 }, { "[1]$a = 2", 139 }, 0 },
   { "on foo then if 5 == 6 then $a = 1; end if 1 == 3 then $b = 3; end $a = 2; end", { "[1]$a = 2[1]$b = 3", 174 }, { "[1]$a = 2", 174 }, 0 },
   { "if 1 == 1 then $a = 1; else $a = min(1, 2, 3); end", { "[1]$a = 1", 139 }, { "[1]$a = 1", 139 }, 0 },
-  { "if 1 == 1 then $a = 1; else $a = min(max(1, 2), 2, 3); end", { "[1]$a = 2", 155 }, { "[1]$a = 1", 155 }, 0 },
-  { "on bar then $a = 1; end on foo then $b = max(1, 2); bar(); end if 3 == 3 then foo(); $a = min(1, 2); end", { { "[1]$a = 1", 111 }, { "[1]$a = 1[2]$b = 2", 222 }, { "[1]$a = 1[2]$b = 2[3]$a = 1", 274 } }, { { "[1]$a = 1", 16 }, { "[1]$a = 1[2]$b = 2", 16 }, { "[1]$a = 1[2]$b = 2[3]$a = 1", 16 } }, 0 },
-  { "on foo then if max(1) == max(1) then $a = 1; end end", { "[1]$a = 1", 143 }, { "[1]$a = 1", 143 }, 0 },
-  { "on foo then if max($c) == 3 && max($a) then $a = 1; end end", { "[1]$a = 1", 178 }, { "[1]$a = 1", 178 }, 0 },
+  { "if 1 == 1 then $a = 1; else $a = min(max(1, 2), 2, 3); end", { "[1]$a = 2", 147 }, { "[1]$a = 1", 147 }, 0 },
+  { "on bar then $a = 1; end on foo then $b = max(1, 2); bar(); end if 3 == 3 then foo(); $a = min(1, 2); end", { { "[1]$a = 1", 111 }, { "[1]$a = 1[2]$b = 2", 214 }, { "[1]$a = 1[2]$b = 2[3]$a = 1", 266 } }, { { "[1]$a = 1", 16 }, { "[1]$a = 1[2]$b = 2", 16 }, { "[1]$a = 1[2]$b = 2[3]$a = 1", 16 } }, 0 },
+  { "on foo then if max(1) == max(1) then $a = 1; end end", { "[1]$a = 1", 135 }, { "[1]$a = 1", 135 }, 0 },
+  { "on foo then if max($c) == 3 && max($a) then $a = 1; end end", { "[1]$a = 1", 170 }, { "[1]$a = 1", 170 }, 0 },
   { "on foo then $a = 6; end if 3 == 3 then $b = 3; end  ", { { "[1]$a = 6", 111 }, { "[2]$b = 3", 182 } }, { { "[1]$a = 6", 111 }, { "[2]$b = 3", 111 } }, 0 },
   { "on foo then $a = 6; end if 3 == 3 then foo(); $b = 3; end  ", { { "[1]$a = 6", 111 }, { "[1]$a = 6[2]$b = 3", 190 } }, { { "[1]$a = 6", 111 }, { "[1]$a = 6[2]$b = 3", 111 } }, 0 },
   { "on foo then $a = 6; end if 3 == 3 then $b = 3; foo(); end  ", { { "[1]$a = 6", 111 }, { "[1]$a = 6[2]$b = 3", 190 } }, { { "[1]$a = 6", 111 }, { "[1]$a = 6[2]$b = 3", 190 } }, 0 },
-  { "on foo then $a = 6; end if 3 == 3 then foo(max(1, 2), 2); $b = 3; end  ", { { "[1]$a = 6", 111 }, { "[1]$a = 6[2]$b = 3", 226 } }, { { "[1]$a = 6", 111 }, { "[1]$a = 6[2]$b = 3", 147 } }, 0 },
+  { "on foo then $a = 6; end if 3 == 3 then foo(max(1, 2), 2); $b = 3; end  ", { { "[1]$a = 6", 111 }, { "[1]$a = 6[2]$b = 3", 218 } }, { { "[1]$a = 6", 111 }, { "[1]$a = 6[2]$b = 3", 147 } }, 0 },
   { "on foo then $a = 6; end if 3 == 3 then foo(1, 2); $b = 3; end  ", { { "[1]$a = 6", 111 }, { "[1]$a = 6[2]$b = 3", 206 } }, { { "[1]$a = 6", 111 }, { "[1]$a = 6[2]$b = 3", 147 } }, 0 },
-  { "on foo then $a = coalesce($b, 0); end  ", { { "[1]$a = 2", 154 } }, { { "[1]$a = 2", 154 } }, 0 }, // FIXME
+  { "on foo then $a = coalesce($b, 0); end  ", { { "[1]$a = 2", 146 } }, { { "[1]$a = 2", 146 } }, 0 }, // FIXME
   { "on foo then if 1 == 2 then $a = 1; elseif 2 == 2 then $a = 3; else $a = 2; end end", { "[1]$a = 2", 155 }, { "[1]$a = 3", 139 }, 0 },
-  { "on foo then if 2 == 2 then $c = 1; elseif 3 == 3 then $b = max(1); end end", { "[1]$c = 1[1]$b = 1", 178 }, { "[1]$c = 1", 139 }, 0 },
+  { "on foo then if 2 == 2 then $c = 1; elseif 3 == 3 then $b = max(1); end end", { "[1]$c = 1[1]$b = 1", 174 }, { "[1]$c = 1", 139 }, 0 },
   { "on foo then if 3 == 3 then $a = 6; elseif 3 == 3 then $b = 1; end end on bar then if 3 == 3 then $b = 3; end end", { { "[1]$a = 6[1]$b = 1", 166 }, { "[2]$b = 3", 202 } }, { { "[1]$a = 6", 147 }, { "[2]$b = 3", 147 } }, 0 },
-  { "on foo then if 1 == 1 then $a = 1; $b = 1.25; $c = 10; $d = 100; else $a = 1; end end on bar then $e = NULL; $f = max(1, 2); $g = 1 + 1.25; foo(); end", { { "[1]$a = 1[1]$b = 1.25[1]$c = 10[1]$d = 100", 212 }, { "[1]$a = 1[1]$b = 1.25[1]$c = 10[1]$d = 100[2]$e = NULL[2]$f = 2[2]$g = 2.25", 341 } }, { { "[1]$a = 1[1]$b = 1.25[1]$c = 10[1]$d = 100", 147 }, { "[1]$a = 1[1]$b = 1.25[1]$c = 10[1]$d = 100[2]$e = NULL[2]$f = 2[2]$g = 2.25", 147 } }, 0 },
+  { "on foo then if 1 == 1 then $a = 1; $b = 1.25; $c = 10; $d = 100; else $a = 1; end end on bar then $e = NULL; $f = max(1, 2); $g = 1 + 1.25; foo(); end", { { "[1]$a = 1[1]$b = 1.25[1]$c = 10[1]$d = 100", 212 }, { "[1]$a = 1[1]$b = 1.25[1]$c = 10[1]$d = 100[2]$e = NULL[2]$f = 2[2]$g = 2.25", 333 } }, { { "[1]$a = 1[1]$b = 1.25[1]$c = 10[1]$d = 100", 147 }, { "[1]$a = 1[1]$b = 1.25[1]$c = 10[1]$d = 100[2]$e = NULL[2]$f = 2[2]$g = 2.25", 147 } }, 0 },
   { "on foo then $a = 1; end if 3 == 3 then if 1 == 1 then foo(); end if 1 == 1 then foo(); end end", { { "[1]$a = 1", 111 }, { "[1]$a = 1", 199 } }, { { "[1]$a = 1", 147 }, { "[1]$a = 1", 147 } }, 0 },
   { "on foo then $a = 1; end if 3 == 3 then if $a == 1 then foo(); end end", { { "[1]$a = 1", 111 }, { "[1]$a = 1", 183 } }, { { "[1]$a = 1", 147 }, { "[1]$a = 1", 202 } }, 0 },
   { "if 3 == 3 then if (1 + 2) >= 3 && (1 + 2) <= $a then $a = 1; end end", { "[1]$a = 1", 143 }, { "", 139 }, 0 },
@@ -575,12 +594,13 @@ bar", 127 } }, 0 }, // Newline
   { "on foo then $a = 1; end if 3 == 3 then foo(); else $a = 1; end", { { "[1]$a = 1", 111 }, { "[1]$a = 1[2]$a = 1", 179 } }, { { "[1]$a = 1", 119 }, { "[1]$a = 1", 119 } }, 0 },
   { "on foo then $a = 1; end if 3 == 3 then foo(); elseif 1 == 1 then $a = 1; end", { { "[1]$a = 1", 111 }, { "[1]$a = 1[2]$a = 1", 187 } }, { { "[1]$a = 1", 147 }, { "[1]$a = 1", 147 } }, 0 },
   { "on foo then $a = 1; end if 3 == 3 then $a = 'foo'; end", { { "[1]$a = 1", 111 }, { "[2]$a = foo", 163 } }, { { "[1]$a = 1", 111 }, { "[2]$a = foo", 202 } }, 0 },
-  { "if 1 == 1 then $a = 1; $b = 2; $aa = round($a / (($b * 230) + 50) * 10) / 10; $b = 2.1; $bb = round($a / (($b * 230) + 50) * 10) / 10; $b = 2.2; $cc = round($a / (($b * 230) + 50) * 10) / 10; $b = 2.3; $dd = round($a / (($b * 230) + 50) * 10) / 10; $b = 2.4; $dd = round($a / (($b * 230) + 50) * 10) / 10; $b = 2.5; $ee = round($a / (($b * 230) + 50) * 10) / 10; $b = 2.6; $ff = round($a / (($b * 230) + 50) * 10) / 10; $b = 2.7; $ff = round($a / (($b * 230) + 50) * 10) / 10; $b = 2.8; $gg = round($a / (($b * 230) + 50) * 10) / 10; end", { "[1]$a = 1[1]$b = 2.8[1]$aa = 0[1]$bb = 0[1]$cc = 0[1]$dd = 0[1]$ee = 0[1]$ff = 0[1]$gg = 0", 710 }, { "[1]$a = 1[1]$b = 2.8[1]$aa = 0[1]$bb = 0[1]$cc = 0[1]$dd = 0[1]$ee = 0[1]$ff = 0[1]$gg = 0", 710 }, 0 },
-  { "on foo then coalesce(10, 5); $a = 1; $b = 2; if $c == 12 && $d == 0 then $e = 1; end", { "[1]$a = 1[1]$b = 2[1]$e = 1", 263 }, { "[1]$a = 1[1]$b = 2", 263 }, 0 },
+  { "if 1 == 1 then $a = 1; $b = 2; $aa = round($a / (($b * 230) + 50) * 10) / 10; $b = 2.1; $bb = round($a / (($b * 230) + 50) * 10) / 10; $b = 2.2; $cc = round($a / (($b * 230) + 50) * 10) / 10; $b = 2.3; $dd = round($a / (($b * 230) + 50) * 10) / 10; $b = 2.4; $dd = round($a / (($b * 230) + 50) * 10) / 10; $b = 2.5; $ee = round($a / (($b * 230) + 50) * 10) / 10; $b = 2.6; $ff = round($a / (($b * 230) + 50) * 10) / 10; $b = 2.7; $ff = round($a / (($b * 230) + 50) * 10) / 10; $b = 2.8; $gg = round($a / (($b * 230) + 50) * 10) / 10; end", { "[1]$a = 1[1]$b = 2.8[1]$aa = 0[1]$bb = 0[1]$cc = 0[1]$dd = 0[1]$ee = 0[1]$ff = 0[1]$gg = 0", 674 }, { "[1]$a = 1[1]$b = 2.8[1]$aa = 0[1]$bb = 0[1]$cc = 0[1]$dd = 0[1]$ee = 0[1]$ff = 0[1]$gg = 0", 674 }, 0 },
+  { "on foo then coalesce(10, 5); $a = 1; $b = 2; if $c == 12 && $d == 0 then $e = 1; end", { "[1]$a = 1[1]$b = 2[1]$e = 1", 255 }, { "[1]$a = 1[1]$b = 2", 255 }, 0 },
   { "on foo($a, $b) then print($a); $b = 1; end", { "[1]$a = NULL[1]$b = 1", 158 }, { "[1]$a = NULL[1]$b = 1", 158 }, 0 },
   { "on foo then print($a); $b = 1; end", { "[1]$b = 1", 150 }, { "[1]$b = 1", 150 }, 0 },
   { "on sub2($a) then print($a); $b = $a; end if 1 == 1 then print($a); sub2(2); end", { { "[1]$a = NULL[1]$b = NULL", 159 }, { "[1]$a = 2[1]$b = 2", 215 } }, { { "[1]$a = NULL[1]$b = NULL", 128 },{ "[1]$a = 2[1]$b = 2", 215 } }, 0 },
   { "on sub2($a) then print($a); $c = $a + 1; end on sub1($a) then print($a); sub2($a + 1); $b = $a - 1; end if 1 == 1 then sub1(1); end", { { "[1]$a = NULL[1]$c = NULL", 167 }, { "[1]$a = NULL[1]$c = NULL[2]$a = NULL[2]$b = NULL", 271 }, { "[1]$a = 2[1]$c = 3[2]$a = 1[2]$b = 0", 271 } }, { { "[1]$a = NULL[1]$c = NULL", 128 }, { "[1]$a = NULL[1]$c = NULL[2]$a = NULL[2]$b = NULL", 196 }, { "[1]$a = 2[1]$c = 3[2]$a = 1[2]$b = 0", 196 } }, 0 },
+  { "on foo then $a = \"1\"; if $a == \"1\" then $b = \"2\"; end end", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
   { "if 1 == 1 then $a = 1; $b = 1; $c = 1; $d = 1; $e = 1; $f = 1; $g = 1; $h = 1; $i = 1; $j = 1; $k = 1; $l = 1; $m = 1; $n = 1; $o = 1; $p = 1; $q = 1; $r = 1; $s = 1; $t = 1; $u = 1; $v = 1; $w = 1; $x = 1; $y = 1; $z = 1; $aa = 1; $ab = 1; $ac = 1; $ad = 1; $ae = 1; $af = 1; $ag = 1; $ah = 1; $aj = 1; $aj = 1; $ak = 1; $al = 1; $am = 1; $an = 1; $ao = 1; $ap = 1; $aq = 1; $ar = 1; $as = 1; $at = 1; $au = 1; $av = 1; $aw = 1; $ax = 1; $ay = 1; $az = 1; $ba = 1; $bb = 1; $bc = 1; $bd = 1; $be = 1; $bf = 1; $bg = 1; $bh = 1; $bj = 1; $bj = 1; $bk = 1; $bl = 1; $bm = 1; $bn = 1; $bo = 1; $bp = 1; $bq = 1; $br = 1; $bs = 1; $bt = 1; $bu = 1; $bv = 1; $bw = 1; $bx = 1; $by = 1; $bz = 1; $ca = 1; $cb = 1; $cc = 1; $cd = 1; $ce = 1; $cf = 1; $cg = 1; $ch = 1; $cj = 1; $cj = 1; $ck = 1; $cl = 1; $cm = 1; $cn = 1; $co = 1; $cp = 1; $cq = 1; $cr = 1; $cs = 1; $ct = 1; $cu = 1; $cv = 1; $cw = 1; $cx = 1; $cy = 1; $cz = 1; $da = 1; $db = 1; $dc = 1; $dd = 1; $de = 1; $df = 1; $dg = 1; $dh = 1; $dj = 1; end", { { "[1]$de = 1[1]$df = 1[1]$dg = 1[1]$dh = 1[1]$dj = 1", 2706 } }, { { "[1]$de = 1[1]$df = 1[1]$dg = 1[1]$dh = 1[1]$dj = 1", 0 } }, 0 },
   { "on sub2 then sub1(1); end on sub1($a) then print($a); end on sub3 then sub2(); end", { { "", 126 }, { "[2]$a = NULL", 189 }, { "[2]$a = 1", 238 } }, { { "", 128 },{ "[2]$a = NULL", 215 }, { "[2]$a = 1", 238 } }, 0 },
 
@@ -588,6 +608,11 @@ bar", 127 } }, 0 }, // Newline
    * Invalid rules
    */
   { "", { { NULL, 0 } }, { { NULL, 0 } }, 1 },
+  { "if 3 == 3 then $a = substr(1, 2); end", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
+  { "if 3 == 3 then $a = substr('foo'); end", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
+  { "if 3 == 3 then $a = startswith('foo', 1); end", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
+  { "if 3 == 3 then $a = find('foo', 'o', 'a'); end", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
+  { "if 3 == 3 then $a = strlen(1); end", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
   { "foo", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
   { "foo(", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
   { "1 == 1", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
@@ -615,7 +640,6 @@ bar", 127 } }, 0 }, // Newline
   { "on foo then ceil('a'); end", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
   { "on foo then $a = coalesce(NULL, 'a') + 1; end", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
   { "on foo then $a = 1 + coalesce(NULL, 'a'); end", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
-  { "if coalesce('a') == coalesce('a') then $a = 1; end", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
   { "if coalesce('a') == 1 then $a = 1; end", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
   { "if 1 == coalesce('a') then $a = 1; end", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
   { "on foo then $a = 'foo; end", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
@@ -669,7 +693,6 @@ bar", 127 } }, 0 }, // Newline
   { "on foo(max(1), $a) then $a = $b; end if 3 == 3 then foo(1, 5, 6); $b = 3; end  ", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
   { "if 1 == 1 then if 1 < 2 then elseif 1 == 1 then $a = 1; end end", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
   { "if 1 == 1 then if 1 < 2 then end end", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
-  { "on foo then $a = \"1\"; if $a == \"1\" then $b = \"2\"; end end", { { NULL, 0 } }, { { NULL, 0 } }, -1 },
   { "if 1 == 1 then $a = 1; $b = 1; $c = 1; $d = 1; $e = 1; $f = 1; $g = 1; $h = 1; $i = 1; $j = 1; $k = 1; $l = 1; $m = 1; $n = 1; $o = 1; $p = 1; $q = 1; $r = 1; $s = 1; $t = 1; $u = 1; $v = 1; $w = 1; $x = 1; $y = 1; $z = 1; $aa = 1; $ab = 1; $ac = 1; $ad = 1; $ae = 1; $af = 1; $ag = 1; $ah = 1; $aj = 1; $aj = 1; $ak = 1; $al = 1; $am = 1; $an = 1; $ao = 1; $ap = 1; $aq = 1; $ar = 1; $as = 1; $at = 1; $au = 1; $av = 1; $aw = 1; $ax = 1; $ay = 1; $az = 1; $ba = 1; $bb = 1; $bc = 1; $bd = 1; $be = 1; $bf = 1; $bg = 1; $bh = 1; $bj = 1; $bj = 1; $bk = 1; $bl = 1; $bm = 1; $bn = 1; $bo = 1; $bp = 1; $bq = 1; $br = 1; $bs = 1; $bt = 1; $bu = 1; $bv = 1; $bw = 1; $bx = 1; $by = 1; $bz = 1; $ca = 1; $cb = 1; $cc = 1; $cd = 1; $ce = 1; $cf = 1; $cg = 1; $ch = 1; $cj = 1; $cj = 1; $ck = 1; $cl = 1; $cm = 1; $cn = 1; $co = 1; $cp = 1; $cq = 1; $cr = 1; $cs = 1; $ct = 1; $cu = 1; $cv = 1; $cw = 1; $cx = 1; $cy = 1; $cz = 1; $da = 1; $db = 1; $dc = 1; $dd = 1; $de = 1; $df = 1; $dg = 1; $dh = 1; $dj = 1; $dj = 1; $dk = 1; $dl = 1; $dm = 1; $dn = 1; $do = 1; $dp = 1; $dq = 1; $dr = 1; $ds = 1; $dt = 1; $du = 1; $dv = 1; $dw = 1; $dx = 1; $dy = 1; $dz = 1; $ea = 1; $eb = 1; $ec = 1; $ed = 1; $ee = 1;end", { { "", 3098 } }, { { "", 0 } }, -1 },
 };
 
@@ -702,6 +725,9 @@ static int8_t vm_value_set(struct rules_t *obj) {
   struct varstack_t *table = (struct varstack_t *)obj->userdata;
   uint16_t x = 0;
   uint8_t type = 0;
+#if defined(DEBUG) || defined(COVERALLS)
+  unsigned int allocs = mem_allocs;
+#endif
 
   if(rules_gettop() < 2) {
     return -1;
@@ -714,6 +740,7 @@ static int8_t vm_value_set(struct rules_t *obj) {
   }
 
   const char *key = rules_tostring(-2);
+  uint16_t handle = rules_tohandle(-2);
 
   if(table == NULL) {
     if((table = (struct varstack_t *)MALLOC(sizeof(struct varstack_t))) == NULL) {
@@ -725,7 +752,7 @@ static int8_t vm_value_set(struct rules_t *obj) {
 
   struct array_t *array = NULL;
   for(x=0;x<table->nr;x++) {
-    if(strcmp(table->array[x].key, key) == 0) {
+    if(table->array[x].handle == handle) {
       array = &table->array[x];
       break;
     }
@@ -738,15 +765,24 @@ static int8_t vm_value_set(struct rules_t *obj) {
     array = &table->array[table->nr];
     memset(array, 0, sizeof(struct array_t));
     table->nr++;
-    rules_ref(key);
+    rules_ref_handle(handle);
   }
 
   array->key = key;
+  array->handle = handle;
+
+#if defined(DEBUG) || defined(COVERALLS)
+  /*
+   * The variable table is owned by the host,
+   * so these don't count as rule allocations.
+   */
+  host_allocs += mem_allocs-allocs;
+#endif
 
   switch(type) {
     case VINTEGER: {
-      if(array->type == VCHAR && array->val.s != NULL) {
-        rules_unref(array->val.s);
+      if(array->type == VCHAR) {
+        rules_unpin(array->pin);
       }
       array->val.i = rules_tointeger(-1);
       array->type = VINTEGER;
@@ -756,8 +792,8 @@ static int8_t vm_value_set(struct rules_t *obj) {
 #endif
     } break;
     case VFLOAT: {
-      if(array->type == VCHAR && array->val.s != NULL) {
-        rules_unref(array->val.s);
+      if(array->type == VCHAR) {
+        rules_unpin(array->pin);
       }
       array->val.f = rules_tofloat(-1);
       array->type = VFLOAT;
@@ -767,21 +803,22 @@ static int8_t vm_value_set(struct rules_t *obj) {
 #endif
     } break;
     case VCHAR: {
-      if(array->type == VCHAR && array->val.s != NULL) {
-        rules_unref(array->val.s);
+      uint16_t pin = rules_pin(-1);
+      if(array->type == VCHAR) {
+        rules_unpin(array->pin);
       }
 
       array->val.s = rules_tostring(-1);
       array->type = VCHAR;
-      rules_ref(array->val.s);
+      array->pin = pin;
 
 #ifdef DEBUG
       printf("%s %s = %s\n", __FUNCTION__, array->key, array->val.s);
 #endif
     } break;
     case VNULL: {
-      if(array->type == VCHAR && array->val.s != NULL) {
-        rules_unref(array->val.s);
+      if(array->type == VCHAR) {
+        rules_unpin(array->pin);
       }
       array->val.n = NULL;
       array->type = VNULL;
@@ -828,9 +865,10 @@ static int8_t vm_value_get(struct rules_t *obj) {
 #endif
     }
   } else {
+    uint16_t handle = rules_tohandle(-1);
     struct array_t *array = NULL;
     for(x=0;x<table->nr;x++) {
-      if(strcmp(table->array[x].key, key) == 0) {
+      if(table->array[x].handle == handle) {
         array = &table->array[x];
         break;
       }
@@ -886,29 +924,6 @@ static int8_t event_cb(struct rules_t *obj, char *name) {
   return 1;
 }
 
-static void rule_done_cb(struct rules_t *obj) {
-  struct varstack_t *table = (struct varstack_t *)obj->userdata;
-  int16_t x = 0;
-
-  struct array_t *array = NULL;
-
-  if(table != NULL) {
-    for(x=0;x<table->nr;x++) {
-      array = &table->array[x];
-      switch(array->type) {
-        case VCHAR: {
-          char *tmp = strdup(array->val.s);
-          if(array->type == VCHAR && array->val.s != NULL) {
-            rules_unref(array->val.s);
-          }
-          array->val.s = tmp;
-        } break;
-      }
-    }
-  }
-  return;
-}
-
 void run_test(int *i, unsigned char *mempool, uint16_t size) {
 
   if(*i == 0) {
@@ -926,7 +941,6 @@ void run_test(int *i, unsigned char *mempool, uint16_t size) {
   memset(&rule_options, 0, sizeof(struct rule_options_t));
   rule_options.is_variable_cb = is_variable;
   rule_options.is_event_cb = is_event;
-  rule_options.done_cb = rule_done_cb;
   rule_options.vm_value_set = vm_value_set;
   rule_options.vm_value_get = vm_value_get;
   rule_options.event_cb = event_cb;
@@ -1011,6 +1025,17 @@ void run_test(int *i, unsigned char *mempool, uint16_t size) {
       printf("Rule %.2d.%d / %.2d: [ %.*s %-*s ]\n", (*i)+1, getval(rules[nrrules-1]->nr), nrtests, size, cpytxt, 50-size, " ");
     }
 
+#if !defined(ESP8266) && defined(DEBUG)
+    /*LCOV_EXCL_START*/
+    if((uint16_t)(rules[nrrules-1]->bc.nrbytes + (rules[nrrules-1]->heap->nrbytes) + rules_memused()) != unittest.validate[rules[nrrules-1]->nr-1].bytes) {
+      printf("Expected: %d\n", unittest.validate[rules[nrrules-1]->nr-1].bytes);
+      printf("Was: %d\n", rules[nrrules-1]->bc.nrbytes + (rules[nrrules-1]->heap->nrbytes) + rules_memused());
+
+      exit(-1);
+    }
+    /*LCOV_EXCL_STOP*/
+#endif
+
     uint8_t x = 0, y = 0, z = 0;
     memset(&out, 0, 255);
     for(y=0;y<nrrules;y++) {
@@ -1027,7 +1052,7 @@ void run_test(int *i, unsigned char *mempool, uint16_t size) {
             } break;
             case VCHAR: {
               x += snprintf(&out[x], 255-x, "[%d]%s = %s", y+1, array->key, array->val.s);
-              free((void *)array->val.s);
+              rules_unpin(array->pin);
             } break;
             case VNULL: {
                x += snprintf(&out[x], 255-x, "[%d]%s = NULL", y+1, array->key);
@@ -1056,18 +1081,19 @@ void run_test(int *i, unsigned char *mempool, uint16_t size) {
 #endif
     }
 
-#if !defined(ESP8266) && defined(DEBUG)
-    /*LCOV_EXCL_START*/
-    if((uint16_t)(rules[nrrules-1]->bc.nrbytes + (rules[nrrules-1]->heap->nrbytes) + rules_memused()) != unittest.validate[rules[nrrules-1]->nr-1].bytes) {
-      printf("Expected: %d\n", unittest.validate[rules[nrrules-1]->nr-1].bytes);
-      printf("Was: %d\n", rules[nrrules-1]->bc.nrbytes + (rules[nrrules-1]->heap->nrbytes) + rules_memused());
-
-      exit(-1);
-    }
-    /*LCOV_EXCL_STOP*/
-#endif
+    /*
+     * The validation run created the strings of
+     * this rule, so with some room to spare the
+     * runs below should not allocate anymore.
+     */
+    rules_reserve(16, 512);
+    rules_noalloc(1);
 
     for(x=0;x<5;x++) {
+#if defined(DEBUG) || defined(COVERALLS)
+      unsigned int allocs = mem_allocs;
+      host_allocs = 0;
+#endif
 #if defined(DEBUG) && !defined(ESP8266)
       clock_gettime(CLOCK_MONOTONIC, &timestamp.first);
 #endif
@@ -1076,6 +1102,14 @@ void run_test(int *i, unsigned char *mempool, uint16_t size) {
         exit(-1);
         /*LCOV_EXCL_STOP*/
       }
+#if defined(DEBUG) || defined(COVERALLS)
+      if(mem_allocs-allocs != host_allocs) {
+        /*LCOV_EXCL_START*/
+        printf("Expected: 0 allocations\nWas: %d\n", mem_allocs-allocs-host_allocs);
+        exit(-1);
+        /*LCOV_EXCL_STOP*/
+      }
+#endif
 #if defined(DEBUG) && !defined(ESP8266)
       clock_gettime(CLOCK_MONOTONIC, &timestamp.second);
 
@@ -1113,7 +1147,7 @@ void run_test(int *i, unsigned char *mempool, uint16_t size) {
               } break;
               case VCHAR: {
                 x += snprintf(&out[x], 255-x, "[%d]%s = %s", y+1, array->key, array->val.s);
-                free((void *)array->val.s);
+                rules_unpin(array->pin);
               } break;
               case VNULL: {
                  x += snprintf(&out[x], 255-x, "[%d]%s = NULL", y+1, array->key);
@@ -1216,7 +1250,6 @@ void check_rule_by_name(unsigned char *mempool, uint16_t size) {
   memset(&rule_options, 0, sizeof(struct rule_options_t));
   rule_options.is_variable_cb = is_variable;
   rule_options.is_event_cb = is_event;
-  rule_options.done_cb = rule_done_cb;
   rule_options.vm_value_set = vm_value_set;
   rule_options.vm_value_get = vm_value_get;
   rule_options.event_cb = event_cb;
@@ -1306,7 +1339,6 @@ void check_rule_by_id(unsigned char *mempool, uint16_t size) {
   memset(&rule_options, 0, sizeof(struct rule_options_t));
   rule_options.is_variable_cb = is_variable;
   rule_options.is_event_cb = is_event;
-  rule_options.done_cb = rule_done_cb;
   rule_options.vm_value_set = vm_value_set;
   rule_options.vm_value_get = vm_value_get;
   rule_options.event_cb = event_cb;
@@ -1403,7 +1435,6 @@ int8_t run_two_mempools(struct pbuf *mem) {
   memset(&rule_options, 0, sizeof(struct rule_options_t));
   rule_options.is_variable_cb = is_variable;
   rule_options.is_event_cb = is_event;
-  rule_options.done_cb = rule_done_cb;
   rule_options.vm_value_set = vm_value_set;
   rule_options.vm_value_get = vm_value_get;
   rule_options.event_cb = event_cb;
@@ -1580,45 +1611,1872 @@ int8_t run_two_mempools(struct pbuf *mem) {
 
 
 #ifndef ESP8266
-int main(void) {
-  int nrtests = sizeof(unittests)/sizeof(unittests[0]), i = 0;
+static void collect_output(void) {
+  uint8_t x = 0, y = 0, z = 0;
+  memset(&out, 0, OUTPUT_SIZE);
+  for(y=0;y<nrrules;y++) {
+    struct varstack_t *table = (struct varstack_t *)rules[y]->userdata;
+    if(table != NULL) {
+      for(z=0;z<table->nr;z++) {
+        struct array_t *array = &table->array[z];
+        switch(array->type) {
+          case VINTEGER: {
+            x += snprintf(&out[x], OUTPUT_SIZE-x, "[%d]%s = %d", y+1, array->key, array->val.i);
+          } break;
+          case VFLOAT: {
+            x += snprintf(&out[x], OUTPUT_SIZE-x, "[%d]%s = %g", y+1, array->key, (double)array->val.f);
+          } break;
+          case VCHAR: {
+            x += snprintf(&out[x], OUTPUT_SIZE-x, "[%d]%s = %s", y+1, array->key, array->val.s);
+            rules_unpin(array->pin);
+          } break;
+          case VNULL: {
+             x += snprintf(&out[x], OUTPUT_SIZE-x, "[%d]%s = NULL", y+1, array->key);
+          } break;
+        }
+      }
+      FREE(table->array);
+      FREE(table);
+      rules[y]->userdata = NULL;
+    }
+  }
+}
 
-  unsigned char *mempool = (unsigned char *)MALLOC(MEMPOOL_SIZE*2);
-  if(mempool == NULL) {
+static uint8_t image_variable_type(const char *name, uint16_t len) {
+  if(len == 2 && strncmp(name, "$c", 2) == 0) {
+    return VCHAR;
+  }
+  return 0;
+}
+
+void check_rule_image(unsigned char *mempool, uint16_t size) {
+#ifdef ESP8266
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  Serial.printf("[ %-*s Loading rule images %-*s ]\n", 22, " ", 26, " ");
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#else
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  printf("[ %-*s Loading rule images %-*s ]\n", 22, " ", 26, " ");
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#endif
+
+  memset(&rule_options, 0, sizeof(struct rule_options_t));
+  rule_options.is_variable_cb = is_variable;
+  rule_options.is_event_cb = is_event;
+  rule_options.vm_value_set = vm_value_set;
+  rule_options.vm_value_get = vm_value_get;
+  rule_options.event_cb = event_cb;
+
+  const char *rule = "on foo then $a = 1 + 2; $b = \"abc\"; bar(); end on bar then $c = max(1, 5) * 2.5; $d = $c; end";
+  const char *expected = "[1]$a = 3[1]$b = abc[2]$c = 12.5[2]$d = 12.5";
+
+  int len = strlen(rule);
+  unsigned char *image[2] = { NULL, NULL };
+  uint16_t imagesize[2] = { 0, 0 };
+  unsigned char *set = NULL;
+  uint16_t setsize = 0;
+
+  struct pbuf mem;
+  struct pbuf input;
+  memset(&mem, 0, sizeof(struct pbuf));
+  memset(&input, 0, sizeof(struct pbuf));
+
+  mem.payload = mempool;
+  mem.len = 0;
+  mem.tot_len = size;
+
+  uint8_t y = 0;
+  uint16_t txtoffset = alignedbuffer(size-len-5);
+  for(y=0;y<len;y++) {
+    mmu_set_uint8((void *)&(mempool[txtoffset+y]), (uint8_t)rule[y]);
+  }
+
+  input.payload = &mempool[txtoffset];
+  input.len = txtoffset;
+  input.tot_len = len;
+
+  while(rule_initialize(&input, &rules, &nrrules, &mem, NULL) == 0) {
+    input.payload = &mempool[getval(input.len)];
+    if(getval(input.tot_len) == 0) {
+      break;
+    }
+  }
+
+  if(nrrules != 2) {
     /*LCOV_EXCL_START*/
-    fprintf(stderr, "OUT_OF_MEMORY\n");
-    assert(1 == 0);
     exit(-1);
     /*LCOV_EXCL_STOP*/
   }
-  MMU_SEC_HEAP = &mempool[MEMPOOL_SIZE];
 
-  for(i=0;i<nrtests;i++) {
-    memset(mempool, 0, MEMPOOL_SIZE*2);
-    run_test(&i, &mempool[MEMPOOL_SIZE], MEMPOOL_SIZE);
+  for(y=0;y<nrrules;y++) {
+    imagesize[y] = rule_dump(rules[y], NULL, 0);
+    if(imagesize[y] == 0 || (image[y] = (unsigned char *)MALLOC(imagesize[y])) == NULL) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+    if(rule_dump(rules[y], image[y], imagesize[y]-1) != 0 ||
+       rule_dump(rules[y], image[y], imagesize[y]) != imagesize[y]) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
   }
-  FREE(mempool);
 
-  mempool = (unsigned char *)MALLOC(MEMPOOL_SIZE*2);
-  if(mempool == NULL) {
+  setsize = rules_dump(rules, nrrules, NULL, 0);
+  if(setsize == 0 || (set = (unsigned char *)MALLOC(setsize*2)) == NULL) {
     /*LCOV_EXCL_START*/
-    fprintf(stderr, "OUT_OF_MEMORY\n");
-    assert(1 == 0);
     exit(-1);
     /*LCOV_EXCL_STOP*/
   }
-  MMU_SEC_HEAP = &mempool[MEMPOOL_SIZE];
+  if(rules_dump(rules, nrrules, set, setsize) != setsize) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+  memcpy(&set[setsize], set, setsize);
 
-  for(i=0;i<nrtests;i++) {
-    memset(mempool, 0, MEMPOOL_SIZE*2);
-    run_test(&i, &mempool[0], MEMPOOL_SIZE);
+  collect_output();
+  rules_gc(&rules, &nrrules);
+
+  memset(mempool, 0, size);
+  mem.len = 0;
+
+  if(rule_load(image[0], imagesize[0]-1, &rules, &nrrules, &mem, NULL) != -1 || nrrules != 0) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
   }
 
-  memset(mempool, 0, MEMPOOL_SIZE*2);
-  check_rule_by_id(&mempool[0], MEMPOOL_SIZE);
+  /*
+   * The same functions in a different order
+   */
+  {
+    struct rule_function_t tmp = rule_functions[0];
+    rule_functions[0] = rule_functions[1];
+    rule_functions[1] = tmp;
 
-  memset(mempool, 0, MEMPOOL_SIZE*2);
-  check_rule_by_name(&mempool[0], MEMPOOL_SIZE);
+    if(rule_load(image[0], imagesize[0], &rules, &nrrules, &mem, NULL) != -1 || nrrules != 0) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+
+    rule_functions[1] = rule_functions[0];
+    rule_functions[0] = tmp;
+  }
+
+  /*
+   * An unknown opcode, a heap slot outside the
+   * heap and a jump past the bytecode.
+   */
+  {
+    uint16_t bc = imagesize[0] - ((image[0][4] << 8) | image[0][5]) - ((image[0][6] << 8) | image[0][7]) - ((image[0][8] << 8) | image[0][9]);
+    unsigned char corrupt[3][4] = { { 31, 0, 0, 0 }, { OP_TEST, 0x81, 0, 0 }, { OP_JMP, 127, 0, 0 } };
+    unsigned char instr[4];
+
+    memcpy(instr, &image[0][bc], 4);
+    for(y=0;y<3;y++) {
+      memcpy(&image[0][bc], corrupt[y], 4);
+      if(rule_load(image[0], imagesize[0], &rules, &nrrules, &mem, NULL) != -1 || nrrules != 0) {
+        /*LCOV_EXCL_START*/
+        exit(-1);
+        /*LCOV_EXCL_STOP*/
+      }
+    }
+    memcpy(&image[0][bc], instr, 4);
+  }
+
+  /*
+   * A rule that fails its type check is taken back
+   * without leaving anything in the mempool.
+   */
+  {
+    uint16_t used = 0;
+
+    if(rule_load(image[0], imagesize[0], &rules, &nrrules, &mem, NULL) != 0) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+    used = mem.len;
+
+    rule_options.variable_type_cb = image_variable_type;
+    if(rule_load(image[1], imagesize[1], &rules, &nrrules, &mem, NULL) != -1 || nrrules != 1 || mem.len != used) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+    rule_options.variable_type_cb = NULL;
+
+    if(rule_load(image[1], imagesize[1], &rules, &nrrules, &mem, NULL) != 0) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+  }
+
+  if(rule_by_name(rules, nrrules, (char *)"foo") != 0 ||
+     rule_by_name(rules, nrrules, (char *)"bar") != 1) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  collect_output();
+
+  if(rule_run(rules[0], 0) == -1) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  collect_output();
+
+  if(strcmp(out, expected) != 0) {
+    /*LCOV_EXCL_START*/
+    printf("Expected: %s\n", expected);
+    printf("Was: %s\n", out);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  FREE(image[0]);
+  FREE(image[1]);
+  rules_gc(&rules, &nrrules);
+
+  memset(mempool, 0, size);
+  mem.len = 0;
+
+  /*
+   * A ruleset image is checked like a rule image
+   */
+  {
+    struct rule_function_t tmp = rule_functions[0];
+    rule_functions[0] = rule_functions[1];
+    rule_functions[1] = tmp;
+
+    if(rules_load(set, setsize, &rules, &nrrules, &mem, NULL) != -1 || nrrules != 0) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+
+    rule_functions[1] = rule_functions[0];
+    rule_functions[0] = tmp;
+  }
+  {
+    uint16_t bc = (set[12] << 8) | set[13];
+
+    set[bc] = 31;
+    if(rules_load(set, setsize, &rules, &nrrules, &mem, NULL) != -1 || nrrules != 0) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+    set[bc] = set[setsize+bc];
+  }
+
+  /*
+   * With an empty varstack the bytecode of a
+   * ruleset image is used in place.
+   */
+  if(rules_load(set, setsize, &rules, &nrrules, &mem, NULL) != 0 || nrrules != 2 ||
+     rules[0]->bc.buffer < set || rules[1]->bc.buffer >= &set[setsize]) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  collect_output();
+
+  if(rule_run(rules[0], 0) == -1) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  collect_output();
+
+  if(strcmp(out, expected) != 0 || memcmp(set, &set[setsize], setsize) != 0) {
+    /*LCOV_EXCL_START*/
+    printf("Expected: %s\n", expected);
+    printf("Was: %s\n", out);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  FREE(set);
+  rules_gc(&rules, &nrrules);
+}
+
+static struct rule_vars_t vars;
+
+static int8_t vars_value_set(struct rules_t *obj) {
+  return rule_vars_set((struct rule_vars_t *)obj->userdata);
+}
+
+static int8_t vars_value_get(struct rules_t *obj) {
+  return rule_vars_get((struct rule_vars_t *)obj->userdata);
+}
+
+static uint8_t vars_initialize(const char *rule, unsigned char *mempool, uint16_t size) {
+  int len = strlen(rule);
+
+  struct pbuf mem;
+  struct pbuf input;
+  memset(&mem, 0, sizeof(struct pbuf));
+  memset(&input, 0, sizeof(struct pbuf));
+
+  memset(mempool, 0, size);
+  mem.payload = mempool;
+  mem.len = 0;
+  mem.tot_len = size;
+
+  uint16_t y = 0;
+  uint16_t txtoffset = alignedbuffer(size-len-5);
+  for(y=0;y<len;y++) {
+    mmu_set_uint8((void *)&(mempool[txtoffset+y]), (uint8_t)rule[y]);
+  }
+
+  input.payload = &mempool[txtoffset];
+  input.len = txtoffset;
+  input.tot_len = len;
+
+  while(rule_initialize(&input, &rules, &nrrules, &mem, &vars) == 0) {
+    input.payload = &mempool[getval(input.len)];
+    if(getval(input.tot_len) == 0) {
+      break;
+    }
+  }
+  return nrrules;
+}
+
+void check_rule_vars(unsigned char *mempool, uint16_t size) {
+#ifdef ESP8266
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  Serial.printf("[ %-*s Restoring variables %-*s ]\n", 22, " ", 26, " ");
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#else
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  printf("[ %-*s Restoring variables %-*s ]\n", 22, " ", 26, " ");
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#endif
+
+  memset(&rule_options, 0, sizeof(struct rule_options_t));
+  memset(&vars, 0, sizeof(struct rule_vars_t));
+  rule_options.is_variable_cb = is_variable;
+  rule_options.is_event_cb = is_event;
+  rule_options.vm_value_set = vars_value_set;
+  rule_options.vm_value_get = vars_value_get;
+  rule_options.event_cb = event_cb;
+
+  const char *file = "rules_vars.snapshot";
+  unsigned char *snapshot[2] = { NULL, NULL };
+  uint32_t len[2] = { 0, 0 };
+  uint8_t i = 0;
+
+  if(vars_initialize("if 1 == 1 then $a = 1; $b = 2.5; $c = \"abc\"; $d = NULL; $e = $a - 2; end", mempool, size) != 1) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  len[0] = rule_vars_serialize(&vars, NULL, 0);
+  if((snapshot[0] = (unsigned char *)MALLOC(len[0])) == NULL ||
+     rule_vars_serialize(&vars, snapshot[0], len[0]) != len[0] ||
+     rule_vars_snapshot(&vars, file) != 0) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  rule_vars_clear(&vars);
+  rules_gc(&rules, &nrrules);
+
+  /*
+   * A restart with a fresh varstack
+   */
+  if(vars_initialize("if $a == 1 then $f = $c; $g = $b * 2; end", mempool, size) != 1) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  if(rule_vars_restore(&vars, file) != 0 || vars.nr != 5) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  len[1] = rule_vars_serialize(&vars, NULL, 0);
+  if(len[1] != len[0] || (snapshot[1] = (unsigned char *)MALLOC(len[1])) == NULL ||
+     rule_vars_serialize(&vars, snapshot[1], len[1]) != len[1] ||
+     memcmp(snapshot[0], snapshot[1], len[0]) != 0) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  if(rule_run(rules[0], 0) == -1) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  memset(&out, 0, OUTPUT_SIZE);
+  for(i=0;i<vars.nr;i++) {
+    struct rule_var_t *var = &vars.array[i];
+    switch(var->type) {
+      case VINTEGER: {
+        snprintf(&out[strlen(out)], OUTPUT_SIZE-strlen(out), "%s = %d", var->key, var->val.i);
+      } break;
+      case VFLOAT: {
+        snprintf(&out[strlen(out)], OUTPUT_SIZE-strlen(out), "%s = %g", var->key, (double)var->val.f);
+      } break;
+      case VCHAR: {
+        snprintf(&out[strlen(out)], OUTPUT_SIZE-strlen(out), "%s = %s", var->key, var->val.s);
+      } break;
+      case VNULL: {
+        snprintf(&out[strlen(out)], OUTPUT_SIZE-strlen(out), "%s = NULL", var->key);
+      } break;
+    }
+  }
+
+  if(strcmp(out, "$a = 1$b = 2.5$c = abc$d = NULL$e = -1$f = abc$g = 5") != 0) {
+    /*LCOV_EXCL_START*/
+    printf("Was: %s\n", out);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  /*
+   * Strings longer than 255 bytes
+   */
+  {
+    struct rule_var_t *var = NULL;
+    char value[301];
+    uint16_t x = 0;
+    uint8_t top = rules_gettop();
+
+    for(x=0;x<300;x++) {
+      value[x] = 'a'+(x%26);
+    }
+    value[300] = 0;
+
+    rules_pushstring((char *)"$h");
+    rules_pushstring(value);
+    if(rule_vars_set(&vars) != 0) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+    rules_settop(top);
+
+    FREE(snapshot[1]);
+    len[1] = rule_vars_serialize(&vars, NULL, 0);
+    if((snapshot[1] = (unsigned char *)MALLOC(len[1])) == NULL ||
+       rule_vars_serialize(&vars, snapshot[1], len[1]) != len[1]) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+
+    /*
+     * A truncated snapshot leaves the store as is
+     */
+    if(rule_vars_deserialize(&vars, snapshot[1], len[1]-1) != -1 || vars.nr != 8 ||
+       rule_vars_find(&vars, "$h") == NULL) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+
+    rule_vars_clear(&vars);
+
+    if(rule_vars_deserialize(&vars, snapshot[1], len[1]) != 0 || vars.nr != 8 ||
+       (var = rule_vars_find(&vars, "$h")) == NULL || var->type != VCHAR ||
+       strcmp(var->val.s, value) != 0) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+  }
+
+  unlink(file);
+  FREE(snapshot[0]);
+  FREE(snapshot[1]);
+  rule_vars_clear(&vars);
+  rules_gc(&rules, &nrrules);
+}
+
+static struct rule_value_t values[4];
+static unsigned int nrgets = 0;
+
+static struct rule_value_t *vars_value_bind(const char *name, uint16_t len) {
+  const char *names[4] = { "$a", "$b", "$d", "$f" };
+  uint8_t i = 0;
+
+  for(i=0;i<4;i++) {
+    if(strlen(names[i]) == len && strncmp(name, names[i], len) == 0) {
+      return &values[i];
+    }
+  }
+  return NULL;
+}
+
+static int8_t vars_value_get_count(struct rules_t *obj) {
+  nrgets++;
+  return rule_vars_get((struct rule_vars_t *)obj->userdata);
+}
+
+void check_rule_bindings(unsigned char *mempool, uint16_t size) {
+#ifdef ESP8266
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  Serial.printf("[ %-*s Bound variables %-*s ]\n", 24, " ", 28, " ");
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#else
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  printf("[ %-*s Bound variables %-*s ]\n", 24, " ", 28, " ");
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#endif
+
+  memset(&rule_options, 0, sizeof(struct rule_options_t));
+  memset(&vars, 0, sizeof(struct rule_vars_t));
+  memset(&values, 0, sizeof(values));
+  rule_options.is_variable_cb = is_variable;
+  rule_options.is_event_cb = is_event;
+  rule_options.vm_value_set = vars_value_set;
+  rule_options.vm_value_get = vars_value_get_count;
+  rule_options.vm_value_bind = vars_value_bind;
+  rule_options.event_cb = event_cb;
+
+  struct rule_var_t *var[3] = { NULL };
+  uint8_t i = 0;
+
+  values[0].type = VNULL;
+  values[1].type = VNULL;
+  values[2].type = VNULL;
+  values[3].type = VINTEGER;
+  values[3].val.i = 5;
+
+  /*
+   * Only $c, $e and $g go through the callbacks
+   */
+  if(vars_initialize("if 1 == 1 then $a = 1 + 2; $b = $a * 2.5; $c = $a; $d = 'foo'; $e = $d; $g = $f + 1; $a = $b; end", mempool, size) != 1) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  for(i=0;i<2;i++) {
+    if(rule_run(rules[0], 0) == -1) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+  }
+
+  var[0] = rule_vars_find(&vars, "$c");
+  var[1] = rule_vars_find(&vars, "$e");
+  var[2] = rule_vars_find(&vars, "$g");
+
+  if(values[0].type != VFLOAT || values[0].val.f != 7.5f ||
+     values[1].type != VFLOAT || values[1].val.f != 7.5f ||
+     values[2].type != VCHAR || strcmp(values[2].val.s, "foo") != 0 ||
+     values[2].val.s != rules_fromhandle(values[2].handle) ||
+     var[0] == NULL || var[0]->type != VINTEGER || var[0]->val.i != 3 ||
+     var[1] == NULL || var[1]->type != VCHAR || strcmp(var[1]->val.s, "foo") != 0 ||
+     var[2] == NULL || var[2]->type != VINTEGER || var[2]->val.i != 6 ||
+     nrgets != 0) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  rules_unpin(values[2].handle);
+  rule_vars_clear(&vars);
+  rules_gc(&rules, &nrrules);
+}
+
+static unsigned int nrbulk = 0;
+
+static int8_t vars_values_get_bulk(struct rules_t *obj, const uint16_t *handles, struct rule_value_t *values, uint8_t nr) {
+  nrbulk++;
+  return rule_vars_get_bulk((struct rule_vars_t *)obj->userdata, handles, values, nr);
+}
+
+/*
+ * Passes the strings by value, without a handle
+ */
+static int8_t vars_values_get_raw(struct rules_t *obj, const uint16_t *handles, struct rule_value_t *values, uint8_t nr) {
+  uint8_t i = 0;
+
+  for(i=0;i<nr;i++) {
+    if(strcmp(rules_fromhandle(handles[i]), "$a") == 0) {
+      values[i].val.s = "hello";
+      values[i].type = VCHAR;
+    } else if(strcmp(rules_fromhandle(handles[i]), "$b") == 0) {
+      values[i].val.s = "world";
+      values[i].type = VCHAR;
+    }
+  }
+  return 0;
+}
+
+void check_rule_prefetch(unsigned char *mempool, uint16_t size) {
+#ifdef ESP8266
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  Serial.printf("[ %-*s Prefetching variables %-*s ]\n", 21, " ", 25, " ");
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#else
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  printf("[ %-*s Prefetching variables %-*s ]\n", 21, " ", 25, " ");
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#endif
+
+  memset(&rule_options, 0, sizeof(struct rule_options_t));
+  memset(&vars, 0, sizeof(struct rule_vars_t));
+  rule_options.is_variable_cb = is_variable;
+  rule_options.is_event_cb = is_event;
+  rule_options.vm_value_set = vars_value_set;
+  rule_options.vm_value_get = vars_value_get_count;
+  rule_options.vm_values_get_bulk = vars_values_get_bulk;
+  rule_options.event_cb = event_cb;
+
+  const char *keys[5] = { "$c", "$d", "$e", "$f", "$g" };
+  struct rule_var_t *var[5] = { NULL };
+  uint8_t i = 0;
+
+  if(vars_initialize("if 1 == 1 then $a = 1; $b = 2; $s = 'str'; end "
+    "if 1 == 1 then $c = $a + $b; $d = $a * 2; $e = $s; $a = $b + 3; $f = $a; $g = $x; end", mempool, size) != 2) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  /*
+   * Everything but $a is fetched before the rule
+   * runs, $a is read again after it was assigned.
+   */
+  nrbulk = 0;
+  nrgets = 0;
+  rule_run(rules[0], 0);
+  if(rule_run(rules[1], 0) == -1 || nrbulk != 1 || nrgets != 1 || rules[1]->reads == NULL) {
+    /*LCOV_EXCL_START*/
+    printf("Was: %d bulk, %d gets\n", nrbulk, nrgets);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  for(i=0;i<5;i++) {
+    var[i] = rule_vars_find(&vars, keys[i]);
+  }
+
+  if(var[0] == NULL || var[0]->type != VINTEGER || var[0]->val.i != 3 ||
+     var[1] == NULL || var[1]->type != VINTEGER || var[1]->val.i != 2 ||
+     var[2] == NULL || var[2]->type != VCHAR || strcmp(var[2]->val.s, "str") != 0 ||
+     var[3] == NULL || var[3]->type != VINTEGER || var[3]->val.i != 5 ||
+     var[4] == NULL || var[4]->type != VNULL) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  rule_vars_clear(&vars);
+  rules_gc(&rules, &nrrules);
+
+  /*
+   * Strings interned from the host values should
+   * survive the strings interned after them.
+   */
+  rule_options.vm_values_get_bulk = vars_values_get_raw;
+
+  if(vars_initialize("if 1 == 1 then $x = concat($a, 1); $y = $b; end "
+    "if 1 == 1 then $x = concat('z', 1); $y = $a; end", mempool, size) != 2) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  for(i=0;i<2;i++) {
+    const char *expected[2][2] = { { "hello1", "world" }, { "z1", "hello" } };
+
+    if(rule_run(rules[i], 0) == -1 ||
+       (var[0] = rule_vars_find(&vars, "$x")) == NULL || var[0]->type != VCHAR ||
+       (var[1] = rule_vars_find(&vars, "$y")) == NULL || var[1]->type != VCHAR ||
+       strcmp(var[0]->val.s, expected[i][0]) != 0 || strcmp(var[1]->val.s, expected[i][1]) != 0) {
+      /*LCOV_EXCL_START*/
+      printf("Was: %s %s\n", (var[0] == NULL) ? "" : var[0]->val.s, (var[1] == NULL) ? "" : var[1]->val.s);
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+  }
+
+  rule_vars_clear(&vars);
+  rules_gc(&rules, &nrrules);
+}
+
+static unsigned int nrsets = 0;
+
+static int8_t vars_value_set_count(struct rules_t *obj) {
+  nrsets++;
+  return rule_vars_set((struct rule_vars_t *)obj->userdata);
+}
+
+static int8_t vars_values_set_bulk(struct rules_t *obj, const uint16_t *handles, struct rule_value_t *values, uint8_t nr) {
+  nrbulk++;
+  nrsets += nr;
+  return rule_vars_set_bulk((struct rule_vars_t *)obj->userdata, handles, values, nr);
+}
+
+void check_rule_writeback(unsigned char *mempool, uint16_t size) {
+#ifdef ESP8266
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  Serial.printf("[ %-*s Deferred assignments %-*s ]\n", 22, " ", 25, " ");
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#else
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  printf("[ %-*s Deferred assignments %-*s ]\n", 22, " ", 25, " ");
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#endif
+
+  memset(&rule_options, 0, sizeof(struct rule_options_t));
+  memset(&vars, 0, sizeof(struct rule_vars_t));
+  rule_options.is_variable_cb = is_variable;
+  rule_options.is_event_cb = is_event;
+  rule_options.vm_value_set = vars_value_set_count;
+  rule_options.vm_value_get = vars_value_get;
+  rule_options.vm_values_set_bulk = vars_values_set_bulk;
+  rule_options.event_cb = event_cb;
+
+  const char *keys[6] = { "$a", "$b", "$c", "$x", "$y", "$z" };
+  struct rule_var_t *var[6] = { NULL };
+  uint8_t i = 0;
+
+  if(vars_initialize("on sub1($p) then $x = $y + $p; end "
+    "if 1 == 1 then $a = 1; $a = $a + 1; $b = 'x'; $b = 'y'; $c = $a; end "
+    "if 1 == 1 then $y = 5; sub1(1); $z = $x; end", mempool, size) != 3) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  /*
+   * Repeated assignments to $a and $b are
+   * delivered once, with their last value.
+   */
+  nrbulk = 0;
+  nrsets = 0;
+  if(rule_run(rules[1], 0) == -1 || nrbulk != 1 || nrsets != 3) {
+    /*LCOV_EXCL_START*/
+    printf("Was: %d bulk, %d sets\n", nrbulk, nrsets);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  /*
+   * The caller delivers $y before the event runs
+   * and $z when it's done.
+   */
+  nrbulk = 0;
+  nrsets = 0;
+  if(rule_run(rules[2], 0) == -1 || nrbulk != 3 || nrsets != 4) {
+    /*LCOV_EXCL_START*/
+    printf("Was: %d bulk, %d sets\n", nrbulk, nrsets);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  for(i=0;i<6;i++) {
+    var[i] = rule_vars_find(&vars, keys[i]);
+  }
+
+  if(var[0] == NULL || var[0]->type != VINTEGER || var[0]->val.i != 2 ||
+     var[1] == NULL || var[1]->type != VCHAR || strcmp(var[1]->val.s, "y") != 0 ||
+     var[2] == NULL || var[2]->type != VINTEGER || var[2]->val.i != 2 ||
+     var[3] == NULL || var[3]->type != VINTEGER || var[3]->val.i != 6 ||
+     var[4] == NULL || var[4]->type != VINTEGER || var[4]->val.i != 5 ||
+     var[5] == NULL || var[5]->type != VINTEGER || var[5]->val.i != 6) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  rule_vars_clear(&vars);
+  rules_gc(&rules, &nrrules);
+}
+
+static uint8_t dirty_names(char *out, uint16_t size) {
+  uint16_t handle = 0;
+  uint8_t nr = 0;
+
+  out[0] = 0;
+  while((handle = rules_dirty(handle)) > 0) {
+    strncat(out, rules_fromhandle(handle), size-strlen(out)-1);
+    nr++;
+  }
+  return nr;
+}
+
+void check_rule_shadows(unsigned char *mempool, uint16_t size) {
+#ifdef ESP8266
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  Serial.printf("[ %-*s Change only assignments %-*s ]\n", 20, " ", 24, " ");
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#else
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  printf("[ %-*s Change only assignments %-*s ]\n", 20, " ", 24, " ");
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#endif
+
+  memset(&rule_options, 0, sizeof(struct rule_options_t));
+  memset(&vars, 0, sizeof(struct rule_vars_t));
+  rule_options.is_variable_cb = is_variable;
+  rule_options.is_event_cb = is_event;
+  rule_options.vm_value_set = vars_value_set_count;
+  rule_options.vm_value_get = vars_value_get;
+  rule_options.event_cb = event_cb;
+
+  char names[32];
+
+  rules_shadow(1);
+  if(vars_initialize("if 1 == 1 then if $n == NULL then $n = 0; end $n = $n + 1; end "
+    "if 1 == 1 then $relay = 1; $s = 'on'; $t = $n + 1; end", mempool, size) != 2) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  /*
+   * The values were already passed on when
+   * the rules were validated.
+   */
+  nrsets = 0;
+  if(rule_run(rules[1], 0) == -1 || nrsets != 0 || dirty_names(names, sizeof(names)) != 0) {
+    /*LCOV_EXCL_START*/
+    printf("Was: %d sets, %s dirty\n", nrsets, names);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  nrsets = 0;
+  if(rule_run(rules[0], 0) == -1 || nrsets != 1 ||
+     dirty_names(names, sizeof(names)) != 1 || strcmp(names, "$n") != 0) {
+    /*LCOV_EXCL_START*/
+    printf("Was: %d sets, %s dirty\n", nrsets, names);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  /*
+   * Only $t changes now that $n did
+   */
+  nrsets = 0;
+  if(rule_run(rules[1], 0) == -1 || nrsets != 1 ||
+     dirty_names(names, sizeof(names)) != 1 || strcmp(names, "$t") != 0) {
+    /*LCOV_EXCL_START*/
+    printf("Was: %d sets, %s dirty\n", nrsets, names);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  nrsets = 0;
+  if(rule_run(rules[1], 0) == -1 || nrsets != 0 || dirty_names(names, sizeof(names)) != 0) {
+    /*LCOV_EXCL_START*/
+    printf("Was: %d sets, %s dirty\n", nrsets, names);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  /*
+   * Enabling it again forgets the last values
+   */
+  rules_shadow(1);
+  nrsets = 0;
+  if(rule_run(rules[1], 0) == -1 || nrsets != 3 ||
+     dirty_names(names, sizeof(names)) != 3 || strcmp(names, "$relay$s$t") != 0) {
+    /*LCOV_EXCL_START*/
+    printf("Was: %d sets, %s dirty\n", nrsets, names);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  struct rule_var_t *var[2] = { rule_vars_find(&vars, "$n"), rule_vars_find(&vars, "$t") };
+  if(var[0] == NULL || var[0]->type != VINTEGER ||
+     var[1] == NULL || var[1]->type != VINTEGER || var[1]->val.i != var[0]->val.i+1) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  rule_vars_clear(&vars);
+  rules_gc(&rules, &nrrules);
+}
+
+static uint8_t variable_type(const char *name, uint16_t len) {
+  if(len == 5 && strncmp(name, "$temp", 5) == 0) {
+    return VFLOAT;
+  } else if(len == 6 && strncmp(name, "$count", 6) == 0) {
+    return VINTEGER;
+  } else if(len == 6 && strncmp(name, "$state", 6) == 0) {
+    return VCHAR;
+  }
+  return 0;
+}
+
+void check_rule_types(unsigned char *mempool, uint16_t size) {
+#ifdef ESP8266
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  Serial.printf("[ %-*s Declared variable types %-*s ]\n", 20, " ", 24, " ");
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#else
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  printf("[ %-*s Declared variable types %-*s ]\n", 20, " ", 24, " ");
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#endif
+
+  memset(&rule_options, 0, sizeof(struct rule_options_t));
+  memset(&vars, 0, sizeof(struct rule_vars_t));
+  rule_options.is_variable_cb = is_variable;
+  rule_options.is_event_cb = is_event;
+  rule_options.variable_type_cb = variable_type;
+  rule_options.vm_value_set = vars_value_set;
+  rule_options.vm_value_get = vars_value_get;
+  rule_options.event_cb = event_cb;
+
+  struct {
+    const char *rule;
+    uint8_t nr;
+  } tests[] = {
+    { "if $state == $b then $state = 'on'; $count = $count + 1; $b = $state; end", 1 },
+    { "if $temp > 1.5 then $b = $state; $temp = $b; $state = max(1, 2); end", 1 },
+    { "if 1 == 1 then if $count > 1 then $b = $state; else $b = $count; end $c = $count * 2; end", 1 },
+    { "if 1 == 1 then $b = $state + 1; end", 0 },
+    { "if $state == $temp then $b = 1; end", 0 },
+    { "if $state > $b then $b = 1; end", 0 },
+    { "if $temp > 1 then $state = $temp; end", 0 },
+    { "if 1 == 1 then $count = 'foo'; end", 0 },
+    { "if 1 == 1 then if $count > 1 then $state = 'a'; else $state = 'b'; end $c = $state * 2; end", 0 }
+  };
+  uint8_t i = 0;
+
+  for(i=0;i<sizeof(tests)/sizeof(tests[0]);i++) {
+    if(vars_initialize(tests[i].rule, mempool, size) != tests[i].nr) {
+      /*LCOV_EXCL_START*/
+      printf("Rule: %s\n", tests[i].rule);
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+    rule_vars_clear(&vars);
+    rules_gc(&rules, &nrrules);
+  }
+}
+
+static uint8_t nrcalls = 0;
+
+static int memo_floor(float x) {
+  nrcalls++;
+  return (int)floor(x);
+}
+
+void check_rule_memo(unsigned char *mempool, uint16_t size) {
+#ifdef ESP8266
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  Serial.printf("[ %-*s Cached function calls %-*s ]\n", 21, " ", 25, " ");
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#else
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  printf("[ %-*s Cached function calls %-*s ]\n", 21, " ", 25, " ");
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#endif
+
+  memset(&rule_options, 0, sizeof(struct rule_options_t));
+  memset(&vars, 0, sizeof(struct rule_vars_t));
+  rule_options.is_variable_cb = is_variable;
+  rule_options.is_event_cb = is_event;
+  rule_options.vm_value_set = vars_value_set;
+  rule_options.vm_value_get = vars_value_get;
+  rule_options.event_cb = event_cb;
+
+  struct rule_function_t old;
+  uint16_t x = 0;
+
+  for(x=0;x<nr_rule_functions;x++) {
+    if(strcmp(rule_functions[x].name, "floor") == 0) {
+      break;
+    }
+  }
+  memcpy(&old, &rule_functions[x], sizeof(struct rule_function_t));
+  rule_functions[x].typed = RULE_FUNCTION_TYPED(memo_floor);
+
+  if(vars_initialize("if 1 == 1 then $c = 1.5; end "
+    "if 1 == 1 then $a = floor(2.5); $b = floor($c); $d = floor($c) + 1; end", mempool, size) != 2 ||
+     rule_run(rules[1], 0) == -1) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  /*
+   * Nothing changed since the last run
+   */
+  nrcalls = 0;
+  if(rule_run(rules[1], 0) == -1 || nrcalls != 0) {
+    /*LCOV_EXCL_START*/
+    printf("Expected: 0 calls\nWas: %d\n", nrcalls);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  /*
+   * The second call reuses the result of
+   * the first one
+   */
+  struct rule_var_t *var = rule_vars_find(&vars, "$c");
+  var->val.f = 3.5;
+  nrcalls = 0;
+  if(rule_run(rules[1], 0) == -1 || nrcalls != 1) {
+    /*LCOV_EXCL_START*/
+    printf("Expected: 1 call\nWas: %d\n", nrcalls);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  struct rule_var_t *res[3] = { rule_vars_find(&vars, "$a"), rule_vars_find(&vars, "$b"), rule_vars_find(&vars, "$d") };
+  if(res[0] == NULL || res[0]->type != VINTEGER || res[0]->val.i != 2 ||
+     res[1] == NULL || res[1]->type != VINTEGER || res[1]->val.i != 3 ||
+     res[2] == NULL || res[2]->type != VINTEGER || res[2]->val.i != 4) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  /*
+   * A per run result is only reused
+   * during the same run
+   */
+  rule_functions[x].flags = RULE_FUNCTION_RUN;
+  nrcalls = 0;
+  if(rule_run(rules[1], 0) == -1 || nrcalls != 2) {
+    /*LCOV_EXCL_START*/
+    printf("Expected: 2 calls\nWas: %d\n", nrcalls);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  rule_functions[x].flags = RULE_FUNCTION_EFFECT;
+  nrcalls = 0;
+  if(rule_run(rules[1], 0) == -1 || nrcalls != 3) {
+    /*LCOV_EXCL_START*/
+    printf("Expected: 3 calls\nWas: %d\n", nrcalls);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  memcpy(&rule_functions[x], &old, sizeof(struct rule_function_t));
+
+  rule_vars_clear(&vars);
+  rules_gc(&rules, &nrrules);
+}
+
+void check_rule_handles(unsigned char *mempool, uint16_t size) {
+#ifdef ESP8266
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  Serial.printf("[ %-*s Interning strings %-*s ]\n", 23, " ", 27, " ");
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#else
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  printf("[ %-*s Interning strings %-*s ]\n", 23, " ", 27, " ");
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#endif
+
+  memset(&rule_options, 0, sizeof(struct rule_options_t));
+  memset(&vars, 0, sizeof(struct rule_vars_t));
+  rule_options.is_variable_cb = is_variable;
+  rule_options.is_event_cb = is_event;
+  rule_options.vm_value_set = vars_value_set;
+  rule_options.vm_value_get = vars_value_get;
+  rule_options.event_cb = event_cb;
+
+  uint16_t handles[100], max = 0, i = 0;
+  char str[16];
+
+  if(vars_initialize("if 1 == 1 then $a = 1; end", mempool, size) != 1) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  for(i=0;i<100;i++) {
+    snprintf(str, sizeof(str), "s%d", i);
+    rules_pushstring(str);
+    handles[i] = rules_tohandle(-1);
+    rules_ref_handle(handles[i]);
+    rules_remove(-1);
+    max = MAX(max, handles[i]);
+  }
+
+  for(i=0;i<100;i++) {
+    snprintf(str, sizeof(str), "s%d", i);
+    rules_pushstring(str);
+    if(rules_tohandle(-1) != handles[i] || strcmp(rules_fromhandle(handles[i]), str) != 0 ||
+       rules_findhandle(str, strlen(str)) != handles[i]) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+    rules_remove(-1);
+    rules_unref(str);
+  }
+
+  if(rules_findhandle("unknown", 7) != 0) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  /*
+   * Released slots are reused
+   */
+  for(i=0;i<100;i++) {
+    snprintf(str, sizeof(str), "t%d", i);
+    rules_pushstring(str);
+    if(rules_tohandle(-1) > max) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+    rules_remove(-1);
+  }
+
+  /*
+   * Length aware and host owned strings
+   */
+  {
+    char payload[600];
+    const char *topic = "home/living/temperature";
+    const char *ret = NULL;
+    uint16_t len = 0;
+
+    memset(payload, 'x', sizeof(payload));
+    rules_pushlstring(payload, sizeof(payload));
+    rules_pushlstring("abcdef", 3);
+    rules_pushstring_ref(topic, strlen(topic));
+
+    if((ret = rules_tolstring(-1, &len)) != topic || len != strlen(topic) ||
+       (ret = rules_tolstring(-2, &len)) == NULL || len != 3 || strcmp(ret, "abc") != 0 ||
+       (ret = rules_tolstring(-3, &len)) == NULL || len != sizeof(payload) ||
+       memcmp(ret, payload, sizeof(payload)) != 0 || ret[len] != 0 ||
+       rules_tolstring(-4, &len) != NULL || len != 0) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+    rules_remove(-1);
+    rules_remove(-1);
+    rules_remove(-1);
+  }
+
+  /*
+   * String builder
+   */
+  {
+    const char *ret = NULL;
+    uint16_t len = 0;
+
+    rules_pushstring((char *)"foo-12-11.5");
+    rules_strbegin();
+    rules_straddstring("foo", 3);
+    rules_straddinteger(-12);
+    rules_pushinteger(-1);
+    rules_straddvalue(-1);
+    rules_remove(-1);
+    rules_straddfloat(1.5);
+    rules_strpush();
+
+    if(rules_tohandle(-1) != rules_tohandle(-2) || strcmp(rules_tostring(-1), "foo-12-11.5") != 0) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+    rules_remove(-1);
+    rules_remove(-1);
+
+    rules_strbegin();
+    for(i=0;i<100;i++) {
+      rules_straddinteger(i % 10);
+      if(i == 50) {
+        rules_pushstring((char *)"bar");
+      }
+    }
+    rules_straddinteger(-2147483647-1);
+    rules_strpush();
+
+    if((ret = rules_tolstring(-1, &len)) == NULL || len != 111 || ret[len] != 0 ||
+       strncmp(ret, "0123456789", 10) != 0 || strcmp(&ret[100], "-2147483648") != 0 ||
+       strcmp(rules_tostring(-2), "bar") != 0) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+    rules_remove(-1);
+    rules_remove(-1);
+  }
+
+  /*
+   * Popping and setting the top of the stack
+   */
+  {
+    rules_pushinteger(1);
+    rules_pushstring((char *)"foo");
+    rules_pushinteger(3);
+    rules_pushfloat(4.5);
+
+    rules_remove(2);
+    rules_pop(2);
+    if(rules_gettop() != 1 || rules_tointeger(-1) != 1) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+
+    rules_settop(3);
+    if(rules_gettop() != 3 || rules_type(-1) != VNULL || rules_tointeger(1) != 1) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+
+    rules_pop(10);
+    if(rules_gettop() != 0) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+  }
+
+  /*
+   * Substrings point into their parent
+   */
+  {
+    const char *parent = NULL, *ret = NULL;
+    uint16_t len = 0;
+
+    rules_pushstring((char *)"heating on");
+    parent = rules_tostring(-1);
+    rules_pushsubstring(-1, 8, 100);
+    rules_pushsubstring(-1, 1, 1);
+    rules_pushsubstring(-3, 0, 100);
+
+    if(rules_tohandle(-1) != rules_tohandle(-4) ||
+       (ret = rules_tolstring(-2, &len)) != &parent[9] || len != 1 ||
+       (ret = rules_tolstring(-3, &len)) != &parent[8] || len != 2) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+    rules_remove(-1);
+
+    /*
+     * Views are interned when a terminated string is needed
+     */
+    if(strcmp((ret = rules_tostring(-1)), "n") != 0 || ret == &parent[9] ||
+       rules_tohandle(-1) != rules_findhandle("n", 1)) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+    rules_remove(-1);
+    rules_remove(-1);
+    rules_remove(-1);
+  }
+
+  /*
+   * Pinned strings survive rules_gc
+   */
+  {
+    struct rule_var_t *var = NULL;
+    uint16_t pin = 0;
+
+    rules_pushstring((char *)"heating");
+    pin = rules_pin(-1);
+    rules_remove(-1);
+
+    rule_vars_clear(&vars);
+    rules_gc(&rules, &nrrules);
+
+    if(strcmp(rules_fromhandle(pin), "heating") != 0) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+
+    if(vars_initialize("if 1 == 1 then $a = 'heating'; end", mempool, size) != 1) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+
+    if(rules_findhandle("heating", 7) != pin ||
+       (var = rule_vars_find(&vars, "$a")) == NULL || var->valhandle != pin) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+
+    /*
+     * The string is also a constant of the rule now
+     */
+    rules_unpin(pin);
+    if(strcmp(rules_fromhandle(pin), "heating") != 0) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+  }
+
+  rule_vars_clear(&vars);
+  rules_gc(&rules, &nrrules);
+}
+
+#if defined(DEBUG) || defined(COVERALLS)
+void check_rule_allocations(unsigned char *mempool, uint16_t size) {
+#ifdef ESP8266
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  Serial.printf("[ %-*s Counting allocations %-*s ]\n", 22, " ", 24, " ");
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#else
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  printf("[ %-*s Counting allocations %-*s ]\n", 22, " ", 24, " ");
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#endif
+
+  memset(&rule_options, 0, sizeof(struct rule_options_t));
+  memset(&vars, 0, sizeof(struct rule_vars_t));
+  rule_options.is_variable_cb = is_variable;
+  rule_options.is_event_cb = is_event;
+  rule_options.vm_value_set = vars_value_set;
+  rule_options.vm_value_get = vars_value_get;
+  rule_options.event_cb = event_cb;
+
+  unsigned int allocs = 0;
+  uint8_t i = 0;
+
+  if(vars_initialize("if 1 == 1 then $a = max(1, 2.5) + 1; $b = coalesce($c, 'foo'); $d = concat($b, $a); $e = substr($d, 1, 2); end", mempool, size) != 1) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  /*
+   * The first run stores the variables and their
+   * strings, later runs should not allocate anymore.
+   */
+  if(rule_run(rules[0], 0) == -1) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  allocs = mem_allocs;
+  for(i=0;i<5;i++) {
+    if(rule_run(rules[0], 0) == -1) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+  }
+
+  if(mem_allocs != allocs) {
+    /*LCOV_EXCL_START*/
+    printf("Expected: 0 allocations\nWas: %d\n", mem_allocs-allocs);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  /*
+   * Without allocations, strings that don't
+   * fit anymore are replaced by a nil.
+   */
+  char str[1024];
+  memset(str, 'x', sizeof(str));
+
+  rules_noalloc(1);
+  allocs = mem_allocs;
+
+  rules_pushlstring(str, sizeof(str));
+  rules_pushsubstring(-1, 1, 10);
+  rules_strbegin();
+  rules_straddstring(str, sizeof(str));
+  rules_strpush();
+  if(rules_type(-1) != VNULL || rules_type(-2) != VNULL || rules_type(-3) != VNULL) {
+    /*LCOV_EXCL_START*/
+    printf("Expected: NULL\nWas: %d %d %d\n", rules_type(-3), rules_type(-2), rules_type(-1));
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+  rules_pop(3);
+
+  rules_noalloc(0);
+  rules_pushlstring(str, sizeof(str));
+  if(rules_type(-1) != VCHAR || mem_allocs == allocs) {
+    /*LCOV_EXCL_START*/
+    printf("Expected: VCHAR\nWas: %d\n", rules_type(-1));
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+  rules_pop(1);
+
+  rule_vars_clear(&vars);
+  rules_gc(&rules, &nrrules);
+}
+#endif
+
+void check_rule_allocators(unsigned char *mempool, uint16_t size) {
+#ifdef ESP8266
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  Serial.printf("[ %-*s Pluggable allocators %-*s ]\n", 22, " ", 24, " ");
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#else
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  printf("[ %-*s Pluggable allocators %-*s ]\n", 22, " ", 24, " ");
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#endif
+
+  memset(&rule_options, 0, sizeof(struct rule_options_t));
+  memset(&vars, 0, sizeof(struct rule_vars_t));
+  rule_options.is_variable_cb = is_variable;
+  rule_options.is_event_cb = is_event;
+  rule_options.vm_value_set = vars_value_set;
+  rule_options.vm_value_get = vars_value_get;
+  rule_options.event_cb = event_cb;
+
+  struct mem_allocator_t pool_allocator, counter_allocator, arena_allocator;
+  struct mem_pool_t pool;
+  struct mem_counter_t counter;
+  struct mem_arena_t arena;
+  struct rule_var_t *var = NULL;
+  size_t used = 0;
+  uint8_t i = 0;
+
+  unsigned char *region = (unsigned char *)MALLOC(16384);
+  if(region == NULL) {
+    /*LCOV_EXCL_START*/
+    OUT_OF_MEMORY
+    /*LCOV_EXCL_STOP*/
+  }
+
+  /*
+   * All memory of the library and the variable
+   * store comes from the pool, so a second round
+   * only reuses the blocks freed by the first.
+   */
+  mem_pool_init(&pool_allocator, &pool, region, 16384, NULL);
+  mem_counter_init(&counter_allocator, &counter, &pool_allocator);
+  mem_set_allocator(&counter_allocator);
+
+  for(i=0;i<2;i++) {
+    if(vars_initialize("if 1 == 1 then $a = max(1, 2.5) + 1; $b = coalesce($c, 'foo'); $d = concat($b, $a); $e = substr($d, 1, 2); end", mempool, size) != 1 ||
+      rule_run(rules[0], 0) == -1) {
+      /*LCOV_EXCL_START*/
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+    if((var = rule_vars_find(&vars, "$e")) == NULL || var->type != VCHAR || strcmp(var->val.s, "oo") != 0) {
+      /*LCOV_EXCL_START*/
+      printf("Expected: oo\n");
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+    rule_vars_clear(&vars);
+    rules_gc(&rules, &nrrules);
+
+    if(i == 0) {
+      used = pool.used;
+    }
+  }
+  mem_set_allocator(NULL);
+
+  if(pool.used != used ||
+    counter.phase[MEM_PHASE_PREPARE].allocs == 0 ||
+    counter.phase[MEM_PHASE_CREATE].allocs == 0 ||
+    counter.phase[MEM_PHASE_RUN].allocs == 0 ||
+    counter.phase[MEM_PHASE_GC].frees == 0 ||
+    counter.phase[MEM_PHASE_GC].allocs != 0) {
+    /*LCOV_EXCL_START*/
+    printf("Was: %zu/%zu bytes, prepare %u, create %u, run %u, gc %u/%u\n",
+      pool.used, used,
+      counter.phase[MEM_PHASE_PREPARE].allocs,
+      counter.phase[MEM_PHASE_CREATE].allocs,
+      counter.phase[MEM_PHASE_RUN].allocs,
+      counter.phase[MEM_PHASE_GC].allocs,
+      counter.phase[MEM_PHASE_GC].frees);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  /*
+   * Only the last arena block can grow in place
+   */
+  mem_arena_init(&arena_allocator, &arena, region, 256);
+  mem_set_allocator(&arena_allocator);
+
+  char *a = (char *)MALLOC(10);
+  strcpy(a, "foo");
+  char *b = (char *)REALLOC(a, 20);
+  char *c = (char *)MALLOC(8);
+  char *d = (char *)REALLOC(b, 40);
+  char *e = (char *)MALLOC(1000);
+
+  if(a == NULL || b != a || c == NULL || d == NULL || d == b || strcmp(d, "foo") != 0 || e != NULL) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+  used = arena.used;
+  FREE(c);
+  FREE(d);
+  if(arena.used >= used) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+  mem_arena_reset(&arena);
+  mem_set_allocator(NULL);
+
+  FREE(region);
+}
+
+void check_rule_logging(void) {
+#ifdef ESP8266
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  Serial.printf("[ %-*s Queued logging %-*s ]\n", 25, " ", 27, " ");
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#else
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  printf("[ %-*s Queued logging %-*s ]\n", 25, " ", 27, " ");
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#endif
+
+  struct log_entry_t ring[5];
+  char str[LOG_BUFSIZE], name[8];
+  const char *expected[4] = {
+    "ERROR: foo -12 1.50    ab 100%",
+    "FATAL: 7 x 0x1f",
+    "ERROR: name",
+    "ERROR: 123456789012345678901234567890123456789012345678901234567890123"
+  };
+  uint8_t i = 0;
+
+  /*
+   * The ring is rounded down to four entries, so
+   * the fifth message is dropped. Strings are copied,
+   * so changing them afterwards doesn't matter.
+   */
+  log_async(ring, 5);
+
+  strcpy(name, "name");
+  logerror_P(F("ERROR: %s %d %.2f %5.*s %d%%"), "foo", -12, 1.5, 2, "abc", 100);
+  logfatal_P(F("FATAL: %ld %c %#x"), 7L, 'x', 31);
+  logerror_P(F("ERROR: %s"), name);
+  logerror_P(F("ERROR: %s"), "1234567890123456789012345678901234567890123456789012345678901234567890");
+  logerror_P(F("ERROR: dropped"));
+  strcpy(name, "other");
+
+  for(i=0;i<4;i++) {
+    if(log_pop(str, sizeof(str)) != 0 || strcmp(str, expected[i]) != 0) {
+      /*LCOV_EXCL_START*/
+      printf("Expected: %s\nWas: %s\n", expected[i], str);
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+  }
+  if(log_pop(str, sizeof(str)) != -1 || log_dropped() != 1) {
+    /*LCOV_EXCL_START*/
+    printf("Expected: 1 dropped\nWas: %d\n", log_dropped());
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  logerror_P(F("ERROR: %d"), 1);
+  if(log_process(10) != 1) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  log_async(NULL, 0);
+}
+
+static float typed_scale(float x, int y) {
+  return x*y;
+}
+
+static const char *typed_pick(const char *a, int b) {
+  return (b > 0) ? a : NULL;
+}
+
+void check_typed_functions(void) {
+#ifdef ESP8266
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  Serial.printf("[ %-*s Typed functions %-*s ]\n", 24, " ", 27, " ");
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#else
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  printf("[ %-*s Typed functions %-*s ]\n", 24, " ", 27, " ");
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#endif
+
+  int8_t (*scale)(const struct rule_value_t *, uint8_t, struct rule_value_t *) = RULE_FUNCTION_TYPED(typed_scale);
+  int8_t (*pick)(const struct rule_value_t *, uint8_t, struct rule_value_t *) = RULE_FUNCTION_TYPED(typed_pick);
+  struct rule_value_t args[2], result;
+
+  memset(&args, 0, sizeof(args));
+
+  /*
+   * Numbers convert into each other
+   */
+  args[0].type = VINTEGER;
+  args[0].val.i = 3;
+  args[1].type = VFLOAT;
+  args[1].val.f = 2.5;
+  result.type = VNULL;
+  if(scale(args, 2, &result) != 0 || result.type != VFLOAT || result.val.f != 6) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  /*
+   * A nil argument gives a nil result
+   */
+  args[1].type = VNULL;
+  result.type = VNULL;
+  if(scale(args, 2, &result) != 0 || result.type != VNULL) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  args[0].type = VCHAR;
+  args[0].val.s = "foo";
+  args[1].type = VINTEGER;
+  args[1].val.i = 1;
+  result.type = VNULL;
+  if(scale(args, 2, &result) != -1 || scale(args, 1, &result) != -1 ||
+     pick(args, 2, &result) != 0 || result.type != VCHAR || strcmp(result.val.s, "foo") != 0) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+
+  args[1].val.i = 0;
+  result.type = VNULL;
+  if(pick(args, 2, &result) != 0 || result.type != VNULL) {
+    /*LCOV_EXCL_START*/
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+}
+
+void check_number_conversions(void) {
+#ifdef ESP8266
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  Serial.printf("[ %-*s Number conversions %-*s ]\n", 23, " ", 25, " ");
+  Serial.printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#else
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+  printf("[ %-*s Number conversions %-*s ]\n", 23, " ", 25, " ");
+  printf("[ %-*s                    %-*s ]\n", 24, " ", 25, " ");
+#endif
+
+  struct {
+    float nr;
+    uint8_t bits;
+    const char *str;
+  } ftoa[] = {
+    { 0.0f, 24, "0" },
+    { -0.0f, 24, "-0" },
+    { 0.1f, 24, "0.1" },
+    { -2.5f, 24, "-2.5" },
+    { 100000.0f, 24, "100000" },
+    { 1000000.0f, 24, "1e+06" },
+    { 0.0001f, 24, "0.0001" },
+    { 0.00001f, 24, "1e-05" },
+    { 1.0e20f, 24, "1e+20" },
+    { 16777215.0f, 24, "1.6777215e+07" },
+    { 3.14159f, 19, "3.14159" },
+    { 0.3f, 19, "0.3" },
+    { INFINITY, 24, "inf" },
+    { -INFINITY, 24, "-inf" }
+  };
+  struct {
+    int32_t nr;
+    const char *str;
+  } itoa[] = {
+    { 0, "0" },
+    { -12, "-12" },
+    { 2147483647, "2147483647" },
+    { INT32_MIN, "-2147483648" }
+  };
+  struct {
+    const char *str;
+    float nr;
+    uint16_t used;
+  } parse[] = {
+    { "12.50", 12.5f, 5 },
+    { "-0.001abc", -0.001f, 6 },
+    { "007", 7.0f, 3 },
+    { "3.4028235e38", 3.4028235f, 9 },
+    { "123456789012345678901234", 1.2345679e23f, 24 }
+  };
+  struct {
+    float nr;
+    uint8_t decimals;
+    float ret;
+  } round[] = {
+    { 2.5f, 0, 3.0f },
+    { -2.5f, 0, -3.0f },
+    { 3.14159f, 2, 3.14f },
+    { -0.125f, 2, -0.13f },
+    { 1.0e20f, 3, 1.0e20f }
+  };
+  char str[NUMBER_BUFSIZE];
+  uint16_t used = 0;
+  uint8_t i = 0, len = 0;
+  float nr = 0;
+
+  for(i=0;i<sizeof(ftoa)/sizeof(ftoa[0]);i++) {
+    len = number_ftoa(ftoa[i].nr, ftoa[i].bits, str);
+    if(strcmp(str, ftoa[i].str) != 0 || len != strlen(ftoa[i].str)) {
+      /*LCOV_EXCL_START*/
+      printf("Expected: %s\nWas: %s\n", ftoa[i].str, str);
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+    /*
+     * The parser doesn't read exponents, like
+     * the rules lexer it is used for.
+     */
+    if(ftoa[i].bits == 24 && strpbrk(str, "ein") == NULL && number_parse(str, len, &used) != ftoa[i].nr) {
+      /*LCOV_EXCL_START*/
+      printf("Expected: %s to round trip\n", str);
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+  }
+
+  for(i=0;i<sizeof(itoa)/sizeof(itoa[0]);i++) {
+    len = number_itoa(itoa[i].nr, str);
+    if(strcmp(str, itoa[i].str) != 0 || len != strlen(itoa[i].str)) {
+      /*LCOV_EXCL_START*/
+      printf("Expected: %s\nWas: %s\n", itoa[i].str, str);
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+  }
+
+  for(i=0;i<sizeof(parse)/sizeof(parse[0]);i++) {
+    nr = number_parse(parse[i].str, strlen(parse[i].str), &used);
+    if(nr != parse[i].nr || used != parse[i].used) {
+      /*LCOV_EXCL_START*/
+      printf("Expected: %g (%d)\nWas: %g (%d)\n", (double)parse[i].nr, parse[i].used, (double)nr, used);
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+  }
+
+  for(i=0;i<sizeof(round)/sizeof(round[0]);i++) {
+    nr = number_round(round[i].nr, round[i].decimals);
+    if(nr != round[i].ret) {
+      /*LCOV_EXCL_START*/
+      printf("Expected: %g\nWas: %g\n", (double)round[i].ret, (double)nr);
+      exit(-1);
+      /*LCOV_EXCL_STOP*/
+    }
+  }
+}
+
+int main(void) {
+  int nrtests = sizeof(unittests)/sizeof(unittests[0]), i = 0;
+
+  unsigned char *mempool = (unsigned char *)MALLOC(MEMPOOL_SIZE*2);
+  if(mempool == NULL) {
+    /*LCOV_EXCL_START*/
+    fprintf(stderr, "OUT_OF_MEMORY\n");
+    assert(1 == 0);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+  MMU_SEC_HEAP = &mempool[MEMPOOL_SIZE];
+
+  for(i=0;i<nrtests;i++) {
+    memset(mempool, 0, MEMPOOL_SIZE*2);
+    run_test(&i, &mempool[MEMPOOL_SIZE], MEMPOOL_SIZE);
+  }
+  FREE(mempool);
+
+  mempool = (unsigned char *)MALLOC(MEMPOOL_SIZE*2);
+  if(mempool == NULL) {
+    /*LCOV_EXCL_START*/
+    fprintf(stderr, "OUT_OF_MEMORY\n");
+    assert(1 == 0);
+    exit(-1);
+    /*LCOV_EXCL_STOP*/
+  }
+  MMU_SEC_HEAP = &mempool[MEMPOOL_SIZE];
+
+  for(i=0;i<nrtests;i++) {
+    memset(mempool, 0, MEMPOOL_SIZE*2);
+    run_test(&i, &mempool[0], MEMPOOL_SIZE);
+  }
+
+  memset(mempool, 0, MEMPOOL_SIZE*2);
+  check_rule_by_id(&mempool[0], MEMPOOL_SIZE);
+
+  memset(mempool, 0, MEMPOOL_SIZE*2);
+  check_rule_by_name(&mempool[0], MEMPOOL_SIZE);
+
+  memset(mempool, 0, MEMPOOL_SIZE*2);
+  check_rule_image(&mempool[0], MEMPOOL_SIZE);
+
+  memset(mempool, 0, MEMPOOL_SIZE*2);
+  check_rule_vars(&mempool[0], MEMPOOL_SIZE);
+
+  memset(mempool, 0, MEMPOOL_SIZE*2);
+  check_rule_handles(&mempool[0], MEMPOOL_SIZE);
+
+  memset(mempool, 0, MEMPOOL_SIZE*2);
+  check_rule_bindings(&mempool[0], MEMPOOL_SIZE);
+
+  memset(mempool, 0, MEMPOOL_SIZE*2);
+  check_rule_prefetch(&mempool[0], MEMPOOL_SIZE);
+
+  memset(mempool, 0, MEMPOOL_SIZE*2);
+  check_rule_writeback(&mempool[0], MEMPOOL_SIZE);
+
+  memset(mempool, 0, MEMPOOL_SIZE*2);
+  check_rule_shadows(&mempool[0], MEMPOOL_SIZE);
+
+  memset(mempool, 0, MEMPOOL_SIZE*2);
+  check_rule_types(&mempool[0], MEMPOOL_SIZE);
+
+  memset(mempool, 0, MEMPOOL_SIZE*2);
+  check_rule_memo(&mempool[0], MEMPOOL_SIZE);
+
+#if defined(DEBUG) || defined(COVERALLS)
+  memset(mempool, 0, MEMPOOL_SIZE*2);
+  check_rule_allocations(&mempool[0], MEMPOOL_SIZE);
+#endif
+
+  memset(mempool, 0, MEMPOOL_SIZE*2);
+  check_rule_allocators(&mempool[0], MEMPOOL_SIZE);
+
+  check_rule_logging();
+  check_number_conversions();
+
+  check_typed_functions();
 
   FREE(mempool);
 
@@ -1630,11 +3488,11 @@ int main(void) {
       uint8_t loc[2];
       int8_t ret;
     } tests[nrtests] = {
-      { { 750, 500 }, { 340, 0 }, {1, 0}, 0 },
-      { { 300, 300 }, { 144, 196 }, {0, 1}, 0 },
-      { { 300, 300 }, { 144, 196 }, {1, 0}, 0 },
-      { { 300, 300 }, { 144, 196 }, {1, 1}, 0 },
-      { { 300, 300 }, { 144, 196 }, {0, 0}, 0 },
+      { { 750, 500 }, { 404, 0 }, {1, 0}, 0 },
+      { { 300, 300 }, { 208, 196 }, {0, 1}, 0 },
+      { { 300, 300 }, { 208, 196 }, {1, 0}, 0 },
+      { { 300, 300 }, { 208, 196 }, {1, 1}, 0 },
+      { { 300, 300 }, { 208, 196 }, {0, 0}, 0 },
       { { 175, 175 }, { 0, 164 }, {0, 0}, -1 }
     };
 
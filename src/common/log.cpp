@@ -16,8 +16,9 @@
 #if defined(ESP8266) || defined(ESP32)
   #include <Arduino.h>
 #else
-  #define strcpy_P strcpy
-  #define strlen_P strlen
+  #define strncpy_P strncpy
+  #define vsnprintf_P vsnprintf
+  #define pgm_read_byte(a) (*(const uint8_t *)(a))
   #define F
   #define PSTR
   #define PGM_P char *
@@ -25,6 +26,7 @@
 #endif
 
 #include "mem.h"
+#include "log.h"
 
 void _logprintln(const char *file, unsigned int line, char *msg) {
 #ifdef ESP8266
@@ -34,69 +36,398 @@ void _logprintln(const char *file, unsigned int line, char *msg) {
 #endif
 }
 
+/*
+ * Messages are formatted on the stack, so logging
+ * from a running rule doesn't allocate. Longer
+ * messages are truncated.
+ */
 void _logprintf(const char *file, unsigned int line, char *fmt, ...) {
-  char *str = NULL;
+  char str[LOG_BUFSIZE];
+
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(str, sizeof(str), fmt, ap);
+  va_end(ap);
+
+  _logprintln(file, line, str);
+}
 
-  va_list ap, apcpy;
-  va_copy(apcpy, ap);
-  va_start(apcpy, fmt);
+void _logprintln_P(const char *file, unsigned int line, const __FlashStringHelper *msg) {
+  char str[LOG_BUFSIZE];
 
-  int bytes = vsnprintf(NULL, 0, fmt, apcpy);
+  strncpy_P(str, (PGM_P)msg, sizeof(str)-1);
+  str[sizeof(str)-1] = 0;
 
-  va_end(apcpy);
-  if((str = (char *)MALLOC(bytes+1)) == NULL) {
-    OUT_OF_MEMORY
-  }
+  _logprintln(file, line, str);
+}
+
+void _logprintf_P(const char *file, unsigned int line, const __FlashStringHelper *fmt, ...) {
+  char str[LOG_BUFSIZE];
+
+  va_list ap;
   va_start(ap, fmt);
-  vsprintf(str, fmt, ap);
+  vsnprintf_P(str, sizeof(str), (PGM_P)fmt, ap);
   va_end(ap);
 
   _logprintln(file, line, str);
+}
 
-  FREE(str);
+/*
+ * Leveled messages are queued in a single producer,
+ * single consumer ring when one is set, so the
+ * producer never waits for the output. The arguments
+ * are copied by walking the conversions of the format
+ * string, the actual formatting is done by the
+ * consumer.
+ */
+typedef enum {
+  LOG_ARG_NONE = 0,
+  LOG_ARG_INT = 1,
+  LOG_ARG_LONG = 2,
+  LOG_ARG_LLONG = 3,
+  LOG_ARG_SIZE = 4,
+  LOG_ARG_DOUBLE = 5,
+  LOG_ARG_STRING = 6,
+  LOG_ARG_PTR = 7
+} log_args;
+
+static struct log_entry_t *log_ring = NULL;
+static uint16_t log_ringsize = 0;
+static uint16_t log_head = 0;
+static uint16_t log_tail = 0;
+static uint32_t log_nrdropped = 0;
+
+/*
+ * Parses the conversion starting after a %.
+ * Returns its length, the type of its argument
+ * and the number of * widths and precisions.
+ */
+static uint8_t log_spec(const __FlashStringHelper *fmt, uint16_t pos, uint8_t *type, uint8_t *stars) {
+  uint8_t len = 0, mod = 0;
+  char c = 0;
+
+  *type = LOG_ARG_NONE;
+  *stars = 0;
+
+  while((c = (char)pgm_read_byte(&((const char *)fmt)[pos+len])) != 0) {
+    len++;
+    switch(c) {
+      case '*': {
+        (*stars)++;
+      } break;
+      case 'l': {
+        mod = (mod == LOG_ARG_LONG) ? LOG_ARG_LLONG : LOG_ARG_LONG;
+      } break;
+      case 'z':
+      case 'j':
+      case 't': {
+        mod = LOG_ARG_SIZE;
+      } break;
+      case 'd':
+      case 'i':
+      case 'u':
+      case 'x':
+      case 'X':
+      case 'o':
+      case 'c': {
+        *type = (mod == 0) ? (uint8_t)LOG_ARG_INT : mod;
+        return len;
+      } break;
+      case 'f':
+      case 'F':
+      case 'g':
+      case 'G':
+      case 'e':
+      case 'E': {
+        *type = LOG_ARG_DOUBLE;
+        return len;
+      } break;
+      case 's': {
+        *type = LOG_ARG_STRING;
+        return len;
+      } break;
+      case 'p': {
+        *type = LOG_ARG_PTR;
+        return len;
+      } break;
+      case '%': {
+        return len;
+      } break;
+    }
+  }
+  return len;
 }
 
-void _logprintln_P(const char *file, unsigned int line, const __FlashStringHelper *msg) {
-  PGM_P p = (PGM_P)msg;
-  int len = strlen_P((const char *)p);
-  char *str = (char *)MALLOC(len+1);
-  if(str == NULL) {
-    OUT_OF_MEMORY
+static uint8_t log_put(struct log_entry_t *entry, const void *val, uint8_t size) {
+  if(entry->size+size > LOG_ARGSIZE) {
+    return 0;
   }
-  strcpy_P(str, p);
+  memcpy(&entry->args[entry->size], val, size);
+  entry->size += size;
+  return 1;
+}
 
-  _logprintln(file, line, str);
+static void log_capture(struct log_entry_t *entry, va_list ap) {
+  uint16_t i = 0;
+  uint8_t len = 0, type = 0, stars = 0, x = 0, ok = 1;
+  char c = 0;
+
+  while(ok == 1 && (c = (char)pgm_read_byte(&((const char *)entry->fmt)[i])) != 0) {
+    i++;
+    if(c != '%') {
+      continue;
+    }
+    len = log_spec(entry->fmt, i, &type, &stars);
+    i += len;
 
-  FREE(str);
+    for(x=0;x<stars;x++) {
+      int val = va_arg(ap, int);
+      ok = ok && log_put(entry, &val, sizeof(val));
+    }
+    switch(type) {
+      case LOG_ARG_INT: {
+        int val = va_arg(ap, int);
+        ok = ok && log_put(entry, &val, sizeof(val));
+      } break;
+      case LOG_ARG_LONG: {
+        long val = va_arg(ap, long);
+        ok = ok && log_put(entry, &val, sizeof(val));
+      } break;
+      case LOG_ARG_LLONG: {
+        long long val = va_arg(ap, long long);
+        ok = ok && log_put(entry, &val, sizeof(val));
+      } break;
+      case LOG_ARG_SIZE: {
+        size_t val = va_arg(ap, size_t);
+        ok = ok && log_put(entry, &val, sizeof(val));
+      } break;
+      case LOG_ARG_DOUBLE: {
+        double val = va_arg(ap, double);
+        ok = ok && log_put(entry, &val, sizeof(val));
+      } break;
+      case LOG_ARG_PTR: {
+        void *val = va_arg(ap, void *);
+        ok = ok && log_put(entry, &val, sizeof(val));
+      } break;
+      case LOG_ARG_STRING: {
+        const char *val = va_arg(ap, const char *);
+        size_t size = 0;
+
+        if(val == NULL) {
+          val = "(null)";
+        }
+        if(ok == 0 || entry->size == LOG_ARGSIZE) {
+          ok = 0;
+          break;
+        }
+        /*
+         * Strings are truncated to the room that is left
+         */
+        size = strlen(val);
+        if(size > (size_t)(LOG_ARGSIZE-entry->size-1)) {
+          size = LOG_ARGSIZE-entry->size-1;
+        }
+        log_put(entry, val, size);
+        entry->args[entry->size++] = 0;
+      } break;
+    }
+  }
 }
 
-void _logprintf_P(const char *file, unsigned int line, const __FlashStringHelper *fmt, ...) {
-  PGM_P p = (PGM_P)fmt;
-  int len = strlen_P((const char *)p);
-  char *foo = (char *)MALLOC(len+1);
-  if(foo == NULL) {
-    OUT_OF_MEMORY
+static void log_format(struct log_entry_t *entry, char *out, uint16_t size) {
+  uint16_t i = 0, n = 0, pos = 0;
+  uint8_t len = 0, type = 0, stars = 0, x = 0, y = 0;
+  char spec[24];
+  char c = 0;
+
+  out[0] = 0;
+
+  while(n+1 < size && (c = (char)pgm_read_byte(&((const char *)entry->fmt)[i])) != 0) {
+    i++;
+    if(c != '%') {
+      out[n++] = c;
+      out[n] = 0;
+      continue;
+    }
+    len = log_spec(entry->fmt, i, &type, &stars);
+    if(len == 1 && type == LOG_ARG_NONE) {
+      out[n++] = '%';
+      out[n] = 0;
+      i += len;
+      continue;
+    }
+
+    /*
+     * The * widths are written into the conversion,
+     * so it only takes a single argument.
+     */
+    spec[0] = '%';
+    y = 1;
+    for(x=0;x<len && y+12 < (int)sizeof(spec);x++) {
+      c = (char)pgm_read_byte(&((const char *)entry->fmt)[i+x]);
+      if(c == '*') {
+        int val = 0;
+        if(pos+sizeof(val) > entry->size) {
+          return;
+        }
+        memcpy(&val, &entry->args[pos], sizeof(val));
+        pos += sizeof(val);
+        y += snprintf(&spec[y], sizeof(spec)-y, "%d", val);
+      } else {
+        spec[y++] = c;
+      }
+    }
+    spec[y] = 0;
+    i += len;
+
+#define LOG_FORMAT(t) { \
+      t val; \
+      if(pos+sizeof(val) > entry->size) { \
+        return; \
+      } \
+      memcpy(&val, &entry->args[pos], sizeof(val)); \
+      pos += sizeof(val); \
+      snprintf(&out[n], size-n, spec, val); \
+    }
+
+    switch(type) {
+      case LOG_ARG_INT: LOG_FORMAT(int) break;
+      case LOG_ARG_LONG: LOG_FORMAT(long) break;
+      case LOG_ARG_LLONG: LOG_FORMAT(long long) break;
+      case LOG_ARG_SIZE: LOG_FORMAT(size_t) break;
+      case LOG_ARG_DOUBLE: LOG_FORMAT(double) break;
+      case LOG_ARG_PTR: LOG_FORMAT(void *) break;
+      case LOG_ARG_STRING: {
+        if(pos >= entry->size) {
+          return;
+        }
+        snprintf(&out[n], size-n, spec, (const char *)&entry->args[pos]);
+        pos += strlen((const char *)&entry->args[pos])+1;
+      } break;
+    }
+
+#undef LOG_FORMAT
+
+    n += strlen(&out[n]);
   }
-  strcpy_P(foo, p);
+}
 
-  char *str = NULL;
+/*
+ * The ring size is rounded down to a power of
+ * two. Without a ring, leveled messages are
+ * written right away.
+ */
+void log_async(struct log_entry_t *ring, uint16_t size) {
+  uint16_t nr = 1;
+
+  while(nr <= size/2) {
+    nr *= 2;
+  }
+
+  log_ring = NULL;
+  log_ringsize = 0;
+  __atomic_store_n(&log_head, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&log_tail, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&log_nrdropped, 0, __ATOMIC_RELEASE);
+
+  if(ring != NULL && size > 0) {
+    log_ringsize = nr;
+    log_ring = ring;
+  }
+}
+
+void _logpush_P(const char *file, unsigned int line, const __FlashStringHelper *fmt, ...) {
+  uint16_t head = 0, tail = 0;
+  va_list ap;
+
+  if(log_ring == NULL) {
+    char str[LOG_BUFSIZE];
 
-  va_list ap, apcpy;
-  va_copy(apcpy, ap);
-  va_start(apcpy, fmt);
+    va_start(ap, fmt);
+    vsnprintf_P(str, sizeof(str), (PGM_P)fmt, ap);
+    va_end(ap);
 
-  int bytes = vsnprintf(NULL, 0, foo, apcpy);
+    _logprintln(file, line, str);
+    return;
+  }
+
+  head = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+  tail = __atomic_load_n(&log_tail, __ATOMIC_ACQUIRE);
 
-  va_end(apcpy);
-  if((str = (char *)MALLOC(bytes+1)) == NULL) {
-    OUT_OF_MEMORY
+  /*
+   * A full ring drops the message
+   * instead of waiting for the consumer.
+   */
+  if((uint16_t)(head-tail) >= log_ringsize) {
+    __atomic_fetch_add(&log_nrdropped, 1, __ATOMIC_RELAXED);
+    return;
   }
+
+  struct log_entry_t *entry = &log_ring[head & (log_ringsize-1)];
+  entry->file = file;
+  entry->line = line;
+  entry->fmt = fmt;
+  entry->size = 0;
+
   va_start(ap, fmt);
-  vsprintf(str, foo, ap);
+  log_capture(entry, ap);
   va_end(ap);
 
-  _logprintln(file, line, str);
+  __atomic_store_n(&log_head, (uint16_t)(head+1), __ATOMIC_RELEASE);
+}
+
+static struct log_entry_t *log_peek(void) {
+  uint16_t tail = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+  uint16_t head = __atomic_load_n(&log_head, __ATOMIC_ACQUIRE);
+
+  if(log_ring == NULL || head == tail) {
+    return NULL;
+  }
+  return &log_ring[tail & (log_ringsize-1)];
+}
+
+static void log_advance(void) {
+  uint16_t tail = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&log_tail, (uint16_t)(tail+1), __ATOMIC_RELEASE);
+}
+
+/*
+ * Formats the oldest queued message. Returns -1
+ * when there are no messages.
+ */
+int8_t log_pop(char *out, uint16_t size) {
+  struct log_entry_t *entry = log_peek();
+
+  if(entry == NULL || size == 0) {
+    return -1;
+  }
+
+  log_format(entry, out, size);
+  log_advance();
 
-  FREE(foo);
-  FREE(str);
-}
\ No newline at end of file
+  return 0;
+}
+
+/*
+ * Writes at most max queued messages, to be
+ * called from a background task or the loop.
+ */
+uint16_t log_process(uint16_t max) {
+  struct log_entry_t *entry = NULL;
+  char str[LOG_BUFSIZE];
+  uint16_t nr = 0;
+
+  while(nr < max && (entry = log_peek()) != NULL) {
+    log_format(entry, str, sizeof(str));
+    _logprintln(entry->file, entry->line, str);
+    log_advance();
+    nr++;
+  }
+
+  return nr;
+}
+
+uint32_t log_dropped(void) {
+  return __atomic_load_n(&log_nrdropped, __ATOMIC_RELAXED);
+}
@@ -9,6 +9,8 @@
 #ifndef _LOG_H_
 #define _LOG_H_
 
+#include <stdint.h>
+
 #if defined(ESP8266) || defined(ESP32)
 #include <Arduino.h>
 #else
@@ -16,14 +18,77 @@
   #define F
 #endif
 
+#define LOG_FATAL 1
+#define LOG_ERROR 2
+#define LOG_WARNING 3
+#define LOG_INFO 4
+#define LOG_DEBUG 5
+
+/*
+ * Leveled messages above LOG_LEVEL are
+ * compiled out. Their arguments are still
+ * type checked, but never evaluated.
+ */
+#ifndef LOG_LEVEL
+  #define LOG_LEVEL LOG_INFO
+#endif
+
+#define LOG_BUFSIZE 256
+#define LOG_ARGSIZE 64
+
+/*
+ * A queued message holds the format string and a
+ * copy of its arguments, strings included, so it
+ * can be formatted later on.
+ */
+typedef struct log_entry_t {
+  const char *file;
+  const __FlashStringHelper *fmt;
+  unsigned int line;
+  uint8_t size;
+  unsigned char args[LOG_ARGSIZE];
+} __attribute__((aligned(4))) log_entry_t;
+
 #define logprintln(a) _logprintln(__FILE__, __LINE__, a)
 #define logprintf(a, ...) _logprintf(__FILE__, __LINE__, a, ##__VA_ARGS__)
 #define logprintln_P(a) _logprintln_P(__FILE__, __LINE__, a)
 #define logprintf_P(a, ...) _logprintf_P(__FILE__, __LINE__, a, ##__VA_ARGS__)
 
+#if LOG_LEVEL >= LOG_FATAL
+  #define logfatal_P(a, ...) _logpush_P(__FILE__, __LINE__, a, ##__VA_ARGS__)
+#else
+  #define logfatal_P(a, ...) do { if(0) _logpush_P(__FILE__, __LINE__, a, ##__VA_ARGS__); } while(0)
+#endif
+#if LOG_LEVEL >= LOG_ERROR
+  #define logerror_P(a, ...) _logpush_P(__FILE__, __LINE__, a, ##__VA_ARGS__)
+#else
+  #define logerror_P(a, ...) do { if(0) _logpush_P(__FILE__, __LINE__, a, ##__VA_ARGS__); } while(0)
+#endif
+#if LOG_LEVEL >= LOG_WARNING
+  #define logwarning_P(a, ...) _logpush_P(__FILE__, __LINE__, a, ##__VA_ARGS__)
+#else
+  #define logwarning_P(a, ...) do { if(0) _logpush_P(__FILE__, __LINE__, a, ##__VA_ARGS__); } while(0)
+#endif
+#if LOG_LEVEL >= LOG_INFO
+  #define loginfo_P(a, ...) _logpush_P(__FILE__, __LINE__, a, ##__VA_ARGS__)
+#else
+  #define loginfo_P(a, ...) do { if(0) _logpush_P(__FILE__, __LINE__, a, ##__VA_ARGS__); } while(0)
+#endif
+#if LOG_LEVEL >= LOG_DEBUG
+  #define logdebug_P(a, ...) _logpush_P(__FILE__, __LINE__, a, ##__VA_ARGS__)
+#else
+  #define logdebug_P(a, ...) do { if(0) _logpush_P(__FILE__, __LINE__, a, ##__VA_ARGS__); } while(0)
+#endif
+
 void _logprintln(const char *file, unsigned int line, char *msg);
 void _logprintf(const char *file, unsigned int line, char *fmt, ...);
 void _logprintln_P(const char *file, unsigned int line, const __FlashStringHelper *msg);
 void _logprintf_P(const char *file, unsigned int line, const __FlashStringHelper *fmt, ...);
+void _logpush_P(const char *file, unsigned int line, const __FlashStringHelper *fmt, ...);
+
+void log_async(struct log_entry_t *ring, uint16_t size);
+int8_t log_pop(char *out, uint16_t size);
+uint16_t log_process(uint16_t max);
+uint32_t log_dropped(void);
 
 #endif
@@ -6,6 +6,22 @@
   file, You can obtain one at http://mozilla.org/MPL/2.0/.
 */
 
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+
+/*
+ * Every block of the arena and the pool starts
+ * with a header holding its size or class.
+ */
+#define MEM_HEADER MEM_ALIGN
+#define MEM_POOL_MIN 16
+
+#if defined(DEBUG) || defined(COVERALLS)
+unsigned int mem_allocs = 0;
+#endif
+
 unsigned int alignedbuffer(int v) {
 #ifdef ESP8266
   return (v + 3) & ~0x3;
@@ -13,3 +29,334 @@ unsigned int alignedbuffer(int v) {
   return v;
 #endif
 }
+
+static size_t mem_align(size_t v) {
+  return (v + MEM_ALIGN-1) & ~((size_t)MEM_ALIGN-1);
+}
+
+static void *mem_libc_alloc(void *, size_t size) {
+  return malloc(size);
+}
+
+static void *mem_libc_resize(void *, void *ptr, size_t size) {
+  if(size == 0) {
+    free(ptr);
+    return NULL;
+  }
+  return realloc(ptr, size);
+}
+
+static void mem_libc_release(void *, void *ptr) {
+  free(ptr);
+}
+
+static struct mem_allocator_t mem_libc = {
+  mem_libc_alloc, mem_libc_resize, mem_libc_release, NULL
+};
+
+static struct mem_allocator_t *mem_allocator = &mem_libc;
+static uint8_t mem_current_phase = MEM_PHASE_HOST;
+
+/*
+ * Blocks are freed by the allocator that is set at
+ * that moment, so the allocator should only be
+ * changed while the library holds no memory.
+ */
+void mem_set_allocator(struct mem_allocator_t *allocator) {
+  if(allocator == NULL) {
+    mem_allocator = &mem_libc;
+  } else {
+    mem_allocator = allocator;
+  }
+}
+
+/*
+ * Sets the phase the following allocations are
+ * accounted to and returns the previous one, so
+ * it can be restored.
+ */
+uint8_t mem_phase(uint8_t phase) {
+  uint8_t old = mem_current_phase;
+  mem_current_phase = phase;
+  return old;
+}
+
+void *mem_malloc(size_t size) {
+#if defined(DEBUG) || defined(COVERALLS)
+  mem_allocs++;
+#endif
+  return mem_allocator->alloc(mem_allocator->ctx, size);
+}
+
+void *mem_calloc(size_t nr, size_t size) {
+  void *ptr = mem_malloc(nr*size);
+  if(ptr != NULL) {
+    memset(ptr, 0, nr*size);
+  }
+  return ptr;
+}
+
+void *mem_realloc(void *ptr, size_t size) {
+#if defined(DEBUG) || defined(COVERALLS)
+  mem_allocs++;
+#endif
+  return mem_allocator->resize(mem_allocator->ctx, ptr, size);
+}
+
+char *mem_strdup(const char *str) {
+  size_t len = strlen(str);
+  char *ptr = (char *)mem_malloc(len+1);
+  if(ptr != NULL) {
+    memcpy(ptr, str, len+1);
+  }
+  return ptr;
+}
+
+void mem_free(void *ptr) {
+  if(ptr != NULL) {
+    mem_allocator->release(mem_allocator->ctx, ptr);
+  }
+}
+
+static void *mem_arena_alloc(void *ctx, size_t size) {
+  struct mem_arena_t *arena = (struct mem_arena_t *)ctx;
+  size_t need = MEM_HEADER+mem_align(size);
+  unsigned char *ptr = NULL;
+
+  if(arena->used+need > arena->size) {
+    return NULL;
+  }
+
+  ptr = &arena->buffer[arena->used];
+  *(size_t *)ptr = size;
+  arena->last = arena->used;
+  arena->used += need;
+
+  return &ptr[MEM_HEADER];
+}
+
+static uint8_t mem_arena_islast(struct mem_arena_t *arena, void *ptr) {
+  return arena->last < arena->used && ptr == &arena->buffer[arena->last+MEM_HEADER];
+}
+
+static void mem_arena_release(void *ctx, void *ptr) {
+  struct mem_arena_t *arena = (struct mem_arena_t *)ctx;
+
+  if(mem_arena_islast(arena, ptr) == 1) {
+    arena->used = arena->last;
+  }
+}
+
+static void *mem_arena_resize(void *ctx, void *ptr, size_t size) {
+  struct mem_arena_t *arena = (struct mem_arena_t *)ctx;
+  size_t *header = NULL;
+  void *ret = NULL;
+
+  if(ptr == NULL) {
+    return mem_arena_alloc(ctx, size);
+  }
+  if(size == 0) {
+    mem_arena_release(ctx, ptr);
+    return NULL;
+  }
+
+  header = (size_t *)&((unsigned char *)ptr)[-MEM_HEADER];
+
+  if(mem_arena_islast(arena, ptr) == 1) {
+    if(arena->last+MEM_HEADER+mem_align(size) > arena->size) {
+      return NULL;
+    }
+    arena->used = arena->last+MEM_HEADER+mem_align(size);
+    *header = size;
+    return ptr;
+  }
+  if(size <= *header) {
+    return ptr;
+  }
+
+  if((ret = mem_arena_alloc(ctx, size)) == NULL) {
+    return NULL;
+  }
+  memcpy(ret, ptr, *header);
+
+  return ret;
+}
+
+void mem_arena_init(struct mem_allocator_t *allocator, struct mem_arena_t *arena, void *buffer, size_t size) {
+  size_t offset = mem_align((size_t)buffer)-(size_t)buffer;
+
+  memset(arena, 0, sizeof(struct mem_arena_t));
+  if(size > offset) {
+    arena->buffer = &((unsigned char *)buffer)[offset];
+    arena->size = size-offset;
+  }
+
+  allocator->alloc = mem_arena_alloc;
+  allocator->resize = mem_arena_resize;
+  allocator->release = mem_arena_release;
+  allocator->ctx = arena;
+}
+
+void mem_arena_reset(struct mem_arena_t *arena) {
+  arena->used = 0;
+  arena->last = 0;
+}
+
+static int8_t mem_pool_class(size_t size) {
+  uint8_t i = 0;
+
+  for(i=0;i<MEM_POOL_CLASSES;i++) {
+    if(size <= ((size_t)MEM_POOL_MIN << i)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static uint8_t mem_pool_owns(struct mem_pool_t *pool, void *ptr) {
+  return (unsigned char *)ptr >= pool->buffer && (unsigned char *)ptr < &pool->buffer[pool->size];
+}
+
+static void *mem_pool_alloc(void *ctx, size_t size) {
+  struct mem_pool_t *pool = (struct mem_pool_t *)ctx;
+  int8_t c = mem_pool_class(size);
+  unsigned char *ptr = NULL;
+
+  if(c > -1 && pool->free[c] != NULL) {
+    ptr = (unsigned char *)pool->free[c];
+    pool->free[c] = *(void **)ptr;
+    return ptr;
+  }
+
+  if(c == -1 || pool->used+MEM_HEADER+((size_t)MEM_POOL_MIN << c) > pool->size) {
+    if(pool->parent == NULL) {
+      return NULL;
+    }
+    return pool->parent->alloc(pool->parent->ctx, size);
+  }
+
+  ptr = &pool->buffer[pool->used];
+  *(size_t *)ptr = c;
+  pool->used += MEM_HEADER+((size_t)MEM_POOL_MIN << c);
+
+  return &ptr[MEM_HEADER];
+}
+
+static void mem_pool_release(void *ctx, void *ptr) {
+  struct mem_pool_t *pool = (struct mem_pool_t *)ctx;
+  size_t c = 0;
+
+  if(mem_pool_owns(pool, ptr) == 0) {
+    if(pool->parent != NULL) {
+      pool->parent->release(pool->parent->ctx, ptr);
+    }
+    return;
+  }
+
+  c = *(size_t *)&((unsigned char *)ptr)[-MEM_HEADER];
+  *(void **)ptr = pool->free[c];
+  pool->free[c] = ptr;
+}
+
+static void *mem_pool_resize(void *ctx, void *ptr, size_t size) {
+  struct mem_pool_t *pool = (struct mem_pool_t *)ctx;
+  size_t old = 0;
+  void *ret = NULL;
+
+  if(ptr == NULL) {
+    return mem_pool_alloc(ctx, size);
+  }
+  if(size == 0) {
+    mem_pool_release(ctx, ptr);
+    return NULL;
+  }
+  if(mem_pool_owns(pool, ptr) == 0) {
+    return pool->parent->resize(pool->parent->ctx, ptr, size);
+  }
+
+  old = (size_t)MEM_POOL_MIN << *(size_t *)&((unsigned char *)ptr)[-MEM_HEADER];
+  if(size <= old) {
+    return ptr;
+  }
+
+  if((ret = mem_pool_alloc(ctx, size)) == NULL) {
+    return NULL;
+  }
+  memcpy(ret, ptr, old);
+  mem_pool_release(ctx, ptr);
+
+  return ret;
+}
+
+void mem_pool_init(struct mem_allocator_t *allocator, struct mem_pool_t *pool, void *buffer, size_t size, struct mem_allocator_t *parent) {
+  size_t offset = mem_align((size_t)buffer)-(size_t)buffer;
+
+  memset(pool, 0, sizeof(struct mem_pool_t));
+  if(size > offset) {
+    pool->buffer = &((unsigned char *)buffer)[offset];
+    pool->size = size-offset;
+  }
+  pool->parent = parent;
+
+  allocator->alloc = mem_pool_alloc;
+  allocator->resize = mem_pool_resize;
+  allocator->release = mem_pool_release;
+  allocator->ctx = pool;
+}
+
+/*
+ * The counter passes everything on to its parent
+ * and keeps track of the allocations, frees and
+ * requested bytes of each phase. A realloc counts
+ * as an allocation of the new size.
+ */
+static void *mem_counter_alloc(void *ctx, size_t size) {
+  struct mem_counter_t *counter = (struct mem_counter_t *)ctx;
+  void *ptr = counter->parent->alloc(counter->parent->ctx, size);
+
+  if(ptr != NULL) {
+    counter->phase[mem_current_phase].allocs++;
+    counter->phase[mem_current_phase].bytes += size;
+  }
+  return ptr;
+}
+
+static void mem_counter_release(void *ctx, void *ptr) {
+  struct mem_counter_t *counter = (struct mem_counter_t *)ctx;
+
+  counter->phase[mem_current_phase].frees++;
+  counter->parent->release(counter->parent->ctx, ptr);
+}
+
+static void *mem_counter_resize(void *ctx, void *ptr, size_t size) {
+  struct mem_counter_t *counter = (struct mem_counter_t *)ctx;
+  void *ret = NULL;
+
+  if(ptr == NULL) {
+    return mem_counter_alloc(ctx, size);
+  }
+  if(size == 0) {
+    mem_counter_release(ctx, ptr);
+    return NULL;
+  }
+
+  if((ret = counter->parent->resize(counter->parent->ctx, ptr, size)) != NULL) {
+    counter->phase[mem_current_phase].allocs++;
+    counter->phase[mem_current_phase].bytes += size;
+  }
+  return ret;
+}
+
+void mem_counter_init(struct mem_allocator_t *allocator, struct mem_counter_t *counter, struct mem_allocator_t *parent) {
+  memset(counter, 0, sizeof(struct mem_counter_t));
+  if(parent == NULL) {
+    counter->parent = &mem_libc;
+  } else {
+    counter->parent = parent;
+  }
+
+  allocator->alloc = mem_counter_alloc;
+  allocator->resize = mem_counter_resize;
+  allocator->release = mem_counter_release;
+  allocator->ctx = counter;
+}
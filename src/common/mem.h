@@ -9,15 +9,98 @@
 #ifndef _MEM_H_
 #define _MEM_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 unsigned int alignedbytes(int v);
 unsigned int alignedbuffer(int v);
 
 #define OUT_OF_MEMORY while(0) { }
 
-#define STRDUP strdup
-#define REALLOC realloc
-#define CALLOC calloc
-#define MALLOC malloc
-#define FREE(a) do { free(a); (a) = NULL; } while(0)
+#define MEM_ALIGN 8
+#define MEM_POOL_CLASSES 9
+
+typedef enum {
+  MEM_PHASE_HOST = 0,
+  MEM_PHASE_PREPARE = 1,
+  MEM_PHASE_CREATE = 2,
+  MEM_PHASE_RUN = 3,
+  MEM_PHASE_GC = 4,
+  MEM_PHASES = 5
+} mem_phases;
+
+/*
+ * All library allocations go through the current
+ * allocator. A realloc to zero bytes frees the
+ * block and returns NULL.
+ */
+typedef struct mem_allocator_t {
+  void *(*alloc)(void *ctx, size_t size);
+  void *(*resize)(void *ctx, void *ptr, size_t size);
+  void (*release)(void *ctx, void *ptr);
+  void *ctx;
+} mem_allocator_t;
+
+/*
+ * Bump allocator for scratch memory. Only the
+ * last block can be freed or resized in place,
+ * everything else is freed by a reset.
+ */
+typedef struct mem_arena_t {
+  unsigned char *buffer;
+  size_t size;
+  size_t used;
+  size_t last;
+} mem_arena_t;
+
+/*
+ * Size class pools of 16 up to 4096 bytes carved
+ * from a fixed region. Larger blocks are passed on
+ * to the parent allocator, if there is one.
+ */
+typedef struct mem_pool_t {
+  unsigned char *buffer;
+  size_t size;
+  size_t used;
+  void *free[MEM_POOL_CLASSES];
+  struct mem_allocator_t *parent;
+} mem_pool_t;
+
+typedef struct mem_counter_t {
+  struct mem_allocator_t *parent;
+  struct {
+    unsigned int allocs;
+    unsigned int frees;
+    size_t bytes;
+  } phase[MEM_PHASES];
+} mem_counter_t;
+
+void mem_set_allocator(struct mem_allocator_t *allocator);
+uint8_t mem_phase(uint8_t phase);
+
+void *mem_malloc(size_t size);
+void *mem_calloc(size_t nr, size_t size);
+void *mem_realloc(void *ptr, size_t size);
+char *mem_strdup(const char *str);
+void mem_free(void *ptr);
+
+void mem_arena_init(struct mem_allocator_t *allocator, struct mem_arena_t *arena, void *buffer, size_t size);
+void mem_arena_reset(struct mem_arena_t *arena);
+void mem_pool_init(struct mem_allocator_t *allocator, struct mem_pool_t *pool, void *buffer, size_t size, struct mem_allocator_t *parent);
+void mem_counter_init(struct mem_allocator_t *allocator, struct mem_counter_t *counter, struct mem_allocator_t *parent);
+
+#if defined(DEBUG) || defined(COVERALLS)
+/*
+ * Counts the allocations, so the tests can
+ * check that running a rule doesn't allocate.
+ */
+extern unsigned int mem_allocs;
+#endif
+
+#define STRDUP(a) mem_strdup(a)
+#define REALLOC(a, b) mem_realloc(a, b)
+#define CALLOC(a, b) mem_calloc(a, b)
+#define MALLOC(a) mem_malloc(a)
+#define FREE(a) do { mem_free(a); (a) = NULL; } while(0)
 
 #endif
@@ -0,0 +1,263 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "number.h"
+
+/*
+ * The mantissa holds at most 19 decimal digits,
+ * a float never needs more than 9 to round trip.
+ */
+#define NUMBER_MAXDIGITS 19
+#define NUMBER_FLOATDIGITS 9
+
+static const double number_pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+  1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+  1e21, 1e22
+};
+
+/*
+ * Powers of ten up to 1e22 are exact, so a
+ * single multiplication or division by them
+ * is correctly rounded.
+ */
+static double number_scale(double v, int16_t exp) {
+  while(exp > 22) {
+    v *= 1e22;
+    exp -= 22;
+  }
+  while(exp < -22) {
+    v /= 1e22;
+    exp += 22;
+  }
+  if(exp >= 0) {
+    return v * number_pow10[exp];
+  }
+  return v / number_pow10[-exp];
+}
+
+/*
+ * Rounds to the given number of significant
+ * bits with the Veltkamp-Dekker split.
+ */
+static float number_bits(float f, uint8_t bits) {
+  if(bits >= 24) {
+    return f;
+  }
+  float factor = (float)((1u << (24-bits)) + 1u);
+  float c = factor * f;
+  return (c-(c-f));
+}
+
+void number_parse_begin(struct number_parser_t *parser) {
+  memset(parser, 0, sizeof(struct number_parser_t));
+}
+
+/*
+ * Accepts an optional minus, digits and a single
+ * dot. Returns 0 for the first character that is
+ * not part of the number.
+ */
+uint8_t number_parse_char(struct number_parser_t *parser, char c) {
+  if(c == '-' && parser->len == 0) {
+    parser->neg = 1;
+  } else if(c == '.' && parser->dot == 0 && parser->len > parser->neg) {
+    parser->dot = 1;
+  } else if(c >= '0' && c <= '9') {
+    if(parser->digits == 0 && c == '0') {
+      if(parser->dot == 1) {
+        parser->exp--;
+      }
+    } else if(parser->digits < NUMBER_MAXDIGITS) {
+      parser->mantissa = parser->mantissa*10 + (c-'0');
+      parser->digits++;
+      if(parser->dot == 1) {
+        parser->exp--;
+      }
+    } else if(parser->dot == 0) {
+      parser->exp++;
+    }
+  } else {
+    return 0;
+  }
+  if(parser->len < UINT8_MAX) {
+    parser->len++;
+  }
+  return 1;
+}
+
+float number_parse_end(struct number_parser_t *parser) {
+  double v = number_scale((double)parser->mantissa, parser->exp);
+
+  return (float)((parser->neg == 1) ? -v : v);
+}
+
+float number_parse(const char *str, uint16_t len, uint16_t *used) {
+  struct number_parser_t parser;
+  uint16_t i = 0;
+
+  number_parse_begin(&parser);
+  while(i < len && number_parse_char(&parser, str[i]) == 1) {
+    i++;
+  }
+  if(used != NULL) {
+    *used = i;
+  }
+
+  return number_parse_end(&parser);
+}
+
+uint8_t number_itoa(int32_t nr, char *out) {
+  char buf[12];
+  uint8_t len = 0, i = sizeof(buf);
+  uint32_t x = (nr < 0) ? -(uint32_t)nr : (uint32_t)nr;
+
+  do {
+    buf[--i] = '0' + (x % 10);
+    x /= 10;
+  } while(x > 0);
+
+  if(nr < 0) {
+    buf[--i] = '-';
+  }
+  len = sizeof(buf)-i;
+
+  memcpy(out, &buf[i], len);
+  out[len] = 0;
+
+  return len;
+}
+
+/*
+ * Writes the shortest decimal that rounds back to
+ * the same value at the given number of significant
+ * bits, laid out like the %g format. A float uses
+ * 24 bits.
+ */
+uint8_t number_ftoa(float nr, uint8_t bits, char *out) {
+  char digits[NUMBER_FLOATDIGITS];
+  uint64_t d = 0;
+  uint8_t n = 0, p = 0, i = 0;
+  int16_t e10 = 0, exp = 0;
+  int e2 = 0;
+  double v = 0;
+  float x = 0;
+
+  if(isnan(nr)) {
+    strcpy(out, "nan");
+    return 3;
+  }
+  if(signbit(nr)) {
+    out[n++] = '-';
+    nr = -nr;
+  }
+  if(isinf(nr)) {
+    strcpy(&out[n], "inf");
+    return n+3;
+  }
+  if(nr == 0) {
+    out[n++] = '0';
+    out[n] = 0;
+    return n;
+  }
+
+  x = number_bits(nr, bits);
+  v = x;
+
+  frexp(v, &e2);
+  e10 = (int16_t)floor((e2-1)*0.30102999566398119521);
+  if(v >= number_scale(1.0, e10+1)) {
+    e10++;
+  } else if(v < number_scale(1.0, e10)) {
+    e10--;
+  }
+
+  for(p=1;p<=NUMBER_FLOATDIGITS;p++) {
+    d = (uint64_t)llround(number_scale(v, p-1-e10));
+    exp = e10;
+    if(d >= (uint64_t)number_pow10[p]) {
+      d /= 10;
+      exp++;
+    }
+    if(number_bits((float)number_scale((double)d, exp-p+1), bits) == x) {
+      break;
+    }
+  }
+  if(p > NUMBER_FLOATDIGITS) {
+    p = NUMBER_FLOATDIGITS;
+  }
+  while(p > 1 && (d % 10) == 0) {
+    d /= 10;
+    p--;
+  }
+  for(i=p;i>0;i--) {
+    digits[i-1] = '0' + (d % 10);
+    d /= 10;
+  }
+
+  if(exp < -4 || exp >= 6) {
+    out[n++] = digits[0];
+    if(p > 1) {
+      out[n++] = '.';
+      memcpy(&out[n], &digits[1], p-1);
+      n += p-1;
+    }
+    out[n++] = 'e';
+    out[n++] = (exp < 0) ? '-' : '+';
+    if(exp < 0) {
+      exp = -exp;
+    }
+    if(exp < 10) {
+      out[n++] = '0';
+    }
+    n += number_itoa(exp, &out[n]);
+  } else if(exp >= 0) {
+    for(i=0;i<=exp;i++) {
+      out[n++] = (i < p) ? digits[i] : '0';
+    }
+    if(p > exp+1) {
+      out[n++] = '.';
+      memcpy(&out[n], &digits[exp+1], p-exp-1);
+      n += p-exp-1;
+    }
+  } else {
+    out[n++] = '0';
+    out[n++] = '.';
+    for(i=0;i<-exp-1;i++) {
+      out[n++] = '0';
+    }
+    memcpy(&out[n], digits, p);
+    n += p;
+  }
+  out[n] = 0;
+
+  return n;
+}
+
+/*
+ * Rounds half away from zero. Values that have
+ * no decimals at this precision are returned
+ * as they are.
+ */
+float number_round(float nr, uint8_t decimals) {
+  double v = nr, s = 0;
+
+  if(decimals > 22) {
+    return nr;
+  }
+  s = v * number_pow10[decimals];
+  if(fabs(s) >= 4503599627370496.0) {
+    return nr;
+  }
+
+  return (float)(round(s) / number_pow10[decimals]);
+}
@@ -0,0 +1,43 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _NUMBER_H_
+#define _NUMBER_H_
+
+#include <stdint.h>
+
+/*
+ * Large enough for any int32_t or float
+ * including the NUL terminator.
+ */
+#define NUMBER_BUFSIZE 24
+
+/*
+ * Decimals are fed one character at a time,
+ * so the digits don't have to be contiguous
+ * or terminated.
+ */
+typedef struct number_parser_t {
+  uint64_t mantissa;
+  int16_t exp;
+  uint8_t digits;
+  uint8_t neg;
+  uint8_t dot;
+  uint8_t len;
+} number_parser_t;
+
+void number_parse_begin(struct number_parser_t *parser);
+uint8_t number_parse_char(struct number_parser_t *parser, char c);
+float number_parse_end(struct number_parser_t *parser);
+float number_parse(const char *str, uint16_t len, uint16_t *used);
+
+uint8_t number_itoa(int32_t nr, char *out);
+uint8_t number_ftoa(float nr, uint8_t bits, char *out);
+float number_round(float nr, uint8_t decimals);
+
+#endif
@@ -34,16 +34,50 @@
 #include "functions/floor.h"
 #include "functions/concat.h"
 #include "functions/print.h"
+#include "functions/substr.h"
+#include "functions/startswith.h"
+#include "functions/endswith.h"
+#include "functions/find.h"
+#include "functions/strlen.h"
 
 struct rule_function_t rule_functions[] = {
-  { "max", rule_function_max_callback },
-  { "min", rule_function_min_callback },
-  { "coalesce", rule_function_coalesce_callback },
-  { "round", rule_function_round_callback },
-  { "floor", rule_function_floor_callback },
-  { "ceil", rule_function_ceil_callback },
-  { "concat", rule_function_concat_callback },
-  { "print", rule_function_print_callback }
+  { "max", rule_function_max_callback, NULL, RULE_FUNCTION_PURE },
+  { "min", rule_function_min_callback, NULL, RULE_FUNCTION_PURE },
+  { "coalesce", rule_function_coalesce_callback, NULL, RULE_FUNCTION_PURE },
+  { "round", rule_function_round_callback, NULL, RULE_FUNCTION_PURE },
+  { "floor", NULL, RULE_FUNCTION_TYPED(rule_function_floor), RULE_FUNCTION_PURE },
+  { "ceil", NULL, RULE_FUNCTION_TYPED(rule_function_ceil), RULE_FUNCTION_PURE },
+  { "concat", rule_function_concat_callback, NULL, RULE_FUNCTION_PURE },
+  { "print", rule_function_print_callback, NULL, RULE_FUNCTION_EFFECT },
+  { "substr", rule_function_substr_callback, NULL, RULE_FUNCTION_PURE },
+  { "startswith", rule_function_startswith_callback, NULL, RULE_FUNCTION_PURE },
+  { "endswith", rule_function_endswith_callback, NULL, RULE_FUNCTION_PURE },
+  { "find", rule_function_find_callback, NULL, RULE_FUNCTION_PURE },
+  { "strlen", NULL, RULE_FUNCTION_TYPED(rule_function_strlen), RULE_FUNCTION_PURE }
 };
 
 uint16_t nr_rule_functions = sizeof(rule_functions)/sizeof(rule_functions[0]);
+
+/*
+ * The opcode the VM runs a built-in function
+ * with, or 0 when it isn't one or the host
+ * replaced it.
+ */
+uint8_t rule_function_opcode(uint16_t nr) {
+  struct rule_function_t *function = &rule_functions[nr];
+
+  if(function->callback == rule_function_max_callback) {
+    return OP_MAX;
+  } else if(function->callback == rule_function_min_callback) {
+    return OP_MIN;
+  } else if(function->callback == rule_function_round_callback) {
+    return OP_ROUND;
+  } else if(function->callback == rule_function_coalesce_callback) {
+    return OP_COALESCE;
+  } else if(function->typed == RULE_FUNCTION_TYPED(rule_function_floor)) {
+    return OP_FLOOR;
+  } else if(function->typed == RULE_FUNCTION_TYPED(rule_function_ceil)) {
+    return OP_CEIL;
+  }
+  return 0;
+}
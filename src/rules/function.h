@@ -10,13 +10,133 @@
 #define _RULE_FUNCTION_H_
 
 #include "rules.h" /* rewrite */
+#include "../common/log.h"
 
+#define RULE_FUNCTION_MAX_ARGS 16
+
+/*
+ * A pure function always gives the same result
+ * for the same arguments, a per run function
+ * only during a single run. A function without
+ * these flags is treated as having side effects
+ * and is called every time.
+ */
+#define RULE_FUNCTION_PURE 0x01
+#define RULE_FUNCTION_RUN 0x02
+#define RULE_FUNCTION_EFFECT 0x04
+
+/*
+ * A function either uses the stack protocol
+ * through callback, or gets its arguments
+ * decoded through typed. The result of a typed
+ * function is nil unless it sets one.
+ */
 struct rule_function_t {
   const char *name;
   int8_t (*callback)(void);
+  int8_t (*typed)(const struct rule_value_t *args, uint8_t nr, struct rule_value_t *result);
+  uint8_t flags;
 } __attribute__((packed));
 
 extern struct rule_function_t rule_functions[];
 extern uint16_t nr_rule_functions;
 
+uint8_t rule_function_opcode(uint16_t nr);
+
+/*
+ * Generates the typed callback of a plain C
+ * function, e.g. RULE_FUNCTION_TYPED(clamp)
+ * for float clamp(float x, int max). The
+ * arguments can be int, float or const char *,
+ * where numbers convert into each other. A nil
+ * argument makes the result nil, a string for
+ * a number or the wrong number of arguments
+ * makes the call fail.
+ */
+template<typename T> struct rule_typed_arg;
+
+template<> struct rule_typed_arg<int> {
+  static uint8_t check(const struct rule_value_t *value) {
+    return (value->type == VNULL) ? 2 : (value->type == VINTEGER || value->type == VFLOAT);
+  }
+  static int get(const struct rule_value_t *value) {
+    return (value->type == VINTEGER) ? value->val.i : (int)value->val.f;
+  }
+};
+
+template<> struct rule_typed_arg<float> {
+  static uint8_t check(const struct rule_value_t *value) {
+    return (value->type == VNULL) ? 2 : (value->type == VINTEGER || value->type == VFLOAT);
+  }
+  static float get(const struct rule_value_t *value) {
+    return (value->type == VFLOAT) ? value->val.f : (float)value->val.i;
+  }
+};
+
+template<> struct rule_typed_arg<const char *> {
+  static uint8_t check(const struct rule_value_t *value) {
+    return (value->type == VNULL) ? 2 : (value->type == VCHAR);
+  }
+  static const char *get(const struct rule_value_t *value) {
+    return value->val.s;
+  }
+};
+
+static inline void rule_typed_result(struct rule_value_t *result, int value) {
+  result->type = VINTEGER;
+  result->val.i = value;
+}
+
+static inline void rule_typed_result(struct rule_value_t *result, float value) {
+  result->type = VFLOAT;
+  result->val.f = value;
+}
+
+static inline void rule_typed_result(struct rule_value_t *result, const char *value) {
+  result->type = (value == NULL) ? VNULL : VCHAR;
+  result->val.s = value;
+  result->handle = 0;
+}
+
+template<int...> struct rule_typed_seq {};
+template<int N, int... S> struct rule_typed_gen : rule_typed_gen<N-1, N-1, S...> {};
+template<int... S> struct rule_typed_gen<0, S...> {
+  typedef rule_typed_seq<S...> type;
+};
+
+template<typename T, T fn> struct rule_typed;
+
+template<typename R, typename... A, R (*fn)(A...)>
+struct rule_typed<R (*)(A...), fn> {
+  template<int... S>
+  static int8_t invoke(const struct rule_value_t *args, struct rule_value_t *result, rule_typed_seq<S...>) {
+    const uint8_t checks[] = { 1, rule_typed_arg<A>::check(&args[S])... };
+    uint8_t i = 0;
+
+    for(i=1;i<sizeof(checks);i++) {
+      if(checks[i] == 0) {
+        logerror_P(F("ERROR: argument %d has the wrong type"), i);
+        return -1;
+      }
+    }
+    for(i=1;i<sizeof(checks);i++) {
+      if(checks[i] == 2) {
+        return 0;
+      }
+    }
+    rule_typed_result(result, fn(rule_typed_arg<A>::get(&args[S])...));
+    return 0;
+  }
+
+  static int8_t call(const struct rule_value_t *args, uint8_t nr, struct rule_value_t *result) {
+    if(nr != sizeof...(A)) {
+      logerror_P(F("ERROR: expected %d arguments"), (int)sizeof...(A));
+      return -1;
+    }
+    return invoke(args, result, typename rule_typed_gen<sizeof...(A)>::type());
+  }
+};
+
+#define RULE_FUNCTION_TYPED(f) (rule_typed<decltype(&f), &f>::call)
+
 #endif
@@ -12,6 +12,6 @@
 #include <stdint.h>
 #include "../rules.h"
 
-int8_t rule_function_ceil_callback(void);
+int rule_function_ceil(float x);
 
 #endif
\ No newline at end of file
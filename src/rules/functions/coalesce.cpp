@@ -43,9 +43,7 @@ int8_t rule_function_coalesce_callback(void) {
       } break;
     }
   }
-  while(nr > 0) {
-    rules_remove(nr--);
-  }
+  rules_pop(nr);
 
   if(a != NULL) {
 #ifdef DEBUG
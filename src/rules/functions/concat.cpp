@@ -22,58 +22,16 @@
 #include "../rules.h"
 
 int8_t rule_function_concat_callback(void) {
-  uint16_t len = 0, offset = 0;
   uint8_t nr = rules_gettop(), y = 0;
 
+  rules_strbegin();
   for(y=1;y<=nr;y++) {
-    switch(rules_type(y)) {
-      case VNULL: {
-        len += strlen("NULL");
-      } break;
-      case VINTEGER: {
-        int i = rules_tointeger(y);
-        len += snprintf(NULL, 0, "%d", i);
-      } break;
-      case VFLOAT: {
-        float f = rules_tofloat(y);
-        len += snprintf(NULL, 0, "%g", (double)f);
-      } break;
-      case VCHAR: {
-        len += strlen(rules_tostring(y));
-      } break;
-    }
+    rules_straddvalue(y);
   }
 
-  char *tmp = (char *)MALLOC(len+1);
-  if(tmp == NULL) {
-    OUT_OF_MEMORY
-  }
-  memset(tmp, 0, len+1);
-  for(y=1;y<=nr;y++) {
-    switch(rules_type(y)) {
-      case VNULL: {
-        offset += snprintf(&tmp[offset], len+1-offset, "NULL");
-      } break;
-      case VINTEGER: {
-        int i = rules_tointeger(y);
-        offset += snprintf(&tmp[offset], len+1-offset, "%d", i);
-      } break;
-      case VFLOAT: {
-        float f = rules_tofloat(y);
-        offset += snprintf(&tmp[offset], len+1-offset, "%g", (double)f);
-      } break;
-      case VCHAR: {
-        offset += snprintf(&tmp[offset], len+1-offset, "%s", rules_tostring(y));
-      } break;
-    }
-  }
-
-  while(nr > 0) {
-    rules_remove(nr--);
-  }
+  rules_pop(nr);
 
-  rules_pushstring(tmp);
-  FREE(tmp);
+  rules_strpush();
 
   return 0;
 }
@@ -0,0 +1,102 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifdef ESP8266
+  #pragma GCC diagnostic warning "-fpermissive"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../../common/uint32float.h"
+#include "../../common/log.h"
+#include "../function.h"
+#include "../rules.h"
+
+int8_t rule_function_find_callback(void) {
+  const char *a = NULL, *b = NULL;
+  uint16_t len1 = 0, len2 = 0, x = 0;
+  uint8_t nr = rules_gettop(), y = 0, isnull = 0;
+  int start = 0, ret = -1;
+
+  if(nr < 2 || nr > 3) {
+    logerror_P(F("ERROR: find takes two or three arguments"));
+    rules_pop(nr);
+    rules_pushnil();
+    return -1;
+  }
+
+  if(nr == 3) {
+    switch(rules_type(3)) {
+      case VNULL: {
+        isnull = 1;
+      } break;
+      case VINTEGER: {
+        start = rules_tointeger(3);
+      } break;
+      case VFLOAT: {
+        start = (int)rules_tofloat(3);
+      } break;
+      default: {
+        logerror_P(F("ERROR: find 3rd argument can only be a number"));
+        rules_pop(nr);
+        rules_pushnil();
+        return -1;
+      } break;
+    }
+  }
+
+  for(y=1;y<=2;y++) {
+    switch(rules_type(y)) {
+      case VNULL: {
+        isnull = 1;
+      } break;
+      case VCHAR: {
+      } break;
+      default: {
+        logerror_P(F("ERROR: find 1st and 2nd argument can only be strings"));
+        rules_pop(nr);
+        rules_pushnil();
+        return -1;
+      } break;
+    }
+  }
+
+  if(isnull == 0) {
+    a = rules_tolstring(1, &len1);
+    b = rules_tolstring(2, &len2);
+
+    /*
+     * Check the start before it's narrowed
+     * to the length of a string.
+     */
+    if(start <= len1) {
+      for(x=MAX(start, 0);x+len2<=len1;x++) {
+        if(memcmp(&a[x], b, len2) == 0) {
+          ret = x;
+          break;
+        }
+      }
+    }
+  }
+
+  rules_pop(nr);
+
+  if(isnull == 1) {
+    rules_pushnil();
+  } else {
+#ifdef DEBUG
+    printf("\tfind = %d\n", ret);
+#endif
+    rules_pushinteger(ret);
+  }
+
+  return 0;
+}
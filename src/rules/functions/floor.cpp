@@ -20,48 +20,9 @@
 #include "../function.h"
 #include "../rules.h"
 
-int8_t rule_function_floor_callback(void) {
-  float x = 0, z = 0;
-  uint8_t nr = rules_gettop();
-
-  if(nr > 1) {
-    return -1;
-  }
-
-  switch(rules_type(nr)) {
-    case VCHAR: {
-      logprintf_P(F("ERROR: floor only takes numbers"));
-      while(nr > 0) {
-        rules_remove(nr--);
-      }
-      rules_pushnil();
-      return -1;
-    } break;
-    case VNULL: {
-      rules_remove(nr--);
-      rules_pushnil();
-      return 0;
-    } break;
-    case VINTEGER: {
-      x = (float)rules_tointeger(nr);
-    } break;
-    case VFLOAT: {
-      x = rules_tofloat(nr);
-    } break;
-  }
-  rules_remove(nr--);
-
-  if(modff(x, &z) == 0) {
+int rule_function_floor(float x) {
 #ifdef DEBUG
-    printf("\tfloor = %d\n", (int)x);
+  printf("\tfloor = %d\n", (int)floorf(x));
 #endif
-    rules_pushinteger(x);
-  } else {
-#ifdef DEBUG
-    printf("\tfloor = %d\n", (int)floorf(x));
-#endif
-    rules_pushinteger((int)floorf(x));
-  }
-
-  return 0;
+  return (int)floorf(x);
 }
@@ -27,10 +27,8 @@ int8_t rule_function_min_callback(void) {
   while(nr > 0) {
     switch(rules_type(nr)) {
        case VCHAR: {
-        logprintf_P(F("ERROR: max only takes numbers"));
-        while(nr > 0) {
-          rules_remove(nr--);
-        }
+        logerror_P(F("ERROR: max only takes numbers"));
+        rules_pop(nr);
         rules_pushnil();
         return -1;
       } break;
@@ -18,6 +18,7 @@
 #include "../../common/uint32float.h"
 #include "../../common/log.h"
 #include "../../common/mem.h"
+#include "../../common/number.h"
 #include "../function.h"
 #include "../rules.h"
 
@@ -34,10 +35,8 @@ int8_t rule_function_round_callback(void) {
         dec = rules_tointeger(nr);
       } break;
       default: {
-        logprintf_P(F("ERROR: round 2nd argument can only be an integer"));
-        while(nr > 0) {
-          rules_remove(nr--);
-        }
+        logerror_P(F("ERROR: round 2nd argument can only be an integer"));
+        rules_pop(nr);
         rules_pushnil();
         return -1;
       } break;
@@ -58,10 +57,8 @@ int8_t rule_function_round_callback(void) {
       x = rules_tofloat(nr);
     } break;
     default: {
-      logprintf_P(F("ERROR: round 1st argument can only be a number"));
-      while(nr > 0) {
-        rules_remove(nr--);
-      }
+      logerror_P(F("ERROR: round 1st argument can only be a number"));
+      rules_pop(nr);
       rules_pushnil();
       return -1;
     } break;
@@ -75,18 +72,10 @@ int8_t rule_function_round_callback(void) {
     rules_pushinteger(roundf(x));
   } else {
     if(y == 2) {
-      uint8_t size = snprintf(NULL, 0, "%.*f", dec, (double)x)+1;
-      char *buf = (char *)MALLOC(size);
-      if(buf == NULL) {
-        OUT_OF_MEMORY
-      }
-      memset(buf, 0, size);
-      snprintf((char *)buf, size, "%.*f", dec, (double)x);
 #ifdef DEBUG
-      printf("\tround = %f\n", atof(buf));
+      printf("\tround = %f\n", (double)number_round(x, dec));
 #endif
-      rules_pushfloat(atof(buf));
-      FREE(buf);
+      rules_pushfloat(number_round(x, dec));
     } else {
 #ifdef DEBUG
       printf("\tround = %d\n", (int)roundf(x));
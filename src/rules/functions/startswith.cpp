@@ -0,0 +1,69 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifdef ESP8266
+  #pragma GCC diagnostic warning "-fpermissive"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../../common/uint32float.h"
+#include "../../common/log.h"
+#include "../function.h"
+#include "../rules.h"
+
+int8_t rule_function_startswith_callback(void) {
+  const char *a = NULL, *b = NULL;
+  uint16_t len1 = 0, len2 = 0;
+  uint8_t nr = rules_gettop(), y = 0, isnull = 0, ret = 0;
+
+  if(nr != 2) {
+    logerror_P(F("ERROR: startswith takes two arguments"));
+    rules_pop(nr);
+    rules_pushnil();
+    return -1;
+  }
+
+  for(y=1;y<=nr;y++) {
+    switch(rules_type(y)) {
+      case VNULL: {
+        isnull = 1;
+      } break;
+      case VCHAR: {
+      } break;
+      default: {
+        logerror_P(F("ERROR: startswith only takes strings"));
+        rules_pop(nr);
+        rules_pushnil();
+        return -1;
+      } break;
+    }
+  }
+
+  if(isnull == 0) {
+    a = rules_tolstring(1, &len1);
+    b = rules_tolstring(2, &len2);
+    ret = (len2 <= len1 && memcmp(a, b, len2) == 0);
+  }
+
+  rules_pop(nr);
+
+  if(isnull == 1) {
+    rules_pushnil();
+  } else {
+#ifdef DEBUG
+    printf("\tstartswith = %d\n", ret);
+#endif
+    rules_pushinteger(ret);
+  }
+
+  return 0;
+}
@@ -0,0 +1,28 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifdef ESP8266
+  #pragma GCC diagnostic warning "-fpermissive"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../../common/uint32float.h"
+#include "../../common/log.h"
+#include "../function.h"
+#include "../rules.h"
+
+int rule_function_strlen(const char *str) {
+#ifdef DEBUG
+  printf("\tstrlen = %d\n", (int)strlen(str));
+#endif
+  return strlen(str);
+}
@@ -0,0 +1,104 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifdef ESP8266
+  #pragma GCC diagnostic warning "-fpermissive"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../../common/uint32float.h"
+#include "../../common/log.h"
+#include "../function.h"
+#include "../rules.h"
+
+/*
+ * The result points into the original string,
+ * so taking a part of a string does not copy it.
+ */
+int8_t rule_function_substr_callback(void) {
+  int x = 0, start = 0, len = UINT16_MAX;
+  uint16_t size = 0;
+  uint8_t nr = rules_gettop(), y = 0, isnull = 0;
+
+  if(nr < 2 || nr > 3) {
+    logerror_P(F("ERROR: substr takes two or three arguments"));
+    rules_pop(nr);
+    rules_pushnil();
+    return -1;
+  }
+
+  for(y=2;y<=nr;y++) {
+    switch(rules_type(y)) {
+      case VNULL: {
+        isnull = 1;
+      } break;
+      case VINTEGER: {
+        x = rules_tointeger(y);
+      } break;
+      case VFLOAT: {
+        x = (int)rules_tofloat(y);
+      } break;
+      default: {
+        logerror_P(F("ERROR: substr start and length can only be numbers"));
+        rules_pop(nr);
+        rules_pushnil();
+        return -1;
+      } break;
+    }
+    if(y == 2) {
+      start = x;
+    } else {
+      len = x;
+    }
+  }
+
+  switch(rules_type(1)) {
+    case VNULL: {
+      isnull = 1;
+    } break;
+    case VCHAR: {
+      rules_tolstring(1, &size);
+    } break;
+    default: {
+      logerror_P(F("ERROR: substr 1st argument can only be a string"));
+      rules_pop(nr);
+      rules_pushnil();
+      return -1;
+    } break;
+  }
+
+  if(isnull == 1) {
+    rules_pop(nr);
+    rules_pushnil();
+    return 0;
+  }
+
+  if(start < 0) {
+    start = MAX(size+start, 0);
+  }
+  start = MIN(start, size);
+  len = MIN(MAX(len, 0), size-start);
+
+#ifdef DEBUG
+  printf("\tsubstr = %d %d\n", start, len);
+#endif
+
+  /*
+   * The string itself is kept until its
+   * substring is pushed on top of it.
+   */
+  rules_pop(nr-1);
+  rules_pushsubstring(1, start, len);
+  rules_remove(1);
+
+  return 0;
+}
@@ -34,12 +34,13 @@
 #include "../common/log.h"
 #include "../common/uint32float.h"
 #include "../common/strnicmp.h"
+#include "../common/number.h"
 #include "rules.h"
 #include "operator.h"
 #include "function.h"
 
 #define EPSILON 0.000001f
-#define JMPSIZE 37
+#define JMPSIZE 43
 
 #if (!defined(NON32XFER_HANDLER) && defined(MMU_SEC_HEAP)) || defined(COVERALLS)
   #define getval(a) \
@@ -70,11 +71,38 @@ typedef struct vm_top_t {
   int8_t c;
 } __attribute__((aligned(4))) vm_top_t;
 
+#define VARSTACK_HASH_SIZE 16
+#define VARSTACK_CHUNK_SIZE 512
+#define VARSTACK_BUILDER_SIZE 64
+#define VARSTACK_FULL UINT16_MAX
+#define VARSTACK_BUILDER_FULL -2
+
+/*
+ * The varstack strings are stored in fixed
+ * size chunks so their addresses stay stable
+ * while the chunk list grows.
+ */
+typedef struct varstack_chunk_t {
+  char *buffer;
+  uint16_t size;
+  uint16_t used;
+  uint16_t live;
+} varstack_chunk_t;
+
+/*
+ * The group bits of a varstack slot type
+ * are used as flags.
+ */
+#define VARSTACK_EXTERNAL 0x20
+#define VARSTACK_RELEASED 0x40
+#define VARSTACK_PINNED 0x80
+
 typedef struct vm_vchar_t {
   uint8_t type;
   uint8_t fixed;
-  uint8_t len;
   uint8_t ref;
+  uint16_t len;
+  uint16_t next;
   char *value;
 #if defined(ESP8266) || defined(ESP32)
 } __attribute__((packed, aligned(4))) vm_vchar_t;
@@ -101,6 +129,37 @@ typedef struct vm_vfloat_t {
   uint8_t value[3];
 } __attribute__((aligned(4))) vm_vfloat_t;
 
+/*
+ * The read set of a rule holds the handles of
+ * the unbound variables it reads, in ascending
+ * order, and the values fetched for them. The
+ * write set has room for the assignments that
+ * are delivered when the rule is done, in the
+ * order they were first made.
+ */
+typedef struct rule_set_t {
+  uint16_t *handles;
+  struct rule_value_t *values;
+  uint8_t nr;
+  uint8_t used;
+} rule_set_t;
+
+/*
+ * The last arguments and result of a call to a
+ * pure or per run function, as they are encoded
+ * on the stack and the heap. An entry is valid
+ * for the run it was stored in, entries of pure
+ * functions for every run after that too.
+ */
+typedef struct rule_memo_t {
+  unsigned char *args;
+  uint32_t run;
+  uint16_t pos;
+  uint8_t fn;
+  uint8_t nr;
+  unsigned char result[4];
+} rule_memo_t;
+
 static void *jmptbl[JMPSIZE] = { NULL };
 
 /*
@@ -176,7 +235,13 @@ struct {
   "OP_PUSH",
   "OP_CALL",
   "OP_CLEAR",
-  "OP_RET"
+  "OP_RET",
+  "OP_MAX",
+  "OP_MIN",
+  "OP_FLOOR",
+  "OP_CEIL",
+  "OP_ROUND",
+  "OP_COALESCE"
 };
 #endif
 
@@ -210,6 +275,28 @@ typedef struct rule_timer_t {
 
 static struct rule_stack_t *varstack = NULL;
 static struct rule_stack_t *stack = NULL;
+static uint16_t stack_capacity = 0;
+static uint16_t *varstack_hash = NULL;
+static uint16_t varstack_hashsize = 0;
+static uint16_t *varstack_freelist = NULL;
+static uint16_t varstack_nrfree = 0;
+static uint16_t varstack_freesize = 0;
+static uint16_t varstack_capacity = 0;
+static struct varstack_chunk_t *varstack_chunks = NULL;
+static uint16_t varstack_nrchunks = 0;
+static int16_t varstack_builder = -1;
+static uint16_t varstack_builder_start = 0;
+static uint16_t varstack_builder_len = 0;
+static uint8_t varstack_noalloc = 0;
+static struct rule_value_t **varstack_binds = NULL;
+static uint16_t varstack_nrbinds = 0;
+static uint8_t vm_written[(INT8_MAX+1)/8];
+static uint8_t vm_dirty[(INT8_MAX+1)/8];
+static struct rule_value_t *varstack_shadows = NULL;
+static uint16_t varstack_nrshadows = 0;
+static uint8_t varstack_shadowing = 0;
+static uint32_t vm_runs = 0;
+static struct rules_t *vm_obj = NULL;
 static struct rule_timer_t timestamp;
 
 static uint8_t group = 1;
@@ -218,6 +305,11 @@ static uint8_t group = 1;
   // return (p + b) - ((p + b) % b);
 // }
 
+/*
+ * Floats keep 19 of their 24 significant bits
+ */
+#define VFLOAT_BITS 19
+
 // Veltkamp-Dekker algorithm
 static float float32to27(float f) {
   uint8_t bits = 5; // remove 8 bits
@@ -327,6 +419,20 @@ static int8_t lexer_parse_number(char *text, uint16_t len, uint16_t *pos) {
   }
 }
 
+static float lexer_number(char **text, uint16_t start, uint16_t len) {
+  struct number_parser_t parser;
+  uint16_t x = 0;
+
+  number_parse_begin(&parser);
+  for(x=0;x<len;x++) {
+    if(number_parse_char(&parser, getval((*text)[start+x])) == 0) {
+      break;
+    }
+  }
+
+  return number_parse_end(&parser);
+}
+
 static uint16_t lexer_parse_string(char *text, uint16_t len, uint16_t *pos) {
   if(*pos >= len) {
     return 0;
@@ -506,7 +612,7 @@ static int16_t lexer_peek(char **text, uint16_t skip, uint8_t *type, uint16_t *s
       } break;
       /* LCOV_EXCL_START*/
       default: {
-        logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+        logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
         return -1;
       } break;
       /* LCOV_EXCL_STOP*/
@@ -518,87 +624,408 @@ static int16_t lexer_peek(char **text, uint16_t skip, uint8_t *type, uint16_t *s
   return -1;
 }
 
-static int32_t varstack_find(char **text, uint16_t start, uint16_t len) {
-  uint32_t a = varstack->nrbytes;
-  uint32_t i = 0, x = 0;
+/*
+ * Strings are bump allocated in the first chunk
+ * with enough room. A chunk is reset as soon as
+ * its last string is released and the tail is
+ * rolled back when the last allocated string is
+ * released.
+ */
+static uint16_t varstack_chunk(uint16_t size) {
+  uint16_t i = varstack_nrchunks;
 
-  for(i=0;i<a;i++) {
-    if(gettype(varstack->buffer[i]) == VCHAR) {
-      struct vm_vchar_t *old = (struct vm_vchar_t *)&varstack->buffer[i];
-      if(len == old->len) {
-        for(x=0;x<len;x++) {
-          if(getval(old->value[x]) != getval((*text)[start+x])) {
-            break;
-          }
-        }
-        if(x == old->len) {
-          return i;
-        }
+  if((varstack_chunks = (struct varstack_chunk_t *)REALLOC(varstack_chunks, sizeof(struct varstack_chunk_t)*(varstack_nrchunks+1))) == NULL) {
+    OUT_OF_MEMORY
+  }
+  varstack_chunks[i].size = MAX(size, VARSTACK_CHUNK_SIZE);
+  if((varstack_chunks[i].buffer = (char *)MALLOC(varstack_chunks[i].size)) == NULL) {
+    OUT_OF_MEMORY
+  }
+  varstack_chunks[i].used = 0;
+  varstack_chunks[i].live = 0;
+  varstack_nrchunks++;
+
+  return i;
+}
+
+static char *varstack_alloc(uint16_t size, uint8_t fixed) {
+  uint16_t i = 0;
+  char *ret = NULL;
+
+  for(i=0;i<varstack_nrchunks;i++) {
+    if(varstack_chunks[i].used+size <= varstack_chunks[i].size) {
+      break;
+    }
+  }
+
+  /*
+   * Strings larger than a chunk get
+   * a dedicated chunk.
+   */
+  if(i == varstack_nrchunks) {
+    if(fixed == 0 && varstack_noalloc == 1) {
+      return NULL;
+    }
+    i = varstack_chunk(size);
+  }
+
+  ret = &varstack_chunks[i].buffer[varstack_chunks[i].used];
+  varstack_chunks[i].used += size;
+  varstack_chunks[i].live++;
+
+  return ret;
+}
+
+static void varstack_dealloc(char *ptr, uint16_t size) {
+  uint16_t i = 0;
+
+  for(i=0;i<varstack_nrchunks;i++) {
+    struct varstack_chunk_t *chunk = &varstack_chunks[i];
+    if(ptr >= chunk->buffer && ptr < &chunk->buffer[chunk->size]) {
+      chunk->live--;
+      if(chunk->live == 0) {
+        chunk->used = 0;
+      } else if(&ptr[size] == &chunk->buffer[chunk->used]) {
+        chunk->used -= size;
       }
-      i += sizeof(struct vm_vchar_t)-1;
+      return;
     }
   }
-  return -1;
 }
 
-static uint16_t varstack_add(char **text, uint16_t start, uint16_t len, uint8_t fixed) {
-  uint16_t a = varstack->nrbytes;
-  int32_t i = -1;
+/*
+ * The slots grow geometrically, while the
+ * bufsize keeps track of the slots handed out.
+ * The free list grows along, so releasing a
+ * slot never has to allocate.
+ */
+static void varstack_reserve(uint16_t size) {
+  uint16_t capacity = varstack_capacity, nr = 0;
 
-  struct vm_vchar_t *value = (struct vm_vchar_t *)&varstack->buffer[a];
+  if(size <= capacity) {
+    return;
+  }
+  while(capacity < size) {
+    capacity = MIN(MAX(capacity*2, (int)sizeof(struct vm_vchar_t)*4), UINT16_MAX);
+  }
+
+  if((varstack->buffer = (unsigned char *)REALLOC(varstack->buffer, capacity)) == NULL) {
+    OUT_OF_MEMORY
+  }
+  memset(&varstack->buffer[varstack_capacity], 0, capacity-varstack_capacity);
+  varstack_capacity = capacity;
+
+  nr = capacity/sizeof(struct vm_vchar_t);
+  if(nr > varstack_freesize) {
+    if((varstack_freelist = (uint16_t *)REALLOC(varstack_freelist, sizeof(uint16_t)*nr)) == NULL) {
+      OUT_OF_MEMORY
+    }
+    varstack_freesize = nr;
+  }
+}
+
+/*
+ * The varstack strings are indexed by a hash
+ * table. Each bucket holds the first slot of a
+ * chain linked through the next member of the
+ * slots, stored as slot index + 1 so zero can
+ * be used as the end of the chain. Slots that
+ * can be reused are kept in a free list.
+ */
+static uint16_t varstack_slot_hash(const char *text, uint16_t len) {
+  uint32_t hash = 2166136261UL;
+  uint16_t x = 0;
+
+  for(x=0;x<len;x++) {
+    uint8_t c = (uint8_t)getval(text[x]);
+    if(c == 127) {
+      c = 9;
+    } else if(c == 128) {
+      c = 10;
+    }
+    hash ^= c;
+    hash *= 16777619UL;
+  }
+
+  return (uint16_t)(hash ^ (hash >> 16));
+}
+
+static void varstack_link(uint16_t idx) {
+  struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[idx*sizeof(struct vm_vchar_t)];
+  uint16_t bucket = varstack_slot_hash(node->value, getval(node->len)) & (varstack_hashsize-1);
+
+  node->next = varstack_hash[bucket];
+  varstack_hash[bucket] = idx+1;
+}
+
+static void varstack_unlink(uint16_t idx) {
+  struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[idx*sizeof(struct vm_vchar_t)];
+  uint16_t bucket = varstack_slot_hash(node->value, getval(node->len)) & (varstack_hashsize-1);
+  uint16_t *link = &varstack_hash[bucket];
+
+  while(*link > 0) {
+    if(*link == idx+1) {
+      *link = node->next;
+      break;
+    }
+    link = &((struct vm_vchar_t *)&varstack->buffer[((*link)-1)*sizeof(struct vm_vchar_t)])->next;
+  }
+  node->next = 0;
+}
+
+static void varstack_rehash(uint16_t size) {
+  uint16_t nr = varstack->nrbytes/sizeof(struct vm_vchar_t), i = 0;
+
+  if((varstack_hash = (uint16_t *)REALLOC(varstack_hash, sizeof(uint16_t)*size)) == NULL) {
+    OUT_OF_MEMORY
+  }
+  memset(varstack_hash, 0, sizeof(uint16_t)*size);
+  varstack_hashsize = size;
+
+  for(i=0;i<nr;i++) {
+    struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[i*sizeof(struct vm_vchar_t)];
+    if((getval(node->type) & VARSTACK_EXTERNAL) == VARSTACK_EXTERNAL) {
+      continue;
+    }
+    node->next = 0;
+    if(node->value != NULL) {
+      varstack_link(i);
+    }
+  }
+}
+
+static void varstack_release(uint16_t idx) {
+  struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[idx*sizeof(struct vm_vchar_t)];
+
+  if((getval(node->type) & VARSTACK_RELEASED) == 0) {
+    varstack_freelist[varstack_nrfree++] = idx;
+    setval(node->type, getval(node->type) | VARSTACK_RELEASED);
+  }
+}
+
+/*
+ * Drop the string of a slot that is about to
+ * be reused or that is no longer referenced.
+ * A view gives back the reference it holds
+ * on the string it points into.
+ */
+static void varstack_drop(uint16_t idx) {
+  struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[idx*sizeof(struct vm_vchar_t)];
+  uint16_t parent = 0;
+
+  if(node->value == NULL) {
+    return;
+  }
+  if((getval(node->type) & VARSTACK_EXTERNAL) == 0) {
+    varstack_unlink(idx);
+    varstack_dealloc(node->value, getval(node->len)+1);
+#if defined(DEBUG) || defined(COVERALLS)
+    memused -= getval(node->len)+1;
+#endif
+  } else {
+    parent = node->next;
+    node->next = 0;
+  }
+  node->value = NULL;
+  setval(node->len, 0);
+  setval(node->type, VCHAR | (getval(node->type) & VARSTACK_RELEASED));
+
+  if(parent > 0) {
+    node = (struct vm_vchar_t *)&varstack->buffer[(parent-1)*sizeof(struct vm_vchar_t)];
+    setval(node->ref, getval(node->ref)-1);
+    if(getval(node->ref) == 0) {
+      setval(node->type, getval(node->type) & ~VARSTACK_PINNED);
+      if(getval(node->fixed) == 0) {
+        varstack_drop(parent-1);
+        varstack_release(parent-1);
+      }
+    }
+  }
+}
+
+static uint8_t varstack_inbuffer(struct rule_stack_t *buffer, uint16_t idx) {
+  uint16_t i = 0;
+
+  for(i=4;i<getval(buffer->nrbytes);i+=rule_max_var_bytes()) {
+    if(gettype(buffer->buffer[i]) == VPTR) {
+      struct vm_vptr_t *node = (struct vm_vptr_t *)&buffer->buffer[i];
+      if(getval(node->value)*sizeof(struct vm_top_t) == idx*sizeof(struct vm_vchar_t)) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * A string is in use when it's on the stack or
+ * in the heap of the running rule, or of one of
+ * the rules that called it through an event.
+ */
+static uint8_t varstack_inuse(uint16_t idx) {
+  struct rules_t *obj = NULL;
+
+  if(stack != NULL && varstack_inbuffer(stack, idx) == 1) {
+    return 1;
+  }
+  for(obj=vm_obj;obj!=NULL;obj=obj->ctx.ret) {
+    if(varstack_inbuffer(obj->heap, idx) == 1) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Slots on the free list are validated
+ * when they are taken, because they can
+ * be referenced again in the meantime.
+ * Unreferenced strings that are still in
+ * use by a running rule are skipped. Without allocations
+ * VARSTACK_FULL is returned when the reserved
+ * slots are all in use.
+ */
+static uint16_t varstack_slot(uint8_t fixed) {
+  uint16_t a = varstack->nrbytes, idx = 0, i = varstack_nrfree;
 
 #ifdef DEBUG
   assert(a/sizeof(struct vm_vchar_t *)/2 <= 127);
 #endif
 
-  i = varstack_find(text, start, len);
+  while(fixed == 0 && i > 0) {
+    idx = varstack_freelist[--i];
+    struct vm_vchar_t *old = (struct vm_vchar_t *)&varstack->buffer[idx*sizeof(struct vm_vchar_t)];
+    if(getval(old->fixed) == 0 && getval(old->ref) == 0 && varstack_inuse(idx) == 1) {
+      continue;
+    }
+    varstack_freelist[i] = varstack_freelist[--varstack_nrfree];
+    setval(old->type, getval(old->type) & ~VARSTACK_RELEASED);
+    if(getval(old->fixed) == 0 && getval(old->ref) == 0) {
+      varstack_drop(idx);
+      return idx*sizeof(struct vm_vchar_t);
+    }
+  }
 
-  if(i > -1) {
-    return i;
+  if(a+sizeof(struct vm_vchar_t) > varstack->bufsize) {
+    if(fixed == 0 && varstack_noalloc == 1 &&
+      varstack->bufsize+sizeof(struct vm_vchar_t) > varstack_capacity) {
+      return VARSTACK_FULL;
+    }
+    varstack_reserve(varstack->bufsize+sizeof(struct vm_vchar_t));
+    varstack->bufsize += sizeof(struct vm_vchar_t);
+
+#if defined(DEBUG) || defined(COVERALLS)
+    memused += sizeof(struct vm_vchar_t);
+#endif
   }
+  setval(varstack->nrbytes, a+sizeof(struct vm_vchar_t));
 
-  if(fixed == 0) {
-    for(i=0;i<a;i++) {
-      if(gettype(varstack->buffer[i]) == VCHAR) {
-        struct vm_vchar_t *old = (struct vm_vchar_t *)&varstack->buffer[i];
-        if(getval(old->fixed) == 0 && getval(old->ref) == 0) {
+  return a;
+}
+
+/*
+ * Interned strings are canonical, so two equal
+ * strings always share the same slot. Only host
+ * owned strings are not part of the index and
+ * need their content compared.
+ */
+static uint8_t varstack_equal(uint16_t a, uint16_t b) {
+  if(a == b) {
+    return 1;
+  }
+
+  struct vm_vchar_t *node1 = (struct vm_vchar_t *)&varstack->buffer[a];
+  struct vm_vchar_t *node2 = (struct vm_vchar_t *)&varstack->buffer[b];
+
+  if(((getval(node1->type) | getval(node2->type)) & VARSTACK_EXTERNAL) == 0) {
+    return 0;
+  }
+
+  return getval(node1->len) == getval(node2->len) &&
+    memcmp(node1->value, node2->value, getval(node1->len)) == 0;
+}
+
+static int32_t varstack_find(char **text, uint16_t start, uint16_t len) {
+  uint16_t idx = 0, x = 0;
+
+  if(varstack_hash == NULL) {
+    return -1;
+  }
+
+  idx = varstack_hash[varstack_slot_hash(&(*text)[start], len) & (varstack_hashsize-1)];
+
+  while(idx > 0) {
+    struct vm_vchar_t *old = (struct vm_vchar_t *)&varstack->buffer[(idx-1)*sizeof(struct vm_vchar_t)];
+    if(len == old->len) {
+      for(x=0;x<len;x++) {
+        if(getval(old->value[x]) != getval((*text)[start+x])) {
           break;
         }
-        i += sizeof(struct vm_vchar_t)-1;
+      }
+      if(x == old->len) {
+        return (idx-1)*sizeof(struct vm_vchar_t);
       }
     }
-    if(i == a) {
-      i = -1;
-    }
-    if(i > -1) {
-      a = i;
-      value = (struct vm_vchar_t *)&varstack->buffer[a];
-    }
+    idx = old->next;
   }
-  if(i == -1) {
-    if(a+sizeof(struct vm_vchar_t) > varstack->bufsize) {
-      void *oldptr = (void *)varstack->buffer;
+  return -1;
+}
 
-      if((varstack->buffer = (unsigned char *)REALLOC(varstack->buffer, varstack->bufsize+sizeof(struct vm_vchar_t))) == NULL) {
-        OUT_OF_MEMORY
-      }
-      memset(&varstack->buffer[varstack->bufsize], 0, sizeof(struct vm_vchar_t));
-      varstack->bufsize += sizeof(struct vm_vchar_t);
+/*
+ * Makes a slot with a freshly stored
+ * string part of the hash index.
+ */
+static void varstack_intern(uint16_t a, uint16_t len, uint8_t fixed) {
+  struct vm_vchar_t *value = (struct vm_vchar_t *)&varstack->buffer[a];
+
+  setval(value->type, VCHAR);
+  setval(value->len, len);
+  setval(value->ref, 0);
+  setval(value->fixed, fixed);
+  value->next = 0;
 
 #if defined(DEBUG) || defined(COVERALLS)
-      memused += sizeof(struct vm_vchar_t);
+  memused += len+1;
 #endif
 
-      if(varstack->buffer != oldptr) {
-        value = (struct vm_vchar_t *)&varstack->buffer[a];
-      }
+  if(varstack_hashsize == 0 || (varstack_noalloc == 0 &&
+    varstack->nrbytes/sizeof(struct vm_vchar_t) > varstack_hashsize)) {
+    varstack_rehash(MAX(varstack_hashsize*2, VARSTACK_HASH_SIZE));
+  } else {
+    varstack_link(a/sizeof(struct vm_vchar_t));
+  }
+  if(fixed == 0) {
+    varstack_release(a/sizeof(struct vm_vchar_t));
+  }
+}
+
+static uint16_t varstack_add(char **text, uint16_t start, uint16_t len, uint8_t fixed) {
+  int32_t i = varstack_find(text, start, len);
+  uint16_t a = 0;
+
+  if(i > -1) {
+    /*
+     * A constant can match a string that was
+     * pinned before the rules were parsed.
+     */
+    if(fixed == 1) {
+      setval(((struct vm_vchar_t *)&varstack->buffer[i])->fixed, 1);
     }
+    return i;
+  }
+
+  if((a = varstack_slot(fixed)) == VARSTACK_FULL) {
+    return VARSTACK_FULL;
   }
 
-  if((value->value = (char *)MALLOC(len+1)) == NULL) {
-    OUT_OF_MEMORY;
+  struct vm_vchar_t *value = (struct vm_vchar_t *)&varstack->buffer[a];
+
+  if((value->value = varstack_alloc(len+1, fixed)) == NULL) {
+    setval(value->type, VCHAR);
+    varstack_release(a/sizeof(struct vm_vchar_t));
+    return VARSTACK_FULL;
   }
-  memset(value->value, 0, len+1);
+
   for(uint16_t x=0;x<len;x++) {
     if(((uint8_t)getval((*text)[start+x])) == 127) {
       setval(value->value[x], 9);
@@ -609,17 +1036,78 @@ static uint16_t varstack_add(char **text, uint16_t start, uint16_t len, uint8_t
     }
   }
   setval(value->value[len], 0);
-  setval(value->type, VCHAR);
+
+  varstack_intern(a, len, fixed);
+
+  return a;
+}
+
+/*
+ * A view is a slot pointing into the string of
+ * another slot, so a slice can be passed around
+ * without being copied. Views are not part of the
+ * hash index and hold a reference on their parent,
+ * also when it is a constant, whose handle is kept
+ * in the otherwise unused next field. A view of a view points into the
+ * original string.
+ */
+static uint16_t varstack_add_view(uint16_t parent, uint16_t offset, uint16_t len) {
+  struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[parent];
+
+  if((getval(node->type) & VARSTACK_EXTERNAL) == VARSTACK_EXTERNAL && node->next > 0) {
+    uint16_t p = (node->next-1)*sizeof(struct vm_vchar_t);
+    offset += node->value-((struct vm_vchar_t *)&varstack->buffer[p])->value;
+    parent = p;
+    node = (struct vm_vchar_t *)&varstack->buffer[parent];
+  }
+
+  setval(node->ref, getval(node->ref)+1);
+
+  uint16_t a = varstack_slot(0);
+
+  node = (struct vm_vchar_t *)&varstack->buffer[parent];
+  if(a == VARSTACK_FULL) {
+    setval(node->ref, getval(node->ref)-1);
+    return VARSTACK_FULL;
+  }
+
+  struct vm_vchar_t *value = (struct vm_vchar_t *)&varstack->buffer[a];
+
+  value->value = &node->value[offset];
+  setval(value->type, VCHAR | VARSTACK_EXTERNAL);
   setval(value->len, len);
   setval(value->ref, 0);
-  setval(value->fixed, fixed);
-  if(i == -1) {
-    setval(varstack->nrbytes, a+sizeof(struct vm_vchar_t));
+  setval(value->fixed, 0);
+  value->next = (parent/sizeof(struct vm_vchar_t))+1;
+
+  varstack_release(a/sizeof(struct vm_vchar_t));
+
+  return a;
+}
+
+/*
+ * External strings are owned by the host and
+ * are not copied. They are not part of the
+ * hash index, so they are never returned for
+ * strings that are interned later on.
+ */
+static uint16_t varstack_add_external(const char *str, uint16_t len) {
+  uint16_t a = varstack_slot(0);
+
+  if(a == VARSTACK_FULL) {
+    return VARSTACK_FULL;
   }
 
-#if defined(DEBUG) || defined(COVERALLS)
-  memused += len+1;
-#endif
+  struct vm_vchar_t *value = (struct vm_vchar_t *)&varstack->buffer[a];
+
+  value->value = (char *)str;
+  setval(value->type, VCHAR | VARSTACK_EXTERNAL);
+  setval(value->len, len);
+  setval(value->ref, 0);
+  setval(value->fixed, 0);
+  value->next = 0;
+
+  varstack_release(a/sizeof(struct vm_vchar_t));
 
   return a;
 }
@@ -652,17 +1140,17 @@ static int8_t rule_prepare(char **text,
         if(ret == -1) {
           if((*len - pos) > 5) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("ERROR: no ending quotes found for '%.5s...'"), &(*text)[s]);
+            logerror_P(F("ERROR: no ending quotes found for '%.5s...'"), &(*text)[s]);
             /* LCOV_EXCL_STOP*/
           } else {
-            logprintf_P(F("ERROR: no ending quotes found for '%.5s'"), &(*text)[s]);
+            logerror_P(F("ERROR: no ending quotes found for '%.5s'"), &(*text)[s]);
           }
         } else if(ret == -2) {
           if((*len - pos) > 5) {
-            logprintf_P(F("ERROR: found invalid ASCII at '%.5s...'"), &(*text)[s]);
+            logerror_P(F("ERROR: found invalid ASCII at '%.5s...'"), &(*text)[s]);
           } else {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("ERROR: found invalid ASCII at '%.5s'"), &(*text)[s]);
+            logerror_P(F("ERROR: found invalid ASCII at '%.5s'"), &(*text)[s]);
             /* LCOV_EXCL_STOP*/
           }
         }
@@ -748,9 +1236,9 @@ static int8_t rule_prepare(char **text,
         /* LCOV_EXCL_START*/
         /* FIXME */
         if((*len - pos) > 5) {
-          logprintf_P(F("ERROR: event arguments can only contain variables at '%.5s...'"), &(*text)[pos]);
+          logerror_P(F("ERROR: event arguments can only contain variables at '%.5s...'"), &(*text)[pos]);
         } else {
-          logprintf_P(F("ERROR: event arguments can only contain variables at '%.5s'"), &(*text)[pos]);
+          logerror_P(F("ERROR: event arguments can only contain variables at '%.5s'"), &(*text)[pos]);
         }
         /* LCOV_EXCL_STOP*/
         return -1;
@@ -766,16 +1254,7 @@ static int8_t rule_prepare(char **text,
       float var = 0;
       tmp = getval((*text)[pos+newlen]);
       setval((*text)[pos+newlen], 0);
-      char *cpy = (char *)MALLOC(newlen+1);
-      if(cpy == NULL) {
-        OUT_OF_MEMORY;
-      }
-      memset(cpy, 0, newlen+1);
-      for(uint16_t x=0;x<newlen;x++) {
-        cpy[x] = getval((*text)[pos+x]);
-      }
-      var = atof(cpy);
-      FREE(cpy);
+      var = lexer_number(text, pos, newlen);
 
       float nr = 0;
       {
@@ -817,21 +1296,7 @@ static int8_t rule_prepare(char **text,
               case TNUMBER1:
               case TNUMBER2:
               case TNUMBER3: {
-                char tmp = 0;
-                float var1 = 0;
-                tmp = getval((*text)[start+1+len]);
-                setval((*text)[start+1+len], 0);
-                char *cpy = (char *)MALLOC(len + 1);
-                if(cpy == NULL) {
-                  OUT_OF_MEMORY;
-                }
-                memset(cpy, 0, len+1);
-                for(uint16_t x=0;x<len;x++) {
-                  cpy[x] = getval((*text)[start+1+x]);
-                }
-                var1 = atof(cpy);
-                FREE(cpy);
-                setval((*text)[start+1+len], tmp);
+                float var1 = lexer_number(text, start+1, len);
 
                 if(modff(var1, &nr) == 0) {
                   if(var == (int32_t)var1) {
@@ -845,7 +1310,7 @@ static int8_t rule_prepare(char **text,
               } break;
               /* LCOV_EXCL_START*/
               default: {
-                logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+                logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
                 return -1;
               } break;
               /* LCOV_EXCL_STOP*/
@@ -907,7 +1372,7 @@ static int8_t rule_prepare(char **text,
           setval((*text)[tpos], VINTEGER); tpos++;
           x = (uint32_t)var;
           if((var < 0 && var < -8388608) || (var > 0 && var > 16777215)) {
-            logprintf_P(F("FATAL: Integer %g is out of range"), __FUNCTION__, __LINE__, (double)var);
+            logfatal_P(F("FATAL: Integer %g is out of range"), (double)var);
             return -1;
           }
         } else {
@@ -992,7 +1457,7 @@ static int8_t rule_prepare(char **text,
       lexer_parse_string((*text), *len, &pos);
 
       if(ctx == TCEVENT || ctx == TTHEN) {
-        logprintf_P(F("ERROR: nested 'on' block"));
+        logerror_P(F("ERROR: nested 'on' block"));
         return -1;
       }
 
@@ -1050,7 +1515,8 @@ static int8_t rule_prepare(char **text,
       setval((*text)[tpos], TTHEN); tpos++;
       ctx = TTHEN;
     } else if(tolower(current) == 'e' && tolower(next) == 'n' &&
-              pos+1 < *len && tolower(getval((*text)[pos+2])) == 'd') {
+              pos+1 < *len && tolower(getval((*text)[pos+2])) == 'd' &&
+              (pos+3 >= *len || !isalnum((unsigned char)getval((*text)[pos+3])))) {
       nrtokens++;
       pos+=3;
       nrblocks--;
@@ -1107,9 +1573,9 @@ static int8_t rule_prepare(char **text,
         /* LCOV_EXCL_START*/
         /* FIXME */
         if((*len - pos) > 5) {
-          logprintf_P(F("ERROR: missing matching '(' at '%.5s...'"), &(*text)[pos]);
+          logerror_P(F("ERROR: missing matching '(' at '%.5s...'"), &(*text)[pos]);
         } else {
-          logprintf_P(F("ERROR: missing matching '(' at '%.5s'"), &(*text)[pos]);
+          logerror_P(F("ERROR: missing matching '(' at '%.5s'"), &(*text)[pos]);
         }
         /* LCOV_EXCL_STOP*/
         return -1;
@@ -1354,9 +1820,9 @@ static int8_t rule_prepare(char **text,
         }
       } else {
         if((*len - pos) > 5) {
-          logprintf_P(F("ERROR: unknown token '%.5s...'"), &(*text)[pos]);
+          logerror_P(F("ERROR: unknown token '%.5s...'"), &(*text)[pos]);
         } else {
-          logprintf_P(F("ERROR: unknown token '%.5s'"), &(*text)[pos]);
+          logerror_P(F("ERROR: unknown token '%.5s'"), &(*text)[pos]);
         }
         FREE(cpy);
         return -1;
@@ -1368,7 +1834,7 @@ static int8_t rule_prepare(char **text,
       if(nrhooks > 0) {
         /* LCOV_EXCL_START*/
         /* FIXME */
-        logprintf_P(F("ERROR: missing matching ')'"), &(*text)[pos]);
+        logerror_P(F("ERROR: missing matching ')'"), &(*text)[pos]);
         /* LCOV_EXCL_STOP*/
         return -1;
       }
@@ -1400,7 +1866,7 @@ static int8_t rule_prepare(char **text,
   if(nrhooks > 0) {
     /* LCOV_EXCL_START*/
     /* FIXME */
-    logprintf_P(F("ERROR: missing matching ')'"), &(*text)[pos]);
+    logerror_P(F("ERROR: missing matching ')'"), &(*text)[pos]);
     return -1;
     /* LCOV_EXCL_STOP*/
   }
@@ -1414,21 +1880,51 @@ static int8_t rule_prepare(char **text,
   return 0;
 }
 
-static uint32_t vm_stack_push(uint16_t pos, unsigned char *in) {
-  uint8_t type = 0, i = 0;
-  uint16_t size = 0, ret = 0;
+/*
+ * Reserves a cleared value on top of the stack, so
+ * values are written in place instead of being
+ * composed in a temporary buffer first.
+ */
+static unsigned char *vm_stack_alloc(void) {
+  uint16_t size = 0, ret = 0, i = 0;
 
   ret = getval(stack->nrbytes);
+  size = ret+rule_max_var_bytes();
 
-  type = gettype(in[0]);
+  if(size > stack_capacity) {
+    /* LCOV_EXCL_START*/
+    logfatal_P(F("FATAL: stack is full"));
+    return NULL;
+    /* LCOV_EXCL_STOP*/
+  }
+
+  setval(stack->nrbytes, size);
+  setval(stack->bufsize, MAX(getval(stack->bufsize), size));
+
+  for(i=ret;i<size;i++) {
+    setval(stack->buffer[i], 0);
+  }
+
+  return &stack->buffer[ret];
+}
+
+static uint32_t vm_stack_push(uint16_t pos, unsigned char *in) {
+  uint8_t type = 0, i = 0;
+  uint16_t ret = 0;
+
+  ret = getval(stack->nrbytes);
+
+  type = gettype(in[0]);
 
 #ifdef DEBUG
   printf("%s %d %d\n", __FUNCTION__, __LINE__, ret);
 #endif
 
-  size = ret+rule_max_var_bytes();
-  setval(stack->nrbytes, size);
-  setval(stack->bufsize, MAX(getval(stack->bufsize), size));
+  if(vm_stack_alloc() == NULL) {
+    /* LCOV_EXCL_START*/
+    return 0;
+    /* LCOV_EXCL_STOP*/
+  }
 
   if(type == VCHAR) {
     struct vm_vptr_t *value = (struct vm_vptr_t *)&stack->buffer[ret];
@@ -1494,32 +1990,24 @@ uint8_t rules_type(int8_t pos) {
 }
 
 void rules_pushnil(void) {
-  unsigned char *val = (unsigned char *)MALLOC(rule_max_var_bytes());
-  if(val == NULL) {
-    OUT_OF_MEMORY
+  struct vm_vnull_t *node = (struct vm_vnull_t *)vm_stack_alloc();
+  if(node == NULL) {
+    return;
   }
-  memset(val, 0, rule_max_var_bytes());
-  struct vm_vnull_t *node = (struct vm_vnull_t *)val;
-  node->type = VNULL;
+  setval(node->type, VNULL);
 
-  vm_stack_push(0, val);
-  FREE(val);
 }
 
 void rules_pushinteger(int nr) {
-  unsigned char *val = (unsigned char *)MALLOC(rule_max_var_bytes());
-  if(val == NULL) {
-    OUT_OF_MEMORY
+  struct vm_vinteger_t *node = (struct vm_vinteger_t *)vm_stack_alloc();
+  if(node == NULL) {
+    return;
   }
-  memset(val, 0, rule_max_var_bytes());
-  struct vm_vinteger_t *node = (struct vm_vinteger_t *)val;
   node->type = VINTEGER;
   setval(node->value[0], ((uint32_t)nr >> 16) & 0xFF);
   setval(node->value[1], ((uint32_t)nr >> 8) & 0xFF);
   setval(node->value[2], ((uint32_t)nr) & 0xFF);
 
-  vm_stack_push(0, val);
-  FREE(val);
 }
 
 void rules_pushfloat(float nr) {
@@ -1527,70 +2015,484 @@ void rules_pushfloat(float nr) {
   uint32_t x = 0;
   float2uint32(f, &x);
 
-  unsigned char *val = (unsigned char *)MALLOC(rule_max_var_bytes());
-  if(val == NULL) {
-    OUT_OF_MEMORY
+  struct vm_vfloat_t *node = (struct vm_vfloat_t *)vm_stack_alloc();
+  if(node == NULL) {
+    return;
   }
-  memset(val, 0, rule_max_var_bytes());
-  struct vm_vfloat_t *node = (struct vm_vfloat_t *)val;
 
   setval(node->type, VFLOAT | ((((uint32_t)x >> 29) & 0x7) << 5));
   setval(node->value[0], ((uint32_t)x >> 21) & 0xFF);
   setval(node->value[1], ((uint32_t)x >> 13) & 0xFF);
   setval(node->value[2], ((uint32_t)x >> 5) & 0xFF);
 
-  vm_stack_push(0, val);
-  FREE(val);
+}
+
+void rules_pushlstring(const char *str, uint16_t len) {
+  uint16_t c = varstack_add((char **)&str, 0, MIN(len, UINT16_MAX-1), 0);
+
+  if(c == VARSTACK_FULL) {
+    logerror_P(F("ERROR: string arena is full"));
+    rules_pushnil();
+    return;
+  }
+
+  struct vm_vptr_t *node = (struct vm_vptr_t *)vm_stack_alloc();
+  if(node == NULL) {
+    return;
+  }
+
+  setval(node->type, VPTR);
+  setval(node->value, c/sizeof(struct vm_top_t));
+
 }
 
 void rules_pushstring(char *str) {
-  uint16_t c = varstack_add(&str, 0, strlen(str), 0);
-  assert(c >= 0);
+  rules_pushlstring(str, strlen(str));
+}
 
-  unsigned char *val = (unsigned char *)MALLOC(rule_max_var_bytes());
-  if(val == NULL) {
-    OUT_OF_MEMORY
+void rules_pushstring_ref(const char *str, uint16_t len) {
+  uint16_t c = varstack_add_external(str, MIN(len, UINT16_MAX-1));
+
+  if(c == VARSTACK_FULL) {
+    logerror_P(F("ERROR: string arena is full"));
+    rules_pushnil();
+    return;
+  }
+
+  struct vm_vptr_t *node = (struct vm_vptr_t *)vm_stack_alloc();
+  if(node == NULL) {
+    return;
   }
-  memset(val, 0, rule_max_var_bytes());
-  struct vm_vptr_t *node = (struct vm_vptr_t *)val;
 
   setval(node->type, VPTR);
   setval(node->value, c/sizeof(struct vm_top_t));
 
-  vm_stack_push(0, val);
-  FREE(val);
 }
 
-void rules_ref(const char *str) {
-  int32_t c = varstack_find((char **)&str, 0, strlen(str));
-  if(c == -1) {
+/*
+ * Pushes a part of the string at stack position
+ * pos without copying it. The range is clamped to
+ * the string, the full string is pushed as is.
+ */
+void rules_pushsubstring(int8_t pos, uint16_t start, uint16_t len) {
+  int16_t offset = vm_val_pos(pos);
+  uint16_t c = 0, size = 0;
+
+  if(pos < 0) {
+    offset = getval(stack->nrbytes)-offset;
+  }
+  if(offset < 4 || getval(stack->buffer[offset]) != VPTR) {
+    rules_pushnil();
+    return;
+  }
+
+  c = getval(((struct vm_vptr_t *)&stack->buffer[offset])->value)*sizeof(struct vm_top_t);
+  size = getval(((struct vm_vchar_t *)&varstack->buffer[c])->len);
+
+  start = MIN(start, size);
+  len = MIN(len, size-start);
+
+  if(len == 0) {
+    rules_pushlstring("", 0);
+    return;
+  }
+  if(len < size && (c = varstack_add_view(c, start, len)) == VARSTACK_FULL) {
+    logerror_P(F("ERROR: string arena is full"));
+    rules_pushnil();
+    return;
+  }
+
+  struct vm_vptr_t *node = (struct vm_vptr_t *)vm_stack_alloc();
+  if(node == NULL) {
+    return;
+  }
+
+  setval(node->type, VPTR);
+  setval(node->value, c/sizeof(struct vm_top_t));
+
+}
+
+/*
+ * The string builder writes straight into the free
+ * tail of an arena chunk. The tail is reserved while
+ * building, so other strings can still be pushed in
+ * the meantime. When the result already exists, the
+ * reservation is dropped and the existing string is
+ * pushed instead. Without allocations the builder
+ * falls back to the largest free tail and turns into
+ * VARSTACK_BUILDER_FULL once the string outgrows it.
+ */
+void rules_strbegin(void) {
+  uint16_t i = 0, x = 0;
+
+  rules_strdiscard();
+
+  for(i=0;i<varstack_nrchunks;i++) {
+    if(varstack_chunks[i].size-varstack_chunks[i].used >= VARSTACK_BUILDER_SIZE) {
+      break;
+    }
+    if(varstack_chunks[i].size-varstack_chunks[i].used > varstack_chunks[x].size-varstack_chunks[x].used) {
+      x = i;
+    }
+  }
+  if(i == varstack_nrchunks) {
+    if(varstack_noalloc == 1) {
+      if(varstack_nrchunks == 0 || varstack_chunks[x].used == varstack_chunks[x].size) {
+        varstack_builder = VARSTACK_BUILDER_FULL;
+        return;
+      }
+      i = x;
+    } else {
+      i = varstack_chunk(VARSTACK_CHUNK_SIZE);
+    }
+  }
+
+  varstack_builder = i;
+  varstack_builder_start = varstack_chunks[i].used;
+  varstack_builder_len = 0;
+  varstack_chunks[i].used = varstack_chunks[i].size;
+}
+
+/*
+ * Makes sure there is room for another len bytes
+ * and the NUL terminator, by moving the string
+ * built so far to a larger chunk if needed. Returns
+ * the number of bytes that can be appended.
+ */
+static uint16_t varstack_builder_grow(uint16_t len) {
+  uint32_t need = (uint32_t)varstack_builder_len+len+1;
+  uint16_t i = 0;
+
+  if(varstack_builder == -1) {
+    rules_strbegin();
+  }
+  if(varstack_builder == VARSTACK_BUILDER_FULL) {
+    return 0;
+  }
+
+  if(need > UINT16_MAX) {
+    need = UINT16_MAX;
+  }
+
+  if(varstack_builder_start+need > varstack_chunks[varstack_builder].size) {
+    if(varstack_noalloc == 1) {
+      rules_strdiscard();
+      varstack_builder = VARSTACK_BUILDER_FULL;
+      return 0;
+    }
+    i = varstack_chunk(MIN(need*2, (uint32_t)UINT16_MAX));
+
+    memcpy(varstack_chunks[i].buffer,
+      &varstack_chunks[varstack_builder].buffer[varstack_builder_start],
+      varstack_builder_len);
+
+    varstack_chunks[varstack_builder].used = varstack_builder_start;
+    varstack_builder = i;
+    varstack_builder_start = 0;
+    varstack_chunks[i].used = varstack_chunks[i].size;
+  }
+  return need-varstack_builder_len-1;
+}
+
+void rules_straddstring(const char *str, uint16_t len) {
+  len = varstack_builder_grow(len);
+  if(varstack_builder == VARSTACK_BUILDER_FULL) {
+    return;
+  }
+
+  memcpy(&varstack_chunks[varstack_builder].buffer[varstack_builder_start+varstack_builder_len], str, len);
+  varstack_builder_len += len;
+}
+
+void rules_straddinteger(int nr) {
+  char buf[NUMBER_BUFSIZE];
+  uint8_t len = number_itoa(nr, buf);
+
+  rules_straddstring(buf, len);
+}
+
+/*
+ * Floats are written with the shortest decimal
+ * that reads back as the same rule value.
+ */
+void rules_straddfloat(float nr) {
+  char buf[NUMBER_BUFSIZE];
+  uint8_t len = number_ftoa(nr, VFLOAT_BITS, buf);
+
+  rules_straddstring(buf, len);
+}
+
+void rules_straddvalue(int8_t pos) {
+  switch(rules_type(pos)) {
+    case VNULL: {
+      rules_straddstring("NULL", 4);
+    } break;
+    case VINTEGER: {
+      rules_straddinteger(rules_tointeger(pos));
+    } break;
+    case VFLOAT: {
+      rules_straddfloat(rules_tofloat(pos));
+    } break;
+    case VCHAR: {
+      uint16_t len = 0;
+      const char *str = rules_tolstring(pos, &len);
+      rules_straddstring(str, len);
+    } break;
+  }
+}
+
+/*
+ * Returns the string built so far without
+ * committing it, for results that are only
+ * used by the host like printed messages.
+ */
+const char *rules_strget(uint16_t *len) {
+  char *str = NULL;
+
+  if(varstack_builder == -1) {
+    rules_strbegin();
+  }
+  if(varstack_builder == VARSTACK_BUILDER_FULL) {
+    if(len != NULL) {
+      *len = 0;
+    }
+    return "";
+  }
+
+  str = &varstack_chunks[varstack_builder].buffer[varstack_builder_start];
+  str[varstack_builder_len] = 0;
+  if(len != NULL) {
+    *len = varstack_builder_len;
+  }
+
+  return str;
+}
+
+void rules_strdiscard(void) {
+  if(varstack_builder > -1) {
+    varstack_chunks[varstack_builder].used = varstack_builder_start;
+  }
+  varstack_builder = -1;
+}
+
+void rules_strpush(void) {
+  int32_t i = 0;
+  uint16_t a = 0, len = 0;
+  char *str = NULL;
+
+  str = (char *)rules_strget(&len);
+
+  if(varstack_builder == VARSTACK_BUILDER_FULL) {
+    varstack_builder = -1;
+    logerror_P(F("ERROR: string arena is full"));
+    rules_pushnil();
+    return;
+  }
+
+  if((i = varstack_find(&str, 0, len)) > -1) {
+    varstack_chunks[varstack_builder].used = varstack_builder_start;
+    a = i;
+  } else {
+    if((a = varstack_slot(0)) == VARSTACK_FULL) {
+      rules_strdiscard();
+      logerror_P(F("ERROR: string arena is full"));
+      rules_pushnil();
+      return;
+    }
+
+    /*
+     * Acquiring the slot can release the last string
+     * of the builder chunk, which resets its counters.
+     */
+    struct varstack_chunk_t *chunk = &varstack_chunks[varstack_builder];
+    chunk->used = varstack_builder_start+len+1;
+    chunk->live++;
+
+    ((struct vm_vchar_t *)&varstack->buffer[a])->value = str;
+    varstack_intern(a, len, 0);
+  }
+  varstack_builder = -1;
+
+  struct vm_vptr_t *node = (struct vm_vptr_t *)vm_stack_alloc();
+  if(node == NULL) {
+    return;
+  }
+
+  setval(node->type, VPTR);
+  setval(node->value, a/sizeof(struct vm_top_t));
+
+}
+
+void rules_ref_handle(uint16_t handle) {
+  if(handle == 0 || handle > varstack->nrbytes/sizeof(struct vm_vchar_t)) {
     return;
   }
 
-  struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[c];
+  struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[(handle-1)*sizeof(struct vm_vchar_t)];
   if(getval(node->fixed) == 0) {
     setval(node->ref, getval(node->ref)+1);
   }
 }
 
+void rules_unref_handle(uint16_t handle) {
+  if(handle == 0 || handle > varstack->nrbytes/sizeof(struct vm_vchar_t)) {
+    return;
+  }
+
+  struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[(handle-1)*sizeof(struct vm_vchar_t)];
+  if(getval(node->fixed) == 0 && getval(node->ref) > 0) {
+    setval(node->ref, getval(node->ref)-1);
+    if(getval(node->ref) == 0) {
+      varstack_drop(handle-1);
+      varstack_release(handle-1);
+    }
+  }
+}
+
+/*
+ * A pin is a reference that also survives rules_gc,
+ * so a host can hold on to a string across runs and
+ * rule reloads without copying it.
+ */
+uint16_t rules_pin(int8_t pos) {
+  uint16_t handle = rules_tohandle(pos);
+
+  if(handle == 0) {
+    return 0;
+  }
+
+  struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[(handle-1)*sizeof(struct vm_vchar_t)];
+  setval(node->ref, getval(node->ref)+1);
+  setval(node->type, getval(node->type) | VARSTACK_PINNED);
+
+  return handle;
+}
+
+void rules_unpin(uint16_t handle) {
+  if(varstack == NULL || handle == 0 || handle > varstack->nrbytes/sizeof(struct vm_vchar_t)) {
+    return;
+  }
+
+  struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[(handle-1)*sizeof(struct vm_vchar_t)];
+  if((getval(node->type) & VARSTACK_PINNED) == 0 || getval(node->ref) == 0) {
+    return;
+  }
+  setval(node->ref, getval(node->ref)-1);
+  if(getval(node->ref) == 0) {
+    setval(node->type, getval(node->type) & ~VARSTACK_PINNED);
+    if(getval(node->fixed) == 0) {
+      varstack_drop(handle-1);
+      varstack_release(handle-1);
+    }
+  }
+}
+
+void rules_ref(const char *str) {
+  int32_t c = varstack_find((char **)&str, 0, strlen(str));
+  if(c == -1) {
+    return;
+  }
+  rules_ref_handle((c/sizeof(struct vm_vchar_t))+1);
+}
+
 void rules_unref(const char *str) {
   int32_t c = varstack_find((char **)&str, 0, strlen(str));
   if(c == -1) {
     return;
   }
+  rules_unref_handle((c/sizeof(struct vm_vchar_t))+1);
+}
 
-  struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[c];
-  if(getval(node->fixed) == 0) {
-    setval(node->ref, getval(node->ref)-1);
-    if(getval(node->ref) == 0) {
-      FREE(node->value);
-#if defined(DEBUG) || defined(COVERALLS)
-      memused -= node->len+1;
-#endif
-      node->value = NULL;
-      setval(node->len, 0);
+/*
+ * Views are not terminated and are not canonical,
+ * so a view on the stack is interned as soon as the
+ * host asks for a C string or a handle. When there
+ * is no room left the view is replaced by a nil.
+ */
+static int8_t vm_stack_intern_view(int16_t offset) {
+  struct vm_vptr_t *node = (struct vm_vptr_t *)&stack->buffer[offset];
+  struct vm_vchar_t *var = (struct vm_vchar_t *)&varstack->buffer[getval(node->value)*sizeof(struct vm_top_t)];
+
+  if((getval(var->type) & VARSTACK_EXTERNAL) == VARSTACK_EXTERNAL && var->next > 0) {
+    char *str = var->value;
+    uint16_t c = varstack_add(&str, 0, getval(var->len), 0);
+    if(c == VARSTACK_FULL) {
+      logerror_P(F("ERROR: string arena is full"));
+      setval(node->type, VNULL);
+      setval(node->value, 0);
+      return -1;
+    }
+    setval(node->value, c/sizeof(struct vm_top_t));
+  }
+  return 0;
+}
+
+uint16_t rules_tohandle(int8_t pos) {
+  int16_t offset = vm_val_pos(pos);
+  if(pos < 0) {
+    offset = getval(stack->nrbytes)-offset;
+  }
+  if(offset >= 4) {
+    if(getval(stack->buffer[offset]) == VPTR) {
+      if(vm_stack_intern_view(offset) == -1) {
+        return 0;
+      }
+      struct vm_vptr_t *node = (struct vm_vptr_t *)&stack->buffer[offset];
+      return ((getval(node->value)*sizeof(struct vm_top_t))/sizeof(struct vm_vchar_t))+1;
+    }
+  }
+  return 0;
+}
+
+const char *rules_fromhandle(uint16_t handle) {
+  if(handle == 0 || handle > varstack->nrbytes/sizeof(struct vm_vchar_t)) {
+    return NULL;
+  }
+
+  struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[(handle-1)*sizeof(struct vm_vchar_t)];
+  return (const char *)node->value;
+}
+
+/*
+ * Returns the handle of an interned string without
+ * pushing it, so a host can resolve the strings it
+ * compares against once and match on handles.
+ */
+uint16_t rules_findhandle(const char *str, uint16_t len) {
+  int32_t c = 0;
+
+  if(varstack == NULL || (c = varstack_find((char **)&str, 0, len)) == -1) {
+    return 0;
+  }
+  return (c/sizeof(struct vm_vchar_t))+1;
+}
+
+/*
+ * Substrings are returned as is, so the result
+ * is not always terminated and can only be used
+ * together with the returned length.
+ */
+const char *rules_tolstring(int8_t pos, uint16_t *len) {
+  int16_t offset = vm_val_pos(pos);
+  if(pos < 0) {
+    offset = getval(stack->nrbytes)-offset;
+  }
+  if(offset >= 4) {
+    if(getval(stack->buffer[offset]) == VPTR) {
+      struct vm_vptr_t *node = (struct vm_vptr_t *)&stack->buffer[offset];
+      uint16_t pos = getval(node->value)*sizeof(struct vm_top_t);
+      struct vm_vchar_t *var = (struct vm_vchar_t *)&varstack->buffer[pos];
+
+      if(len != NULL) {
+        *len = getval(var->len);
+      }
+      return (const char *)var->value;
     }
   }
+  if(len != NULL) {
+    *len = 0;
+  }
+  return NULL;
 }
 
 const char *rules_tostring(int8_t pos) {
@@ -1600,6 +2502,9 @@ const char *rules_tostring(int8_t pos) {
   }
   if(offset >= 4) {
     if(getval(stack->buffer[offset]) == VPTR) {
+      if(vm_stack_intern_view(offset) == -1) {
+        return NULL;
+      }
       struct vm_vptr_t *node = (struct vm_vptr_t *)&stack->buffer[offset];
       uint16_t pos = getval(node->value)*sizeof(struct vm_top_t);
       struct vm_vchar_t *var = (struct vm_vchar_t *)&varstack->buffer[pos];
@@ -1669,9 +2574,32 @@ void rules_remove(int8_t pos) {
   if(pos < 0) {
     offset = getval(stack->nrbytes)-offset;
   }
+  if(offset+rule_max_var_bytes() == getval(stack->nrbytes)) {
+    setval(stack->nrbytes, offset);
+    return;
+  }
   vm_stack_del(offset);
 }
 
+/*
+ * Values are removed from the top by just
+ * lowering the stack size, so clearing the
+ * arguments of a function doesn't have to
+ * move the values above them.
+ */
+void rules_pop(uint8_t n) {
+  uint8_t top = rules_gettop();
+
+  rules_settop(top-MIN(n, top));
+}
+
+void rules_settop(uint8_t n) {
+  while(rules_gettop() < n) {
+    rules_pushnil();
+  }
+  setval(stack->nrbytes, 4+(n*rule_max_var_bytes()));
+}
+
 static uint16_t bc_parent(struct rules_t *obj, uint8_t type, int16_t a, int16_t b, int16_t c) {
   uint16_t ret = 0, size = 0;
   ret = getval(obj->bc.nrbytes);
@@ -1740,21 +2668,7 @@ static int32_t vm_heap_push(struct rules_t *obj, uint8_t type, char **text, uint
     case TNUMBER1:
     case TNUMBER2:
     case TNUMBER3: {
-      char tmp = 0;
-      float var = 0;
-      tmp = getval((*text)[start+1+len]);
-      setval((*text)[start+1+len], 0);
-      char *cpy = (char *)MALLOC(len+1);
-      if(cpy == NULL) {
-        OUT_OF_MEMORY;
-      }
-      memset(cpy, 0, len+1);
-      for(uint16_t x=0;x<len;x++) {
-        cpy[x] = (char)getval((*text)[start+1+x]);
-      }
-      var = atof(cpy);
-      FREE(cpy);
-      setval((*text)[start+1+len], tmp);
+      float var = lexer_number(text, start+1, len);
 
       float nr = 0;
       if(modff(var, &nr) == 0) {
@@ -1901,7 +2815,7 @@ static int32_t vm_heap_push(struct rules_t *obj, uint8_t type, char **text, uint
     } break;
     /* LCOV_EXCL_START*/
     default: {
-      logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+      logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
       return -1;
     } break;
     /* LCOV_EXCL_STOP*/
@@ -1933,7 +2847,7 @@ static int32_t vm_heap_next(struct rules_t *obj, uint8_t type, uint8_t skip) {
     } break;
     /* LCOV_EXCL_START*/
     default: {
-      logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+      logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
       return -1;
     } break;
     /* LCOV_EXCL_STOP*/
@@ -1955,7 +2869,7 @@ static int32_t bc_whatfirst(char **text, uint16_t pos, uint8_t token) {
      */
     /* LCOV_EXCL_START*/
     if(lexer_peek(text, pos, &type, &start, &len) < 0) {
-      logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+      logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
       break;
     }
     /* LCOV_EXCL_STOP*/
@@ -1979,7 +2893,7 @@ static int32_t bc_whatfirst(char **text, uint16_t pos, uint8_t token) {
   while(1) {
     /* LCOV_EXCL_START*/
     if(lexer_peek(text, pos, &type, &start, &len) < 0) {
-      logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+      logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
       break;
     }
     /* LCOV_EXCL_STOP*/
@@ -1998,7 +2912,7 @@ static int32_t bc_whatfirst(char **text, uint16_t pos, uint8_t token) {
   if(has_paren > 0) {
     /* LCOV_EXCL_START*/
     if(lexer_peek(text, has_paren-1, &type, &start, &len) < 0) {
-      logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+      logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
       return -1;
     }
     /* LCOV_EXCL_STOP*/
@@ -2304,7 +3218,7 @@ static void bc_math_move_closest(struct rules_t *obj, int16_t limit) {
 
           if((tmp1B = bc_next(obj, tmp1B)) == -1) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
             exit(-1);
             /* LCOV_EXCL_STOP*/
           }
@@ -2371,7 +3285,7 @@ static void bc_math_move_closest(struct rules_t *obj, int16_t limit) {
 
           if((tmp1B = bc_next(obj, tmp1B)) == -1) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
             exit(-1);
             /* LCOV_EXCL_STOP*/
           }
@@ -2447,7 +3361,7 @@ static void bc_math_move_closest(struct rules_t *obj, int16_t limit) {
 
             if((tmp1C = bc_next(obj, tmp1C)) == -1) {
               /* LCOV_EXCL_START*/
-              logprintf_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
+              logfatal_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
               exit(-1);
               /* LCOV_EXCL_STOP*/
             }
@@ -2524,7 +3438,7 @@ static void bc_math_move_closest(struct rules_t *obj, int16_t limit) {
 
             if((tmp1B = bc_next(obj, tmp1B)) == -1) {
               /* LCOV_EXCL_START*/
-              logprintf_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
+              logfatal_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
               exit(-1);
               /* LCOV_EXCL_STOP*/
             }
@@ -2581,7 +3495,7 @@ static int32_t bc_parse_math_order(char **text, struct rules_t *obj, uint16_t *p
 
   if(lexer_peek(text, (*pos), &a, &start, &len) < 0) {
     /* LCOV_EXCL_START*/
-    logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+    logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
     return -1;
     /* LCOV_EXCL_STOP*/
   }
@@ -2626,7 +3540,7 @@ static int32_t bc_parse_math_order(char **text, struct rules_t *obj, uint16_t *p
       (*pos)++;
     } break;
     default: {
-      logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+      logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
       return -1;
     }
   }
@@ -2639,7 +3553,7 @@ static int32_t bc_parse_math_order(char **text, struct rules_t *obj, uint16_t *p
 
     /* LCOV_EXCL_START*/
     if(idx > nr_rule_operators) {
-      logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+      logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
       return -1;
     }
     /* LCOV_EXCL_STOP*/
@@ -2683,11 +3597,14 @@ static int32_t bc_parse_math_order(char **text, struct rules_t *obj, uint16_t *p
             } else {
               d = vm_heap_push(obj, c, text, start, len, 0);
             }
+            if(d == -1) {
+              return -1;
+            }
             d = vm_val_posr(d);
           }
         } break;
         default: {
-          logprintf_P(F("ERROR: Expected a parenthesis block, function, number or variable"));
+          logerror_P(F("ERROR: Expected a parenthesis block, function, number or variable"));
           return -1;
         } break;
       }
@@ -2696,7 +3613,7 @@ static int32_t bc_parse_math_order(char **text, struct rules_t *obj, uint16_t *p
     step = bc_parent(obj, rule_operators[idx].opcode, ++(*cnt), heap_in, d);
 
     if(*cnt > (INT8_MAX/2)) {
-      logprintf_P(F("ERROR: Too many stacked conditions"));
+      logerror_P(F("ERROR: Too many stacked conditions"));
       return -1;
     }
 
@@ -2986,7 +3903,7 @@ uint16_t lexer_clear(struct rules_t *obj, char **text, uint16_t start, uint16_t
       } break;
       /* LCOV_EXCL_START*/
       default: {
-        logprintf_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
+        logfatal_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
       } break;
       /* LCOV_EXCL_STOP*/
     }
@@ -3016,7 +3933,7 @@ uint16_t lexer_clear(struct rules_t *obj, char **text, uint16_t start, uint16_t
       setval((*text)[y], tmp & 0xFF);
     } else {
       /* LCOV_EXCL_START*/
-        logprintf_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
+        logfatal_P(F("FATAL: Internal error in %s #%d %d"), __FUNCTION__, __LINE__);
       /* LCOV_EXCL_STOP*/
     }
   }
@@ -3043,13 +3960,13 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
 
   /* LCOV_EXCL_START*/
   if(lexer_peek(text, 0, &type, &start, &len) < 0) {
-    logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+    logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
     return -1;
   }
   /* LCOV_EXCL_STOP*/
 
   if(type != TIF && type != TEVENT) {
-    logprintf_P(F("ERROR: Expected an 'if' or an 'on' statement"));
+    logerror_P(F("ERROR: Expected an 'if' or an 'on' statement"));
     return -1;
   }
 
@@ -3083,7 +4000,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
         if(go == TTHEN) {
           if(pos == 0) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             return -1;
             /* LCOV_EXCL_STOP*/
           }
@@ -3118,14 +4035,14 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
 
         if(lexer_peek(text, pos, &type, &start, &len) < 0) {
           /* LCOV_EXCL_START*/
-          logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+          logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
           return -1;
           /* LCOV_EXCL_STOP*/
         }
         switch(type) {
           case TELSEIF: {
             if(go == TTHEN) {
-              logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+              logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
               return -1;
             }
             go = TIF;
@@ -3139,7 +4056,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
             go = type;
           } break;
           default: {
-            logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+            logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
             return -1;
           } break;
         }
@@ -3148,7 +4065,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
         if(pos == 0) {
           if(lexer_peek(text, pos, &type, &start, &len) < 0) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             return -1;
             /* LCOV_EXCL_STOP*/
           }
@@ -3159,7 +4076,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
 
           if(lexer_peek(text, pos+1, &type, &start, &len) < 0) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             return -1;
             /* LCOV_EXCL_STOP*/
           }
@@ -3180,7 +4097,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
             } break;
             /* LCOV_EXCL_START*/
             default: {
-              logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+              logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
               return -1;
             } break;
             /* LCOV_EXCL_STOP*/
@@ -3188,7 +4105,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
         } else {
           if(lexer_peek(text, pos, &type, &start, &len) < 0) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             return -1;
             /* LCOV_EXCL_STOP*/
           }
@@ -3209,7 +4126,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
             } break;
             /* LCOV_EXCL_START*/
             default: {
-              logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+              logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
               return -1;
             } break;
            /* LCOV_EXCL_STOP*/
@@ -3234,7 +4151,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
 
         if(lexer_peek(text, pos, &type, &start, &len) < 0) {
           /* LCOV_EXCL_START*/
-          logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+          logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
           return -1;
           /* LCOV_EXCL_STOP*/
         }
@@ -3250,7 +4167,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
           case TVAR: {
           } break;
           default: {
-            logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+            logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
             return -1;
           } break;
         }
@@ -3269,7 +4186,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
           in_child = pos;
           if(lexer_peek(text, pos, &type, &start, &len) < 0) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             return -1;
             /* LCOV_EXCL_STOP*/
           }
@@ -3281,7 +4198,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
             } break;
             /* LCOV_EXCL_START*/
             default: {
-              logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+              logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
               return -1;
             } break;
             /* LCOV_EXCL_STOP*/
@@ -3296,7 +4213,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
             // continue;
           } else if(lexer_peek(text, pos, &type, &start, &len) <= 0) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             return -1;
             /* LCOV_EXCL_STOP*/
           } else {
@@ -3334,7 +4251,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
 
             if(lexer_peek(text, pos, &type, &start, &len) <= 0) {
               /* LCOV_EXCL_START*/
-              logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+              logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
               return -1;
               /* LCOV_EXCL_STOP*/
             }
@@ -3357,13 +4274,13 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
               case TEND: {
                 if(lexer_peek(text, pos-1, &type, &start, &len) <= 0) {
                   /* LCOV_EXCL_START*/
-                  logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+                  logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
                   return -1;
                   /* LCOV_EXCL_STOP*/
                 }
                 if(type != TSEMICOLON) {
                   /* LCOV_EXCL_START*/
-                  logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+                  logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
                   return -1;
                   /* LCOV_EXCL_STOP*/
                 }
@@ -3378,7 +4295,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
               } break;
               /* LCOV_EXCL_START*/
               default: {
-                logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+                logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
                 return -1;
               } break;
               /* LCOV_EXCL_STOP*/
@@ -3409,14 +4326,14 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
           } break;
           /* LCOV_EXCL_START*/
           default: {
-            logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+            logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
             return -1;
           } break;
           /* LCOV_EXCL_STOP*/
         }
         if(lexer_peek(text, pos+1, &type, &start, &len) <= 0) {
           /* LCOV_EXCL_START*/
-          logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+          logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
           return -1;
           /* LCOV_EXCL_STOP*/
         }
@@ -3433,7 +4350,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
             } else {
               if(lexer_peek(text, pos+2, &type, &start, &len) <= 0) {
                 /* LCOV_EXCL_START*/
-                logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+                logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
                 return -1;
                 /* LCOV_EXCL_STOP*/
               }
@@ -3444,7 +4361,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
                 go = type;
               } else {
                 /* LCOV_EXCL_START*/
-                logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+                logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
                 return -1;
                 /* LCOV_EXCL_STOP*/
               }
@@ -3474,7 +4391,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
           case TOPERATOR: {
           } break;
           default: {
-            logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+            logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
             return -1;
           } break;
         }
@@ -3490,7 +4407,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
         if(lexer_peek(text, pos+1, &type, &start, &len) >= 0 && type == TOPERATOR) {
         } else if(lexer_peek(text, pos, &type, &start, &len) < 0) {
           /* LCOV_EXCL_START*/
-          logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+          logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
           return -1;
           /* LCOV_EXCL_STOP*/
         }
@@ -3501,13 +4418,13 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
         } else if(type == RPAREN) {
           if(in_child == -1) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             return -1;
             /* LCOV_EXCL_STOP*/
           }
           if(lexer_peek(text, in_child, &type, &start, &len) < 0) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             return -1;
             /* LCOV_EXCL_STOP*/
           }
@@ -3544,7 +4461,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
           if(in_child > -1) {
             if(lexer_peek(text, in_child, &type, &start, &len) < 0) {
               /* LCOV_EXCL_START*/
-              logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+              logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
               return -1;
               /* LCOV_EXCL_STOP*/
             }
@@ -3553,7 +4470,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
 
           if(lexer_peek(text, pos, &type, &start, &len) < 0) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             return -1;
             /* LCOV_EXCL_STOP*/
           }
@@ -3568,7 +4485,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
               }
             } else {
               /* LCOV_EXCL_START*/
-              logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+              logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
               return -1;
               /* LCOV_EXCL_STOP*/
             }
@@ -3595,7 +4512,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
 
           if(lexer_peek(text, pos+1, &type, &start, &len) < 0) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             return -1;
             /* LCOV_EXCL_STOP*/
           }
@@ -3606,7 +4523,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
             case RPAREN: {
             } break;
             default: {
-              logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+              logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
               return -1;
             } break;
           }
@@ -3628,7 +4545,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
           in_child = pos;
           if(lexer_peek(text, pos, &type, &start, &len) < 0) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             return -1;
             /* LCOV_EXCL_STOP*/
           }
@@ -3640,7 +4557,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
             pos++;
           } else if(lexer_peek(text, pos, &type, &start, &len) < 0) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             return -1;
             /* LCOV_EXCL_STOP*/
           }
@@ -3685,7 +4602,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
             go = type;
           } break;
           default: {
-            logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+            logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
             return -1;
           } break;
         }
@@ -3693,7 +4610,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
       case TVAR: {
         if(lexer_peek(text, pos, &type, &start, &len) < 0) {
           /* LCOV_EXCL_START*/
-          logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+          logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
           return -1;
           /* LCOV_EXCL_STOP*/
         }
@@ -3713,13 +4630,13 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
             }
             if(lexer_peek(text, tmp-1, &type, &start, &len) < 0) {
               /* LCOV_EXCL_START*/
-              logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+              logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
               return -1;
               /* LCOV_EXCL_STOP*/
             }
             if(type != TVAR) {
               /* LCOV_EXCL_START*/
-              logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+              logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
               return -1;
               /* LCOV_EXCL_STOP*/
             }
@@ -3735,7 +4652,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
 
             if(lexer_peek(text, pos, &type, &start, &len) < 0) {
               /* LCOV_EXCL_START*/
-              logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+              logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
               return -1;
               /* LCOV_EXCL_STOP*/
             }
@@ -3747,7 +4664,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
           } break;
           /* LCOV_EXCL_START*/
           default: {
-            logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+            logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
             return -1;
           } break;
           /* LCOV_EXCL_STOP*/
@@ -3757,7 +4674,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
       case TFUNCTION: {
         if(lexer_peek(text, pos, &type, &start, &len) < 0) {
           /* LCOV_EXCL_START*/
-          logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+          logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
           return -1;
           /* LCOV_EXCL_STOP*/
         }
@@ -3779,7 +4696,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
               in_child = pos;
               if(lexer_peek(text, pos, &type, &start, &len) < 0) {
                 /* LCOV_EXCL_START*/
-                logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+                logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
                 return -1;
                 /* LCOV_EXCL_STOP*/
               }
@@ -3787,20 +4704,20 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
               go = type;
               ret = TFUNCTION;
             } else {
-              logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+              logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
               return -1;
             }
           } break;
           case RPAREN: {
             if(in_child == -1) {
               /* LCOV_EXCL_START*/
-              logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+              logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
               return -1;
               /* LCOV_EXCL_STOP*/
             }
             if(lexer_peek(text, in_child, &type, &start, &len) < 0) {
               /* LCOV_EXCL_START*/
-              logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+              logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
               return -1;
               /* LCOV_EXCL_STOP*/
             }
@@ -3833,7 +4750,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
             ret = TFUNCTION;
           } break;
           default: {
-            logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+            logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
             return -1;
           } break;
         }
@@ -3856,14 +4773,14 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
       case RPAREN: {
         if(in_child == -1) {
           /* LCOV_EXCL_START*/
-          logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+          logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
           return -1;
           /* LCOV_EXCL_STOP*/
         }
 
         if(lexer_peek(text, pos+1, &type, &start, &len) < 0) {
           /* LCOV_EXCL_START*/
-          logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+          logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
           return -1;
           /* LCOV_EXCL_STOP*/
         }
@@ -3877,7 +4794,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
           } break;
           default: {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+            logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
             return -1;
             /* LCOV_EXCL_STOP*/
           } break;
@@ -3892,7 +4809,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
         in_child = -1;
         if(lexer_peek(text, pos, &type, &start, &len) < 0) {
           /* LCOV_EXCL_START*/
-          logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+          logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
           return -1;
           /* LCOV_EXCL_STOP*/
         }
@@ -3912,7 +4829,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
           } break;
           /* LCOV_EXCL_START*/
           default: {
-            logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+            logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
             return -1;
           } break;
           /* LCOV_EXCL_STOP*/
@@ -3921,7 +4838,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
       case VPTR: {
         if(lexer_peek(text, pos, &type, &start, &len) < 0) {
           /* LCOV_EXCL_START*/
-          logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+          logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
           return -1;
           /* LCOV_EXCL_STOP*/
         }
@@ -3937,14 +4854,14 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
         if(in_child == -1) {
           if(lexer_peek(text, 0, &type, &start, &len) < 0) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             return -1;
             /* LCOV_EXCL_STOP*/
           }
         } else {
           if(lexer_peek(text, in_child, &type, &start, &len) < 0) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             return -1;
             /* LCOV_EXCL_STOP*/
           }
@@ -3959,7 +4876,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
           break;
           /* LCOV_EXCL_START*/
           default: {
-            logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+            logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
             return -1;
           } break;
           /* LCOV_EXCL_STOP*/
@@ -4005,7 +4922,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
             if(lexer_peek(text, pos-1, &type, &start, &len) >= 0 && type == LPAREN) {
               if(lexer_peek(text, pos, &type, &start, &len) < 0) {
                 /* LCOV_EXCL_START*/
-                logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+                logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
                 return -1;
                 /* LCOV_EXCL_STOP*/
               }
@@ -4015,7 +4932,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
                */
               if(lexer_peek(text, pos, &type, &start, &len) < 0) {
                 /* LCOV_EXCL_START*/
-                logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+                logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
                 return -1;
                 /* LCOV_EXCL_STOP*/
               }
@@ -4029,7 +4946,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
           }
         } else if(lexer_peek(text, pos, &type, &start, &len) < 0) {
           /* LCOV_EXCL_START*/
-          logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+          logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
           return -1;
           /* LCOV_EXCL_STOP*/
         }
@@ -4042,13 +4959,13 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
           case RPAREN: {
             if(in_child == -1) {
               /* LCOV_EXCL_START*/
-              logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+              logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
               return -1;
               /* LCOV_EXCL_STOP*/
             }
             if(lexer_peek(text, in_child, &type, &start, &len) < 0) {
               /* LCOV_EXCL_START*/
-              logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+              logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
               return -1;
               /* LCOV_EXCL_STOP*/
             }
@@ -4087,12 +5004,12 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
             pos++;
             if(lexer_peek(text, pos, &type, &start, &len) < 0) {
               /* LCOV_EXCL_START*/
-              logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+              logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
               return -1;
               /* LCOV_EXCL_STOP*/
             }
             if(type == TTHEN) {
-              logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+              logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
               return -1;
             }
           } break;
@@ -4111,13 +5028,13 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
               uint8_t a = 0;
               if(in_child == -1) {
                 /* LCOV_EXCL_START*/
-                logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+                logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
                 return -1;
                 /* LCOV_EXCL_STOP*/
               }
               if(lexer_peek(text, in_child, &a, &start, &len) < 0) {
                 /* LCOV_EXCL_START*/
-                logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+                logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
                 return -1;
                 /* LCOV_EXCL_STOP*/
               }
@@ -4141,13 +5058,13 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
               uint8_t a = 0;
               if(in_child == -1) {
                 /* LCOV_EXCL_START*/
-                logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+                logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
                 return -1;
                 /* LCOV_EXCL_STOP*/
               }
               if(lexer_peek(text, in_child, &a, &start, &len) < 0) {
                 /* LCOV_EXCL_START*/
-                logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+                logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
                 return -1;
                 /* LCOV_EXCL_STOP*/
               }
@@ -4155,7 +5072,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
               if(a == TFUNCTION || a == TEVENT) {
                 if(lexer_peek(text, pos, &a, &start, &len) < 0) {
                   /* LCOV_EXCL_START*/
-                  logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+                  logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
                   return -1;
                   /* LCOV_EXCL_STOP*/
                 }
@@ -4178,7 +5095,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
           } break;
           /* LCOV_EXCL_START*/
           default: {
-            logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+            logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
             return -1;
           } break;
           /* LCOV_EXCL_STOP*/
@@ -4189,7 +5106,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
         int32_t lastjmp = getval(obj->bc.nrbytes);
         if(lexer_peek(text, pos, &type, &start, &len) < 0) {
           /* LCOV_EXCL_START*/
-          logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+          logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
           return -1;
           /* LCOV_EXCL_STOP*/
         }
@@ -4204,7 +5121,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
           pos++;
           if(lexer_peek(text, pos, &type, &start, &len) < 0) {
             /* LCOV_EXCL_START*/
-            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+            logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
             return -1;
             /* LCOV_EXCL_STOP*/
           }
@@ -4236,7 +5153,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
             } break;
             /* LCOV_EXCL_START*/
             default: {
-              logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+              logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
               return -1;
             } break;
             /* LCOV_EXCL_STOP*/
@@ -4247,7 +5164,7 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
           depth--;
         } else {
           /* LCOV_EXCL_START*/
-          logprintf_P(F("ERROR: Unexpected token (%d)"), __LINE__);
+          logerror_P(F("ERROR: Unexpected token (%d)"), __LINE__);
           return -1;
           /* LCOV_EXCL_STOP*/
         }
@@ -4258,1043 +5175,3094 @@ static int16_t rule_create(char **text, struct rules_t *obj) {
   return 0;
 }
 
-int8_t rule_run(struct rules_t *obj, uint8_t validate) {
-  uint16_t pos = 0;
-  uint8_t t = 0;
-
-  /*
-   * This approach is much faster than a switch
-   * Initialize once for even better performance
-   */
-
-  if(jmptbl[1] == NULL) {
-    void *tmp[JMPSIZE] = {
-      NULL,             //                0
-      &&STEP_OP_MATH,   // OP_EQ,         1
-      &&STEP_OP_MATH,   // OP_NE,         2
-      &&STEP_OP_MATH,   // OP_LT,         3
-      &&STEP_OP_MATH,   // OP_LE,         4
-      &&STEP_OP_MATH,   // OP_GT,         5
-      &&STEP_OP_MATH,   // OP_GE,         6
-      &&STEP_OP_MATH,   // OP_AND,        7
-      &&STEP_OP_MATH,   // OP_OR,         8
-      &&STEP_OP_MATH,   // OP_SUB,        9
-      &&STEP_OP_MATH,   // OP_ADD,        10
-      &&STEP_OP_MATH,   // OP_DIV,        11
-      &&STEP_OP_MATH,   // OP_MUL,        12
-      &&STEP_OP_MATH,   // OP_POW,        13
-      &&STEP_OP_MATH,   // OP_MOD,        14
-      &&STEP_TEST,      // OP_JMP,        15
-      &&STEP_JMP,       // OP_JMP,        15
-      &&STEP_SETVAL,    // OP_SETVAL,     16
-      &&STEP_GETVAL,    // OP_GETVAL,     17
-      &&STEP_PUSH,      // OP_PUSH,       18
-      &&STEP_CALL,      // OP_CALL,       19
-      &&STEP_CLEAR,     // OP_CLEAR,      20
-      &&STEP_RET,       // OP_RET         21
-      &&STEP_OP_EQ,     // OP_EQ          22
-      &&STEP_OP_NE,     // OP_NE          23
-      &&STEP_OP_LT,     // OP_LT          24
-      &&STEP_OP_LE,     // OP_LE          25
-      &&STEP_OP_GT,     // OP_GT          26
-      &&STEP_OP_GE,     // OP_GE          27
-      &&STEP_OP_AND,    // OP_AND         28
-      &&STEP_OP_OR,     // OP_OR          29
-      &&STEP_OP_SUB,    // OP_SUB         30
-      &&STEP_OP_ADD,    // OP_ADD         31
-      &&STEP_OP_DIV,    // OP_DIV         32
-      &&STEP_OP_MUL,    // OP_MUL         33
-      &&STEP_OP_POW,    // OP_POW         34
-      &&STEP_OP_MOD,    // OP_MOD         35
-    };
-    memcpy(&jmptbl, &tmp, sizeof(tmp));
+static struct rule_value_t *varstack_bound(uint16_t idx) {
+  if(idx >= varstack_nrbinds) {
+    return NULL;
   }
+  return varstack_binds[idx];
+}
 
-  memset(stack->buffer, 0, getval(stack->bufsize));
-  setval(stack->nrbytes, 4);
+/*
+ * Asks the host for the values of the variables
+ * a rule uses. Bindings are kept per name, so they
+ * are shared by all rules until the next rules_gc.
+ */
+static void rule_bind(struct rules_t *obj) {
+  struct rule_value_t *value = NULL;
+  uint16_t i = 0, idx = 0;
 
-/*****************/
-  BEGIN:
-    uint8_t type = gettype(obj->bc.buffer[pos]);
-#ifdef DEBUG
-    printf("rule #%d, pos: %lu, op_id: %d, op: %s\n", obj->nr, pos/sizeof(struct vm_top_t), type, op_names[type].name);
-#endif
-    goto *jmptbl[type];
-/*****************/
+  if(rule_options.vm_value_bind == NULL) {
+    return;
+  }
 
-/*****************/
-  STEP_OP_MATH: {
-    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
-    int16_t a = vm_val_pos((int8_t)getval(node->a));
-    int16_t b = vm_val_pos((int8_t)getval(node->b));
-    int16_t c = vm_val_pos((int8_t)getval(node->c));
+  for(i=0;i<getval(obj->bc.nrbytes);i+=sizeof(struct vm_top_t)) {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i];
 
-#if defined(DEBUG) || defined(COVERALLS)
-    if((int8_t)getval(node->a) >= 0) {
-      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-      return -1;
+    if(gettype(node->type) == OP_GETVAL) {
+      idx = (int8_t)getval(node->b);
+    } else if(gettype(node->type) == OP_SETVAL) {
+      idx = (int8_t)getval(node->a);
+    } else {
+      continue;
     }
-    if((int8_t)getval(node->b) >= 0) {
-      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-      return -1;
+    if(varstack_bound(idx) != NULL) {
+      continue;
     }
-    if((int8_t)getval(node->c) >= 0) {
-      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-      return -1;
+
+    struct vm_vchar_t *var = (struct vm_vchar_t *)&varstack->buffer[idx*sizeof(struct vm_vchar_t)];
+    if((value = rule_options.vm_value_bind(var->value, getval(var->len))) == NULL) {
+      continue;
     }
-    if(b > getval(obj->heap->nrbytes)) {
-      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-      return -1;
+
+    if(idx >= varstack_nrbinds) {
+      if((varstack_binds = (struct rule_value_t **)REALLOC(varstack_binds, sizeof(struct rule_value_t *)*(idx+1))) == NULL) {
+        OUT_OF_MEMORY
+      }
+      memset(&varstack_binds[varstack_nrbinds], 0, sizeof(struct rule_value_t *)*(idx+1-varstack_nrbinds));
+      varstack_nrbinds = idx+1;
     }
-    if(c > getval(obj->heap->nrbytes)) {
-      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-      return -1;
+    varstack_binds[idx] = value;
+  }
+}
+
+/*
+ * Stores a stack value in a bound variable the
+ * same way a host would from vm_value_set. A
+ * string that can't be pinned is stored as nil.
+ */
+static void vm_value_store(struct rule_value_t *value, int8_t pos) {
+  uint8_t type = rules_type(pos);
+  uint16_t handle = 0;
+
+  if(type == VCHAR && (handle = rules_pin(pos)) == 0) {
+    type = VNULL;
+  }
+  if(value->type == VCHAR) {
+    rules_unpin(value->handle);
+  }
+  value->handle = 0;
+
+  switch(type) {
+    case VINTEGER: {
+      value->val.i = rules_tointeger(pos);
+    } break;
+    case VFLOAT: {
+      value->val.f = rules_tofloat(pos);
+    } break;
+    case VCHAR: {
+      value->val.s = rules_fromhandle(handle);
+      value->handle = handle;
+    } break;
+    default: {
+      value->val.s = NULL;
+      type = VNULL;
+    } break;
+  }
+  value->type = type;
+}
+
+/*
+ * Writes a host value to the heap slot
+ * the result of OP_GETVAL is stored in.
+ */
+static void vm_heap_value(struct rules_t *obj, int16_t a, struct rule_value_t *value) {
+  uint8_t type = value->type;
+
+  if(type == VCHAR && value->handle == 0) {
+    type = VNULL;
+  }
+
+  switch(type) {
+    case VINTEGER: {
+      struct vm_vinteger_t *upd = (struct vm_vinteger_t *)&obj->heap->buffer[a];
+      setval(upd->type, VINTEGER);
+      setval(upd->value[0], ((uint32_t)value->val.i >> 16) & 0xFF);
+      setval(upd->value[1], ((uint32_t)value->val.i >> 8) & 0xFF);
+      setval(upd->value[2], ((uint32_t)value->val.i) & 0xFF);
+    } break;
+    case VFLOAT: {
+      uint32_t x = 0;
+      float2uint32(float32to27(value->val.f), &x);
+
+      struct vm_vfloat_t *upd = (struct vm_vfloat_t *)&obj->heap->buffer[a];
+      setval(upd->type, VFLOAT | ((((uint32_t)x >> 29) & 0x7) << 5));
+      setval(upd->value[0], ((uint32_t)x >> 21) & 0xFF);
+      setval(upd->value[1], ((uint32_t)x >> 13) & 0xFF);
+      setval(upd->value[2], ((uint32_t)x >> 5) & 0xFF);
+    } break;
+    case VCHAR: {
+      struct vm_vptr_t *upd = (struct vm_vptr_t *)&obj->heap->buffer[a];
+      setval(upd->type, VPTR);
+      setval(upd->value, ((value->handle-1)*sizeof(struct vm_vchar_t))/sizeof(struct vm_top_t));
+    } break;
+    default: {
+      struct vm_vnull_t *upd = (struct vm_vnull_t *)&obj->heap->buffer[a];
+      setval(upd->type, VNULL);
+    } break;
+  }
+}
+
+/*
+ * Decodes a number on the heap, x is left
+ * untouched for other types.
+ */
+static uint8_t vm_heap_tofloat(struct rules_t *obj, int16_t a, float *x) {
+  uint8_t type = gettype(obj->heap->buffer[a]);
+
+  if(type == VINTEGER) {
+    struct vm_vinteger_t *node = (struct vm_vinteger_t *)&obj->heap->buffer[a];
+    uint32_t val = 0;
+
+    val |= getval(node->value[0]) << 16;
+    val |= getval(node->value[1]) << 8;
+    val |= getval(node->value[2]);
+
+    /*
+     * Correctly restore sign
+     */
+    if(val & 0x800000) {
+      val |= 0xFF000000;
     }
-#endif
+    *x = (float)(int32_t)val;
+  } else if(type == VFLOAT) {
+    struct vm_vfloat_t *node = (struct vm_vfloat_t *)&obj->heap->buffer[a];
+    uint32_t val = 0;
 
-    float nr = 0, var = 0;
-    float x = 0, y = 0;
-    uint8_t x_type = gettype(obj->heap->buffer[b]);
-    uint8_t y_type = gettype(obj->heap->buffer[c]);
+    val |= (getval(node->type) >> 5) << 29;
+    val |= getval(node->value[0]) << 21;
+    val |= getval(node->value[1]) << 13;
+    val |= getval(node->value[2]) << 5;
 
-    if(x_type == VINTEGER) {
-      struct vm_vinteger_t *node1 = (struct vm_vinteger_t *)&obj->heap->buffer[b];
-      uint32_t val = 0;
+    uint322float(val, x);
+  }
 
-      val |= getval(node1->value[0]) << 16;
-      val |= getval(node1->value[1]) << 8;
-      val |= getval(node1->value[2]);
+  return type;
+}
 
-      /*
-       * Correctly restore sign
-       */
-      if(val & 0x800000) {
-        val |= 0xFF000000;
-        x = ((float)(val*-1))*-1;
-      } else {
-        x = (float)val;
-      }
-    } else if(x_type == VFLOAT) {
-      struct vm_vfloat_t *node = (struct vm_vfloat_t *)&obj->heap->buffer[b];
-      uint32_t val = 0;
+/*
+ * Stores whole numbers as integers, the same
+ * as the built-in functions push them.
+ */
+static void vm_heap_number(struct rules_t *obj, int16_t a, float x) {
+  struct rule_value_t value;
+  float z = 0;
+
+  memset(&value, 0, sizeof(struct rule_value_t));
+  if(modff(x, &z) == 0) {
+    value.type = VINTEGER;
+    value.val.i = (int)x;
+  } else {
+    value.type = VFLOAT;
+    value.val.f = x;
+  }
+  vm_heap_value(obj, a, &value);
+}
 
-      val |= (getval(node->type) >> 5) << 29;
-      val |= getval(node->value[0]) << 21;
-      val |= getval(node->value[1]) << 13;
-      val |= getval(node->value[2]) << 5;
+static uint8_t rule_set_add(uint16_t *set, uint8_t nr, uint16_t handle) {
+  uint8_t x = nr;
 
-      uint322float(val, &x);
-    } else if(x_type == VNULL) {
-#ifndef DEBUG
-      goto STEP_IS_NULL;
-#endif
-    } else if(is_math(type)) {
-      uint8_t i = 0;
-      const char *op = NULL;
-      for(i=0;i<nr_rule_operators;i++) {
-        if(rule_operators[i].opcode == type) {
-          op = rule_operators[i].name;
-          break;
-        }
-      }
-      logprintf_P(F("ERROR: cannot compute %s with a left char value"), op);
-      return -1;
-    } else if(is_op_and_math(type)) {
-      uint8_t i = 0;
-      const char *op = NULL;
-      for(i=0;i<nr_rule_operators;i++) {
-        if(rule_operators[i].opcode == type) {
-          op = rule_operators[i].name;
+  while(x > 0 && set[x-1] > handle) {
+    x--;
+  }
+  if(x > 0 && set[x-1] == handle) {
+    return nr;
+  }
+  memmove(&set[x+1], &set[x], sizeof(uint16_t)*(nr-x));
+  set[x] = handle;
+
+  return nr+1;
+}
+
+static struct rule_set_t *rule_set_alloc(uint16_t *handles, uint8_t nr) {
+  struct rule_set_t *set = NULL;
+
+  if(nr == 0) {
+    return NULL;
+  }
+
+  if((set = (struct rule_set_t *)CALLOC(1, sizeof(struct rule_set_t)+
+    (sizeof(struct rule_value_t)+sizeof(uint16_t))*nr)) == NULL) {
+    OUT_OF_MEMORY
+  }
+  set->values = (struct rule_value_t *)&set[1];
+  set->handles = (uint16_t *)&set->values[nr];
+  set->nr = nr;
+  memcpy(set->handles, handles, sizeof(uint16_t)*nr);
+
+  return set;
+}
+
+/*
+ * Replaces calls of the built-in numeric functions
+ * with their own opcodes, which read the arguments
+ * from the heap slots that would have been pushed.
+ * Only calls where those slots aren't written again
+ * before the call are replaced. The pushes are
+ * removed and the jumps over them shortened.
+ */
+static void bc_intrinsics(struct rules_t *obj) {
+  uint16_t nrops = getval(obj->bc.nrbytes)/sizeof(struct vm_top_t);
+  uint16_t *map = NULL, i = 0, x = 0, y = 0;
+  int8_t slots[3];
+  uint16_t pushes[3];
+  uint8_t op = 0, nr = 0, removed = 0;
+
+  for(i=0;i<nrops;i++) {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i*sizeof(struct vm_top_t)];
+
+    if(gettype(node->type) != OP_CALL || getval(node->c) != 0 ||
+       (op = rule_function_opcode(getval(node->b))) == 0) {
+      continue;
+    }
+
+    nr = 0;
+    for(x=i;x>0;x--) {
+      struct vm_top_t *prev = (struct vm_top_t *)&obj->bc.buffer[(x-1)*sizeof(struct vm_top_t)];
+      uint8_t type = gettype(prev->type);
+
+      if(type == OP_PUSH) {
+        if(nr == 3 || (int8_t)getval(prev->a) >= 0) {
+          nr = 3;
           break;
         }
+        memmove(&slots[1], &slots[0], sizeof(slots[0])*nr);
+        memmove(&pushes[1], &pushes[0], sizeof(pushes[0])*nr);
+        slots[0] = getval(prev->a);
+        pushes[0] = x-1;
+        nr++;
+      } else if(type != OP_GETVAL && !is_op_and_math(type)) {
+        break;
       }
-      logprintf_P(F("ERROR: cannot compare %s with a left char value"), op);
-      return -1;
     }
-    if(y_type == VINTEGER) {
-      struct vm_vinteger_t *node1 = (struct vm_vinteger_t *)&obj->heap->buffer[c];
-      uint32_t val = 0;
-      val |= getval(node1->value[0]) << 16;
-      val |= getval(node1->value[1]) << 8;
-      val |= getval(node1->value[2]);
-
-      /*
-       * Correctly restore sign
-       */
-      if(val & 0x800000) {
-        val |= 0xFF000000;
-        y = ((float)(val*-1))*-1;
-      } else {
-        y = (float)val;
-      }
-    } else if(y_type == VFLOAT) {
-      struct vm_vfloat_t *node = (struct vm_vfloat_t *)&obj->heap->buffer[c];
-      uint32_t val = 0;
 
-      val |= (getval(node->type) >> 5) << 29;
-      val |= getval(node->value[0]) << 21;
-      val |= getval(node->value[1]) << 13;
-      val |= getval(node->value[2]) << 5;
+    if(nr == 0 || nr > 2 || ((op == OP_FLOOR || op == OP_CEIL) && nr != 1)) {
+      continue;
+    }
 
-      uint322float(val, &y);
-    } else if(y_type == VNULL) {
-      goto STEP_IS_NULL;
-    } else if(is_math(type)) {
-      uint8_t i = 0;
-      const char *op = NULL;
-      for(i=0;i<nr_rule_operators;i++) {
-        if(rule_operators[i].opcode == type) {
-          op = rule_operators[i].name;
+    for(x=0;x<nr;x++) {
+      for(y=pushes[x]+1;y<i;y++) {
+        struct vm_top_t *next = (struct vm_top_t *)&obj->bc.buffer[y*sizeof(struct vm_top_t)];
+        if(gettype(next->type) != OP_PUSH && (int8_t)getval(next->a) == slots[x]) {
           break;
         }
       }
-      logprintf_P(F("ERROR: cannot compute %s with a right char value"), op);
-      return -1;
-    } else if(is_op_and_math(type)) {
-      uint8_t i = 0;
-      const char *op = NULL;
-      for(i=0;i<nr_rule_operators;i++) {
-        if(rule_operators[i].opcode == type) {
-          op = rule_operators[i].name;
-          break;
-        }
+      if(y < i) {
+        break;
       }
-      logprintf_P(F("ERROR: cannot compare %s with a right char value"), op);
-      return -1;
     }
-#ifdef DEBUG
-    if(x_type == VNULL) {
-      goto STEP_IS_NULL;
+    if(x < nr) {
+      continue;
     }
-#endif
 
-    goto *jmptbl[type+22];
+    if(map == NULL) {
+      if((map = (uint16_t *)CALLOC(nrops+1, sizeof(uint16_t))) == NULL) {
+        OUT_OF_MEMORY
+      }
+    }
+    for(x=0;x<nr;x++) {
+      map[pushes[x]] = 1;
+      removed++;
+    }
 
-    STEP_OP_ADD:
-      var = x+y;
-      goto STEP_MATH_RESULT;
-    STEP_OP_DIV:
-      var = x/y;
-      goto STEP_MATH_RESULT;
-    STEP_OP_SUB:
-      var = x-y;
-      goto STEP_MATH_RESULT;
-    STEP_OP_MUL:
-      var = x*y;
-      goto STEP_MATH_RESULT;
-    STEP_OP_POW:
-      var = powf(x, y);
-      goto STEP_MATH_RESULT;
-    STEP_OP_MOD:
-      var = fmodf(x, y);
-      goto STEP_MATH_RESULT;
-    STEP_OP_EQ:
-      t = var = (fabsf(x - y) < EPSILON);
-      goto STEP_OP_RESULT;
-    STEP_OP_NE:
-      t = var = (fabsf(x - y) >= EPSILON);
-      goto STEP_OP_RESULT;
-    STEP_OP_OR:
-      t = var = (x > 0 || y > 0);
-      goto STEP_OP_RESULT;
-    STEP_OP_AND:
-      t = var = (x > 0 && y > 0);
-      goto STEP_OP_RESULT;
-    STEP_OP_LT:
-      t = var = (x < y);
-      goto STEP_OP_RESULT;
-    STEP_OP_LE:
-      t = var = (x <= y);
-      goto STEP_OP_RESULT;
-    STEP_OP_GT:
-      t = var = (x > y);
-      goto STEP_OP_RESULT;
-    STEP_OP_GE:
-      t = var = (x >= y);
-      goto STEP_OP_RESULT;
+    setval(node->type, op);
+    setval(node->b, slots[0]);
+    if(nr == 2) {
+      setval(node->c, slots[1]);
+    } else if(op == OP_ROUND || op == OP_FLOOR || op == OP_CEIL) {
+      setval(node->c, 0);
+    } else {
+      setval(node->c, slots[0]);
+    }
+  }
 
-    t = 1;
+  if(map == NULL) {
+    return;
+  }
 
-    STEP_IS_NULL: {
-#ifdef DEBUG
-    {
-      const char *op = NULL;
-      uint8_t i = 0;
-      for(i=0;i<nr_rule_operators;i++) {
-        if(rule_operators[i].opcode == type) {
-          op = rule_operators[i].name;
-          break;
-        }
+  /*
+   * Turn the marks into the new position
+   * of every instruction, a removed one
+   * maps to the one following it.
+   */
+  for(i=0,x=0;i<=nrops;i++) {
+    y = map[i];
+    map[i] = x;
+    if(i < nrops && y == 0) {
+      x++;
+    }
+  }
+
+  for(i=0;i<nrops;i++) {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i*sizeof(struct vm_top_t)];
+
+    if(map[i] == map[i+1]) {
+      continue;
+    }
+    if(gettype(node->type) == OP_JMP) {
+      setval(node->a, map[i+(int8_t)getval(node->a)]-map[i]);
+    }
+    if(map[i] != i) {
+      memcpy(&obj->bc.buffer[map[i]*sizeof(struct vm_top_t)], node, sizeof(struct vm_top_t));
+    }
+  }
+  setval(obj->bc.nrbytes, (nrops-removed)*sizeof(struct vm_top_t));
+
+  FREE(map);
+}
+
+/*
+ * Integers and floats are both numbers to the
+ * checker, because the results of math switch
+ * between them.
+ */
+static uint8_t rule_var_type(uint16_t idx) {
+  struct vm_vchar_t *var = (struct vm_vchar_t *)&varstack->buffer[idx*sizeof(struct vm_vchar_t)];
+
+  switch(rule_options.variable_type_cb((const char *)var->value, getval(var->len))) {
+    case VINTEGER:
+    case VFLOAT: {
+      return VFLOAT;
+    } break;
+    case VCHAR: {
+      return VCHAR;
+    } break;
+  }
+  return 0;
+}
+
+static uint8_t rule_heap_type(struct rules_t *obj, int8_t slot) {
+  switch(gettype(obj->heap->buffer[vm_val_pos(slot)])) {
+    case VINTEGER:
+    case VFLOAT: {
+      return VFLOAT;
+    } break;
+    case VPTR: {
+      return VCHAR;
+    } break;
+  }
+  return 0;
+}
+
+/*
+ * Follows the types of the heap slots through
+ * the bytecode, so operations on variables the
+ * host declared a type for are rejected when
+ * the rule is loaded instead of when it runs.
+ * Jumps only go forward, so the slot types are
+ * forgotten at every instruction a jump lands.
+ */
+static int8_t rule_check_types(struct rules_t *obj) {
+  uint8_t types[INT8_MAX+1];
+  uint8_t *targets = NULL;
+  uint16_t nrbytes = getval(obj->bc.nrbytes), nrslots = 0, i = 0, x = 0;
+  uint8_t type = 0, left = 0, right = 0;
+  int8_t ret = 0;
+
+  if(rule_options.variable_type_cb == NULL) {
+    return 0;
+  }
+
+  nrslots = getval(obj->heap->nrbytes)/rule_max_var_bytes();
+  if(nrslots > INT8_MAX+1) {
+    nrslots = INT8_MAX+1;
+  }
+
+  if((targets = (uint8_t *)CALLOC((nrbytes/sizeof(struct vm_top_t))/8+1, 1)) == NULL) {
+    OUT_OF_MEMORY
+  }
+  for(i=0;i<nrbytes;i+=sizeof(struct vm_top_t)) {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i];
+    if(gettype(node->type) == OP_JMP) {
+      x = i/sizeof(struct vm_top_t)+(int8_t)getval(node->a);
+      if(x < nrbytes/sizeof(struct vm_top_t)) {
+        targets[x >> 3] |= 1 << (x & 7);
+      }
+    }
+  }
+
+  for(x=1;x<nrslots;x++) {
+    types[x] = rule_heap_type(obj, -x);
+  }
+
+  for(i=0;i<nrbytes && ret == 0;i+=sizeof(struct vm_top_t)) {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i];
+    int8_t a = getval(node->a), b = getval(node->b), c = getval(node->c);
+
+    x = i/sizeof(struct vm_top_t);
+    if((targets[x >> 3] & (1 << (x & 7))) != 0) {
+      for(x=1;x<nrslots;x++) {
+        types[x] = rule_heap_type(obj, -x);
       }
+    }
 
-      if(x_type != VNULL && y_type != VNULL) {
-        printf("\t%g %s %g = %g -> %d\n", (double)x, op, (double)y, (double)var, vm_val_posr(a));
-      } else if(x_type != VNULL && y_type == VNULL) {
-        printf("\t%g %s NULL = %g -> %d\n", (double)x, op, (double)var, vm_val_posr(a));
-      } else if(x_type == VNULL && y_type != VNULL) {
-        printf("\tNULL %s %g = %g -> %d\n", op, (double)y, (double)var, vm_val_posr(a));
+    type = gettype(node->type);
+    if(is_op_and_math(type)) {
+      left = (-b < nrslots) ? types[-b] : 0;
+      right = (-c < nrslots) ? types[-c] : 0;
+
+      if(left == VCHAR || right == VCHAR) {
+        if(is_math(type) || (type != OP_EQ && type != OP_NE) ||
+          (left != 0 && right != 0 && left != right)) {
+          for(x=0;x<nr_rule_operators;x++) {
+            if(rule_operators[x].opcode == type) {
+              break;
+            }
+          }
+          logerror_P(F("ERROR: cannot %s %s with a %s char value"),
+            is_math(type) ? "compute" : "compare", rule_operators[x].name,
+            (left == VCHAR) ? "left" : "right");
+          ret = -1;
+        }
+      }
+      if(-a < nrslots) {
+        types[-a] = VFLOAT;
+      }
+    } else if(type == OP_GETVAL) {
+      if(-a < nrslots) {
+        types[-a] = rule_var_type(b);
+      }
+    } else if(type == OP_CALL || (type >= OP_MAX && type <= OP_COALESCE)) {
+      if(-a < nrslots) {
+        types[-a] = 0;
+      }
+    } else if(type == OP_SETVAL && (left = rule_var_type(a)) != 0) {
+      if(b < 0) {
+        right = (-b < nrslots) ? types[-b] : 0;
+      } else if(b > 0) {
+        right = VCHAR;
       } else {
-        printf("\tNULL %s NULL = NULL -> %d\n", op, vm_val_posr(a));
+        right = 0;
+      }
+      if(right != 0 && right != left) {
+        struct vm_vchar_t *var = (struct vm_vchar_t *)&varstack->buffer[a*sizeof(struct vm_vchar_t)];
+        logerror_P(F("ERROR: cannot assign a %s value to %s"),
+          (right == VCHAR) ? "char" : "number", (const char *)var->value);
+        ret = -1;
       }
     }
-#endif
+  }
 
-      struct vm_vnull_t *value = (struct vm_vnull_t *)&obj->heap->buffer[a];
-      setval(value->type, VNULL);
+  FREE(targets);
 
-      pos += sizeof(struct vm_top_t);
-      goto BEGIN;
+  return ret;
+}
+
+/*
+ * Records the variables a rule reads and writes,
+ * so they can be fetched and delivered in bulk.
+ */
+static void rule_sets(struct rules_t *obj) {
+  uint16_t reads[INT8_MAX], writes[INT8_MAX];
+  uint16_t i = 0;
+  uint8_t nrreads = 0, nrwrites = 0;
+
+  for(i=0;i<getval(obj->bc.nrbytes);i+=sizeof(struct vm_top_t)) {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i];
+
+    if(gettype(node->type) == OP_GETVAL && varstack_bound(getval(node->b)) == NULL) {
+      nrreads = rule_set_add(reads, nrreads, (int8_t)getval(node->b)+1);
+    } else if(gettype(node->type) == OP_SETVAL && varstack_bound(getval(node->a)) == NULL) {
+      nrwrites = rule_set_add(writes, nrwrites, (int8_t)getval(node->a)+1);
     }
+  }
 
-    STEP_OP_RESULT: {
-#ifdef DEBUG
-      {
-        const char *op = NULL;
-        uint8_t i = 0;
-        for(i=0;i<nr_rule_operators;i++) {
-          if(rule_operators[i].opcode == type) {
-            op = rule_operators[i].name;
-            break;
+  /*
+   * Room for the shadows of the variables that
+   * are assigned, in ascending order, so the
+   * last write tells the highest index.
+   */
+  if(varstack_shadowing == 1 && nrwrites > 0 && writes[nrwrites-1] > varstack_nrshadows) {
+    if((varstack_shadows = (struct rule_value_t *)REALLOC(varstack_shadows, sizeof(struct rule_value_t)*writes[nrwrites-1])) == NULL) {
+      OUT_OF_MEMORY
+    }
+    memset(&varstack_shadows[varstack_nrshadows], 0, sizeof(struct rule_value_t)*(writes[nrwrites-1]-varstack_nrshadows));
+    varstack_nrshadows = writes[nrwrites-1];
+  }
+
+  obj->reads = rule_set_alloc(reads, nrreads);
+  obj->writes = rule_set_alloc(writes, nrwrites);
+}
+
+static uint8_t rule_memoizable(uint16_t fn) {
+  uint8_t flags = rule_functions[fn].flags;
+
+  return (flags & RULE_FUNCTION_EFFECT) == 0 && (flags & (RULE_FUNCTION_PURE | RULE_FUNCTION_RUN)) != 0;
+}
+
+/*
+ * Reserves a cache entry for every call of a pure
+ * or per run function, with room for the values
+ * the bytecode pushes as its arguments.
+ */
+static void rule_memos(struct rules_t *obj) {
+  unsigned char *args = NULL;
+  uint16_t i = 0, size = 0;
+  uint8_t pass = 0, nr = 0, pushes = 0;
+
+  for(pass=0;pass<2;pass++) {
+    if(pass == 1) {
+      if(nr == 0) {
+        return;
+      }
+      if((obj->memos = (struct rule_memo_t *)CALLOC(1, sizeof(struct rule_memo_t)*nr+size)) == NULL) {
+        OUT_OF_MEMORY
+      }
+      args = (unsigned char *)&obj->memos[nr];
+      obj->nrmemos = nr;
+      nr = 0;
+    }
+
+    pushes = 0;
+    for(i=0;i<getval(obj->bc.nrbytes);i+=sizeof(struct vm_top_t)) {
+      struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i];
+
+      if(gettype(node->type) == OP_PUSH) {
+        pushes++;
+      } else if(gettype(node->type) == OP_CLEAR) {
+        pushes = 0;
+      } else if(gettype(node->type) == OP_CALL) {
+        if(getval(node->c) == 0 && pushes <= RULE_FUNCTION_MAX_ARGS && rule_memoizable(getval(node->b)) == 1) {
+          if(pass == 1) {
+            struct rule_memo_t *memo = &obj->memos[nr];
+            memo->args = args;
+            memo->pos = i;
+            memo->fn = getval(node->b);
+            memo->nr = pushes;
+            args += pushes*rule_max_var_bytes();
           }
+          size += pushes*rule_max_var_bytes();
+          nr++;
         }
+        pushes = 0;
+      }
+    }
+  }
+}
 
-        if(x_type == VNULL && y_type == VNULL) {
-          printf("\tNULL %s %g = %g -> %d\n", op, (double)y, (double)var, vm_val_posr(a));
-        } else if(x_type != VNULL && y_type == VNULL) {
-          printf("\tNULL %s %g = %g -> %d\n", op, (double)x, (double)var, vm_val_posr(a));
-        } else if(x_type != VNULL && y_type != VNULL) {
-          printf("\t%g %s %g = %g -> %d\n", (double)x, op, (double)y, (double)var, vm_val_posr(a));
-        } else {
-          printf("\tNULL %s NULL = NULL -> %d\n", op, vm_val_posr(a));
-        }
+/*
+ * Strings an earlier run left in the heap would
+ * keep their varstack slots in use, see
+ * varstack_inuse, so they are cleared when the
+ * rule is entered.
+ */
+static void vm_heap_release(struct rules_t *obj) {
+  uint16_t i = 0;
+
+  for(i=4;i<getval(obj->heap->nrbytes);i+=rule_max_var_bytes()) {
+    if(gettype(obj->heap->buffer[i]) == VPTR) {
+      setval(obj->heap->buffer[i], VNULL | (getval(obj->heap->buffer[i]) & 0xE0));
+    }
+  }
+}
+
+/*
+ * Gives back the references the prefetched
+ * strings hold. This is done when the rule
+ * returns, or when it's prefetched again after
+ * a run that failed.
+ */
+static void vm_prefetch_release(struct rules_t *obj) {
+  struct rule_set_t *reads = obj->reads;
+  uint8_t i = 0;
+
+  if(reads == NULL) {
+    return;
+  }
+  for(i=0;i<reads->used;i++) {
+    if(reads->values[i].type == VCHAR) {
+      rules_unref_handle(reads->values[i].handle);
+    }
+  }
+  reads->used = 0;
+}
+
+/*
+ * Fetches the read set of a rule in a single
+ * call before it runs. Strings the host passes
+ * without a handle are interned, when that fails
+ * they read as nil. Each string is referenced
+ * for as long as the rule runs, so it can't be
+ * replaced by the strings interned after it.
+ */
+static void vm_prefetch(struct rules_t *obj) {
+  struct rule_set_t *reads = obj->reads;
+  struct rule_value_t *value = NULL;
+  uint16_t c = 0;
+  uint8_t i = 0;
+
+  if(rule_options.vm_values_get_bulk == NULL || reads == NULL) {
+    return;
+  }
+
+  vm_prefetch_release(obj);
+  memset(reads->values, 0, sizeof(struct rule_value_t)*reads->nr);
+  for(i=0;i<reads->nr;i++) {
+    reads->values[i].type = VNULL;
+  }
+
+  if(rule_options.vm_values_get_bulk(obj, reads->handles, reads->values, reads->nr) != 0) {
+    return;
+  }
+
+  for(i=0;i<reads->nr;i++) {
+    value = &reads->values[i];
+    if(value->type != VCHAR) {
+      continue;
+    }
+    if(value->handle > varstack->nrbytes/sizeof(struct vm_vchar_t)) {
+      value->handle = 0;
+    } else if(value->handle == 0 && value->val.s != NULL) {
+      char *str = (char *)value->val.s;
+      if((c = varstack_add(&str, 0, strlen(str), 0)) != VARSTACK_FULL) {
+        value->handle = (c/sizeof(struct vm_vchar_t))+1;
       }
-#endif
-      struct vm_vinteger_t *value = (struct vm_vinteger_t *)&obj->heap->buffer[a];
-      setval(value->type, VINTEGER);
-      setval(value->value[0], 0);
-      setval(value->value[1], 0);
-      setval(value->value[2], var);
+    }
+    rules_ref_handle(value->handle);
+  }
 
-      pos += sizeof(struct vm_top_t);
-      goto BEGIN;
+  reads->used = reads->nr;
+}
+
+/*
+ * A prefetched value is only used as long as
+ * the variable isn't assigned during the run.
+ */
+static struct rule_value_t *vm_prefetched(struct rules_t *obj, uint16_t idx) {
+  struct rule_set_t *reads = obj->reads;
+  int16_t low = 0, high = 0, mid = 0;
+
+  if(reads == NULL || reads->used == 0 || (vm_written[idx >> 3] & (1 << (idx & 7))) != 0) {
+    return NULL;
+  }
+
+  high = reads->nr-1;
+  while(low <= high) {
+    mid = (low+high)/2;
+    if(reads->handles[mid] == idx+1) {
+      return &reads->values[mid];
+    } else if(reads->handles[mid] < idx+1) {
+      low = mid+1;
+    } else {
+      high = mid-1;
     }
+  }
+  return NULL;
+}
 
-    STEP_MATH_RESULT: {
-#ifdef DEBUG
-      {
-        const char *op = NULL;
-        uint8_t i = 0;
-        for(i=0;i<nr_rule_operators;i++) {
-          if(rule_operators[i].opcode == type) {
-            op = rule_operators[i].name;
-            break;
-          }
-        }
+/*
+ * Returns the pending assignment of a variable.
+ * When it wasn't assigned yet and add is set, a
+ * new one is taken from the write set.
+ */
+static struct rule_value_t *vm_pending(struct rules_t *obj, uint16_t idx, uint8_t add) {
+  struct rule_set_t *writes = obj->writes;
+  uint8_t i = 0;
+
+  if(rule_options.vm_values_set_bulk == NULL || writes == NULL) {
+    return NULL;
+  }
+
+  if((vm_written[idx >> 3] & (1 << (idx & 7))) != 0) {
+    for(i=0;i<writes->used;i++) {
+      if(writes->handles[i] == idx+1) {
+        return &writes->values[i];
+      }
+    }
+  }
+  if(add == 0 || writes->used >= writes->nr) {
+    return NULL;
+  }
+
+  i = writes->used++;
+  writes->handles[i] = idx+1;
+  memset(&writes->values[i], 0, sizeof(struct rule_value_t));
+  writes->values[i].type = VNULL;
+
+  return &writes->values[i];
+}
+
+/*
+ * Delivers the pending assignments of a rule
+ * in a single call. The strings are only pinned
+ * until the callback returns.
+ */
+static void vm_flush(struct rules_t *obj) {
+  struct rule_set_t *writes = obj->writes;
+  uint8_t i = 0;
+
+  if(rule_options.vm_values_set_bulk == NULL || writes == NULL || writes->used == 0) {
+    return;
+  }
+
+  rule_options.vm_values_set_bulk(obj, writes->handles, writes->values, writes->used);
+
+  for(i=0;i<writes->used;i++) {
+    if(writes->values[i].type == VCHAR) {
+      rules_unpin(writes->values[i].handle);
+    }
+  }
+  writes->used = 0;
+}
+
+/*
+ * Compares a stack value with a stored one.
+ * A value that was never stored differs from
+ * everything.
+ */
+static uint8_t vm_value_equal(struct rule_value_t *value, int8_t pos) {
+  if(rules_type(pos) != value->type) {
+    return 0;
+  }
+
+  switch(value->type) {
+    case VINTEGER: {
+      return rules_tointeger(pos) == value->val.i;
+    } break;
+    case VFLOAT: {
+      return rules_tofloat(pos) == value->val.f;
+    } break;
+    case VCHAR: {
+      return value->val.s != NULL && strcmp(rules_tostring(pos), value->val.s) == 0;
+    } break;
+  }
+
+  return 1;
+}
+
+static struct rule_value_t *varstack_shadow(uint16_t idx) {
+  if(varstack_shadowing == 0 || idx >= varstack_nrshadows) {
+    return NULL;
+  }
+  return &varstack_shadows[idx];
+}
+
+/*
+ * Assigns the value on top of the stack, with
+ * the variable name below it. Assignments that
+ * don't change the last known value are skipped,
+ * the others mark the variable dirty.
+ */
+static void vm_assign(struct rules_t *obj, uint16_t idx, struct rule_value_t *value) {
+  struct rule_value_t *shadow = NULL;
+
+  if(value != NULL) {
+    if(vm_value_equal(value, -1) == 1) {
+      return;
+    }
+  } else if((shadow = varstack_shadow(idx)) != NULL) {
+    if(vm_value_equal(shadow, -1) == 1) {
+      return;
+    }
+    vm_value_store(shadow, -1);
+  }
+  vm_dirty[idx >> 3] |= 1 << (idx & 7);
+
+  if(value == NULL) {
+    value = vm_pending(obj, idx, 1);
+  }
+  if(value != NULL) {
+    vm_value_store(value, -1);
+  } else {
+    rule_options.vm_value_set(obj);
+  }
+}
+
+/*
+ * Decodes a stack value. Strings are interned
+ * first, so the handle stays valid while the
+ * value is on the stack.
+ */
+static void vm_stack_value(int16_t offset, struct rule_value_t *value) {
+  value->handle = 0;
+  value->val.s = NULL;
+
+  switch(gettype(stack->buffer[offset])) {
+    case VINTEGER: {
+      struct vm_vinteger_t *node = (struct vm_vinteger_t *)&stack->buffer[offset];
+      uint32_t val = 0;
+      val |= getval(node->value[0]) << 16;
+      val |= getval(node->value[1]) << 8;
+      val |= getval(node->value[2]);
+
+      /*
+       * Correctly restore sign
+       */
+      if(val & 0x800000) {
+        val |= 0xFF000000;
+      }
+      value->val.i = (int32_t)val;
+      value->type = VINTEGER;
+    } break;
+    case VFLOAT: {
+      struct vm_vfloat_t *node = (struct vm_vfloat_t *)&stack->buffer[offset];
+      uint32_t val = 0;
+
+      val |= (getval(node->type) >> 5) << 29;
+      val |= getval(node->value[0]) << 21;
+      val |= getval(node->value[1]) << 13;
+      val |= getval(node->value[2]) << 5;
+
+      uint322float(val, &value->val.f);
+      value->type = VFLOAT;
+    } break;
+    case VPTR: {
+      if(vm_stack_intern_view(offset) == -1) {
+        value->type = VNULL;
+        break;
+      }
+      struct vm_vptr_t *node = (struct vm_vptr_t *)&stack->buffer[offset];
+      struct vm_vchar_t *var = (struct vm_vchar_t *)&varstack->buffer[getval(node->value)*sizeof(struct vm_top_t)];
+
+      value->handle = ((getval(node->value)*sizeof(struct vm_top_t))/sizeof(struct vm_vchar_t))+1;
+      value->val.s = (const char *)var->value;
+      value->type = VCHAR;
+    } break;
+    default: {
+      value->type = VNULL;
+    } break;
+  }
+}
+
+/*
+ * Calls a typed function with the arguments
+ * decoded in a single pass over the stack and
+ * leaves its result on the stack, the same as
+ * a function using the stack protocol would.
+ */
+static int8_t vm_call_typed(uint16_t nr) {
+  struct rule_value_t args[RULE_FUNCTION_MAX_ARGS], result;
+  uint8_t top = rules_gettop(), i = 0;
+
+  if(top > RULE_FUNCTION_MAX_ARGS) {
+    logerror_P(F("ERROR: %s takes at most %d arguments"), rule_functions[nr].name, RULE_FUNCTION_MAX_ARGS);
+    return -1;
+  }
+
+  for(i=0;i<top;i++) {
+    vm_stack_value(vm_val_pos(i+1), &args[i]);
+  }
+
+  memset(&result, 0, sizeof(struct rule_value_t));
+  result.type = VNULL;
+
+  if(rule_functions[nr].typed(args, top, &result) != 0) {
+    return -1;
+  }
+
+  /*
+   * A string result can point to one of the
+   * arguments, so those are only removed after
+   * it was pushed.
+   */
+  switch(result.type) {
+    case VINTEGER: {
+      rules_settop(0);
+      rules_pushinteger(result.val.i);
+    } break;
+    case VFLOAT: {
+      rules_settop(0);
+      rules_pushfloat(result.val.f);
+    } break;
+    case VCHAR: {
+      if(result.handle > 0) {
+        uint16_t c = (result.handle-1)*sizeof(struct vm_vchar_t);
+        vm_stack_push(c, &varstack->buffer[c]);
+      } else {
+        rules_pushstring((char *)result.val.s);
+      }
+      while(rules_gettop() > 1) {
+        rules_remove(1);
+      }
+    } break;
+    default: {
+      rules_settop(0);
+      rules_pushnil();
+    } break;
+  }
+
+  return 0;
+}
+
+static uint8_t vm_memo_equal(struct rule_memo_t *memo) {
+  uint16_t i = 0;
+
+  if(memo->run == 0 || (memo->run != vm_runs && (rule_functions[memo->fn].flags & RULE_FUNCTION_PURE) == 0)) {
+    return 0;
+  }
+  for(i=0;i<memo->nr*rule_max_var_bytes();i++) {
+    if(getval(stack->buffer[4+i]) != memo->args[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Looks for a call of the same function with the
+ * same arguments, at this or any other place in
+ * the rule. Strings are never cached, because
+ * their slots are reused once released.
+ */
+static struct rule_memo_t *vm_memo_find(struct rules_t *obj, uint16_t pos, uint16_t fn, struct rule_memo_t **own) {
+  struct rule_memo_t *hit = NULL;
+  uint16_t i = 0;
+  uint8_t x = 0, top = rules_gettop();
+
+  *own = NULL;
+
+  for(i=1;i<=top;i++) {
+    if(gettype(stack->buffer[vm_val_pos(i)]) == VPTR) {
+      return NULL;
+    }
+  }
+
+  for(x=0;x<obj->nrmemos;x++) {
+    struct rule_memo_t *memo = &obj->memos[x];
+    if(memo->fn != fn || memo->nr != top) {
+      continue;
+    }
+    if(memo->pos == pos) {
+      *own = memo;
+    }
+    if(hit == NULL && vm_memo_equal(memo) == 1) {
+      hit = memo;
+    }
+  }
+
+  if(*own != NULL && hit == NULL) {
+    for(i=0;i<top*rule_max_var_bytes();i++) {
+      (*own)->args[i] = getval(stack->buffer[4+i]);
+    }
+    (*own)->run = 0;
+  }
+
+  return hit;
+}
+
+static void vm_memo_store(struct rules_t *obj, struct rule_memo_t *memo, int16_t a) {
+  uint8_t i = 0;
+
+  if(gettype(obj->heap->buffer[a]) == VPTR) {
+    return;
+  }
+  for(i=0;i<rule_max_var_bytes();i++) {
+    memo->result[i] = getval(obj->heap->buffer[a+i]);
+  }
+  memo->run = vm_runs;
+}
+
+static int8_t vm_run(struct rules_t *obj, uint8_t validate) {
+  uint16_t pos = 0;
+  uint8_t t = 0;
+
+  /*
+   * This approach is much faster than a switch
+   * Initialize once for even better performance
+   */
+
+  if(jmptbl[1] == NULL) {
+    void *tmp[JMPSIZE] = {
+      NULL,             //                0
+      &&STEP_OP_MATH,   // OP_EQ,         1
+      &&STEP_OP_MATH,   // OP_NE,         2
+      &&STEP_OP_MATH,   // OP_LT,         3
+      &&STEP_OP_MATH,   // OP_LE,         4
+      &&STEP_OP_MATH,   // OP_GT,         5
+      &&STEP_OP_MATH,   // OP_GE,         6
+      &&STEP_OP_MATH,   // OP_AND,        7
+      &&STEP_OP_MATH,   // OP_OR,         8
+      &&STEP_OP_MATH,   // OP_SUB,        9
+      &&STEP_OP_MATH,   // OP_ADD,        10
+      &&STEP_OP_MATH,   // OP_DIV,        11
+      &&STEP_OP_MATH,   // OP_MUL,        12
+      &&STEP_OP_MATH,   // OP_POW,        13
+      &&STEP_OP_MATH,   // OP_MOD,        14
+      &&STEP_TEST,      // OP_JMP,        15
+      &&STEP_JMP,       // OP_JMP,        15
+      &&STEP_SETVAL,    // OP_SETVAL,     16
+      &&STEP_GETVAL,    // OP_GETVAL,     17
+      &&STEP_PUSH,      // OP_PUSH,       18
+      &&STEP_CALL,      // OP_CALL,       19
+      &&STEP_CLEAR,     // OP_CLEAR,      20
+      &&STEP_RET,       // OP_RET         21
+      &&STEP_MINMAX,    // OP_MAX         22
+      &&STEP_MINMAX,    // OP_MIN         23
+      &&STEP_ROUNDING,  // OP_FLOOR       24
+      &&STEP_ROUNDING,  // OP_CEIL        25
+      &&STEP_ROUNDING,  // OP_ROUND       26
+      &&STEP_COALESCE,  // OP_COALESCE    27
+      &&STEP_OP_EQ,     // OP_EQ          28
+      &&STEP_OP_NE,     // OP_NE          29
+      &&STEP_OP_LT,     // OP_LT          30
+      &&STEP_OP_LE,     // OP_LE          31
+      &&STEP_OP_GT,     // OP_GT          32
+      &&STEP_OP_GE,     // OP_GE          33
+      &&STEP_OP_AND,    // OP_AND         34
+      &&STEP_OP_OR,     // OP_OR          35
+      &&STEP_OP_SUB,    // OP_SUB         36
+      &&STEP_OP_ADD,    // OP_ADD         37
+      &&STEP_OP_DIV,    // OP_DIV         38
+      &&STEP_OP_MUL,    // OP_MUL         39
+      &&STEP_OP_POW,    // OP_POW         40
+      &&STEP_OP_MOD,    // OP_MOD         41
+    };
+    memcpy(&jmptbl, &tmp, sizeof(tmp));
+  }
+
+  /*
+   * Values are cleared when they are pushed,
+   * so resetting the stack only has to move
+   * its top, whatever size it grew to before.
+   */
+  setval(stack->nrbytes, 4);
+
+  memset(vm_written, 0, sizeof(vm_written));
+  memset(vm_dirty, 0, sizeof(vm_dirty));
+  vm_obj = obj;
+  vm_heap_release(obj);
+  vm_prefetch(obj);
+
+/*****************/
+  BEGIN:
+    uint8_t type = gettype(obj->bc.buffer[pos]);
+#ifdef DEBUG
+    printf("rule #%d, pos: %lu, op_id: %d, op: %s\n", obj->nr, pos/sizeof(struct vm_top_t), type, op_names[type].name);
+#endif
+    goto *jmptbl[type];
+/*****************/
+
+/*****************/
+  STEP_OP_MATH: {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
+    int16_t a = vm_val_pos((int8_t)getval(node->a));
+    int16_t b = vm_val_pos((int8_t)getval(node->b));
+    int16_t c = vm_val_pos((int8_t)getval(node->c));
+
+#if defined(DEBUG) || defined(COVERALLS)
+    if((int8_t)getval(node->a) >= 0) {
+      logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
+    }
+    if((int8_t)getval(node->b) >= 0) {
+      logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
+    }
+    if((int8_t)getval(node->c) >= 0) {
+      logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
+    }
+    if(b > getval(obj->heap->nrbytes)) {
+      logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
+    }
+    if(c > getval(obj->heap->nrbytes)) {
+      logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
+    }
+#endif
+
+    float nr = 0, var = 0;
+    float x = 0, y = 0;
+    uint8_t x_type = gettype(obj->heap->buffer[b]);
+    uint8_t y_type = gettype(obj->heap->buffer[c]);
+
+    if((type == OP_EQ || type == OP_NE) && x_type == VPTR && y_type == VPTR) {
+      struct vm_vptr_t *node1 = (struct vm_vptr_t *)&obj->heap->buffer[b];
+      struct vm_vptr_t *node2 = (struct vm_vptr_t *)&obj->heap->buffer[c];
+
+      t = varstack_equal(getval(node1->value)*sizeof(struct vm_top_t), getval(node2->value)*sizeof(struct vm_top_t));
+      if(type == OP_NE) {
+        t = !t;
+      }
+      var = t;
+      goto STEP_OP_RESULT;
+    }
+
+    if(x_type == VINTEGER) {
+      struct vm_vinteger_t *node1 = (struct vm_vinteger_t *)&obj->heap->buffer[b];
+      uint32_t val = 0;
+
+      val |= getval(node1->value[0]) << 16;
+      val |= getval(node1->value[1]) << 8;
+      val |= getval(node1->value[2]);
+
+      /*
+       * Correctly restore sign
+       */
+      if(val & 0x800000) {
+        val |= 0xFF000000;
+        x = ((float)(val*-1))*-1;
+      } else {
+        x = (float)val;
+      }
+    } else if(x_type == VFLOAT) {
+      struct vm_vfloat_t *node = (struct vm_vfloat_t *)&obj->heap->buffer[b];
+      uint32_t val = 0;
+
+      val |= (getval(node->type) >> 5) << 29;
+      val |= getval(node->value[0]) << 21;
+      val |= getval(node->value[1]) << 13;
+      val |= getval(node->value[2]) << 5;
+
+      uint322float(val, &x);
+    } else if(x_type == VNULL) {
+#ifndef DEBUG
+      goto STEP_IS_NULL;
+#endif
+    } else if(is_math(type)) {
+      uint8_t i = 0;
+      const char *op = NULL;
+      for(i=0;i<nr_rule_operators;i++) {
+        if(rule_operators[i].opcode == type) {
+          op = rule_operators[i].name;
+          break;
+        }
+      }
+      logerror_P(F("ERROR: cannot compute %s with a left char value"), op);
+      return -1;
+    } else if(is_op_and_math(type)) {
+      uint8_t i = 0;
+      const char *op = NULL;
+      for(i=0;i<nr_rule_operators;i++) {
+        if(rule_operators[i].opcode == type) {
+          op = rule_operators[i].name;
+          break;
+        }
+      }
+      logerror_P(F("ERROR: cannot compare %s with a left char value"), op);
+      return -1;
+    }
+    if(y_type == VINTEGER) {
+      struct vm_vinteger_t *node1 = (struct vm_vinteger_t *)&obj->heap->buffer[c];
+      uint32_t val = 0;
+      val |= getval(node1->value[0]) << 16;
+      val |= getval(node1->value[1]) << 8;
+      val |= getval(node1->value[2]);
+
+      /*
+       * Correctly restore sign
+       */
+      if(val & 0x800000) {
+        val |= 0xFF000000;
+        y = ((float)(val*-1))*-1;
+      } else {
+        y = (float)val;
+      }
+    } else if(y_type == VFLOAT) {
+      struct vm_vfloat_t *node = (struct vm_vfloat_t *)&obj->heap->buffer[c];
+      uint32_t val = 0;
+
+      val |= (getval(node->type) >> 5) << 29;
+      val |= getval(node->value[0]) << 21;
+      val |= getval(node->value[1]) << 13;
+      val |= getval(node->value[2]) << 5;
+
+      uint322float(val, &y);
+    } else if(y_type == VNULL) {
+      goto STEP_IS_NULL;
+    } else if(is_math(type)) {
+      uint8_t i = 0;
+      const char *op = NULL;
+      for(i=0;i<nr_rule_operators;i++) {
+        if(rule_operators[i].opcode == type) {
+          op = rule_operators[i].name;
+          break;
+        }
+      }
+      logerror_P(F("ERROR: cannot compute %s with a right char value"), op);
+      return -1;
+    } else if(is_op_and_math(type)) {
+      uint8_t i = 0;
+      const char *op = NULL;
+      for(i=0;i<nr_rule_operators;i++) {
+        if(rule_operators[i].opcode == type) {
+          op = rule_operators[i].name;
+          break;
+        }
+      }
+      logerror_P(F("ERROR: cannot compare %s with a right char value"), op);
+      return -1;
+    }
+#ifdef DEBUG
+    if(x_type == VNULL) {
+      goto STEP_IS_NULL;
+    }
+#endif
+
+    goto *jmptbl[type+OP_COALESCE];
+
+    STEP_OP_ADD:
+      var = x+y;
+      goto STEP_MATH_RESULT;
+    STEP_OP_DIV:
+      var = x/y;
+      goto STEP_MATH_RESULT;
+    STEP_OP_SUB:
+      var = x-y;
+      goto STEP_MATH_RESULT;
+    STEP_OP_MUL:
+      var = x*y;
+      goto STEP_MATH_RESULT;
+    STEP_OP_POW:
+      var = powf(x, y);
+      goto STEP_MATH_RESULT;
+    STEP_OP_MOD:
+      var = fmodf(x, y);
+      goto STEP_MATH_RESULT;
+    STEP_OP_EQ:
+      t = var = (fabsf(x - y) < EPSILON);
+      goto STEP_OP_RESULT;
+    STEP_OP_NE:
+      t = var = (fabsf(x - y) >= EPSILON);
+      goto STEP_OP_RESULT;
+    STEP_OP_OR:
+      t = var = (x > 0 || y > 0);
+      goto STEP_OP_RESULT;
+    STEP_OP_AND:
+      t = var = (x > 0 && y > 0);
+      goto STEP_OP_RESULT;
+    STEP_OP_LT:
+      t = var = (x < y);
+      goto STEP_OP_RESULT;
+    STEP_OP_LE:
+      t = var = (x <= y);
+      goto STEP_OP_RESULT;
+    STEP_OP_GT:
+      t = var = (x > y);
+      goto STEP_OP_RESULT;
+    STEP_OP_GE:
+      t = var = (x >= y);
+      goto STEP_OP_RESULT;
+
+    t = 1;
+
+    STEP_IS_NULL: {
+#ifdef DEBUG
+    {
+      const char *op = NULL;
+      uint8_t i = 0;
+      for(i=0;i<nr_rule_operators;i++) {
+        if(rule_operators[i].opcode == type) {
+          op = rule_operators[i].name;
+          break;
+        }
+      }
+
+      if(x_type != VNULL && y_type != VNULL) {
+        printf("\t%g %s %g = %g -> %d\n", (double)x, op, (double)y, (double)var, vm_val_posr(a));
+      } else if(x_type != VNULL && y_type == VNULL) {
+        printf("\t%g %s NULL = %g -> %d\n", (double)x, op, (double)var, vm_val_posr(a));
+      } else if(x_type == VNULL && y_type != VNULL) {
+        printf("\tNULL %s %g = %g -> %d\n", op, (double)y, (double)var, vm_val_posr(a));
+      } else {
+        printf("\tNULL %s NULL = NULL -> %d\n", op, vm_val_posr(a));
+      }
+    }
+#endif
+
+      struct vm_vnull_t *value = (struct vm_vnull_t *)&obj->heap->buffer[a];
+      setval(value->type, VNULL);
+
+      pos += sizeof(struct vm_top_t);
+      goto BEGIN;
+    }
+
+    STEP_OP_RESULT: {
+#ifdef DEBUG
+      {
+        const char *op = NULL;
+        uint8_t i = 0;
+        for(i=0;i<nr_rule_operators;i++) {
+          if(rule_operators[i].opcode == type) {
+            op = rule_operators[i].name;
+            break;
+          }
+        }
+
+        if(x_type == VNULL && y_type == VNULL) {
+          printf("\tNULL %s %g = %g -> %d\n", op, (double)y, (double)var, vm_val_posr(a));
+        } else if(x_type != VNULL && y_type == VNULL) {
+          printf("\tNULL %s %g = %g -> %d\n", op, (double)x, (double)var, vm_val_posr(a));
+        } else if(x_type != VNULL && y_type != VNULL) {
+          printf("\t%g %s %g = %g -> %d\n", (double)x, op, (double)y, (double)var, vm_val_posr(a));
+        } else {
+          printf("\tNULL %s NULL = NULL -> %d\n", op, vm_val_posr(a));
+        }
+      }
+#endif
+      struct vm_vinteger_t *value = (struct vm_vinteger_t *)&obj->heap->buffer[a];
+      setval(value->type, VINTEGER);
+      setval(value->value[0], 0);
+      setval(value->value[1], 0);
+      setval(value->value[2], var);
+
+      pos += sizeof(struct vm_top_t);
+      goto BEGIN;
+    }
+
+    STEP_MATH_RESULT: {
+#ifdef DEBUG
+      {
+        const char *op = NULL;
+        uint8_t i = 0;
+        for(i=0;i<nr_rule_operators;i++) {
+          if(rule_operators[i].opcode == type) {
+            op = rule_operators[i].name;
+            break;
+          }
+        }
+
+        if(x_type == VNULL && y_type == VNULL) {
+          printf("\tNULL %s %g = %g -> %d\n", op, (double)y, (double)var, vm_val_posr(a));
+        } else if(x_type != VNULL && y_type == VNULL) {
+          printf("\tNULL %s %g = %g -> %d\n", op, (double)x, (double)var, vm_val_posr(a));
+        } else if(x_type != VNULL && y_type != VNULL) {
+          printf("\t%g %s %g = %g -> %d\n", (double)x, op, (double)y, (double)var, vm_val_posr(a));
+        } else {
+          printf("\tNULL %s NULL = NULL -> %d\n", op, vm_val_posr(a));
+        }
+      }
+#endif
+      if(modff(var, &nr) == 0) {
+        struct vm_vinteger_t *value = (struct vm_vinteger_t *)&obj->heap->buffer[a];
+        setval(value->type, VINTEGER);
+        setval(value->value[0], ((uint32_t)var >> 16) & 0xFF);
+        setval(value->value[1], ((uint32_t)var >> 8) & 0xFF);
+        setval(value->value[2], ((uint32_t)var) & 0xFF);
+      } else {
+        float f = float32to27(var);
+        uint32_t x = 0;
+        float2uint32(f, &x);
+
+        struct vm_vfloat_t *value = (struct vm_vfloat_t *)&obj->heap->buffer[a];
+        setval(value->type, VFLOAT | ((((uint32_t)x >> 29) & 0x7) << 5));
+        setval(value->value[0], ((uint32_t)x >> 21) & 0xFF);
+        setval(value->value[1], ((uint32_t)x >> 13) & 0xFF);
+        setval(value->value[2], ((uint32_t)x >> 5) & 0xFF);
+      }
+
+      pos += sizeof(struct vm_top_t);
+      goto BEGIN;
+    }
+  }
+/*****************/
+
+/*****************/
+  STEP_JMP: {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
+#if defined(DEBUG) || defined(COVERALLS)
+    /* LCOV_EXCL_START*/
+    if((uint8_t)getval(node->a) <= 0) {
+      logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
+    }
+    /* LCOV_EXCL_STOP*/
+#endif
+
+    if(t == 1 || validate == 1) {
+      pos += sizeof(struct vm_top_t);
+    } else {
+      pos += (sizeof(struct vm_top_t)*(int8_t)getval(node->a));
+    }
+
+    t = 0;
+
+    goto BEGIN;
+  }
+/*****************/
+
+/*****************/
+  STEP_TEST: {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
+    int16_t a = vm_val_pos((int8_t)getval(node->a));
+
+    float x = 0;
+    uint8_t x_type = gettype(obj->heap->buffer[a]);
+
+    if(x_type == VINTEGER) {
+      struct vm_vinteger_t *node1 = (struct vm_vinteger_t *)&obj->heap->buffer[a];
+      uint32_t val = 0;
+
+      val |= getval(node1->value[0]) << 16;
+      val |= getval(node1->value[1]) << 8;
+      val |= getval(node1->value[2]);
+
+      /*
+       * Correctly restore sign
+       */
+      if(val & 0x800000) {
+        val |= 0xFF000000;
+        x = ((float)(val*-1))*-1;
+      } else {
+        x = (float)val;
+      }
+      t = (x > 0);
+    } else if(x_type == VFLOAT) {
+      struct vm_vfloat_t *node = (struct vm_vfloat_t *)&obj->heap->buffer[a];
+      uint32_t val = 0;
+
+      val |= (getval(node->type) >> 5) << 29;
+      val |= getval(node->value[0]) << 21;
+      val |= getval(node->value[1]) << 13;
+      val |= getval(node->value[2]) << 5;
+
+      uint322float(val, &x);
+      t = (x > 0);
+    } else if(x_type == VNULL) {
+      t = 0;
+    }
+
+#ifdef DEBUG
+    if(t == 1) {
+      printf("\t= TRUE\n");
+    } else {
+      printf("\t= FALSE\n");
+    }
+#endif
+
+
+    pos += sizeof(struct vm_top_t);
+    goto BEGIN;
+  }
+/*****************/
+
+/*****************/
+  STEP_GETVAL: {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
+
+    uint16_t b = (int8_t)getval(node->b)*sizeof(struct vm_vchar_t);
+    int16_t a = vm_val_pos(getval(node->a));
+
+#if defined(DEBUG) || defined(COVERALLS)
+    if((int8_t)getval(node->b) < 0) {
+      logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
+    }
+    if((int8_t)getval(node->a) >= 0) {
+      logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
+    }
+    if(a > getval(obj->heap->nrbytes)) {
+      logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
+    }
+#endif
+
+    struct rule_value_t *value = NULL;
+    if((value = varstack_bound(getval(node->b))) != NULL ||
+       (value = vm_prefetched(obj, getval(node->b))) != NULL ||
+       (value = vm_pending(obj, getval(node->b), 0)) != NULL) {
+      vm_heap_value(obj, a, value);
+
+      pos += sizeof(struct vm_top_t);
+
+      goto BEGIN;
+    }
+
+    vm_stack_push(b, &varstack->buffer[b]);
+
+    rule_options.vm_value_get(obj);
+
+#if defined(DEBUG) || defined(COVERALLS)
+    /* LCOV_EXCL_START*/
+    if(rules_gettop() < 2) {
+      logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+      return -1;
+    }
+#endif
+
+    /* LCOV_EXCL_STOP*/
+    switch(rules_type(-1)) {
+      case VNULL: {
+        struct vm_vnull_t *upd = (struct vm_vnull_t *)&obj->heap->buffer[a];
+        setval(upd->type, VNULL);
+      } break;
+      case VINTEGER: {
+        int32_t x = rules_tointeger(-1);
+        struct vm_vinteger_t *upd = (struct vm_vinteger_t *)&obj->heap->buffer[a];
+        setval(upd->type, VINTEGER);
+        setval(upd->value[0], ((uint32_t)x >> 16) & 0xFF);
+        setval(upd->value[1], ((uint32_t)x >> 8) & 0xFF);
+        setval(upd->value[2], ((uint32_t)x) & 0xFF);
+      } break;
+      case VCHAR: {
+        int16_t offset = vm_val_pos(-1);
+        offset = getval(stack->nrbytes)-offset;
+
+        if(offset >= 4) {
+          if(getval(stack->buffer[offset]) == VPTR) {
+            struct vm_vptr_t *node = (struct vm_vptr_t *)&stack->buffer[offset];
+
+            struct vm_vptr_t *upd = (struct vm_vptr_t *)&obj->heap->buffer[a];
+            setval(upd->type, VPTR);
+            setval(upd->value, getval(node->value));
+          } else {
+            return -1;
+          }
+        } else {
+          return -1;
+        }
+      } break;
+      case VFLOAT: {
+        float f = rules_tofloat(-1);
+        uint32_t x = 0;
+        float2uint32(f, &x);
+
+        struct vm_vfloat_t *upd = (struct vm_vfloat_t *)&obj->heap->buffer[a];
+
+        setval(upd->type, VFLOAT | ((((uint32_t)x >> 29) & 0x7) << 5));
+        setval(upd->value[0], ((uint32_t)x >> 21) & 0xFF);
+        setval(upd->value[1], ((uint32_t)x >> 13) & 0xFF);
+        setval(upd->value[2], ((uint32_t)x >> 5) & 0xFF);
+
+      } break;
+      /* LCOV_EXCL_START*/
+      default: {
+        logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+        return -1;
+      } break;
+      /* LCOV_EXCL_STOP*/
+    }
+
+    rules_pop(2);
+
+    pos += sizeof(struct vm_top_t);
+
+    goto BEGIN;
+  }
+/*****************/
+
+/*****************/
+  STEP_SETVAL: {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
+    struct rule_value_t *value = varstack_bound(getval(node->a));
+
+    vm_written[getval(node->a) >> 3] |= 1 << (getval(node->a) & 7);
+
+#if defined(DEBUG) || defined(COVERALLS)
+    if((int8_t)getval(node->a) < 0) {
+      logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
+    }
+    // if((int8_t)getval(node->b) > 0) {
+      // logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      // return -1;
+    // }
+#endif
+
+    if((int8_t)getval(node->b) < 0) {
+      uint16_t a = (int8_t)getval(node->a)*sizeof(struct vm_vchar_t);
+      int16_t b = vm_val_pos((int8_t)getval(node->b));
+
+#if defined(DEBUG) || defined(COVERALLS)
+      if(b > getval(obj->heap->nrbytes)) {
+        logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+        return -1;
+      }
+#endif
+
+#ifdef DEBUG
+      struct vm_vchar_t *var = (struct vm_vchar_t *)&varstack->buffer[a];
+      switch(gettype(obj->heap->buffer[b])) {
+        case VINTEGER: {
+          struct vm_vinteger_t *out = (struct vm_vinteger_t *)&obj->heap->buffer[b];
+          uint32_t val = 0;
+          val |= getval(out->value[0]) << 16;
+          val |= getval(out->value[1]) << 8;
+          val |= getval(out->value[2]);
+
+          /*
+           * Correctly restore sign
+           */
+          if(val & 0x800000) {
+            val |= 0xFF000000;
+          }
+          printf("%s = %d\n", (const char *)var->value, val);
+        } break;
+        case VNULL: {
+          printf("%s = NULL\n", (const char *)var->value);
+        } break;
+      }
+#endif
+      vm_stack_push(a, &varstack->buffer[a]);
+      vm_stack_push(b, &obj->heap->buffer[b]);
+
+      vm_assign(obj, getval(node->a), value);
+
+      rules_settop(0);
+    } else if((int8_t)getval(node->b) > 0) {
+      uint16_t a = (int8_t)getval(node->a)*sizeof(struct vm_vchar_t);
+      uint16_t b = (int8_t)(getval(node->b)-1)*sizeof(struct vm_vchar_t);
+
+#if defined(DEBUG) || defined(COVERALLS)
+      if(b > varstack->nrbytes) {
+        logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+        return -1;
+      }
+#endif
+
+      vm_stack_push(a, &varstack->buffer[a]);
+      vm_stack_push(b, &varstack->buffer[b]);
+
+      vm_assign(obj, getval(node->a), value);
+
+      rules_settop(0);
+    } else { // node->b == 0
+      uint16_t a = (int8_t)getval(node->a)*sizeof(struct vm_vchar_t);
+      uint16_t b = ((int8_t)getval(node->b)+1)*rule_max_var_bytes();
+
+      if(rules_gettop() >= 1) {
+        vm_stack_push(a, &varstack->buffer[a]);
+        vm_stack_push(b, &stack->buffer[b]);
+        rules_remove((int8_t)getval(node->b)+1);
+      } else {
+        vm_stack_push(a, &varstack->buffer[a]);
+        rules_pushnil();
+      }
+
+      vm_assign(obj, getval(node->a), value);
+
+      rules_pop(2);
+    }
+    pos += sizeof(struct vm_top_t);
+
+    goto BEGIN;
+  }
+
+  STEP_PUSH: {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
+    if((int8_t)getval(node->a) < 0) {
+      int16_t a = vm_val_pos((int8_t)getval(node->a));
+
+#if defined(DEBUG) || defined(COVERALLS)
+      if(a > getval(obj->heap->nrbytes)) {
+        logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+        return -1;
+      }
+#endif
+
+      vm_stack_push(a, &obj->heap->buffer[a]);
+    } else {
+      uint16_t a = (uint8_t)(getval(node->a)-1)*sizeof(struct vm_vchar_t);
+
+#if defined(DEBUG) || defined(COVERALLS)
+      if(a > varstack->nrbytes) {
+        logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+        return -1;
+      }
+#endif
+
+      vm_stack_push(a, &varstack->buffer[a]);
+    }
+
+    pos += sizeof(struct vm_top_t);
+
+    goto BEGIN;
+  }
+/*****************/
+
+/*****************/
+  STEP_CALL: {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
+    int16_t a = vm_val_pos((int8_t)getval(node->a));
+    uint16_t b = (int8_t)getval(node->b);
+    uint16_t c = (int8_t)getval(node->c);
+
+#if defined(DEBUG) || defined(COVERALLS)
+    if((int8_t)getval(node->a) >= 0) {
+      logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
+    }
+    if((int8_t)getval(node->b) < 0) {
+      logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
+    }
+    if((int8_t)getval(node->c) < 0 || (int8_t)getval(node->c) > 1) {
+      logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
+    }
+    if(a > getval(obj->heap->nrbytes)) {
+      logfatal_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+      return -1;
+    }
+#endif
+
+    struct rule_memo_t *memo = NULL, *hit = NULL;
+
+    if(c == 0 && obj->nrmemos > 0 && rule_memoizable(b) == 1) {
+      hit = vm_memo_find(obj, pos, b, &memo);
+    }
+
+    if(hit != NULL) {
+      uint8_t i = 0;
+      for(i=0;i<rule_max_var_bytes();i++) {
+        setval(obj->heap->buffer[a+i], hit->result[i]);
+      }
+      rules_settop(0);
+    } else if(c == 0) {
+      if(((rule_functions[b].typed != NULL) ? vm_call_typed(b) : rule_functions[b].callback()) != 0) {
+        /* LCOV_EXCL_START*/
+        logfatal_P(F("FATAL: function call '%s' failed"), rule_functions[b].name);
+        return -1;
+        /* LCOV_EXCL_STOP*/
+      }
+      if(rules_gettop() == 1) {
+        switch(rules_type(-1)) {
+          case VNULL: {
+            struct vm_vnull_t *upd = (struct vm_vnull_t *)&obj->heap->buffer[a];
+            setval(upd->type, VNULL);
+          } break;
+          case VINTEGER: {
+            int32_t x = rules_tointeger(-1);
+            struct vm_vinteger_t *upd = (struct vm_vinteger_t *)&obj->heap->buffer[a];
+            setval(upd->type, VINTEGER);
+            setval(upd->value[0], ((uint32_t)x >> 16) & 0xFF);
+            setval(upd->value[1], ((uint32_t)x >> 8) & 0xFF);
+            setval(upd->value[2], ((uint32_t)x) & 0xFF);
+          } break;
+          case VCHAR: {
+            int16_t offset = vm_val_pos(-1);
+            offset = getval(stack->nrbytes)-offset;
+
+            if(offset >= 4) {
+              if(getval(stack->buffer[offset]) == VPTR) {
+                struct vm_vptr_t *node = (struct vm_vptr_t *)&stack->buffer[offset];
+                struct vm_vptr_t *upd = (struct vm_vptr_t *)&obj->heap->buffer[a];
+                setval(upd->type, VPTR);
+                setval(upd->value, getval(node->value));
+              } else {
+                return -1;
+              }
+            } else {
+              return -1;
+            }
+          } break;
+          case VFLOAT: {
+            float f = rules_tofloat(-1);
+            uint32_t x = 0;
+            float2uint32(f, &x);
+
+            struct vm_vfloat_t *upd = (struct vm_vfloat_t *)&obj->heap->buffer[a];
+
+            setval(upd->type, VFLOAT | ((((uint32_t)x >> 29) & 0x7) << 5));
+            setval(upd->value[0], ((uint32_t)x >> 21) & 0xFF);
+            setval(upd->value[1], ((uint32_t)x >> 13) & 0xFF);
+            setval(upd->value[2], ((uint32_t)x >> 5) & 0xFF);
+          } break;
+          /* LCOV_EXCL_START*/
+          default: {
+            logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+            return -1;
+          } break;
+          /* LCOV_EXCL_STOP*/
+        }
+
+        rules_remove(-1);
+
+        if(memo != NULL) {
+          vm_memo_store(obj, memo, a);
+        }
+      }
+    } else {
+      struct vm_vchar_t *var = (struct vm_vchar_t *)&varstack->buffer[b*sizeof(struct vm_vchar_t)];
+
+      if(rule_options.event_cb(obj, var->value) == 1) {
+        setval(obj->cont, pos+sizeof(struct vm_top_t));
+
+        vm_flush(obj);
+
+        obj = obj->ctx.go;
+        pos = 0;
+        vm_obj = obj;
+
+        vm_heap_release(obj);
+        vm_prefetch(obj);
+
+#ifdef DEBUG
+      printf("\n");
+#endif
+
+        goto BEGIN;
+      } else {
+        rules_settop(0);
+      }
+    }
+
+    pos += sizeof(struct vm_top_t);
+
+    goto BEGIN;
+  }
+/*****************/
+
+/*****************/
+  STEP_MINMAX: {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
+    int16_t a = vm_val_pos((int8_t)getval(node->a));
+    int16_t args[2] = { vm_val_pos((int8_t)getval(node->c)), vm_val_pos((int8_t)getval(node->b)) };
+    float x = 0, y = 0;
+    uint8_t i = 0;
+
+    /*
+     * Like the functions, the arguments are taken
+     * from last to first and a nil argument
+     * repeats the one before it.
+     */
+    for(i=0;i<2;i++) {
+      switch(vm_heap_tofloat(obj, args[i], &y)) {
+        case VINTEGER:
+        case VFLOAT:
+        case VNULL: {
+        } break;
+        default: {
+          logerror_P(F("ERROR: %s only takes numbers"), (type == OP_MAX) ? "max" : "min");
+          return -1;
+        } break;
+      }
+      if(i == 0) {
+        x = y;
+      } else if(type == OP_MAX) {
+        x = MAX(x, y);
+      } else {
+        x = MIN(x, y);
+      }
+    }
+
+    vm_heap_number(obj, a, x);
+
+    pos += sizeof(struct vm_top_t);
+
+    goto BEGIN;
+  }
+
+  STEP_ROUNDING: {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
+    int16_t a = vm_val_pos((int8_t)getval(node->a));
+    int16_t b = vm_val_pos((int8_t)getval(node->b));
+    struct rule_value_t value;
+    float x = 0, z = 0;
+    uint8_t dec = 0;
+
+    memset(&value, 0, sizeof(struct rule_value_t));
+
+    if(type == OP_ROUND && (int8_t)getval(node->c) < 0) {
+      int16_t c = vm_val_pos((int8_t)getval(node->c));
+      if(vm_heap_tofloat(obj, c, &x) != VINTEGER) {
+        logerror_P(F("ERROR: round 2nd argument can only be an integer"));
+        return -1;
+      }
+      dec = (int)x;
+    }
+
+    switch(vm_heap_tofloat(obj, b, &x)) {
+      case VNULL: {
+        value.type = VNULL;
+      } break;
+      case VINTEGER:
+      case VFLOAT: {
+        value.type = VINTEGER;
+        if(type == OP_FLOOR) {
+          value.val.i = (int)floorf(x);
+        } else if(type == OP_CEIL) {
+          value.val.i = (int)ceilf(x);
+        } else if(modff(x, &z) != 0 && (int8_t)getval(node->c) < 0) {
+          value.type = VFLOAT;
+          value.val.f = number_round(x, dec);
+        } else {
+          value.val.i = (int)roundf(x);
+        }
+      } break;
+      default: {
+        if(type == OP_ROUND) {
+          logerror_P(F("ERROR: round 1st argument can only be a number"));
+        } else {
+          logerror_P(F("ERROR: %s only takes numbers"), (type == OP_FLOOR) ? "floor" : "ceil");
+        }
+        return -1;
+      } break;
+    }
+
+    vm_heap_value(obj, a, &value);
+
+    pos += sizeof(struct vm_top_t);
+
+    goto BEGIN;
+  }
+
+  STEP_COALESCE: {
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
+    int16_t a = vm_val_pos((int8_t)getval(node->a));
+    int16_t args[2] = { vm_val_pos((int8_t)getval(node->b)), vm_val_pos((int8_t)getval(node->c)) };
+    float x = 0;
+    uint8_t i = 0, x_type = VNULL;
+
+    for(i=0;i<2 && x_type == VNULL;i++) {
+      if((x_type = vm_heap_tofloat(obj, args[i], &x)) == VPTR) {
+        struct vm_vptr_t *node1 = (struct vm_vptr_t *)&obj->heap->buffer[args[i]];
+        struct vm_vptr_t *upd = (struct vm_vptr_t *)&obj->heap->buffer[a];
+        setval(upd->type, VPTR);
+        setval(upd->value, getval(node1->value));
+      }
+    }
+
+    /*
+     * Only nil arguments give zero
+     */
+    if(x_type != VPTR) {
+      vm_heap_number(obj, a, x);
+    }
+
+    pos += sizeof(struct vm_top_t);
+
+    goto BEGIN;
+  }
+/*****************/
+
+/*****************/
+  STEP_CLEAR: {
+
+    rules_settop(0);
+    pos += sizeof(struct vm_top_t);
+
+    goto BEGIN;
+  }
+
+  STEP_RET: {
+    vm_flush(obj);
+    vm_prefetch_release(obj);
+
+    if(rule_options.done_cb != NULL) {
+      rule_options.done_cb(obj);
+    }
+    if(obj->ctx.ret != NULL) {
+      struct rules_t *newctx = obj->ctx.ret;
+      obj->ctx.ret = NULL;
+      obj->ctx.go = NULL;
+
+      obj = newctx;
+      vm_obj = obj;
+      pos = getval(obj->cont);
+
+#ifdef DEBUG
+      printf("\n");
+#endif
+
+    } else {
+      setval(obj->cont, 0);
+
+      return 0;
+    }
+    goto BEGIN;
+  }
+}
+
+int8_t rule_run(struct rules_t *obj, uint8_t validate) {
+  uint8_t phase = mem_phase(MEM_PHASE_RUN);
+  int8_t ret = 0;
+
+  if(++vm_runs == 0) {
+    vm_runs = 1;
+  }
+  ret = vm_run(obj, validate);
+  vm_obj = NULL;
+
+  mem_phase(phase);
+
+  return ret;
+}
+
+#ifdef DEBUG
+static void print_heap(struct rules_t *obj) {
+  uint16_t size = getval(obj->heap->nrbytes), i = 0;
+
+  for(i=4;i<size;i+=rule_max_var_bytes()) {
+    uint8_t type = gettype(obj->heap->buffer[i]);
+    printf("%2lu\t", i/sizeof(struct vm_top_t));
+    switch(type) {
+      case VPTR: {
+        struct vm_vptr_t *node = (struct vm_vptr_t *)&obj->heap->buffer[i];
+        printf("VPTR\t\t%d\n", getval(node->value));
+      } break;
+      case VINTEGER: {
+        struct vm_vinteger_t *node = (struct vm_vinteger_t *)&obj->heap->buffer[i];
+        uint32_t val = 0;
+        val |= getval(node->value[0]) << 16;
+        val |= getval(node->value[1]) << 8;
+        val |= getval(node->value[2]);
+
+        /*
+         * Correctly restore sign
+         */
+        if(val & 0x800000) {
+          val |= 0xFF000000;
+        }
+
+        printf("VINTEGER\t%d\n", val);
+      } break;
+      case VFLOAT: {
+        struct vm_vfloat_t *node = (struct vm_vfloat_t *)&obj->heap->buffer[i];
+        uint32_t val = 0;
+
+        val |= (getval(node->type) >> 5) << 29;
+        val |= getval(node->value[0]) << 21;
+        val |= getval(node->value[1]) << 13;
+        val |= getval(node->value[2]) << 5;
+
+        float f = 0;
+        uint322float(val, &f);
+        printf("VFLOAT\t\t%g\n", (double)f);
+      } break;
+      case VNULL: {
+        printf("VNULL\n");
+      } break;
+    }
+  }
+}
+
+static void print_varstack(void) {
+  uint16_t i = 0;
+
+  for(i=0;i<varstack->nrbytes;i++) {
+    printf("%2lu ", i/sizeof(struct vm_vchar_t));
+
+    switch(gettype(varstack->buffer[i])) {
+      case VCHAR: {
+        struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[i];
+        printf("%d %d", node->fixed, node->ref);
+        if(node->value != NULL) {
+          printf("\t%.*s\n", getval(node->len), node->value);
+        } else {
+          printf("\n");
+        }
+      } break;
+      /* LCOV_EXCL_START*/
+      default: {
+        logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+        return;
+      } break;
+      /* LCOV_EXCL_STOP*/
+    }
+    i += sizeof(struct vm_vchar_t)-1;
+  }
+}
+
+static void print_stack(struct rules_t *obj) {
+  uint16_t size = getval(stack->nrbytes), i = 0;
+
+  for(i=4;i<size;i+=rule_max_var_bytes()) {
+    uint8_t type = getval(stack->buffer[i]);
+    printf("%2d\t", vm_val_posr(i*-1));
+    switch(type) {
+      case VINTEGER: {
+        struct vm_vinteger_t *node = (struct vm_vinteger_t *)&stack->buffer[i];
+        uint32_t val = 0;
+        val |= getval(node->value[0]) << 16;
+        val |= getval(node->value[1]) << 8;
+        val |= getval(node->value[2]);
+
+        /*
+         * Correctly restore sign
+         */
+        if(val & 0x800000) {
+          val |= 0xFF000000;
+        }
+
+        printf("VINTEGER\t%d\n", val);
+      } break;
+      case VFLOAT: {
+        struct vm_vfloat_t *node = (struct vm_vfloat_t *)&stack->buffer[i];
+        uint32_t val = 0;
+
+        val |= (getval(node->type) >> 5) << 29;
+        val |= getval(node->value[0]) << 21;
+        val |= getval(node->value[1]) << 13;
+        val |= getval(node->value[2]) << 5;
+
+        float f = 0;
+        uint322float(val, &f);
+
+        printf("VFLOAT\t\t%g\n", (double)f);
+      } break;
+      case VNULL: {
+        printf("VNULL\n");
+      } break;
+      case VPTR: {
+        struct vm_vptr_t *node = (struct vm_vptr_t *)&stack->buffer[i];
+        uint16_t pos = getval(node->value)*sizeof(struct vm_top_t);
+        struct vm_vchar_t *val = (struct vm_vchar_t *)&varstack->buffer[pos];
+        printf("VCHAR\t%.*s\n", getval(val->len), val->value);
+      } break;
+      /* LCOV_EXCL_START*/
+      default: {
+        logfatal_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
+        return;
+      } break;
+      /* LCOV_EXCL_STOP*/
+    }
+  }
+}
+
+static void print_bytecode(struct rules_t *obj) {
+  uint16_t i = 0;
+  uint16_t nrbytes = getval(obj->bc.nrbytes);
+  uint8_t type = 0;
+  for(i=0;i<nrbytes;i = bc_next(obj, i)) {
+    printf("%2lu\t", i/sizeof(struct vm_top_t));
+    type = gettype(obj->bc.buffer[i]);
+
+    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i];
+    printf("%s\t", op_names[type].name);
+    if(strlen(op_names[type].name) < 8) {
+      printf("\t");
+    }
+    if(type == OP_JMP) {
+      printf("%lu\t", (uint8_t)getval(node->a)+(i/sizeof(struct vm_top_t)));
+    } else {
+      printf("%d\t", (int8_t)getval(node->a));
+    }
+    printf("%d\t", (int8_t)getval(node->b));
+    printf("%d\t", (int8_t)getval(node->c));
+    if(get_group(obj->bc.buffer[i])) {
+      printf(" // %d", get_group(obj->bc.buffer[i]));
+    }
+    printf("\n");
+  }
+}
+#endif
+
+#if defined(DEBUG) || defined(COVERALLS)
+uint16_t rules_memused(void) {
+  return memused;
+}
+#endif
+
+/*
+ * Drops all strings except the pinned ones and
+ * frees the chunks that became empty. The slots
+ * are kept, so the handles of the pinned strings
+ * stay valid. Returns the number of pinned strings.
+ */
+static uint16_t varstack_keep_pinned(void) {
+  uint16_t i = 0, x = 0, nr = 0;
+
+  /*
+   * Views first give back the references they
+   * hold, so only the strings pinned by the host
+   * are left pinned.
+   */
+  for(i=0;i<varstack->nrbytes/sizeof(struct vm_vchar_t);i++) {
+    struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[i*sizeof(struct vm_vchar_t)];
+    if((getval(node->type) & VARSTACK_EXTERNAL) == VARSTACK_EXTERNAL && node->next > 0) {
+      varstack_drop(i);
+    }
+  }
+
+  for(i=0;i<varstack->nrbytes/sizeof(struct vm_vchar_t);i++) {
+    struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[i*sizeof(struct vm_vchar_t)];
+    if((getval(node->type) & VARSTACK_PINNED) == VARSTACK_PINNED) {
+      nr++;
+    }
+  }
+  if(nr == 0) {
+    return 0;
+  }
 
-        if(x_type == VNULL && y_type == VNULL) {
-          printf("\tNULL %s %g = %g -> %d\n", op, (double)y, (double)var, vm_val_posr(a));
-        } else if(x_type != VNULL && y_type == VNULL) {
-          printf("\tNULL %s %g = %g -> %d\n", op, (double)x, (double)var, vm_val_posr(a));
-        } else if(x_type != VNULL && y_type != VNULL) {
-          printf("\t%g %s %g = %g -> %d\n", (double)x, op, (double)y, (double)var, vm_val_posr(a));
-        } else {
-          printf("\tNULL %s NULL = NULL -> %d\n", op, vm_val_posr(a));
-        }
-      }
+#if defined(DEBUG) || defined(COVERALLS)
+  memused = sizeof(struct rule_stack_t);
 #endif
-      if(modff(var, &nr) == 0) {
-        struct vm_vinteger_t *value = (struct vm_vinteger_t *)&obj->heap->buffer[a];
-        setval(value->type, VINTEGER);
-        setval(value->value[0], ((uint32_t)var >> 16) & 0xFF);
-        setval(value->value[1], ((uint32_t)var >> 8) & 0xFF);
-        setval(value->value[2], ((uint32_t)var) & 0xFF);
-      } else {
-        float f = float32to27(var);
-        uint32_t x = 0;
-        float2uint32(f, &x);
 
-        struct vm_vfloat_t *value = (struct vm_vfloat_t *)&obj->heap->buffer[a];
-        setval(value->type, VFLOAT | ((((uint32_t)x >> 29) & 0x7) << 5));
-        setval(value->value[0], ((uint32_t)x >> 21) & 0xFF);
-        setval(value->value[1], ((uint32_t)x >> 13) & 0xFF);
-        setval(value->value[2], ((uint32_t)x >> 5) & 0xFF);
+  for(i=0;i<varstack->nrbytes/sizeof(struct vm_vchar_t);i++) {
+    struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[i*sizeof(struct vm_vchar_t)];
+    setval(node->fixed, 0);
+    if((getval(node->type) & VARSTACK_PINNED) == VARSTACK_PINNED) {
+#if defined(DEBUG) || defined(COVERALLS)
+      if((getval(node->type) & VARSTACK_EXTERNAL) == 0) {
+        memused += getval(node->len)+1;
       }
+#endif
+      continue;
+    }
+    if(node->value != NULL && (getval(node->type) & VARSTACK_EXTERNAL) == 0) {
+      varstack_unlink(i);
+      varstack_dealloc(node->value, getval(node->len)+1);
+    }
+    node->value = NULL;
+    setval(node->len, 0);
+    setval(node->ref, 0);
+    setval(node->type, VCHAR | (getval(node->type) & VARSTACK_RELEASED));
+    varstack_release(i);
+  }
 
-      pos += sizeof(struct vm_top_t);
-      goto BEGIN;
+  for(i=0,x=0;i<varstack_nrchunks;i++) {
+    if(varstack_chunks[i].live == 0) {
+      FREE(varstack_chunks[i].buffer);
+    } else {
+      varstack_chunks[x++] = varstack_chunks[i];
     }
   }
-/*****************/
+  varstack_nrchunks = x;
+  varstack_builder = -1;
 
-/*****************/
-  STEP_JMP: {
-    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
+  varstack->bufsize = varstack->nrbytes;
 #if defined(DEBUG) || defined(COVERALLS)
-    /* LCOV_EXCL_START*/
-    if((uint8_t)getval(node->a) <= 0) {
-      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-      return -1;
-    }
-    /* LCOV_EXCL_STOP*/
+  memused += varstack->bufsize;
 #endif
 
-    if(t == 1 || validate == 1) {
-      pos += sizeof(struct vm_top_t);
-    } else {
-      pos += (sizeof(struct vm_top_t)*(int8_t)getval(node->a));
-    }
+  return nr;
+}
 
-    t = 0;
+/*
+ * Makes room for another nrstrings strings and
+ * a chunk with at least bytes free, so the strings
+ * created while running don't have to allocate.
+ */
+void rules_reserve(uint16_t nrstrings, uint16_t bytes) {
+  uint32_t size = 0;
+  uint16_t hashsize = MAX(varstack_hashsize, VARSTACK_HASH_SIZE), i = 0;
 
-    goto BEGIN;
+  if(varstack == NULL) {
+    return;
   }
-/*****************/
 
-/*****************/
-  STEP_TEST: {
-    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
-    int16_t a = vm_val_pos((int8_t)getval(node->a));
+  size = (uint32_t)varstack->bufsize+(uint32_t)nrstrings*sizeof(struct vm_vchar_t);
+  varstack_reserve(MIN(size, (uint32_t)UINT16_MAX));
 
-    float x = 0;
-    uint8_t x_type = gettype(obj->heap->buffer[a]);
-
-    if(x_type == VINTEGER) {
-      struct vm_vinteger_t *node1 = (struct vm_vinteger_t *)&obj->heap->buffer[a];
-      uint32_t val = 0;
+  while(hashsize < varstack_capacity/sizeof(struct vm_vchar_t)) {
+    hashsize *= 2;
+  }
+  if(hashsize != varstack_hashsize) {
+    varstack_rehash(hashsize);
+  }
 
-      val |= getval(node1->value[0]) << 16;
-      val |= getval(node1->value[1]) << 8;
-      val |= getval(node1->value[2]);
+  for(i=0;i<varstack_nrchunks;i++) {
+    if(varstack_chunks[i].size-varstack_chunks[i].used >= bytes) {
+      break;
+    }
+  }
+  if(i == varstack_nrchunks) {
+    varstack_chunk(bytes);
+  }
+}
 
-      /*
-       * Correctly restore sign
-       */
-      if(val & 0x800000) {
-        val |= 0xFF000000;
-        x = ((float)(val*-1))*-1;
-      } else {
-        x = (float)val;
-      }
-      t = (x > 0);
-    } else if(x_type == VFLOAT) {
-      struct vm_vfloat_t *node = (struct vm_vfloat_t *)&obj->heap->buffer[a];
-      uint32_t val = 0;
+/*
+ * While enabled, running a rule never allocates.
+ * Strings that don't fit in the reserved room are
+ * logged and replaced by nil instead.
+ */
+void rules_noalloc(uint8_t enable) {
+  varstack_noalloc = (enable > 0);
+}
 
-      val |= (getval(node->type) >> 5) << 29;
-      val |= getval(node->value[0]) << 21;
-      val |= getval(node->value[1]) << 13;
-      val |= getval(node->value[2]) << 5;
+/*
+ * Remembers the last value assigned to each
+ * variable, so only assignments that change it
+ * are passed on. Enabling it again forgets the
+ * values, e.g. when the host changed them.
+ */
+void rules_shadow(uint8_t enable) {
+  uint16_t i = 0;
 
-      uint322float(val, &x);
-      t = (x > 0);
-    } else if(x_type == VNULL) {
-      t = 0;
+  for(i=0;i<varstack_nrshadows;i++) {
+    if(varstack_shadows[i].type == VCHAR) {
+      rules_unpin(varstack_shadows[i].handle);
     }
+  }
+  if(varstack_shadows != NULL) {
+    memset(varstack_shadows, 0, sizeof(struct rule_value_t)*varstack_nrshadows);
+  }
+  varstack_shadowing = (enable > 0);
+}
 
-#ifdef DEBUG
-    if(t == 1) {
-      printf("\t= TRUE\n");
-    } else {
-      printf("\t= FALSE\n");
+/*
+ * Returns the handle of the next variable that
+ * changed during the last run, starting after
+ * the given handle, or 0 when there are no more.
+ */
+uint16_t rules_dirty(uint16_t handle) {
+  uint16_t i = 0;
+
+  for(i=handle;i<=INT8_MAX;i++) {
+    if((vm_dirty[i >> 3] & (1 << (i & 7))) != 0) {
+      return i+1;
     }
-#endif
+  }
+  return 0;
+}
 
+void rules_gc(struct rules_t ***rules, uint8_t *nrrules) {
+  uint8_t phase = mem_phase(MEM_PHASE_GC);
+  uint16_t i = 0;
 
-    pos += sizeof(struct vm_top_t);
-    goto BEGIN;
+  for(i=0;i<*nrrules;i++) {
+    FREE((*rules)[i]->reads);
+    FREE((*rules)[i]->writes);
+    FREE((*rules)[i]->memos);
   }
-/*****************/
+  FREE(*rules);
+  *rules = NULL;
+  *nrrules = 0;
 
-/*****************/
-  STEP_GETVAL: {
-    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
+  if(stack != NULL) {
+    stack->bufsize = 0;
+    stack->nrbytes = 0;
+    stack = NULL;
+    stack_capacity = 0;
+  }
 
-    uint16_t b = (int8_t)getval(node->b)*sizeof(struct vm_vchar_t);
-    int16_t a = vm_val_pos(getval(node->a));
+  FREE(varstack_binds);
+  varstack_nrbinds = 0;
 
-#if defined(DEBUG) || defined(COVERALLS)
-    if((int8_t)getval(node->b) < 0) {
-      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-      return -1;
-    }
-    if((int8_t)getval(node->a) >= 0) {
-      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-      return -1;
-    }
-    if(a > getval(obj->heap->nrbytes)) {
-      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-      return -1;
-    }
-#endif
+  rules_shadow(0);
+  FREE(varstack_shadows);
+  varstack_nrshadows = 0;
 
-    vm_stack_push(b, &varstack->buffer[b]);
+  if(varstack != NULL && varstack_keep_pinned() > 0) {
+    mem_phase(phase);
+    return;
+  }
 
-    rule_options.vm_value_get(obj);
+  if(varstack != NULL) {
+    if(varstack->buffer != NULL) {
+      FREE(varstack->buffer);
+    }
+    FREE(varstack);
+  }
+
+  for(i=0;i<varstack_nrchunks;i++) {
+    FREE(varstack_chunks[i].buffer);
+  }
+  FREE(varstack_chunks);
+  varstack_nrchunks = 0;
+  varstack_builder = -1;
+  varstack_capacity = 0;
+
+  FREE(varstack_hash);
+  varstack_hashsize = 0;
+  FREE(varstack_freelist);
+  varstack_nrfree = 0;
+  varstack_freesize = 0;
+  varstack_noalloc = 0;
+  varstack = NULL;
 
 #if defined(DEBUG) || defined(COVERALLS)
-    /* LCOV_EXCL_START*/
-    if(rules_gettop() < 2) {
-      logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
-      return -1;
-    }
+  memused = 0;
 #endif
 
-    /* LCOV_EXCL_STOP*/
-    switch(rules_type(-1)) {
-      case VNULL: {
-        struct vm_vnull_t *upd = (struct vm_vnull_t *)&obj->heap->buffer[a];
-        setval(upd->type, VNULL);
-      } break;
-      case VINTEGER: {
-        int32_t x = rules_tointeger(-1);
-        struct vm_vinteger_t *upd = (struct vm_vinteger_t *)&obj->heap->buffer[a];
-        setval(upd->type, VINTEGER);
-        setval(upd->value[0], ((uint32_t)x >> 16) & 0xFF);
-        setval(upd->value[1], ((uint32_t)x >> 8) & 0xFF);
-        setval(upd->value[2], ((uint32_t)x) & 0xFF);
-      } break;
-      case VCHAR: {
-        int16_t offset = vm_val_pos(-1);
-        offset = getval(stack->nrbytes)-offset;
+  mem_phase(phase);
+}
 
-        if(offset >= 4) {
-          if(getval(stack->buffer[offset]) == VPTR) {
-            struct vm_vptr_t *node = (struct vm_vptr_t *)&stack->buffer[offset];
+/*
+ * A rule image is a flat and pointer free copy of a
+ * rule that passed rule_initialize. The variable, string
+ * and event names are stored by value and the bytecode
+ * refers to them by their index inside the image. This
+ * allows rules to be compiled on a build host and loaded
+ * at boot without parsing them again.
+ *
+ * Rule image header (RULE_IMAGE_HEADER bytes):
+ *  0    'R'
+ *  1    'I'
+ *  2    version
+ *  3    number of names
+ *  4-5  bytecode size
+ *  6-7  heap size
+ *  8-9  names size
+ *  10   name of the rule (name index or 0xFF)
+ *  11   number of functions
+ *  12-15 hash of the function names
+ *
+ * Followed by the bytecode, the heap and the names.
+ * Each name is prefixed by its length.
+ *
+ * The bytecode calls functions by their index, so an
+ * image only loads when the function table has the
+ * same names in the same order.
+ *
+ * A ruleset image holds several rules that share a
+ * single names table. The offsets of each rule are
+ * relative to the start of the image so the image can
+ * be mapped anywhere.
+ *
+ * Ruleset image header (RULESET_IMAGE_HEADER bytes):
+ *  0    'R'
+ *  1    'S'
+ *  2    version
+ *  3    number of rules
+ *  4    number of names
+ *  5    number of functions
+ *  6-7  names size
+ *  8-11 hash of the function names
+ *
+ * Followed by a RULESET_IMAGE_ENTRY bytes entry per rule:
+ *  0-1  bytecode offset
+ *  2-3  bytecode size
+ *  4-5  heap size
+ *  6    name of the rule (name index or 0xFF)
+ *  7    unused
+ *
+ * Followed by the names, padded to 4 bytes, and the
+ * bytecode and heap of each rule.
+ */
+#define RULE_IMAGE_VERSION 4
+#define RULE_IMAGE_HEADER 16
+#define RULESET_IMAGE_HEADER 12
+#define RULESET_IMAGE_ENTRY 8
 
-            struct vm_vptr_t *upd = (struct vm_vptr_t *)&obj->heap->buffer[a];
-            setval(upd->type, VPTR);
-            setval(upd->value, getval(node->value));
-          } else {
-            return -1;
-          }
-        } else {
-          return -1;
-        }
-      } break;
-      case VFLOAT: {
-        float f = rules_tofloat(-1);
-        uint32_t x = 0;
-        float2uint32(f, &x);
+static uint32_t rule_image_functions(void) {
+  uint32_t hash = 2166136261UL;
+  uint16_t i = 0;
+  uint8_t x = 0;
 
-        struct vm_vfloat_t *upd = (struct vm_vfloat_t *)&obj->heap->buffer[a];
+  for(i=0;i<nr_rule_functions;i++) {
+    x = 0;
+    do {
+      hash ^= (uint8_t)rule_functions[i].name[x];
+      hash *= 16777619UL;
+    } while(rule_functions[i].name[x++] != 0);
+  }
 
-        setval(upd->type, VFLOAT | ((((uint32_t)x >> 29) & 0x7) << 5));
-        setval(upd->value[0], ((uint32_t)x >> 21) & 0xFF);
-        setval(upd->value[1], ((uint32_t)x >> 13) & 0xFF);
-        setval(upd->value[2], ((uint32_t)x >> 5) & 0xFF);
+  return hash;
+}
+
+static void rule_image_sethash(unsigned char *out) {
+  uint32_t hash = rule_image_functions();
+
+  out[0] = (hash >> 24) & 0xFF;
+  out[1] = (hash >> 16) & 0xFF;
+  out[2] = (hash >> 8) & 0xFF;
+  out[3] = hash & 0xFF;
+}
+
+static int8_t rule_image_gethash(const unsigned char *in, uint8_t nr) {
+  uint32_t hash = ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+
+  if(nr != nr_rule_functions || hash != rule_image_functions()) {
+    logerror_P(F("ERROR: rule image was created with a different function table"));
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * The bytecode of an image is not produced by this
+ * parser, so every instruction is checked before it
+ * can index the jump table, the heap or the function
+ * table. Varstack operands are checked by the remap.
+ */
+static uint8_t bc_heap_slot(int8_t val, uint16_t heapsize) {
+  return val < 0 && vm_val_pos(val)+rule_max_var_bytes() <= heapsize;
+}
 
+static int8_t bc_validate(const unsigned char *bc, uint16_t bcsize, uint16_t heapsize) {
+  uint16_t i = 0;
+  uint8_t ok = 1;
+
+  if(bcsize == 0 || gettype(bc[bcsize-sizeof(struct vm_top_t)]) != OP_RET) {
+    return -1;
+  }
+
+  for(i=0;i<bcsize && ok == 1;i+=sizeof(struct vm_top_t)) {
+    const struct vm_top_t *node = (const struct vm_top_t *)&bc[i];
+    int8_t a = getval(node->a), b = getval(node->b), c = getval(node->c);
+
+    switch(gettype(node->type)) {
+      case OP_EQ:
+      case OP_NE:
+      case OP_LT:
+      case OP_LE:
+      case OP_GT:
+      case OP_GE:
+      case OP_AND:
+      case OP_OR:
+      case OP_SUB:
+      case OP_ADD:
+      case OP_DIV:
+      case OP_MUL:
+      case OP_POW:
+      case OP_MOD:
+      case OP_MAX:
+      case OP_MIN:
+      case OP_COALESCE: {
+        ok = bc_heap_slot(a, heapsize) && bc_heap_slot(b, heapsize) && bc_heap_slot(c, heapsize);
+      } break;
+      case OP_FLOOR:
+      case OP_CEIL:
+      case OP_ROUND: {
+        ok = bc_heap_slot(a, heapsize) && bc_heap_slot(b, heapsize) && (c == 0 || bc_heap_slot(c, heapsize));
+      } break;
+      case OP_TEST:
+      case OP_GETVAL: {
+        ok = bc_heap_slot(a, heapsize);
+      } break;
+      case OP_JMP: {
+        ok = a > 0 && i+a*sizeof(struct vm_top_t) < bcsize;
+      } break;
+      case OP_SETVAL: {
+        ok = b >= 0 || bc_heap_slot(b, heapsize);
+      } break;
+      case OP_PUSH: {
+        ok = a > 0 || bc_heap_slot(a, heapsize);
+      } break;
+      case OP_CALL: {
+        ok = bc_heap_slot(a, heapsize) && (c == 1 || (c == 0 && b >= 0 && b < nr_rule_functions));
+      } break;
+      case OP_CLEAR:
+      case OP_RET: {
       } break;
-      /* LCOV_EXCL_START*/
       default: {
-        logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
-        return -1;
+        ok = 0;
       } break;
-      /* LCOV_EXCL_STOP*/
     }
+  }
+
+  return (ok == 1) ? 0 : -1;
+}
+
+static int16_t bc_remap_varstack(unsigned char *buffer, uint16_t nrbytes, uint8_t *from, uint8_t *to, uint8_t nr, uint8_t collect) {
+  uint16_t i = 0;
+  uint8_t x = 0, y = 0, n = 0;
+
+  for(i=0;i<nrbytes;i+=sizeof(struct vm_top_t)) {
+    struct vm_top_t *node = (struct vm_top_t *)&buffer[i];
+    int8_t *operand[2] = { NULL, NULL };
+    uint8_t offset[2] = { 0, 0 };
+
+    switch(gettype(node->type)) {
+      case OP_GETVAL: {
+        operand[0] = &node->b;
+      } break;
+      case OP_SETVAL: {
+        operand[0] = &node->a;
+        if((int8_t)getval(node->b) > 0) {
+          operand[1] = &node->b;
+          offset[1] = 1;
+        }
+      } break;
+      case OP_PUSH: {
+        if((int8_t)getval(node->a) > 0) {
+          operand[0] = &node->a;
+          offset[0] = 1;
+        }
+      } break;
+      case OP_CALL: {
+        if((int8_t)getval(node->c) == 1) {
+          operand[0] = &node->b;
+        }
+      } break;
+    }
+
+    for(n=0;n<2;n++) {
+      if(operand[n] == NULL) {
+        continue;
+      }
+      uint8_t val = (int8_t)getval(*operand[n]) - offset[n];
+      for(x=0;x<nr;x++) {
+        if(from[x] == val) {
+          break;
+        }
+      }
+      if(x == nr) {
+        if(collect == 0 || nr >= INT8_MAX) {
+          return -1;
+        }
+        from[nr] = val;
+        to[nr] = nr;
+        nr++;
+      }
+      if(collect == 0) {
+        y = to[x] + offset[n];
+        setval(*operand[n], y);
+      }
+    }
+  }
 
-    rules_remove(-1);
-    rules_remove(-1);
+  return nr;
+}
 
-    pos += sizeof(struct vm_top_t);
+static int16_t rule_image_collect(struct rules_t *obj, uint8_t *from, uint8_t *to, int16_t nr, uint8_t *name) {
+  uint16_t i = 0;
+  uint8_t x = 0;
 
-    goto BEGIN;
+  *name = 0xFF;
+
+  if((nr = bc_remap_varstack(obj->bc.buffer, getval(obj->bc.nrbytes), from, to, nr, 1)) == -1) {
+    logerror_P(F("ERROR: maximum number of 127 variables reached"));
+    return -1;
   }
-/*****************/
 
-/*****************/
-  STEP_SETVAL: {
-    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
+  for(i=0;obj->name != NULL && i<varstack->nrbytes;i+=sizeof(struct vm_vchar_t)) {
+    struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[i];
+    if(node->value == obj->name) {
+      for(x=0;x<nr;x++) {
+        if(from[x] == i/sizeof(struct vm_vchar_t)) {
+          break;
+        }
+      }
+      if(x == nr) {
+        if(nr >= INT8_MAX) {
+          logerror_P(F("ERROR: maximum number of 127 variables reached"));
+          return -1;
+        }
+        from[nr] = i/sizeof(struct vm_vchar_t);
+        to[nr] = nr;
+        nr++;
+      }
+      *name = x;
+      break;
+    }
+  }
 
-#if defined(DEBUG) || defined(COVERALLS)
-    if((int8_t)getval(node->a) < 0) {
-      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
+  for(x=0;x<nr;x++) {
+    struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[from[x]*sizeof(struct vm_vchar_t)];
+    if(getval(node->len) > UINT8_MAX) {
+      logerror_P(F("ERROR: string too long for a rule image"));
       return -1;
     }
-    // if((int8_t)getval(node->b) > 0) {
-      // logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-      // return -1;
-    // }
-#endif
+  }
 
-    if((int8_t)getval(node->b) < 0) {
-      uint16_t a = (int8_t)getval(node->a)*sizeof(struct vm_vchar_t);
-      int16_t b = vm_val_pos((int8_t)getval(node->b));
+  return nr;
+}
 
-#if defined(DEBUG) || defined(COVERALLS)
-      if(b > getval(obj->heap->nrbytes)) {
-        logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-        return -1;
+static uint16_t rule_image_names(uint8_t *from, uint8_t nr, unsigned char *out) {
+  uint16_t pos = 0, i = 0;
+  uint8_t x = 0;
+
+  for(x=0;x<nr;x++) {
+    struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[from[x]*sizeof(struct vm_vchar_t)];
+    uint8_t len = getval(node->len);
+    if(out != NULL) {
+      out[pos] = len;
+      for(i=0;i<len;i++) {
+        out[pos+1+i] = node->value[i];
       }
-#endif
+    }
+    pos += 1+len;
+  }
 
-#ifdef DEBUG
-      struct vm_vchar_t *var = (struct vm_vchar_t *)&varstack->buffer[a];
-      switch(gettype(obj->heap->buffer[b])) {
-        case VINTEGER: {
-          struct vm_vinteger_t *out = (struct vm_vinteger_t *)&obj->heap->buffer[b];
-          uint32_t val = 0;
-          val |= getval(out->value[0]) << 16;
-          val |= getval(out->value[1]) << 8;
-          val |= getval(out->value[2]);
+  return pos;
+}
 
-          /*
-           * Correctly restore sign
-           */
-          if(val & 0x800000) {
-            val |= 0xFF000000;
-          }
-          printf("%s = %d\n", (const char *)var->value, val);
-        } break;
-        case VNULL: {
-          printf("%s = NULL\n", (const char *)var->value);
-        } break;
-      }
-#endif
-      vm_stack_push(a, &varstack->buffer[a]);
-      vm_stack_push(b, &obj->heap->buffer[b]);
+static void rule_image_body(struct rules_t *obj, uint8_t *from, uint8_t *to, uint8_t nr, unsigned char *out) {
+  uint16_t bcsize = getval(obj->bc.nrbytes);
+  uint16_t heapsize = getval(obj->heap->nrbytes);
+  uint16_t i = 0;
 
-      rule_options.vm_value_set(obj);
+  for(i=0;i<bcsize;i++) {
+    out[i] = getval(obj->bc.buffer[i]);
+  }
+  bc_remap_varstack(out, bcsize, from, to, nr, 0);
+  out = &out[bcsize];
 
-      rules_remove(-1);
-      rules_remove(-1);
+  for(i=0;i<heapsize;i++) {
+    out[i] = getval(obj->heap->buffer[i]);
+  }
+  /*
+   * String values are runtime leftovers that point into
+   * the global varstack of this process.
+   */
+  for(i=4;i<heapsize;i+=rule_max_var_bytes()) {
+    if((out[i] & 0x1F) == VPTR) {
+      out[i] = VNULL | (out[i] & 0xE0);
+      out[i+1] = 0;
+      out[i+2] = 0;
+      out[i+3] = 0;
+    }
+  }
+}
 
-      memset(stack->buffer, 0, getval(stack->bufsize));
-      setval(stack->nrbytes, 4);
-    } else if((int8_t)getval(node->b) > 0) {
-      uint16_t a = (int8_t)getval(node->a)*sizeof(struct vm_vchar_t);
-      uint16_t b = (int8_t)(getval(node->b)-1)*sizeof(struct vm_vchar_t);
+static int8_t rule_image_intern(const unsigned char *names, uint16_t namesize, uint8_t nr, uint8_t *to) {
+  uint16_t pos = 0, idx = 0;
+  uint8_t x = 0;
 
+  if(varstack == NULL) {
+    if((varstack = (struct rule_stack_t *)MALLOC(sizeof(struct rule_stack_t))) == NULL) {
+      OUT_OF_MEMORY
+    }
+    memset(varstack, 0, sizeof(struct rule_stack_t));
 #if defined(DEBUG) || defined(COVERALLS)
-      if(b > varstack->nrbytes) {
-        logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-        return -1;
-      }
+    memused += sizeof(struct rule_stack_t);
 #endif
+  }
 
-      vm_stack_push(a, &varstack->buffer[a]);
-      vm_stack_push(b, &varstack->buffer[b]);
-
-      rule_options.vm_value_set(obj);
-
-      rules_remove(-1);
-      rules_remove(-1);
-
-      memset(stack->buffer, 0, getval(stack->bufsize));
-      setval(stack->nrbytes, 4);
-    } else { // node->b == 0
-      uint16_t a = (int8_t)getval(node->a)*sizeof(struct vm_vchar_t);
-      uint16_t b = ((int8_t)getval(node->b)+1)*rule_max_var_bytes();
-
-      if(rules_gettop() >= 1) {
-        vm_stack_push(a, &varstack->buffer[a]);
-        vm_stack_push(b, &stack->buffer[b]);
-        rules_remove((int8_t)getval(node->b)+1);
-      } else {
-        vm_stack_push(a, &varstack->buffer[a]);
-        rules_pushnil();
-      }
-
-      rule_options.vm_value_set(obj);
-
-      rules_remove(-1);
-      rules_remove(-1);
+  for(x=0;x<nr;x++) {
+    if(pos >= namesize || pos+1+names[pos] > namesize) {
+      logerror_P(F("ERROR: rule image is truncated"));
+      return -1;
     }
-    pos += sizeof(struct vm_top_t);
+    char *str = (char *)&names[pos+1];
 
-    goto BEGIN;
+    idx = varstack_add(&str, 0, names[pos], 1);
+    if(idx/sizeof(struct vm_vchar_t) > INT8_MAX) {
+      logerror_P(F("ERROR: maximum number of 127 variables reached"));
+      return -1;
+    }
+    to[x] = idx/sizeof(struct vm_vchar_t);
+    pos += 1+names[pos];
   }
 
-  STEP_PUSH: {
-    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
-    if((int8_t)getval(node->a) < 0) {
-      int16_t a = vm_val_pos((int8_t)getval(node->a));
-
-#if defined(DEBUG) || defined(COVERALLS)
-      if(a > getval(obj->heap->nrbytes)) {
-        logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-        return -1;
-      }
-#endif
-
-      vm_stack_push(a, &obj->heap->buffer[a]);
-    } else {
-      uint16_t a = (uint8_t)(getval(node->a)-1)*sizeof(struct vm_vchar_t);
+  return 0;
+}
 
+/*
+ * Take back a rule that failed to load, the same way
+ * rule_compile does, and move the shared stack back
+ * to where it was before the rule was placed.
+ */
+static void rule_image_unplace(struct rules_t ***rules, uint8_t *nrrules, struct pbuf *mempool, uint16_t len, struct rule_stack_t *oldstack, uint16_t oldcapacity) {
+  (*nrrules)--;
+  if(*nrrules == 0) {
+    FREE(*rules);
+    *rules = NULL;
+  } else if((*rules = (struct rules_t **)REALLOC(*rules, sizeof(struct rules_t **)*((*nrrules)))) == NULL) {
+    OUT_OF_MEMORY
+  }
+  mempool->len = len;
 #if defined(DEBUG) || defined(COVERALLS)
-      if(a > varstack->nrbytes) {
-        logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-        return -1;
-      }
+  memused -= sizeof(struct rules_t **);
 #endif
 
-      vm_stack_push(a, &varstack->buffer[a]);
-    }
+  stack = oldstack;
+  stack_capacity = oldcapacity;
+  if(stack != NULL) {
+    setval(stack->nrbytes, 4);
+    stack->buffer = &((unsigned char *)stack)[sizeof(struct rule_stack_t)];
+  }
+}
 
-    pos += sizeof(struct vm_top_t);
+/*
+ * When shared is set, the bytecode is not copied into
+ * the mempool but used in place. This requires the names
+ * to be interned at the same varstack slots as their
+ * index inside the image.
+ */
+static int8_t rule_image_place(const unsigned char *bc, uint16_t bcsize, const unsigned char *heap, uint16_t heapsize, uint8_t *to, uint8_t nr, uint8_t name, uint8_t shared, struct rules_t ***rules, uint8_t *nrrules, struct pbuf *mempool, void *userdata) {
+  uint8_t from[INT8_MAX];
+  uint16_t max_varstack_size = 4, i = 0;
+  uint8_t x = 0;
 
-    goto BEGIN;
+  if((bcsize % 4) != 0 || (heapsize % 4) != 0 || heapsize < 4 || (name != 0xFF && name >= nr)) {
+    logerror_P(F("ERROR: rule image is corrupt"));
+    return -1;
   }
-/*****************/
 
-/*****************/
-  STEP_CALL: {
-    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[pos];
-    int16_t a = vm_val_pos((int8_t)getval(node->a));
-    uint16_t b = (int8_t)getval(node->b);
-    uint16_t c = (int8_t)getval(node->c);
+  for(x=0;x<nr;x++) {
+    from[x] = x;
+  }
+  if(bc_remap_varstack((unsigned char *)bc, bcsize, from, from, nr, 1) != nr) {
+    logerror_P(F("ERROR: rule image refers to an unknown name"));
+    return -1;
+  }
+  if(bc_validate(bc, bcsize, heapsize) == -1) {
+    logerror_P(F("ERROR: rule image is corrupt"));
+    return -1;
+  }
 
-#if defined(DEBUG) || defined(COVERALLS)
-    if((int8_t)getval(node->a) >= 0) {
-      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-      return -1;
-    }
-    if((int8_t)getval(node->b) < 0) {
-      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-      return -1;
-    }
-    if((int8_t)getval(node->c) < 0 || (int8_t)getval(node->c) > 1) {
-      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-      return -1;
-    }
-    if(a > getval(obj->heap->nrbytes)) {
-      logprintf_P(F("FATAL: Internal error in %s #%d pos (%d)"), __FUNCTION__, __LINE__, pos/4);
-      return -1;
+  if(stack != NULL) {
+    if(getval(stack->bufsize) > max_varstack_size) {
+      max_varstack_size = getval(stack->bufsize);
     }
-#endif
-
-    if(c == 0) {
-      if(rule_functions[b].callback() != 0) {
-        /* LCOV_EXCL_START*/
-        logprintf_P(F("FATAL: function call '%s' failed"), rule_functions[b].name);
-        return -1;
-        /* LCOV_EXCL_STOP*/
-      }
-      if(rules_gettop() == 1) {
-        switch(rules_type(-1)) {
-          case VNULL: {
-            struct vm_vnull_t *upd = (struct vm_vnull_t *)&obj->heap->buffer[a];
-            setval(upd->type, VNULL);
-          } break;
-          case VINTEGER: {
-            int32_t x = rules_tointeger(-1);
-            struct vm_vinteger_t *upd = (struct vm_vinteger_t *)&obj->heap->buffer[a];
-            setval(upd->type, VINTEGER);
-            setval(upd->value[0], ((uint32_t)x >> 16) & 0xFF);
-            setval(upd->value[1], ((uint32_t)x >> 8) & 0xFF);
-            setval(upd->value[2], ((uint32_t)x) & 0xFF);
-          } break;
-          case VCHAR: {
-            int16_t offset = vm_val_pos(-1);
-            offset = getval(stack->nrbytes)-offset;
+  }
 
-            if(offset >= 4) {
-              if(getval(stack->buffer[offset]) == VPTR) {
-                struct vm_vptr_t *node = (struct vm_vptr_t *)&stack->buffer[offset];
-                struct vm_vptr_t *upd = (struct vm_vptr_t *)&obj->heap->buffer[a];
-                setval(upd->type, VPTR);
-                setval(upd->value, getval(node->value));
-              } else {
-                return -1;
-              }
-            } else {
-              return -1;
-            }
-          } break;
-          case VFLOAT: {
-            float f = rules_tofloat(-1);
-            uint32_t x = 0;
-            float2uint32(f, &x);
+  if(shared == 1) {
+    bcsize = 0;
+  }
 
-            struct vm_vfloat_t *upd = (struct vm_vfloat_t *)&obj->heap->buffer[a];
+  while(mempool) {
+    if((mempool->len+sizeof(struct rules_t)+bcsize+heapsize+sizeof(struct rule_stack_t)*2+max_varstack_size) >= mempool->tot_len) {
+      mempool = mempool->next;
+      continue;
+    }
+    break;
+  }
+  if(mempool == NULL) {
+    logfatal_P(F("FATAL #%d: ruleset too large, out of memory"), __LINE__);
+    return -1;
+  }
 
-            setval(upd->type, VFLOAT | ((((uint32_t)x >> 29) & 0x7) << 5));
-            setval(upd->value[0], ((uint32_t)x >> 21) & 0xFF);
-            setval(upd->value[1], ((uint32_t)x >> 13) & 0xFF);
-            setval(upd->value[2], ((uint32_t)x >> 5) & 0xFF);
-          } break;
-          /* LCOV_EXCL_START*/
-          default: {
-            logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
-            return -1;
-          } break;
-          /* LCOV_EXCL_STOP*/
-        }
+  struct rule_stack_t *oldstack = stack;
+  uint16_t oldcapacity = stack_capacity;
+  uint16_t len = mempool->len;
 
-        rules_remove(-1);
-      }
-    } else {
-      struct vm_vchar_t *var = (struct vm_vchar_t *)&varstack->buffer[b*sizeof(struct vm_vchar_t)];
+  if((*rules = (struct rules_t **)REALLOC(*rules, sizeof(struct rules_t **)*((*nrrules)+1))) == NULL) {
+    OUT_OF_MEMORY
+  }
+  struct rules_t *obj = (struct rules_t *)&((unsigned char *)mempool->payload)[mempool->len];
+  (*rules)[*nrrules] = obj;
+  memset(obj, 0, sizeof(struct rules_t));
+  mempool->len += sizeof(struct rules_t);
 
-      if(rule_options.event_cb(obj, var->value) == 1) {
-        setval(obj->cont, pos+sizeof(struct vm_top_t));
+#if defined(DEBUG) || defined(COVERALLS)
+  memused += sizeof(struct rules_t **);
+#endif
 
-        obj = obj->ctx.go;
-        pos = 0;
+  obj->userdata = userdata;
+  obj->ctx.go = NULL;
+  obj->ctx.ret = NULL;
+  obj->name = NULL;
+  setval(obj->nr, (*nrrules)+1);
+  (*nrrules)++;
 
-#ifdef DEBUG
-      printf("\n");
-#endif
+  if(shared == 1) {
+    bcsize = (uint16_t)(heap - bc);
+    obj->bc.buffer = (unsigned char *)bc;
+  } else {
+    obj->bc.buffer = (unsigned char *)&((unsigned char *)mempool->payload)[mempool->len];
+    mempool->len += bcsize;
 
-        goto BEGIN;
-      } else {
-        while(rules_gettop() > 0) {
-          rules_remove(1);
-        }
-      }
+    for(i=0;i<bcsize;i++) {
+      setval(obj->bc.buffer[i], bc[i]);
     }
+    bc_remap_varstack(obj->bc.buffer, bcsize, from, to, nr, 0);
+  }
+  setval(obj->bc.bufsize, bcsize);
+  setval(obj->bc.nrbytes, bcsize);
 
-    pos += sizeof(struct vm_top_t);
+  obj->heap = (struct rule_stack_t *)&((unsigned char *)mempool->payload)[mempool->len];
+  setval(obj->heap->nrbytes, heapsize);
+  setval(obj->heap->bufsize, heapsize);
+  obj->heap->buffer = &((unsigned char *)mempool->payload)[mempool->len+sizeof(struct rule_stack_t)];
+  mempool->len += heapsize+sizeof(struct rule_stack_t);
 
-    goto BEGIN;
+  for(i=0;i<heapsize;i++) {
+    setval(obj->heap->buffer[i], heap[i]);
   }
-/*****************/
 
-/*****************/
-  STEP_CLEAR: {
+  stack = (struct rule_stack_t *)&((unsigned char *)mempool->payload)[mempool->len];
+  setval(stack->bufsize, max_varstack_size);
+  setval(stack->nrbytes, 4);
+  stack->buffer = &((unsigned char *)mempool->payload)[mempool->len+sizeof(struct rule_stack_t)];
+  stack_capacity = mempool->tot_len-mempool->len-sizeof(struct rule_stack_t);
 
-    memset(stack->buffer, 0, getval(stack->bufsize));
-    setval(stack->nrbytes, 4);
-    pos += sizeof(struct vm_top_t);
+  if(name != 0xFF) {
+    struct vm_vchar_t *chr = (struct vm_vchar_t *)&varstack->buffer[to[name]*sizeof(struct vm_vchar_t)];
+    obj->name = (char *)chr->value;
+  }
 
-    goto BEGIN;
+  if(rule_check_types(obj) == -1) {
+    rule_image_unplace(rules, nrrules, mempool, len, oldstack, oldcapacity);
+    return -1;
   }
 
-  STEP_RET: {
-    if(rule_options.done_cb != NULL) {
-      rule_options.done_cb(obj);
-    }
-    if(obj->ctx.ret != NULL) {
-      struct rules_t *newctx = obj->ctx.ret;
-      obj->ctx.ret = NULL;
-      obj->ctx.go = NULL;
+  rule_bind(obj);
+  rule_sets(obj);
+  rule_memos(obj);
 
-      obj = newctx;
-      pos = getval(obj->cont);
+  if(rule_run(obj, 1) == -1) {
+    FREE(obj->reads);
+    FREE(obj->writes);
+    FREE(obj->memos);
+    rule_image_unplace(rules, nrrules, mempool, len, oldstack, oldcapacity);
+    return -1;
+  }
 
-#ifdef DEBUG
-      printf("\n");
-#endif
+  return 0;
+}
 
-    } else {
-      setval(obj->cont, 0);
+uint16_t rule_dump(struct rules_t *obj, unsigned char *out, uint16_t size) {
+  uint8_t from[INT8_MAX], to[INT8_MAX];
+  uint16_t bcsize = getval(obj->bc.nrbytes);
+  uint16_t heapsize = getval(obj->heap->nrbytes);
+  uint16_t namesize = 0, total = 0;
+  uint8_t name = 0xFF;
+  int16_t nr = 0;
 
-      return 0;
-    }
-    goto BEGIN;
+  if((nr = rule_image_collect(obj, from, to, 0, &name)) == -1) {
+    return 0;
   }
-}
 
-#ifdef DEBUG
-static void print_heap(struct rules_t *obj) {
-  uint16_t size = getval(obj->heap->nrbytes), i = 0;
+  namesize = rule_image_names(from, nr, NULL);
+  total = RULE_IMAGE_HEADER + bcsize + heapsize + namesize;
 
-  for(i=4;i<size;i+=rule_max_var_bytes()) {
-    uint8_t type = gettype(obj->heap->buffer[i]);
-    printf("%2lu\t", i/sizeof(struct vm_top_t));
-    switch(type) {
-      case VPTR: {
-        struct vm_vptr_t *node = (struct vm_vptr_t *)&obj->heap->buffer[i];
-        printf("VPTR\t\t%d\n", getval(node->value));
-      } break;
-      case VINTEGER: {
-        struct vm_vinteger_t *node = (struct vm_vinteger_t *)&obj->heap->buffer[i];
-        uint32_t val = 0;
-        val |= getval(node->value[0]) << 16;
-        val |= getval(node->value[1]) << 8;
-        val |= getval(node->value[2]);
+  if(out == NULL) {
+    return total;
+  }
+  if(size < total) {
+    logerror_P(F("ERROR: rule image needs %d bytes"), total);
+    return 0;
+  }
 
-        /*
-         * Correctly restore sign
-         */
-        if(val & 0x800000) {
-          val |= 0xFF000000;
-        }
+  out[0] = 'R';
+  out[1] = 'I';
+  out[2] = RULE_IMAGE_VERSION;
+  out[3] = nr;
+  out[4] = (bcsize >> 8) & 0xFF;
+  out[5] = bcsize & 0xFF;
+  out[6] = (heapsize >> 8) & 0xFF;
+  out[7] = heapsize & 0xFF;
+  out[8] = (namesize >> 8) & 0xFF;
+  out[9] = namesize & 0xFF;
+  out[10] = name;
+  out[11] = nr_rule_functions;
+  rule_image_sethash(&out[12]);
+
+  rule_image_body(obj, from, to, nr, &out[RULE_IMAGE_HEADER]);
+  rule_image_names(from, nr, &out[RULE_IMAGE_HEADER+bcsize+heapsize]);
+
+  return total;
+}
 
-        printf("VINTEGER\t%d\n", val);
-      } break;
-      case VFLOAT: {
-        struct vm_vfloat_t *node = (struct vm_vfloat_t *)&obj->heap->buffer[i];
-        uint32_t val = 0;
+int8_t rule_load(const unsigned char *image, uint16_t size, struct rules_t ***rules, uint8_t *nrrules, struct pbuf *mempool, void *userdata) {
+  uint8_t to[INT8_MAX];
+  uint16_t bcsize = 0, heapsize = 0, namesize = 0;
+  uint8_t nr = 0, phase = 0;
+  int8_t ret = 0;
 
-        val |= (getval(node->type) >> 5) << 29;
-        val |= getval(node->value[0]) << 21;
-        val |= getval(node->value[1]) << 13;
-        val |= getval(node->value[2]) << 5;
+  if(size < RULE_IMAGE_HEADER || image[0] != 'R' || image[1] != 'I' || image[2] != RULE_IMAGE_VERSION) {
+    logerror_P(F("ERROR: not a rule image"));
+    return -1;
+  }
 
-        float f = 0;
-        uint322float(val, &f);
-        printf("VFLOAT\t\t%g\n", (double)f);
-      } break;
-      case VNULL: {
-        printf("VNULL\n");
-      } break;
-    }
+  nr = image[3];
+  bcsize = (image[4] << 8) | image[5];
+  heapsize = (image[6] << 8) | image[7];
+  namesize = (image[8] << 8) | image[9];
+
+  if(RULE_IMAGE_HEADER+bcsize+heapsize+namesize > size || nr > INT8_MAX) {
+    logerror_P(F("ERROR: rule image is truncated"));
+    return -1;
+  }
+  if(rule_image_gethash(&image[12], image[11]) == -1) {
+    return -1;
   }
-}
 
-static void print_varstack(void) {
-  uint16_t i = 0;
+  phase = mem_phase(MEM_PHASE_CREATE);
+  if((ret = rule_image_intern(&image[RULE_IMAGE_HEADER+bcsize+heapsize], namesize, nr, to)) == 0) {
+    ret = rule_image_place(&image[RULE_IMAGE_HEADER], bcsize, &image[RULE_IMAGE_HEADER+bcsize], heapsize,
+      to, nr, image[10], 0, rules, nrrules, mempool, userdata);
+  }
+  mem_phase(phase);
 
-  for(i=0;i<varstack->nrbytes;i++) {
-    printf("%2lu ", i/sizeof(struct vm_vchar_t));
+  return ret;
+}
 
-    switch(varstack->buffer[i]) {
-      case VCHAR: {
-        struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[i];
-        printf("%d %d", node->fixed, node->ref);
-        if(node->value != NULL) {
-          printf("\t%s\n", node->value);
-        } else {
-          printf("\n");
-        }
-      } break;
-      /* LCOV_EXCL_START*/
-      default: {
-        logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
-        return;
-      } break;
-      /* LCOV_EXCL_STOP*/
+uint16_t rules_dump(struct rules_t **rules, uint8_t nrrules, unsigned char *out, uint16_t size) {
+  uint8_t from[INT8_MAX], to[INT8_MAX], name[UINT8_MAX];
+  uint16_t namesize = 0, pos = 0, total = 0;
+  int16_t nr = 0;
+  uint8_t i = 0;
+
+  for(i=0;i<nrrules;i++) {
+    if((nr = rule_image_collect(rules[i], from, to, nr, &name[i])) == -1) {
+      return 0;
     }
-    i += sizeof(struct vm_vchar_t)-1;
   }
-}
 
-static void print_stack(struct rules_t *obj) {
-  uint16_t size = getval(stack->nrbytes), i = 0;
+  namesize = rule_image_names(from, nr, NULL);
+  total = ((RULESET_IMAGE_HEADER + RULESET_IMAGE_ENTRY*nrrules + namesize + 3) & ~0x3);
+  for(i=0;i<nrrules;i++) {
+    total += getval(rules[i]->bc.nrbytes) + getval(rules[i]->heap->nrbytes);
+  }
 
-  for(i=4;i<size;i+=rule_max_var_bytes()) {
-    uint8_t type = getval(stack->buffer[i]);
-    printf("%2d\t", vm_val_posr(i*-1));
-    switch(type) {
-      case VINTEGER: {
-        struct vm_vinteger_t *node = (struct vm_vinteger_t *)&stack->buffer[i];
-        uint32_t val = 0;
-        val |= getval(node->value[0]) << 16;
-        val |= getval(node->value[1]) << 8;
-        val |= getval(node->value[2]);
+  if(out == NULL) {
+    return total;
+  }
+  if(size < total) {
+    logerror_P(F("ERROR: rule image needs %d bytes"), total);
+    return 0;
+  }
 
-        /*
-         * Correctly restore sign
-         */
-        if(val & 0x800000) {
-          val |= 0xFF000000;
-        }
+  memset(out, 0, total);
+  out[0] = 'R';
+  out[1] = 'S';
+  out[2] = RULE_IMAGE_VERSION;
+  out[3] = nrrules;
+  out[4] = nr;
+  out[5] = nr_rule_functions;
+  out[6] = (namesize >> 8) & 0xFF;
+  out[7] = namesize & 0xFF;
+  rule_image_sethash(&out[8]);
+
+  rule_image_names(from, nr, &out[RULESET_IMAGE_HEADER + RULESET_IMAGE_ENTRY*nrrules]);
+  pos = ((RULESET_IMAGE_HEADER + RULESET_IMAGE_ENTRY*nrrules + namesize + 3) & ~0x3);
+
+  for(i=0;i<nrrules;i++) {
+    unsigned char *entry = &out[RULESET_IMAGE_HEADER + RULESET_IMAGE_ENTRY*i];
+    uint16_t bcsize = getval(rules[i]->bc.nrbytes);
+    uint16_t heapsize = getval(rules[i]->heap->nrbytes);
+
+    entry[0] = (pos >> 8) & 0xFF;
+    entry[1] = pos & 0xFF;
+    entry[2] = (bcsize >> 8) & 0xFF;
+    entry[3] = bcsize & 0xFF;
+    entry[4] = (heapsize >> 8) & 0xFF;
+    entry[5] = heapsize & 0xFF;
+    entry[6] = name[i];
+
+    rule_image_body(rules[i], from, to, nr, &out[pos]);
+    pos += bcsize + heapsize;
+  }
 
-        printf("VINTEGER\t%d\n", val);
-      } break;
-      case VFLOAT: {
-        struct vm_vfloat_t *node = (struct vm_vfloat_t *)&stack->buffer[i];
-        uint32_t val = 0;
+  return total;
+}
 
-        val |= (getval(node->type) >> 5) << 29;
-        val |= getval(node->value[0]) << 21;
-        val |= getval(node->value[1]) << 13;
-        val |= getval(node->value[2]) << 5;
+int8_t rules_load(const unsigned char *image, uint16_t size, struct rules_t ***rules, uint8_t *nrrules, struct pbuf *mempool, void *userdata) {
+  uint8_t to[INT8_MAX];
+  uint16_t namesize = 0, offset = 0, bcsize = 0, heapsize = 0;
+  uint8_t nr = 0, shared = 1, i = 0, phase = 0;
+  int8_t ret = 0;
 
-        float f = 0;
-        uint322float(val, &f);
+  if(size < RULESET_IMAGE_HEADER || image[0] != 'R' || image[1] != 'S' || image[2] != RULE_IMAGE_VERSION) {
+    logerror_P(F("ERROR: not a ruleset image"));
+    return -1;
+  }
 
-        printf("VFLOAT\t\t%g\n", (double)f);
-      } break;
-      case VNULL: {
-        printf("VNULL\n");
-      } break;
-      case VPTR: {
-        struct vm_vptr_t *node = (struct vm_vptr_t *)&stack->buffer[i];
-        uint16_t pos = getval(node->value)*sizeof(struct vm_top_t);
-        struct vm_vchar_t *val = (struct vm_vchar_t *)&varstack->buffer[pos];
-        printf("VCHAR\t%s\n", val->value);
-      } break;
-      /* LCOV_EXCL_START*/
-      default: {
-        logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
-        return;
-      } break;
-      /* LCOV_EXCL_STOP*/
-    }
+  nr = image[4];
+  namesize = (image[6] << 8) | image[7];
+
+  if(RULESET_IMAGE_HEADER + RULESET_IMAGE_ENTRY*image[3] + namesize > size || nr > INT8_MAX) {
+    logerror_P(F("ERROR: rule image is truncated"));
+    return -1;
+  }
+  if(rule_image_gethash(&image[8], image[5]) == -1) {
+    return -1;
   }
-}
 
-static void print_bytecode(struct rules_t *obj) {
-  uint16_t i = 0;
-  uint16_t nrbytes = getval(obj->bc.nrbytes);
-  uint8_t type = 0;
-  for(i=0;i<nrbytes;i = bc_next(obj, i)) {
-    printf("%2lu\t", i/sizeof(struct vm_top_t));
-    type = gettype(obj->bc.buffer[i]);
+  phase = mem_phase(MEM_PHASE_CREATE);
+  if(rule_image_intern(&image[RULESET_IMAGE_HEADER + RULESET_IMAGE_ENTRY*image[3]], namesize, nr, to) == -1) {
+    mem_phase(phase);
+    return -1;
+  }
 
-    struct vm_top_t *node = (struct vm_top_t *)&obj->bc.buffer[i];
-    printf("%s\t", op_names[type].name);
-    if(strlen(op_names[type].name) < 8) {
-      printf("\t");
-    }
-    if(type == OP_JMP) {
-      printf("%lu\t", (uint8_t)getval(node->a)+(i/sizeof(struct vm_top_t)));
-    } else {
-      printf("%d\t", (int8_t)getval(node->a));
-    }
-    printf("%d\t", (int8_t)getval(node->b));
-    printf("%d\t", (int8_t)getval(node->c));
-    if(get_group(obj->bc.buffer[i])) {
-      printf(" // %d", get_group(obj->bc.buffer[i]));
+  /*
+   * The bytecode can only be used in place when it
+   * refers to the correct varstack slots and when it
+   * is properly aligned.
+   */
+  if(((uintptr_t)image % 4) != 0) {
+    shared = 0;
+  }
+  for(i=0;i<nr;i++) {
+    if(to[i] != i) {
+      shared = 0;
     }
-    printf("\n");
   }
-}
-#endif
-
-#if defined(DEBUG) || defined(COVERALLS)
-uint16_t rules_memused(void) {
-  return memused;
-}
-#endif
 
-void rules_gc(struct rules_t ***rules, uint8_t *nrrules) {
-  uint16_t i = 0;
+  for(i=0;i<image[3] && ret == 0;i++) {
+    const unsigned char *entry = &image[RULESET_IMAGE_HEADER + RULESET_IMAGE_ENTRY*i];
 
-  FREE(*rules);
-  *rules = NULL;
-  *nrrules = 0;
+    offset = (entry[0] << 8) | entry[1];
+    bcsize = (entry[2] << 8) | entry[3];
+    heapsize = (entry[4] << 8) | entry[5];
 
-  if(varstack != NULL) {
-    for(i=0;i<varstack->nrbytes;i++) {
-      switch(varstack->buffer[i]) {
-        case VCHAR: {
-          struct vm_vchar_t *node = (struct vm_vchar_t *)&varstack->buffer[i];
-          FREE(node->value);
-        } break;
-        /* LCOV_EXCL_START*/
-        default: {
-          logprintf_P(F("FATAL: Internal error in %s #%d"), __FUNCTION__, __LINE__);
-          return;
-        } break;
-        /* LCOV_EXCL_STOP*/
-      }
-      i += sizeof(struct vm_vchar_t)-1;
-    }
-    if(varstack->nrbytes > 0 && varstack->buffer != NULL) {
-      FREE(varstack->buffer);
+    if((offset % 4) != 0 || (uint32_t)offset+bcsize+heapsize > size) {
+      logerror_P(F("ERROR: rule image is truncated"));
+      ret = -1;
+      break;
     }
-    FREE(varstack);
-  }
 
-  if(stack != NULL) {
-    stack->bufsize = 0;
-    stack->nrbytes = 0;
-    stack = NULL;
+    ret = rule_image_place(&image[offset], bcsize, &image[offset+bcsize], heapsize,
+      to, nr, entry[6], shared, rules, nrrules, mempool, userdata);
   }
+  mem_phase(phase);
 
-  varstack = NULL;
-
-#if defined(DEBUG) || defined(COVERALLS)
-  memused = 0;
-#endif
+  return ret;
 }
 
-int8_t rule_initialize(struct pbuf *input, struct rules_t ***rules, uint8_t *nrrules, struct pbuf *mempool, void *userdata) {
+static int8_t rule_compile(struct pbuf *input, struct rules_t ***rules, uint8_t *nrrules, struct pbuf *mempool, void *userdata) {
   struct pbuf *mempool_rule = NULL;
   uint16_t newlen = getval(input->tot_len), max_varstack_size = 4;
   uint16_t heapsize = 4, bcsize = 0, varsize = 0, memsize = 0;
+  uint8_t phase = 0;
+  int16_t ret = 0;
   if(varstack == NULL) {
     if((varstack = (struct rule_stack_t *)MALLOC(sizeof(struct rule_stack_t))) == NULL) {
       OUT_OF_MEMORY
@@ -5340,7 +8308,7 @@ int8_t rule_initialize(struct pbuf *input, struct rules_t ***rules, uint8_t *nrr
       }
     }
     if(mempool == NULL) {
-      logprintf_P(F("FATAL #%d: ruleset too large, out of memory"), __LINE__);
+      logfatal_P(F("FATAL #%d: ruleset too large, out of memory"), __LINE__);
       return -1;
     }
   }
@@ -5379,7 +8347,7 @@ int8_t rule_initialize(struct pbuf *input, struct rules_t ***rules, uint8_t *nrr
   if(rule_prepare((char **)&input->payload, &bcsize, &heapsize, &varsize, &memsize, &newlen) == -1 ||
     (varsize/sizeof(struct vm_vchar_t)) > INT8_MAX) {
     if(varsize/sizeof(struct vm_vchar_t) > INT8_MAX) {
-      logprintf_P(F("ERROR: maximum number of 127 variables reached"));
+      logerror_P(F("ERROR: maximum number of 127 variables reached"));
     }
     if((*rules = (struct rules_t **)REALLOC(*rules, sizeof(struct rules_t **)*((*nrrules)))) == NULL) {
       OUT_OF_MEMORY
@@ -5396,7 +8364,7 @@ int8_t rule_initialize(struct pbuf *input, struct rules_t ***rules, uint8_t *nrr
 #if defined(ESP8266) || defined(ESP32)
   timestamp.second = micros();
 
-  logprintf_P(F("rule #%d was prepared in %d microseconds"), mmu_get_uint8(&obj->nr), timestamp.second - timestamp.first);
+  loginfo_P(F("rule #%d was prepared in %d microseconds"), mmu_get_uint8(&obj->nr), timestamp.second - timestamp.first);
 #else
   clock_gettime(CLOCK_MONOTONIC, &timestamp.second);
 
@@ -5443,7 +8411,7 @@ int8_t rule_initialize(struct pbuf *input, struct rules_t ***rules, uint8_t *nrr
         }
       }
       if(mempool == NULL) {
-        logprintf_P(F("FATAL #%d: ruleset too large, out of memory"), __LINE__);
+        logfatal_P(F("FATAL #%d: ruleset too large, out of memory"), __LINE__);
         if((*rules = (struct rules_t **)REALLOC(*rules, sizeof(struct rules_t **)*((*nrrules)))) == NULL) {
           OUT_OF_MEMORY
         }
@@ -5474,12 +8442,10 @@ int8_t rule_initialize(struct pbuf *input, struct rules_t ***rules, uint8_t *nrr
     setval(stack->bufsize, max_varstack_size);
     setval(stack->nrbytes, 4);
     stack->buffer = &((unsigned char *)mempool->payload)[mempool->len+sizeof(struct rule_stack_t)];
+    stack_capacity = mempool->tot_len-mempool->len-sizeof(struct rule_stack_t);
 
     if(varsize > 0) {
-      if((varstack->buffer = (unsigned char *)REALLOC(varstack->buffer, varstack->bufsize+varsize)) == NULL) {
-        OUT_OF_MEMORY
-      }
-      memset(&varstack->buffer[varstack->bufsize], 0, varsize);
+      varstack_reserve(varstack->bufsize+varsize);
       varstack->bufsize += varsize;
 #if defined(DEBUG) || defined(COVERALLS)
       memused += varsize;
@@ -5493,7 +8459,19 @@ int8_t rule_initialize(struct pbuf *input, struct rules_t ***rules, uint8_t *nrr
     clock_gettime(CLOCK_MONOTONIC, &timestamp.first);
 #endif
     /*LCOV_EXCL_STOP*/
-    if(rule_create((char **)&input->payload, obj) == -1) {
+    phase = mem_phase(MEM_PHASE_CREATE);
+    if((ret = rule_create((char **)&input->payload, obj)) != -1) {
+      bc_intrinsics(obj);
+      ret = rule_check_types(obj);
+    }
+    if(ret != -1) {
+      rule_bind(obj);
+      rule_sets(obj);
+      rule_memos(obj);
+    }
+    mem_phase(phase);
+
+    if(ret == -1) {
       if((*rules = (struct rules_t **)REALLOC(*rules, sizeof(struct rules_t **)*((*nrrules)))) == NULL) {
         OUT_OF_MEMORY
       }
@@ -5509,8 +8487,8 @@ int8_t rule_initialize(struct pbuf *input, struct rules_t ***rules, uint8_t *nrr
 #if defined(ESP8266) || defined(ESP32)
     timestamp.second = micros();
 
-    logprintf_P(F("rule #%d bytecode was created in %d microseconds"), getval(obj->nr), timestamp.second - timestamp.first);
-    logprintf_P(F("bytecode: %d/%d, heap: %d/%d, stack: %d/%d bytes, varstack: %d/%d bytes"),
+    loginfo_P(F("rule #%d bytecode was created in %d microseconds"), getval(obj->nr), timestamp.second - timestamp.first);
+    loginfo_P(F("bytecode: %d/%d, heap: %d/%d, stack: %d/%d bytes, varstack: %d/%d bytes"),
       getval(obj->bc.nrbytes),
       getval(obj->bc.bufsize),
       getval(obj->heap->nrbytes),
@@ -5564,7 +8542,7 @@ int8_t rule_initialize(struct pbuf *input, struct rules_t ***rules, uint8_t *nrr
   printf("heap expected %d, got %d\n", heapsize, getval(obj->heap->nrbytes));
   assert(heapsize >= getval(obj->heap->nrbytes));
   printf("bc expected %d, got %d\n", bcsize, getval(obj->bc.nrbytes));
-  assert(bcsize == getval(obj->bc.nrbytes));
+  assert(bcsize >= getval(obj->bc.nrbytes));
   printf("bcsize: %d, heapsize: %d\n", getval(obj->bc.nrbytes), getval(obj->heap->nrbytes));
 #endif
 /*LCOV_EXCL_STOP*/
@@ -5585,8 +8563,8 @@ int8_t rule_initialize(struct pbuf *input, struct rules_t ***rules, uint8_t *nrr
 #if defined(ESP8266) || defined(ESP32)
   timestamp.second = micros();
 
-  logprintf_P(F("rule #%d was executed in %d microseconds"), getval(obj->nr), timestamp.second - timestamp.first);
-  logprintf_P(F("bytecode: %d/%d, heap: %d/%d, stack: %d/%d bytes, varstack: %d/%d bytes"),
+  loginfo_P(F("rule #%d was executed in %d microseconds"), getval(obj->nr), timestamp.second - timestamp.first);
+  loginfo_P(F("bytecode: %d/%d, heap: %d/%d, stack: %d/%d bytes, varstack: %d/%d bytes"),
     getval(obj->bc.nrbytes),
     getval(obj->bc.bufsize),
     getval(obj->heap->nrbytes),
@@ -5631,3 +8609,16 @@ int8_t rule_initialize(struct pbuf *input, struct rules_t ***rules, uint8_t *nrr
 
   return 0;
 }
+
+/*
+ * Everything up to the bytecode generation is
+ * accounted to the prepare phase.
+ */
+int8_t rule_initialize(struct pbuf *input, struct rules_t ***rules, uint8_t *nrrules, struct pbuf *mempool, void *userdata) {
+  uint8_t phase = mem_phase(MEM_PHASE_PREPARE);
+  int8_t ret = rule_compile(input, rules, nrrules, mempool, userdata);
+
+  mem_phase(phase);
+
+  return ret;
+}
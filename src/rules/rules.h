@@ -115,9 +115,31 @@ typedef enum {
   OP_PUSH = 19,
   OP_CALL = 20,
   OP_CLEAR = 21,
-  OP_RET = 22
+  OP_RET = 22,
+  OP_MAX = 23,
+  OP_MIN = 24,
+  OP_FLOOR = 25,
+  OP_CEIL = 26,
+  OP_ROUND = 27,
+  OP_COALESCE = 28
 } opcodes;
 
+/*
+ * A host owned variable. Variables bound through
+ * the vm_value_bind callback are read and written
+ * directly, without the vm_value_get and vm_value_set
+ * callbacks. A string value is pinned by its handle.
+ */
+typedef struct rule_value_t {
+  union {
+    int i;
+    float f;
+    const char *s;
+  } val;
+  uint16_t handle;
+  uint8_t type;
+} rule_value_t;
+
 typedef struct rules_t {
   /* --- PUBLIC MEMBERS --- */
 
@@ -149,6 +171,19 @@ typedef struct rules_t {
   struct rule_stack_t bc;
   struct rule_stack_t *heap;
 
+  /* The variables this rule reads and
+   * writes, with their values, so they can
+   * be passed to the host in bulk.
+   */
+  struct rule_set_t *reads;
+  struct rule_set_t *writes;
+
+  /* The last results of its calls to pure
+   * and per run functions.
+   */
+  struct rule_memo_t *memos;
+  uint8_t nrmemos;
+
 } __attribute__((aligned(4))) rules_t;
 
 typedef struct rule_options_t {
@@ -157,9 +192,13 @@ typedef struct rule_options_t {
    */
   int8_t (*is_variable_cb)(char *text, uint16_t size);
   int8_t (*is_event_cb)(char *text, uint16_t size);
+  uint8_t (*variable_type_cb)(const char *name, uint16_t len);
 
   int8_t (*vm_value_set)(struct rules_t *obj);
   int8_t (*vm_value_get)(struct rules_t *obj);
+  struct rule_value_t *(*vm_value_bind)(const char *name, uint16_t len);
+  int8_t (*vm_values_get_bulk)(struct rules_t *obj, const uint16_t *handles, struct rule_value_t *values, uint8_t nr);
+  int8_t (*vm_values_set_bulk)(struct rules_t *obj, const uint16_t *handles, struct rule_value_t *values, uint8_t nr);
 
   /*
    * Events
@@ -174,21 +213,51 @@ const char *rule_by_nr(struct rules_t **rule, uint8_t nrrules, uint8_t nr);
 int8_t rule_by_name(struct rules_t **rule, uint8_t nrrules, char *name);
 int8_t rule_initialize(struct pbuf *input, struct rules_t ***rules, uint8_t *nrrules, struct pbuf *mempool, void *userdata);
 int8_t rule_run(struct rules_t *rule, uint8_t validate);
+uint16_t rule_dump(struct rules_t *obj, unsigned char *out, uint16_t size);
+int8_t rule_load(const unsigned char *image, uint16_t size, struct rules_t ***rules, uint8_t *nrrules, struct pbuf *mempool, void *userdata);
+uint16_t rules_dump(struct rules_t **rules, uint8_t nrrules, unsigned char *out, uint16_t size);
+int8_t rules_load(const unsigned char *image, uint16_t size, struct rules_t ***rules, uint8_t *nrrules, struct pbuf *mempool, void *userdata);
 void rules_gc(struct rules_t ***rules, uint8_t *nrrules);
+void rules_reserve(uint16_t nrstrings, uint16_t bytes);
+void rules_noalloc(uint8_t enable);
+void rules_shadow(uint8_t enable);
+uint16_t rules_dirty(uint16_t handle);
 
 void rules_pushnil(void);
 void rules_pushfloat(float nr);
 void rules_pushinteger(int nr);
 void rules_pushstring(char *str);
+void rules_pushlstring(const char *str, uint16_t len);
+void rules_pushstring_ref(const char *str, uint16_t len);
+void rules_pushsubstring(int8_t pos, uint16_t start, uint16_t len);
+
+void rules_strbegin(void);
+void rules_straddstring(const char *str, uint16_t len);
+void rules_straddinteger(int nr);
+void rules_straddfloat(float nr);
+void rules_straddvalue(int8_t pos);
+const char *rules_strget(uint16_t *len);
+void rules_strdiscard(void);
+void rules_strpush(void);
 
 void rules_ref(const char *str);
 void rules_unref(const char *str);
+void rules_ref_handle(uint16_t handle);
+void rules_unref_handle(uint16_t handle);
+uint16_t rules_pin(int8_t pos);
+void rules_unpin(uint16_t handle);
+uint16_t rules_tohandle(int8_t pos);
+const char *rules_fromhandle(uint16_t handle);
+uint16_t rules_findhandle(const char *str, uint16_t len);
 
 int rules_tointeger(int8_t pos);
 float rules_tofloat(int8_t pos);
 const char *rules_tostring(int8_t pos);
+const char *rules_tolstring(int8_t pos, uint16_t *len);
 
 void rules_remove(int8_t pos);
+void rules_pop(uint8_t n);
+void rules_settop(uint8_t n);
 uint8_t rules_gettop(void);
 uint8_t rules_type(int8_t pos);
 
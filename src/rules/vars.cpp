@@ -0,0 +1,542 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifdef ESP8266
+  #pragma GCC diagnostic warning "-fpermissive"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if !defined(ESP8266) && !defined(ESP32)
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+#endif
+
+#include "../common/uint32float.h"
+#include "../common/log.h"
+#include "../common/mem.h"
+#include "vars.h"
+#include "rules.h"
+
+/*
+ * Snapshot layout:
+ *  0    'R'
+ *  1    'V'
+ *  2    version
+ *  3    unused
+ *  4-5  number of variables
+ *
+ * Followed by each variable:
+ *  0    type
+ *  1-2  key length
+ *  ...  key
+ *  ...  value (4 bytes for integers and floats,
+ *       2 bytes length prefixed for strings,
+ *       nothing for NULL)
+ */
+#define RULE_VARS_VERSION 2
+#define RULE_VARS_HEADER 6
+
+struct rule_var_t *rule_vars_find(struct rule_vars_t *vars, const char *key) {
+  uint16_t x = 0;
+
+  for(x=0;x<vars->nr;x++) {
+    if(vars->array[x].key == key || strcmp(vars->array[x].key, key) == 0) {
+      return &vars->array[x];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Variable names are interned, so the keys
+ * passed by the rules can be matched by handle.
+ */
+static struct rule_var_t *rule_vars_find_handle(struct rule_vars_t *vars, uint16_t handle) {
+  uint16_t x = 0;
+
+  for(x=0;x<vars->nr;x++) {
+    if(vars->array[x].keyhandle == handle) {
+      return &vars->array[x];
+    }
+  }
+  return NULL;
+}
+
+static struct rule_var_t *rule_vars_add(struct rule_vars_t *vars, const char *key, uint16_t handle) {
+  struct rule_var_t *var = NULL;
+
+  if((vars->array = (struct rule_var_t *)REALLOC(vars->array, sizeof(struct rule_var_t)*(vars->nr+1))) == NULL) {
+    OUT_OF_MEMORY
+  }
+  var = &vars->array[vars->nr];
+  memset(var, 0, sizeof(struct rule_var_t));
+  vars->nr++;
+
+  var->key = key;
+  var->keyhandle = handle;
+  var->type = VNULL;
+  rules_ref_handle(handle);
+
+  return var;
+}
+
+static void rule_vars_release(struct rule_var_t *var) {
+  if(var->type == VCHAR) {
+    rules_unref_handle(var->valhandle);
+  }
+  var->val.s = NULL;
+  var->valhandle = 0;
+  var->type = VNULL;
+}
+
+/*
+ * Intern a string that is not on the
+ * rules stack and return a referenced
+ * handle to it.
+ */
+static uint16_t rule_vars_intern(const unsigned char *str, uint16_t len) {
+  uint16_t ret = 0;
+
+  rules_pushlstring((const char *)str, len);
+  ret = rules_tohandle(-1);
+  rules_ref_handle(ret);
+  rules_remove(-1);
+
+  return ret;
+}
+
+int8_t rule_vars_set(struct rule_vars_t *vars) {
+  struct rule_var_t *var = NULL;
+  uint8_t type = 0;
+
+  if(rules_gettop() < 2) {
+    return -1;
+  }
+  type = rules_type(-1);
+
+  if(rules_type(-2) != VCHAR ||
+    (type != VINTEGER && type != VFLOAT && type != VNULL && type != VCHAR)) {
+    return -1;
+  }
+
+  const char *key = rules_tostring(-2);
+  uint16_t handle = rules_tohandle(-2);
+
+  if((var = rule_vars_find_handle(vars, handle)) == NULL) {
+    var = rule_vars_add(vars, key, handle);
+  }
+
+  switch(type) {
+    case VINTEGER: {
+      rule_vars_release(var);
+      var->val.i = rules_tointeger(-1);
+      var->type = VINTEGER;
+    } break;
+    case VFLOAT: {
+      rule_vars_release(var);
+      var->val.f = rules_tofloat(-1);
+      var->type = VFLOAT;
+    } break;
+    case VCHAR: {
+      uint16_t handle = rules_tohandle(-1);
+      rules_ref_handle(handle);
+      rule_vars_release(var);
+      var->val.s = rules_tostring(-1);
+      var->valhandle = handle;
+      var->type = VCHAR;
+    } break;
+    case VNULL: {
+      rule_vars_release(var);
+    } break;
+  }
+
+  return 0;
+}
+
+int8_t rule_vars_get(struct rule_vars_t *vars) {
+  struct rule_var_t *var = NULL;
+
+  if(rules_gettop() < 1) {
+    return -1;
+  }
+  if(rules_type(-1) != VCHAR) {
+    return -1;
+  }
+
+  if((var = rule_vars_find_handle(vars, rules_tohandle(-1))) == NULL) {
+    rules_pushnil();
+    return 0;
+  }
+
+  switch(var->type) {
+    case VINTEGER: {
+      rules_pushinteger(var->val.i);
+    } break;
+    case VFLOAT: {
+      rules_pushfloat(var->val.f);
+    } break;
+    case VCHAR: {
+      rules_pushstring((char *)var->val.s);
+    } break;
+    default: {
+      rules_pushnil();
+    } break;
+  }
+
+  return 0;
+}
+
+/*
+ * Fills the read set of a rule at once. The
+ * strings are referenced by the store, so they
+ * are passed by handle.
+ */
+int8_t rule_vars_get_bulk(struct rule_vars_t *vars, const uint16_t *handles, struct rule_value_t *values, uint8_t nr) {
+  struct rule_var_t *var = NULL;
+  uint8_t i = 0;
+
+  for(i=0;i<nr;i++) {
+    if((var = rule_vars_find_handle(vars, handles[i])) == NULL) {
+      continue;
+    }
+    switch(var->type) {
+      case VINTEGER: {
+        values[i].val.i = var->val.i;
+      } break;
+      case VFLOAT: {
+        values[i].val.f = var->val.f;
+      } break;
+      case VCHAR: {
+        values[i].val.s = var->val.s;
+        values[i].handle = var->valhandle;
+      } break;
+    }
+    values[i].type = var->type;
+  }
+
+  return 0;
+}
+
+/*
+ * Stores the assignments of a rule at once. The
+ * strings are only valid during the call, so the
+ * store takes its own reference on them.
+ */
+int8_t rule_vars_set_bulk(struct rule_vars_t *vars, const uint16_t *handles, struct rule_value_t *values, uint8_t nr) {
+  struct rule_var_t *var = NULL;
+  uint8_t i = 0;
+
+  for(i=0;i<nr;i++) {
+    if((var = rule_vars_find_handle(vars, handles[i])) == NULL) {
+      var = rule_vars_add(vars, rules_fromhandle(handles[i]), handles[i]);
+    }
+    if(values[i].type == VCHAR) {
+      rules_ref_handle(values[i].handle);
+    }
+    rule_vars_release(var);
+
+    switch(values[i].type) {
+      case VINTEGER: {
+        var->val.i = values[i].val.i;
+      } break;
+      case VFLOAT: {
+        var->val.f = values[i].val.f;
+      } break;
+      case VCHAR: {
+        var->val.s = values[i].val.s;
+        var->valhandle = values[i].handle;
+      } break;
+    }
+    var->type = values[i].type;
+  }
+
+  return 0;
+}
+
+void rule_vars_clear(struct rule_vars_t *vars) {
+  uint16_t x = 0;
+
+  for(x=0;x<vars->nr;x++) {
+    rule_vars_release(&vars->array[x]);
+    rules_unref_handle(vars->array[x].keyhandle);
+  }
+  FREE(vars->array);
+  vars->nr = 0;
+}
+
+uint32_t rule_vars_serialize(struct rule_vars_t *vars, unsigned char *out, uint32_t size) {
+  uint32_t total = RULE_VARS_HEADER, pos = 0, val = 0;
+  uint16_t x = 0, len = 0;
+
+  for(x=0;x<vars->nr;x++) {
+    struct rule_var_t *var = &vars->array[x];
+    total += 3 + strlen(var->key);
+    switch(var->type) {
+      case VINTEGER:
+      case VFLOAT: {
+        total += 4;
+      } break;
+      case VCHAR: {
+        total += 2 + strlen(var->val.s);
+      } break;
+    }
+  }
+
+  if(out == NULL) {
+    return total;
+  }
+  if(size < total) {
+    logerror_P(F("ERROR: variable snapshot needs %d bytes"), total);
+    return 0;
+  }
+
+  out[0] = 'R';
+  out[1] = 'V';
+  out[2] = RULE_VARS_VERSION;
+  out[3] = 0;
+  out[4] = (vars->nr >> 8) & 0xFF;
+  out[5] = vars->nr & 0xFF;
+  pos = RULE_VARS_HEADER;
+
+  for(x=0;x<vars->nr;x++) {
+    struct rule_var_t *var = &vars->array[x];
+
+    len = strlen(var->key);
+    out[pos++] = var->type;
+    out[pos++] = (len >> 8) & 0xFF;
+    out[pos++] = len & 0xFF;
+    memcpy(&out[pos], var->key, len);
+    pos += len;
+
+    switch(var->type) {
+      case VINTEGER:
+      case VFLOAT: {
+        if(var->type == VINTEGER) {
+          val = (uint32_t)var->val.i;
+        } else {
+          float2uint32(var->val.f, &val);
+        }
+        out[pos++] = (val >> 24) & 0xFF;
+        out[pos++] = (val >> 16) & 0xFF;
+        out[pos++] = (val >> 8) & 0xFF;
+        out[pos++] = val & 0xFF;
+      } break;
+      case VCHAR: {
+        len = strlen(var->val.s);
+        out[pos++] = (len >> 8) & 0xFF;
+        out[pos++] = len & 0xFF;
+        memcpy(&out[pos], var->val.s, len);
+        pos += len;
+      } break;
+    }
+  }
+
+  return total;
+}
+
+/*
+ * Walks the snapshot without touching the
+ * store, so a corrupt or truncated snapshot
+ * leaves the current variables as they are.
+ */
+static int8_t rule_vars_validate(const unsigned char *in, uint32_t size) {
+  uint32_t pos = RULE_VARS_HEADER, len = 0;
+  uint16_t nr = 0, x = 0;
+  uint8_t type = 0;
+
+  if(size < RULE_VARS_HEADER || in[0] != 'R' || in[1] != 'V' || in[2] != RULE_VARS_VERSION) {
+    logerror_P(F("ERROR: not a variable snapshot"));
+    return -1;
+  }
+
+  nr = (in[4] << 8) | in[5];
+
+  for(x=0;x<nr;x++) {
+    if(pos+3 > size || pos+3+((in[pos+1] << 8) | in[pos+2]) > size) {
+      logerror_P(F("ERROR: variable snapshot is truncated"));
+      return -1;
+    }
+    type = in[pos];
+    pos += 3+((in[pos+1] << 8) | in[pos+2]);
+
+    switch(type) {
+      case VINTEGER:
+      case VFLOAT: {
+        len = 4;
+      } break;
+      case VCHAR: {
+        if(pos+2 > size) {
+          logerror_P(F("ERROR: variable snapshot is truncated"));
+          return -1;
+        }
+        len = 2+((in[pos] << 8) | in[pos+1]);
+      } break;
+      case VNULL: {
+        len = 0;
+      } break;
+      default: {
+        logerror_P(F("ERROR: variable snapshot is corrupt"));
+        return -1;
+      } break;
+    }
+    if(pos+len > size) {
+      logerror_P(F("ERROR: variable snapshot is truncated"));
+      return -1;
+    }
+    pos += len;
+  }
+
+  return 0;
+}
+
+int8_t rule_vars_deserialize(struct rule_vars_t *vars, const unsigned char *in, uint32_t size) {
+  struct rule_var_t *var = NULL;
+  uint32_t pos = RULE_VARS_HEADER, val = 0;
+  uint16_t nr = 0, x = 0, len = 0;
+  uint8_t type = 0;
+
+  if(rule_vars_validate(in, size) == -1) {
+    return -1;
+  }
+
+  rule_vars_clear(vars);
+
+  nr = (in[4] << 8) | in[5];
+
+  for(x=0;x<nr;x++) {
+    type = in[pos];
+    len = (in[pos+1] << 8) | in[pos+2];
+    pos += 3;
+
+    uint16_t handle = rule_vars_intern(&in[pos], len);
+    pos += len;
+
+    var = rule_vars_add(vars, rules_fromhandle(handle), handle);
+    rules_unref_handle(handle);
+
+    switch(type) {
+      case VINTEGER:
+      case VFLOAT: {
+        val = ((uint32_t)in[pos] << 24) | (in[pos+1] << 16) | (in[pos+2] << 8) | in[pos+3];
+        pos += 4;
+        if(type == VINTEGER) {
+          var->val.i = (int)val;
+        } else {
+          uint322float(val, &var->val.f);
+        }
+        var->type = type;
+      } break;
+      case VCHAR: {
+        len = (in[pos] << 8) | in[pos+1];
+        var->valhandle = rule_vars_intern(&in[pos+2], len);
+        var->val.s = rules_fromhandle(var->valhandle);
+        var->type = VCHAR;
+        pos += 2+len;
+      } break;
+    }
+  }
+
+  return 0;
+}
+
+#if !defined(ESP8266) && !defined(ESP32)
+/*
+ * The snapshot is first written to a temporary
+ * file which replaces the old snapshot when
+ * it is fully written.
+ */
+int8_t rule_vars_snapshot(struct rule_vars_t *vars, const char *file) {
+  uint32_t size = rule_vars_serialize(vars, NULL, 0), pos = 0;
+  unsigned char *buffer = NULL;
+  char *tmp = NULL;
+  ssize_t n = 0;
+  int fd = -1, ret = 0;
+
+  if((buffer = (unsigned char *)MALLOC(size)) == NULL) {
+    OUT_OF_MEMORY
+  }
+  if((tmp = (char *)MALLOC(strlen(file)+5)) == NULL) {
+    OUT_OF_MEMORY
+  }
+  sprintf(tmp, "%s.tmp", file);
+
+  rule_vars_serialize(vars, buffer, size);
+
+  if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    logerror_P(F("ERROR: cannot open %s"), tmp);
+    FREE(buffer);
+    FREE(tmp);
+    return -1;
+  }
+
+  while(pos < size) {
+    if((n = write(fd, &buffer[pos], size-pos)) <= 0) {
+      logerror_P(F("ERROR: cannot write %s"), tmp);
+      close(fd);
+      unlink(tmp);
+      FREE(buffer);
+      FREE(tmp);
+      return -1;
+    }
+    pos += n;
+  }
+
+  /*
+   * Close the file even when it could not be synced
+   */
+  ret = fsync(fd);
+  if(close(fd) == -1) {
+    ret = -1;
+  }
+
+  if(ret == -1 || rename(tmp, file) == -1) {
+    logerror_P(F("ERROR: cannot replace %s"), file);
+    unlink(tmp);
+    FREE(buffer);
+    FREE(tmp);
+    return -1;
+  }
+
+  FREE(buffer);
+  FREE(tmp);
+
+  return 0;
+}
+
+int8_t rule_vars_restore(struct rule_vars_t *vars, const char *file) {
+  struct stat st;
+  void *map = NULL;
+  int8_t ret = 0;
+  int fd = -1;
+
+  if((fd = open(file, O_RDONLY)) == -1) {
+    return -1;
+  }
+  if(fstat(fd, &st) == -1 || st.st_size < RULE_VARS_HEADER) {
+    close(fd);
+    return -1;
+  }
+  if((map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  ret = rule_vars_deserialize(vars, (const unsigned char *)map, st.st_size);
+
+  munmap(map, st.st_size);
+
+  return ret;
+}
+#endif
@@ -0,0 +1,51 @@
+/*
+  Copyright (C) CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _RULE_VARS_H_
+#define _RULE_VARS_H_
+
+#include "rules.h" /* rewrite */
+
+/*
+ * The key and string values are interned
+ * in the varstack and referenced for as long
+ * as they are part of the store.
+ */
+typedef struct rule_var_t {
+  const char *key;
+  union {
+    int i;
+    float f;
+    const char *s;
+  } val;
+  uint16_t keyhandle;
+  uint16_t valhandle;
+  uint8_t type;
+} rule_var_t;
+
+typedef struct rule_vars_t {
+  struct rule_var_t *array;
+  uint16_t nr;
+} rule_vars_t;
+
+int8_t rule_vars_set(struct rule_vars_t *vars);
+int8_t rule_vars_get(struct rule_vars_t *vars);
+int8_t rule_vars_get_bulk(struct rule_vars_t *vars, const uint16_t *handles, struct rule_value_t *values, uint8_t nr);
+int8_t rule_vars_set_bulk(struct rule_vars_t *vars, const uint16_t *handles, struct rule_value_t *values, uint8_t nr);
+struct rule_var_t *rule_vars_find(struct rule_vars_t *vars, const char *key);
+void rule_vars_clear(struct rule_vars_t *vars);
+
+uint32_t rule_vars_serialize(struct rule_vars_t *vars, unsigned char *out, uint32_t size);
+int8_t rule_vars_deserialize(struct rule_vars_t *vars, const unsigned char *in, uint32_t size);
+
+#if !defined(ESP8266) && !defined(ESP32)
+int8_t rule_vars_snapshot(struct rule_vars_t *vars, const char *file);
+int8_t rule_vars_restore(struct rule_vars_t *vars, const char *file);
+#endif
+
+#endif